@@ -168,6 +168,28 @@ sane_get_parameters (SANE_Handle handle, SANE_Parameters * params)
   return SANE_STATUS_GOOD;
 }
 
+/* Software processing of the back side, see sane_start */
+static SANE_Status
+process_back (void *arg)
+{
+  PKV_DEV dev = (PKV_DEV) arg;
+
+  if (dev->val[OPT_SWDESKEW].w){
+    buffer_deskew(dev,SIDE_BACK);
+  }
+  if (dev->val[OPT_SWCROP].w){
+    buffer_crop(dev,SIDE_BACK);
+  }
+  if (dev->val[OPT_SWDESPECK].w){
+    buffer_despeck(dev,SIDE_BACK);
+  }
+  if (dev->val[OPT_SWDEROTATE].w || dev->val[OPT_ROTATE].w){
+    buffer_rotate(dev,SIDE_BACK);
+  }
+
+  return SANE_STATUS_GOOD;
+}
+
 /* Start scanning */
 SANE_Status
 sane_start (SANE_Handle handle)
@@ -178,6 +200,10 @@ sane_start (SANE_Handle handle)
   KV_CMD_RESPONSE rs;
 
   DBG (DBG_proc, "sane_start: enter\n");
+
+  /* the back side of the last page may still be in the works */
+  kv_wait_back (dev);
+
   if (!dev->scanning)
     {
       /* open device */
@@ -338,6 +364,21 @@ sane_start (SANE_Handle handle)
   if (dev->val[OPT_SWCROP].w){
     buffer_crop(dev,SIDE_FRONT);
   }
+
+  /* the back side only reuses the deskew and crop values of the front, */
+  /* so from here on it is processed by a worker while we finish the */
+  /* front, and while the frontend reads it. sane_start joins it before */
+  /* the back is delivered. without threads, it is done right here */
+  if (IS_DUPLEX (dev)){
+    if (!dev->pool && sanei_pool_create(1, &dev->pool)){
+      DBG (DBG_error, "sane_start: no worker pool, back side runs inline\n");
+    }
+    if (!dev->pool
+      || sanei_pool_submit(dev->pool, process_back, dev, &dev->back_job)){
+      process_back(dev);
+    }
+  }
+
   if (dev->val[OPT_SWDESPECK].w){
     buffer_despeck(dev,SIDE_FRONT);
   }
@@ -345,21 +386,6 @@ sane_start (SANE_Handle handle)
     buffer_rotate(dev,SIDE_FRONT);
   }
 
-  if (IS_DUPLEX (dev)){
-    if (dev->val[OPT_SWDESKEW].w){
-      buffer_deskew(dev,SIDE_BACK);
-    }
-    if (dev->val[OPT_SWCROP].w){
-      buffer_crop(dev,SIDE_BACK);
-    }
-    if (dev->val[OPT_SWDESPECK].w){
-      buffer_despeck(dev,SIDE_BACK);
-    }
-    if (dev->val[OPT_SWDEROTATE].w || dev->val[OPT_ROTATE].w){
-      buffer_rotate(dev,SIDE_BACK);
-    }
-  }
-
   cleanup:
 
   /* check if we need to skip this page */
@@ -57,6 +57,9 @@ kv_free (KV_DEV ** pdev)
 
   kv_close (dev);
 
+  DBG (DBG_proc, "kv_free : stop worker pool\n");
+  sanei_pool_destroy (dev->pool);
+
   DBG (DBG_proc, "kv_free : free image buffer 0 \n");
   if (dev->img_buffers[0])
     free (dev->img_buffers[0]);
@@ -209,6 +212,7 @@ kv_already_open (PKV_DEV dev)
 void
 kv_close (PKV_DEV dev)
 {
+  kv_wait_back (dev);
   if (dev->bus_mode == KV_USB_BUS)
     {
       kv_usb_close (dev);
@@ -968,6 +972,19 @@ ReadImageData (PKV_DEV dev, int page)
   return status;
 }
 
+/* Wait until the back side of the current page has been processed,
+ * if it was handed to dev->pool */
+void
+kv_wait_back (PKV_DEV dev)
+{
+  if (dev->back_job)
+    {
+      DBG (DBG_proc, "kv_wait_back: waiting for back side\n");
+      sanei_pool_join (dev->back_job);
+      dev->back_job = NULL;
+    }
+}
+
 /* Look in image for likely upper and left paper edges, then rotate
  * image so that upper left corner of paper is upper left of image.
  * FIXME: should we do this before we binarize instead of after? */
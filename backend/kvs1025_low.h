@@ -9,6 +9,7 @@
 #define __KVS1025_LOW_H
 
 #include "kvs1025_cmds.h"
+#include "../include/sane/sanei_pool.h"
 
 #define VENDOR_ID       0x04DA
 
@@ -198,6 +199,10 @@ typedef struct kv_scanner_dev
   SANE_Status crop_stat;
   int crop_vals[4];
 
+  /* the back side is finished by a worker while the front is read */
+  SANEI_Pool *pool;
+  SANEI_Pool_Job *back_job;
+
   /* Support info */
   KV_SUPPORT_INFO support_info;
 
@@ -280,6 +285,7 @@ SANE_Status AllocateImageBuffer (PKV_DEV dev);
 SANE_Status ReadImageDataSimplex (PKV_DEV dev, int page);
 SANE_Status ReadImageDataDuplex (PKV_DEV dev, int page);
 SANE_Status ReadImageData (PKV_DEV dev, int page);
+void kv_wait_back (PKV_DEV dev);
 
 SANE_Status buffer_deskew (PKV_DEV dev, int side);
 SANE_Status buffer_crop (PKV_DEV dev, int side);
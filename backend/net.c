@@ -63,6 +63,16 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
+
+#if defined(HAVE_SYS_POLL_H) && defined(HAVE_POLL)
+# include <sys/poll.h>
+# define NET_PARALLEL_PROBE	/* sane_get_devices() asks all hosts at once */
+#endif
+
+#ifdef USE_PTHREAD
+# include <pthread.h>
+#endif
 
 /*#include <netinet/in.h>*/
 #include <netdb.h> /* OS/2 needs this _after_ <netinet/in.h>, grrr... */
@@ -84,8 +94,11 @@ static AvahiServiceBrowser *avahi_browser = NULL;
 
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei.h"
+#include "../include/sane/saneopts.h"
 #include "../include/sane/sanei_net.h"
 #include "../include/sane/sanei_codec_bin.h"
+#include "../include/sane/sanei_compress.h"
+#include "../include/sane/sanei_byteorder.h"
 #include "net.h"
 
 #define BACKEND_NAME    net
@@ -98,6 +111,51 @@ static AvahiServiceBrowser *avahi_browser = NULL;
 #include "../include/sane/sanei_config.h"
 #define NET_CONFIG_FILE "net.conf"
 
+/* Largest record accepted on a compressed data connection */
+#define NET_MAX_RECORD  (256 * 1024 * 1024)
+
+/* Most option requests batch_options defers before they are sent */
+#define NET_MAX_PENDING_OPTIONS 64
+
+/* Options batch_options defers: backends don't change other options
+   when they are set */
+static const char *const deferred_options[] = {
+  SANE_NAME_SCAN_TL_X, SANE_NAME_SCAN_TL_Y,
+  SANE_NAME_SCAN_BR_X, SANE_NAME_SCAN_BR_Y,
+  SANE_NAME_BRIGHTNESS, SANE_NAME_CONTRAST, SANE_NAME_THRESHOLD,
+  SANE_NAME_GAMMA_VECTOR, SANE_NAME_GAMMA_VECTOR_R,
+  SANE_NAME_GAMMA_VECTOR_G, SANE_NAME_GAMMA_VECTOR_B,
+  0
+};
+
+/* Limits of the read-ahead ring */
+#define NET_MIN_READ_AHEAD  (64 * 1024)
+#define NET_MAX_READ_AHEAD  (256 * 1024 * 1024)
+
+#ifdef USE_PTHREAD
+/* A thread draining the data connection of a scan into a ring, so the
+   socket is read in large blocks while the frontend processes the data.
+   The thread parses (and decompresses) the records; sane_read() only
+   copies from the ring. NOTIFY is readable while data is buffered. */
+struct Net_Read_Ahead
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;		/* data added, space freed or cancelled */
+  SANE_Byte *ring;
+  size_t size, start, len;
+  int done;			/* no more data, STATUS tells why */
+  int cancel;
+  SANE_Status status;
+  int notify[2];
+  int notified;			/* a byte is waiting in notify[0] */
+  SANE_Bool nonblocking;
+};
+
+static void start_read_ahead (Net_Scanner * s);
+static void stop_read_ahead (Net_Scanner * s);
+#endif /* USE_PTHREAD */
+
 /* Please increase version number with every change
    (don't forget to update net.desc) */
 
@@ -105,13 +163,13 @@ static AvahiServiceBrowser *avahi_browser = NULL;
 #if defined (HAVE_GETADDRINFO) && defined (HAVE_GETNAMEINFO)
 # define NET_USES_AF_INDEP
 # ifdef ENABLE_IPV6
-#  define NET_VERSION "1.0.14 (AF-indep+IPv6)"
+#  define NET_VERSION "1.0.19 (AF-indep+IPv6)"
 # else
-#  define NET_VERSION "1.0.14 (AF-indep)"
+#  define NET_VERSION "1.0.19 (AF-indep)"
 # endif /* ENABLE_IPV6 */
 #else
 # undef ENABLE_IPV6
-# define NET_VERSION "1.0.14"
+# define NET_VERSION "1.0.19"
 #endif /* HAVE_GETADDRINFO && HAVE_GETNAMEINFO */
 
 static SANE_Auth_Callback auth_callback;
@@ -119,33 +177,16 @@ static Net_Device *first_device;
 static Net_Scanner *first_handle;
 static const SANE_Device **devlist;
 static int client_big_endian; /* 1 == big endian; 0 == little endian */
-static int server_big_endian; /* 1 == big endian; 0 == little endian */
-static int depth; /* bits per pixel */
 static int connect_timeout = -1; /* timeout for connection to saned */
+static size_t read_ahead_size = 0; /* ring of the read-ahead thread, 0: off */
+static SANE_Bool batch_options = SANE_FALSE; /* defer setting options */
+static int device_list_ttl = 0; /* seconds to reuse the device list */
+static time_t devlist_time;	/* when devlist was fetched, 0: stale */
 
 #ifndef NET_USES_AF_INDEP
 static int saned_port;
 #endif /* !NET_USES_AF_INDEP */
 
-/* This variable is only needed, if the depth is 16bit/channel and
-   client/server have different endianness.  A value of -1 means, that there's
-   no hang over; otherwise the value has to be casted to SANE_Byte.  hang_over
-   means, that there is a remaining byte from a previous call to sane_read,
-   which could not be byte-swapped, e.g. because the frontend requested an odd
-   number of bytes.
-*/
-static int hang_over;
-
-/* This variable is only needed, if the depth is 16bit/channel and
-   client/server have different endianness.  A value of -1 means, that there's
-   no left over; otherwise the value has to be casted to SANE_Byte.  left_over
-   means, that there is a remaining byte from a previous call to sane_read,
-   which already is in the the correct byte order, but could not be returned,
-   e.g.  because the frontend requested only one byte per call.
-*/
-static int left_over;
-
-
 #ifdef NET_USES_AF_INDEP
 static SANE_Status
 add_device (const char *name, Net_Device ** ndp)
@@ -240,6 +281,7 @@ add_device (const char *name, Net_Device ** ndp)
   nd->next = first_device;
 
   first_device = nd;
+  devlist_time = 0;		/* the host is not in the device list yet */
       
   if (ndp)
     *ndp = nd;
@@ -306,6 +348,7 @@ add_device (const char *name, Net_Device ** ndp)
   nd->ctl = -1;
   nd->next = first_device;
   first_device = nd;
+  devlist_time = 0;		/* the host is not in the device list yet */
   if (ndp)
     *ndp = nd;
   DBG (2, "add_device: backend %s added\n", name);
@@ -314,21 +357,142 @@ add_device (const char *name, Net_Device ** ndp)
 #endif /* NET_USES_AF_INDEP */
 
 
+/* Prepares the freshly connected control socket of DEV for the wire */
+static void
+setup_ctl (Net_Device * dev)
+{
+#ifdef TCP_NODELAY
+  int on = 1;
+  int level = -1;
+#endif
+  struct timeval tv;
+
+  /* We're connected now, so reset SO_SNDTIMEO to the default value of 0 */
+  if (connect_timeout > 0)
+    {
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
+
+      if (setsockopt (dev->ctl, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+	{
+	  DBG (1, "setup_ctl: failed to reset SO_SNDTIMEO (%s)\n", strerror (errno));
+	}
+    }
+
+#ifdef TCP_NODELAY
+# ifdef SOL_TCP
+  level = SOL_TCP;
+# else /* !SOL_TCP */
+  /* Look up the protocol level in the protocols database. */
+  {
+    struct protoent *p;
+    p = getprotobyname ("tcp");
+    if (p == 0)
+      DBG (1, "setup_ctl: cannot look up `tcp' protocol number");
+    else
+      level = p->p_proto;
+  }
+# endif	/* SOL_TCP */
+
+  if (level == -1 ||
+      setsockopt (dev->ctl, level, TCP_NODELAY, &on, sizeof (on)))
+    DBG (1, "setup_ctl: failed to put send socket in TCP_NODELAY mode (%s)",
+	 strerror (errno));
+#endif /* !TCP_NODELAY */
+
+  DBG (2, "setup_ctl: sanei_w_init\n");
+  sanei_w_init (&dev->wire, sanei_codec_bin_init);
+  dev->wire.io.fd = dev->ctl;
+  dev->wire.io.read = read;
+  dev->wire.io.write = write;
+}
+
+/* Sends the SANE_NET_INIT request on the control connection of DEV */
+static void
+send_init (Net_Device * dev)
+{
+  SANE_Init_Req req;
+
+  /* exchange version codes with the server, offering compression,
+     batched option requests and descriptor changes: */
+  req.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR,
+					SANEI_NET_PROTOCOL_DELTA);
+  req.username = getlogin ();
+  DBG (2, "send_init: net_init (user=%s, local version=%d.%d.%d)\n",
+       req.username, V_MAJOR, V_MINOR, SANEI_NET_PROTOCOL_DELTA);
+  sanei_w_send (&dev->wire, SANE_NET_INIT,
+		(WireCodecFunc) sanei_w_init_req, &req);
+}
+
+/* Receives the reply to send_init() and checks the protocol version;
+   closes the connection if it cannot be used. */
+static SANE_Status
+finish_init (Net_Device * dev)
+{
+  SANE_Word version_code;
+  SANE_Init_Reply reply;
+  SANE_Status status;
+
+  sanei_w_receive (&dev->wire, (WireCodecFunc) sanei_w_init_reply, &reply);
+
+  if (dev->wire.status != 0)
+    {
+      DBG (1, "finish_init: argument marshalling error (%s)\n",
+	   strerror (dev->wire.status));
+      status = SANE_STATUS_IO_ERROR;
+      goto fail;
+    }
+
+  status = reply.status;
+  version_code = reply.version_code;
+  DBG (2, "finish_init: freeing init reply (status=%s, remote "
+       "version=%d.%d.%d)\n", sane_strstatus (status),
+       SANE_VERSION_MAJOR (version_code),
+       SANE_VERSION_MINOR (version_code), SANE_VERSION_BUILD (version_code));
+  sanei_w_free (&dev->wire, (WireCodecFunc) sanei_w_init_reply, &reply);
+
+  if (status != 0)
+    {
+      DBG (1, "finish_init: access to %s denied\n", dev->name);
+      goto fail;
+    }
+  if (SANE_VERSION_MAJOR (version_code) != V_MAJOR)
+    {
+      DBG (1, "finish_init: major version mismatch: got %d, expected %d\n",
+	   SANE_VERSION_MAJOR (version_code), V_MAJOR);
+      status = SANE_STATUS_IO_ERROR;
+      goto fail;
+    }
+  if (SANE_VERSION_BUILD (version_code) != SANEI_NET_PROTOCOL_DELTA
+      && SANE_VERSION_BUILD (version_code) != SANEI_NET_PROTOCOL_BATCH
+      && SANE_VERSION_BUILD (version_code) != SANEI_NET_PROTOCOL_COMPRESS
+      && SANE_VERSION_BUILD (version_code) != SANEI_NET_PROTOCOL_VERSION
+      && SANE_VERSION_BUILD (version_code) != 2)
+    {
+      DBG (1, "finish_init: network protocol version mismatch: "
+	   "got %d, expected %d\n",
+	   SANE_VERSION_BUILD (version_code), SANEI_NET_PROTOCOL_VERSION);
+      status = SANE_STATUS_IO_ERROR;
+      goto fail;
+    }
+  dev->wire.version = SANE_VERSION_BUILD (version_code);
+  DBG (4, "finish_init: done\n");
+  return SANE_STATUS_GOOD;
+
+fail:
+  DBG (2, "finish_init: closing connection to %s\n", dev->name);
+  close (dev->ctl);
+  dev->ctl = -1;
+  return status;
+}
+
+
 #ifdef NET_USES_AF_INDEP
 static SANE_Status
 connect_dev (Net_Device * dev)
 {
   struct addrinfo *addrp;
-
-  SANE_Word version_code;
-  SANE_Init_Reply reply;
-  SANE_Status status = SANE_STATUS_IO_ERROR;
-  SANE_Init_Req req;
   SANE_Bool connected = SANE_FALSE;
-#ifdef TCP_NODELAY
-  int on = 1;
-  int level = -1;
-#endif
   struct timeval tv;
 
   int i;
@@ -392,14 +556,6 @@ static SANE_Status
 connect_dev (Net_Device * dev)
 {
   struct sockaddr_in *sin;
-  SANE_Word version_code;
-  SANE_Init_Reply reply;
-  SANE_Status status = SANE_STATUS_IO_ERROR;
-  SANE_Init_Req req;
-#ifdef TCP_NODELAY
-  int on = 1;
-  int level = -1;
-#endif
   struct timeval tv;
 
   DBG (2, "connect_dev: trying to connect to %s\n", dev->name);
@@ -444,135 +600,608 @@ connect_dev (Net_Device * dev)
   DBG (3, "connect_dev: connection succeeded\n");
 #endif /* NET_USES_AF_INDEP */
 
-  /* We're connected now, so reset SO_SNDTIMEO to the default value of 0 */
-  if (connect_timeout > 0)
+  setup_ctl (dev);
+  send_init (dev);
+  return finish_init (dev);
+}
+
+/* Progress of a host while sane_get_devices() asks all of them at once */
+typedef enum
+{
+  PROBE_CONNECT,		/* non-blocking connect in progress */
+  PROBE_INIT,			/* waiting for the SANE_NET_INIT reply */
+  PROBE_DEVICES,		/* waiting for the device list */
+  PROBE_DONE,			/* REPLY holds the device list */
+  PROBE_FAILED
+}
+Net_Probe_State;
+
+typedef struct
+{
+  Net_Device *dev;
+  Net_Probe_State state;
+  SANE_Bool opened;		/* the connection was opened by the probe */
+  SANE_Bool ready;		/* poll() reported the socket */
+#ifdef NET_USES_AF_INDEP
+  struct addrinfo *addr;	/* the address being connected to */
+#else /* !NET_USES_AF_INDEP */
+  SANE_Bool tried;		/* the address was connected to */
+#endif /* NET_USES_AF_INDEP */
+  int flags;			/* file status flags of the socket */
+  struct timeval deadline;	/* if opened and connect_timeout > 0 */
+  SANE_Get_Devices_Reply reply;
+}
+Net_Probe;
+
+/* Closes a connection the probe P opened; connections that were open
+   before may have handles on them and are left alone. */
+static void
+probe_close (Net_Probe * p)
+{
+  Net_Device *dev = p->dev;
+
+  if (p->opened && dev->ctl >= 0)
     {
-      tv.tv_sec = 0;
-      tv.tv_usec = 0;
+      DBG (2, "probe_close: closing connection to %s\n", dev->name);
+      if (p->state != PROBE_CONNECT)
+	sanei_w_exit (&dev->wire);
+      close (dev->ctl);
+      dev->ctl = -1;
+    }
+  p->state = PROBE_FAILED;
+}
 
-      if (setsockopt (dev->ctl, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
-	{
-	  DBG (1, "connect_dev: failed to reset SO_SNDTIMEO (%s)\n", strerror (errno));
-	}
+static void
+probe_send_devices (Net_Probe * p)
+{
+  sanei_w_send (&p->dev->wire, SANE_NET_GET_DEVICES,
+		(WireCodecFunc) sanei_w_void, 0);
+  if (p->dev->wire.status != 0)
+    {
+      DBG (1, "probe_send_devices: failed to send request to %s (%s)\n",
+	   p->dev->name, strerror (p->dev->wire.status));
+      probe_close (p);
+      return;
     }
+  p->state = PROBE_DEVICES;
+}
 
-#ifdef TCP_NODELAY
-# ifdef SOL_TCP
-  level = SOL_TCP;
-# else /* !SOL_TCP */
-  /* Look up the protocol level in the protocols database. */
-  {
-    struct protoent *p;
-    p = getprotobyname ("tcp");
-    if (p == 0)
-      DBG (1, "connect_dev: cannot look up `tcp' protocol number");
-    else
-      level = p->p_proto;
-  }
-# endif	/* SOL_TCP */
+static void
+probe_receive_devices (Net_Probe * p)
+{
+  Net_Device *dev = p->dev;
 
-  if (level == -1 ||
-      setsockopt (dev->ctl, level, TCP_NODELAY, &on, sizeof (on)))
-    DBG (1, "connect_dev: failed to put send socket in TCP_NODELAY mode (%s)",
-	 strerror (errno));
-#endif /* !TCP_NODELAY */
+  /* the reply lives in the wire's arena until it has been merged */
+  sanei_w_arena_begin (&dev->wire);
+  sanei_w_receive (&dev->wire,
+		   (WireCodecFunc) sanei_w_get_devices_reply, &p->reply);
+  if (dev->wire.status != 0)
+    {
+      DBG (1, "probe_receive_devices: failed to receive reply from %s "
+	   "(%s)\n", dev->name, strerror (dev->wire.status));
+      sanei_w_arena_end (&dev->wire);
+      probe_close (p);
+      return;
+    }
+  if (p->reply.status != SANE_STATUS_GOOD)
+    {
+      DBG (1, "sane_get_devices: ignoring rpc-returned status %s\n",
+	   sane_strstatus (p->reply.status));
+      sanei_w_arena_end (&dev->wire);
+      p->state = PROBE_FAILED;
+      return;
+    }
+  p->state = PROBE_DONE;
+}
 
-  DBG (2, "connect_dev: sanei_w_init\n");
-  sanei_w_init (&dev->wire, sanei_codec_bin_init);
-  dev->wire.io.fd = dev->ctl;
-  dev->wire.io.read = read;
-  dev->wire.io.write = write;
+#ifdef NET_PARALLEL_PROBE
+/* The connection of P is up: hand it to the wire and say hello */
+static void
+probe_connected (Net_Probe * p)
+{
+  Net_Device *dev = p->dev;
 
-  /* exchange version codes with the server: */
-  req.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR,
-					SANEI_NET_PROTOCOL_VERSION);
-  req.username = getlogin ();
-  DBG (2, "connect_dev: net_init (user=%s, local version=%d.%d.%d)\n",
-       req.username, V_MAJOR, V_MINOR, SANEI_NET_PROTOCOL_VERSION);
-  sanei_w_call (&dev->wire, SANE_NET_INIT,
-		(WireCodecFunc) sanei_w_init_req, &req,
-		(WireCodecFunc) sanei_w_init_reply, &reply);
+#ifdef NET_USES_AF_INDEP
+  DBG (3, "probe_connected: connected to %s (%s)\n", dev->name,
+       (p->addr->ai_family == AF_INET6) ? "IPv6" : "IPv4");
+  dev->addr_used = p->addr;
+#else /* !NET_USES_AF_INDEP */
+  DBG (3, "probe_connected: connected to %s\n", dev->name);
+#endif /* NET_USES_AF_INDEP */
+  fcntl (dev->ctl, F_SETFL, p->flags);
 
-  if (dev->wire.status != 0)
+  setup_ctl (dev);
+  send_init (dev);
+  p->state = PROBE_INIT;
+  if (dev->wire.status != 0 && finish_init (dev) != SANE_STATUS_GOOD)
+    p->state = PROBE_FAILED;
+}
+
+/* Starts a non-blocking connect of P to ADDR.  Returns SANE_FALSE if
+   that failed right away. */
+static SANE_Bool
+probe_start (Net_Probe * p, const struct sockaddr *addr, socklen_t len)
+{
+  Net_Device *dev = p->dev;
+
+  dev->ctl = socket (addr->sa_family, SOCK_STREAM, 0);
+  if (dev->ctl < 0)
     {
-      DBG (1, "connect_dev: argument marshalling error (%s)\n",
-	   strerror (dev->wire.status));
-      status = SANE_STATUS_IO_ERROR;
-      goto fail;
+      DBG (1, "probe_start: failed to obtain socket (%s)\n",
+	   strerror (errno));
+      dev->ctl = -1;
+      return SANE_FALSE;
     }
+  p->flags = fcntl (dev->ctl, F_GETFL, 0);
+  fcntl (dev->ctl, F_SETFL, p->flags | O_NONBLOCK);
 
-  status = reply.status;
-  version_code = reply.version_code;
-  DBG (2, "connect_dev: freeing init reply (status=%s, remote "
-       "version=%d.%d.%d)\n", sane_strstatus (status),
-       SANE_VERSION_MAJOR (version_code),
-       SANE_VERSION_MINOR (version_code), SANE_VERSION_BUILD (version_code));
-  sanei_w_free (&dev->wire, (WireCodecFunc) sanei_w_init_reply, &reply);
+  gettimeofday (&p->deadline, NULL);
+  p->deadline.tv_sec += connect_timeout;
+
+  p->state = PROBE_CONNECT;
+  if (connect (dev->ctl, addr, len) == 0)
+    probe_connected (p);
+  else if (errno != EINPROGRESS)
+    {
+      DBG (1, "probe_start: failed to connect to %s (%s)\n", dev->name,
+	   strerror (errno));
+      close (dev->ctl);
+      dev->ctl = -1;
+      return SANE_FALSE;
+    }
+  return SANE_TRUE;
+}
+
+/* Moves P on to the next address of its host, or fails it when there is
+   none left. */
+static void
+probe_connect (Net_Probe * p)
+{
+  Net_Device *dev = p->dev;
+#ifdef NET_USES_AF_INDEP
+  struct addrinfo *addrp;
+#else /* !NET_USES_AF_INDEP */
+  struct sockaddr_in *sin;
+#endif /* NET_USES_AF_INDEP */
+
+  if (dev->ctl >= 0)
+    {
+      close (dev->ctl);
+      dev->ctl = -1;
+    }
+
+#ifdef NET_USES_AF_INDEP
+  for (addrp = p->addr ? p->addr->ai_next : dev->addr; addrp;
+       addrp = addrp->ai_next)
+    {
+      p->addr = addrp;
+# ifdef ENABLE_IPV6
+      if ((addrp->ai_family != AF_INET) && (addrp->ai_family != AF_INET6))
+# else /* !ENABLE_IPV6 */
+      if (addrp->ai_family != AF_INET)
+# endif /* ENABLE_IPV6 */
+	continue;
+      if (probe_start (p, addrp->ai_addr, addrp->ai_addrlen))
+	return;
+    }
+#else /* !NET_USES_AF_INDEP */
+  if (!p->tried && dev->addr.sa_family == AF_INET)
+    {
+      p->tried = SANE_TRUE;
+      sin = (struct sockaddr_in *) &dev->addr;
+      sin->sin_port = saned_port;
+      if (probe_start (p, &dev->addr, sizeof (dev->addr)))
+	return;
+    }
+#endif /* NET_USES_AF_INDEP */
+
+  DBG (1, "probe_connect: couldn't connect to %s\n", dev->name);
+  p->state = PROBE_FAILED;
+}
+
+/* Milliseconds from NOW to DEADLINE */
+static long
+time_left (const struct timeval *deadline, const struct timeval *now)
+{
+  return (deadline->tv_sec - now->tv_sec) * 1000
+    + (deadline->tv_usec - now->tv_usec) / 1000;
+}
+
+/* Connects to all NUM hosts at once and collects their device lists as
+   they answer.  A host whose connection attempt has not got through
+   connect_timeout seconds after it was started is given up on. */
+static void
+probe_hosts (Net_Probe * probe, int num)
+{
+  struct pollfd *fds;
+  struct timeval now;
+  Net_Probe *p;
+  long left, wait;
+  int i, n, ret, err;
+  socklen_t len;
+
+  fds = malloc (num * sizeof (fds[0]));
+  if (!fds)
+    {
+      DBG (1, "probe_hosts: not enough memory\n");
+      return;
+    }
+
+  for (p = probe; p < probe + num; ++p)
+    {
+      if (p->dev->ctl >= 0)
+	probe_send_devices (p);
+      else
+	{
+	  DBG (2, "probe_hosts: trying to connect to %s\n", p->dev->name);
+	  p->opened = SANE_TRUE;
+	  probe_connect (p);
+	}
+    }
+
+  for (;;)
+    {
+      gettimeofday (&now, NULL);
+      wait = -1;
+      n = 0;
+      for (p = probe; p < probe + num; ++p)
+	{
+	  if (p->state == PROBE_DONE || p->state == PROBE_FAILED)
+	    continue;
+	  if (p->opened && connect_timeout > 0)
+	    {
+	      left = time_left (&p->deadline, &now);
+	      if (left <= 0)
+		{
+		  DBG (1, "probe_hosts: %s does not answer in time\n",
+		       p->dev->name);
+		  if (p->state == PROBE_CONNECT)
+		    probe_connect (p);
+		  else
+		    probe_close (p);
+		  if (p->state == PROBE_DONE || p->state == PROBE_FAILED)
+		    continue;
+		  left = time_left (&p->deadline, &now);
+		}
+	      if (wait < 0 || left < wait)
+		wait = left;
+	    }
+	  fds[n].fd = p->dev->ctl;
+	  fds[n].events = (p->state == PROBE_CONNECT) ? POLLOUT : POLLIN;
+	  fds[n].revents = 0;
+	  ++n;
+	}
+      if (n == 0)
+	break;
+
+      ret = poll (fds, n, wait);
+      if (ret < 0 && errno != EINTR)
+	{
+	  DBG (1, "probe_hosts: poll failed (%s)\n", strerror (errno));
+	  for (p = probe; p < probe + num; ++p)
+	    if (p->state != PROBE_DONE && p->state != PROBE_FAILED)
+	      probe_close (p);
+	  break;
+	}
+      if (ret <= 0)
+	continue;
+
+      /* note who is ready before anyone's state (and socket) changes */
+      for (p = probe, i = 0; p < probe + num; ++p)
+	{
+	  if (p->state == PROBE_DONE || p->state == PROBE_FAILED)
+	    continue;
+	  p->ready = (fds[i++].revents != 0);
+	}
+
+      for (p = probe; p < probe + num; ++p)
+	{
+	  if (p->state == PROBE_DONE || p->state == PROBE_FAILED
+	      || !p->ready)
+	    continue;
+	  switch (p->state)
+	    {
+	    case PROBE_CONNECT:
+	      err = 0;
+	      len = sizeof (err);
+	      if (getsockopt (p->dev->ctl, SOL_SOCKET, SO_ERROR, &err, &len)
+		  < 0)
+		err = errno;
+	      if (err)
+		{
+		  DBG (1, "probe_hosts: failed to connect to %s (%s)\n",
+		       p->dev->name, strerror (err));
+		  probe_connect (p);
+		}
+	      else
+		probe_connected (p);
+	      break;
+
+	    case PROBE_INIT:
+	      if (finish_init (p->dev) == SANE_STATUS_GOOD)
+		probe_send_devices (p);
+	      else
+		p->state = PROBE_FAILED;
+	      break;
+
+	    case PROBE_DEVICES:
+	      probe_receive_devices (p);
+	      break;
 
-  if (status != 0)
-    {
-      DBG (1, "connect_dev: access to %s denied\n", dev->name);
-      goto fail;
+	    default:
+	      break;
+	    }
+	}
     }
-  if (SANE_VERSION_MAJOR (version_code) != V_MAJOR)
+  free (fds);
+}
+
+#else /* !NET_PARALLEL_PROBE */
+
+/* Without poll(), the hosts are asked one after the other */
+static void
+probe_hosts (Net_Probe * probe, int num)
+{
+  Net_Probe *p;
+
+  for (p = probe; p < probe + num; ++p)
     {
-      DBG (1, "connect_dev: major version mismatch: got %d, expected %d\n",
-	   SANE_VERSION_MAJOR (version_code), V_MAJOR);
-      status = SANE_STATUS_IO_ERROR;
-      goto fail;
+      if (p->dev->ctl < 0 && connect_dev (p->dev) != SANE_STATUS_GOOD)
+	{
+	  DBG (1, "sane_get_devices: ignoring failure to connect to %s\n",
+	       p->dev->name);
+	  p->state = PROBE_FAILED;
+	  continue;
+	}
+      probe_send_devices (p);
+      if (p->state == PROBE_DEVICES)
+	probe_receive_devices (p);
     }
-  if (SANE_VERSION_BUILD (version_code) != SANEI_NET_PROTOCOL_VERSION
-      && SANE_VERSION_BUILD (version_code) != 2)
-    {
-      DBG (1, "connect_dev: network protocol version mismatch: "
-	   "got %d, expected %d\n",
-	   SANE_VERSION_BUILD (version_code), SANEI_NET_PROTOCOL_VERSION);
-      status = SANE_STATUS_IO_ERROR;
-      goto fail;
+}
+#endif /* NET_PARALLEL_PROBE */
+
+
+/* Descriptors of a device as it opens, kept across sane_open() calls
+   (protocol version 6) */
+struct Net_Option_Cache
+{
+  struct Net_Option_Cache *next;
+  char *name;			/* remote device name */
+  char *digest;			/* saned's digest of the descriptors */
+  SANE_Option_Descriptor_Array opt;
+};
+
+static void
+free_descriptors (SANE_Option_Descriptor_Array * opt)
+{
+  SANE_Word i;
+
+  for (i = 0; i < opt->num_options; ++i)
+    sanei_net_free_option_descriptor (opt->desc[i]);
+  if (opt->desc)
+    free (opt->desc);
+  opt->desc = NULL;
+  opt->num_options = 0;
+}
+
+/* Replaces OPT with copies of the NUM descriptors in DESC.  Where DESC
+   has NULL, the descriptor at the same index of BASE is copied. */
+static SANE_Status
+copy_descriptors (SANE_Option_Descriptor_Array * opt, SANE_Word num,
+		  SANE_Option_Descriptor ** desc,
+		  const SANE_Option_Descriptor_Array * base)
+{
+  SANE_Option_Descriptor_Array copy;
+  const SANE_Option_Descriptor *d;
+  SANE_Word i;
+
+  copy.num_options = num;
+  copy.desc = calloc (num > 0 ? num : 1, sizeof (copy.desc[0]));
+  if (!copy.desc)
+    return SANE_STATUS_NO_MEM;
+  for (i = 0; i < num; ++i)
+    {
+      d = desc[i];
+      if (!d && base && i < base->num_options)
+	d = base->desc[i];
+      if (!d)
+	{
+	  DBG (1, "copy_descriptors: no descriptor for option %d\n", i);
+	  free_descriptors (&copy);
+	  return SANE_STATUS_IO_ERROR;
+	}
+      copy.desc[i] = sanei_net_copy_option_descriptor (d);
+      if (!copy.desc[i])
+	{
+	  free_descriptors (&copy);
+	  return SANE_STATUS_NO_MEM;
+	}
     }
-  dev->wire.version = SANE_VERSION_BUILD (version_code);
-  DBG (4, "connect_dev: done\n");
+  free_descriptors (opt);
+  *opt = copy;
   return SANE_STATUS_GOOD;
+}
 
-fail:
-  DBG (2, "connect_dev: closing connection to %s\n", dev->name);
-  close (dev->ctl);
-  dev->ctl = -1;
-  return status;
+static void
+free_option_cache (Net_Device * dev)
+{
+  struct Net_Option_Cache *c;
+
+  while ((c = dev->option_cache) != NULL)
+    {
+      dev->option_cache = c->next;
+      free_descriptors (&c->opt);
+      free (c->name);
+      free (c->digest);
+      free (c);
+    }
 }
 
+static struct Net_Option_Cache *
+find_option_cache (Net_Device * dev, const char *name)
+{
+  struct Net_Option_Cache *c;
 
-static SANE_Status
-fetch_options (Net_Scanner * s)
+  for (c = dev->option_cache; c; c = c->next)
+    if (strcmp (c->name, name) == 0)
+      return c;
+  return NULL;
+}
+
+/* Keeps a copy of the descriptors of S as its device opens */
+static void
+cache_options (Net_Scanner * s, const char *digest)
 {
-  int option_number;
-  DBG (3, "fetch_options: %p\n", (void *) s);
+  struct Net_Option_Cache *c;
 
-  if (s->opt.num_options)
+  c = find_option_cache (s->hw, s->name);
+  if (!c)
     {
-      DBG (2, "fetch_options: %d option descriptors cached... freeing\n",
-	   s->opt.num_options);
-      sanei_w_set_dir (&s->hw->wire, WIRE_FREE);
-      s->hw->wire.status = 0;
-      sanei_w_option_descriptor_array (&s->hw->wire, &s->opt);
-      if (s->hw->wire.status)
+      c = calloc (1, sizeof (*c));
+      if (!c)
+	return;
+      c->name = strdup (s->name);
+      if (!c->name)
 	{
-	  DBG (1, "fetch_options: failed to free old list (%s)\n",
-	       strerror (s->hw->wire.status));
-	  return SANE_STATUS_IO_ERROR;
+	  free (c);
+	  return;
 	}
-    }
+      c->next = s->hw->option_cache;
+      s->hw->option_cache = c;
+    }
+  free (c->digest);
+  c->digest = strdup (digest);
+  if (!c->digest
+      || copy_descriptors (&c->opt, s->opt.num_options, s->opt.desc,
+			   NULL) != SANE_STATUS_GOOD)
+    {
+      free_descriptors (&c->opt);
+      free (c->digest);
+      c->digest = NULL;
+      return;
+    }
+  DBG (3, "cache_options: cached %d descriptors of `%s' (digest %s)\n",
+       c->opt.num_options, c->name, c->digest);
+}
+
+static SANE_Status
+fetch_all_options (Net_Scanner * s)
+{
+  SANE_Option_Descriptor_Array opt;
+  SANE_Status status;
+
   DBG (3, "fetch_options: get_option_descriptors\n");
+  memset (&opt, 0, sizeof (opt));
+  sanei_w_arena_begin (&s->hw->wire);
   sanei_w_call (&s->hw->wire, SANE_NET_GET_OPTION_DESCRIPTORS,
 		(WireCodecFunc) sanei_w_word, &s->handle,
-		(WireCodecFunc) sanei_w_option_descriptor_array, &s->opt);
+		(WireCodecFunc) sanei_w_option_descriptor_array, &opt);
   if (s->hw->wire.status)
     {
       DBG (1, "fetch_options: failed to get option descriptors (%s)\n",
 	   strerror (s->hw->wire.status));
+      sanei_w_arena_end (&s->hw->wire);
+      return SANE_STATUS_IO_ERROR;
+    }
+
+  status = copy_descriptors (&s->opt, opt.num_options, opt.desc, NULL);
+  sanei_w_arena_end (&s->hw->wire);
+  return status;
+}
+
+/* Gets the descriptors that changed since the ones S has, or since the
+   ones cached for its device if it has none yet (protocol version 6) */
+static SANE_Status
+fetch_option_changes (Net_Scanner * s)
+{
+  SANE_Get_Option_Changes_Req req;
+  SANE_Get_Option_Changes_Reply reply;
+  struct Net_Option_Cache *cache = NULL;
+  const SANE_Option_Descriptor_Array *base = NULL;
+  SANE_Option_Descriptor **desc;
+  SANE_Status status;
+  SANE_Word i, index;
+
+  req.handle = s->handle;
+  req.version = s->desc_version;
+  req.digest = NULL;
+  if (s->desc_version > 0)
+    base = &s->opt;
+  else if (s->name)
+    {
+      cache = find_option_cache (s->hw, s->name);
+      if (cache)
+	req.digest = cache->digest;
+    }
+
+  DBG (3, "fetch_options: get_option_changes since version %d%s\n",
+       req.version, req.digest ? " or the cached ones" : "");
+  memset (&reply, 0, sizeof (reply));
+  sanei_w_arena_begin (&s->hw->wire);
+  sanei_w_call (&s->hw->wire, SANE_NET_GET_OPTION_CHANGES,
+		(WireCodecFunc) sanei_w_get_option_changes_req, &req,
+		(WireCodecFunc) sanei_w_get_option_changes_reply, &reply);
+  if (s->hw->wire.status)
+    {
+      DBG (1, "fetch_options: failed to get option changes (%s)\n",
+	   strerror (s->hw->wire.status));
+      sanei_w_arena_end (&s->hw->wire);
       return SANE_STATUS_IO_ERROR;
     }
 
+  status = reply.status;
+  if (status == SANE_STATUS_GOOD)
+    {
+      /* saned only left out the descriptors the cached set has if the
+         digests match */
+      if (cache && reply.digest && strcmp (reply.digest, cache->digest) == 0
+	  && reply.num_options == cache->opt.num_options)
+	base = &cache->opt;
+      desc = calloc (reply.num_options > 0 ? reply.num_options : 1,
+		     sizeof (desc[0]));
+      if (!desc)
+	status = SANE_STATUS_NO_MEM;
+      for (i = 0; desc && i < reply.num_changes; ++i)
+	{
+	  index = reply.changes[i].index;
+	  if (index >= 0 && index < reply.num_options)
+	    desc[index] = reply.changes[i].desc;
+	}
+      if (desc)
+	{
+	  status = copy_descriptors (&s->opt, reply.num_options, desc, base);
+	  free (desc);
+	}
+    }
+
+  if (status == SANE_STATUS_GOOD)
+    {
+      DBG (2, "fetch_options: %d of %d descriptors downloaded%s\n",
+	   reply.num_changes, reply.num_options,
+	   (base && base != &s->opt) ? " (cached)" : "");
+      if (!base && req.version == 0 && reply.version == 1 && s->name
+	  && reply.digest && reply.digest[0])
+	cache_options (s, reply.digest);
+      s->desc_version = reply.version;
+    }
+  sanei_w_arena_end (&s->hw->wire);
+  return status;
+}
+
+static SANE_Status
+fetch_options (Net_Scanner * s)
+{
+  SANE_Status status;
+  int option_number;
+  DBG (3, "fetch_options: %p\n", (void *) s);
+
+  if (s->hw->wire.version >= SANEI_NET_PROTOCOL_DELTA)
+    status = fetch_option_changes (s);
+  else
+    status = fetch_all_options (s);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
   if (s->local_opt.num_options == 0)
     {
       DBG (3, "fetch_options: creating %d local option descriptors\n",
@@ -624,12 +1253,24 @@ do_cancel (Net_Scanner * s)
 {
   DBG (2, "do_cancel: %p\n", (void *) s);
   s->hw->auth_active = 0;
+#ifdef USE_PTHREAD
+  if (s->read_ahead)
+    stop_read_ahead (s);
+#endif
   if (s->data >= 0)
     {
       DBG (3, "do_cancel: closing data pipe\n");
       close (s->data);
       s->data = -1;
     }
+  if (s->bytes_packed > 0)
+    DBG (2, "do_cancel: received %.0f bytes for %.0f (ratio %.2f), "
+	 "%.0f ms of CPU time decompressing\n", s->bytes_packed,
+	 s->bytes_unpacked, s->bytes_unpacked / s->bytes_packed,
+	 (double) s->cpu * 1000 / CLOCKS_PER_SEC);
+  s->packed_len = s->unpacked_len = s->unpacked_pos = 0;
+  s->bytes_packed = s->bytes_unpacked = 0;
+  s->cpu = 0;
   return SANE_STATUS_CANCELLED;
 }
 
@@ -694,6 +1335,206 @@ do_authorization (Net_Device * dev, SANE_String resource)
     DBG (1, "do_authorization: auth_active is false... strange\n");
 }
 
+/* Performs the option requests of REQ with one SANE_NET_CONTROL_OPTIONS
+   call (protocol version 5) and updates the option descriptors with the
+   changes that come with the reply.  REPLY is decoded into the wire's
+   arena, which the caller has begun and ends when done with it. */
+static SANE_Status
+call_control_options (Net_Scanner * s, SANE_Control_Options_Req * req,
+		      SANE_Control_Options_Reply * reply)
+{
+  SANE_Word i, index, reload = 0;
+  SANE_Option_Descriptor *desc;
+  int need_auth = 0;
+
+  DBG (3, "call_control_options: %d requests\n", req->num_requests);
+
+  memset (reply, 0, sizeof (*reply));
+  sanei_w_call (&s->hw->wire, SANE_NET_CONTROL_OPTIONS,
+		(WireCodecFunc) sanei_w_control_options_req, req,
+		(WireCodecFunc) sanei_w_control_options_reply, reply);
+  while (s->hw->wire.status == 0 && reply->resource_to_authorize)
+    {
+      if (need_auth && !s->hw->auth_active)
+	return SANE_STATUS_CANCELLED;
+      DBG (3, "call_control_options: auth required\n");
+      need_auth = 1;
+      do_authorization (s->hw, reply->resource_to_authorize);
+      memset (reply, 0, sizeof (*reply));
+      sanei_w_set_dir (&s->hw->wire, WIRE_DECODE);
+      sanei_w_control_options_reply (&s->hw->wire, reply);
+    }
+
+  if (s->hw->wire.status || reply->num_replies != req->num_requests)
+    {
+      DBG (1, "call_control_options: bad reply (%s, %d replies)\n",
+	   strerror (s->hw->wire.status), reply->num_replies);
+      return SANE_STATUS_IO_ERROR;
+    }
+
+  for (i = 0; i < reply->num_replies; ++i)
+    if (reply->replies[i].status == SANE_STATUS_GOOD)
+      reload |= reply->replies[i].info & SANE_INFO_RELOAD_OPTIONS;
+  if (!reload || !s->options_valid)
+    return SANE_STATUS_GOOD;
+
+  /* replace the descriptors that changed */
+  if (reply->num_options != s->opt.num_options)
+    {
+      DBG (2, "call_control_options: %d options instead of %d\n",
+	   reply->num_options, s->opt.num_options);
+      s->options_valid = 0;
+      return SANE_STATUS_GOOD;
+    }
+  for (i = 0; i < reply->num_changes; ++i)
+    {
+      index = reply->changes[i].index;
+      desc = reply->changes[i].desc;
+      if (index < 0 || index >= s->opt.num_options || !desc)
+	{
+	  s->options_valid = 0;
+	  continue;
+	}
+      desc = sanei_net_copy_option_descriptor (desc);
+      if (!desc)
+	{
+	  s->options_valid = 0;
+	  continue;
+	}
+      sanei_net_free_option_descriptor (s->opt.desc[index]);
+      s->opt.desc[index] = desc;
+      memcpy (s->local_opt.desc[index], desc, sizeof (*desc));
+    }
+  DBG (2, "call_control_options: %d option descriptors changed\n",
+       reply->num_changes);
+  return SANE_STATUS_GOOD;
+}
+
+static void
+free_pending_options (Net_Scanner * s)
+{
+  int i;
+
+  for (i = 0; i < s->num_pending; ++i)
+    free (s->pending[i].value);
+  s->num_pending = 0;
+}
+
+/* With batch_options, queues setting OPTION to VALUE if that can't fail:
+   the option is one of deferred_options, active and settable without
+   automatic mode, and the value meets its constraint as it is.  Returns
+   whether it did. */
+static int
+defer_option (Net_Scanner * s, SANE_Int option, void *value,
+	      size_t value_size)
+{
+  const SANE_Option_Descriptor *desc = s->opt.desc[option];
+  SANE_Control_Option_Req *req;
+  SANE_Word info = 0;
+  void *copy;
+  int i;
+
+  if (!batch_options || s->hw->wire.version < SANEI_NET_PROTOCOL_BATCH
+      || !SANE_OPTION_IS_ACTIVE (desc->cap)
+      || !SANE_OPTION_IS_SETTABLE (desc->cap)
+      || (desc->cap & SANE_CAP_AUTOMATIC)
+      || desc->type == SANE_TYPE_BUTTON || desc->type == SANE_TYPE_GROUP
+      || desc->size <= 0 || s->num_pending >= NET_MAX_PENDING_OPTIONS
+      || !desc->name)
+    return 0;
+
+  for (i = 0; deferred_options[i]; ++i)
+    if (strcmp (desc->name, deferred_options[i]) == 0)
+      break;
+  if (!deferred_options[i])
+    return 0;
+
+  if (!s->pending)
+    {
+      s->pending = malloc (NET_MAX_PENDING_OPTIONS * sizeof (s->pending[0]));
+      if (!s->pending)
+	return 0;
+    }
+
+  /* sanei_constrain_value() may look at all of a string option's size */
+  copy = calloc (1, desc->size);
+  if (!copy)
+    return 0;
+  memcpy (copy, value, value_size);
+  if (sanei_constrain_value (desc, copy, &info) != SANE_STATUS_GOOD
+      || info != 0)
+    {
+      free (copy);
+      return 0;
+    }
+
+  req = s->pending + s->num_pending++;
+  req->handle = s->handle;
+  req->option = option;
+  req->action = SANE_ACTION_SET_VALUE;
+  req->value_type = desc->type;
+  req->value_size = value_size;
+  req->value = copy;
+  DBG (3, "defer_option: option %d deferred (%d pending)\n", option,
+       s->num_pending);
+  return 1;
+}
+
+/* Sends the option requests deferred by batch_options.  Returns the
+   status of the first one that failed, or the failure of an earlier
+   flush that wasn't reported yet.  What the requests changed is kept
+   in s->pending_info for the next sane_control_option() that asks. */
+static SANE_Status
+flush_options (Net_Scanner * s)
+{
+  SANE_Control_Options_Req req;
+  SANE_Control_Options_Reply reply;
+  SANE_Status status;
+  SANE_Word i, info = 0;
+
+  if (s->pending_status != SANE_STATUS_GOOD)
+    {
+      status = s->pending_status;
+      s->pending_status = SANE_STATUS_GOOD;
+      DBG (2, "flush_options: reporting earlier failure (%s)\n",
+	   sane_strstatus (status));
+      free_pending_options (s);
+      return status;
+    }
+  if (s->num_pending == 0)
+    return SANE_STATUS_GOOD;
+
+  DBG (3, "flush_options: sending %d option requests\n", s->num_pending);
+  req.handle = s->handle;
+  req.num_requests = s->num_pending;
+  req.requests = s->pending;
+  sanei_w_arena_begin (&s->hw->wire);
+  status = call_control_options (s, &req, &reply);
+  if (status == SANE_STATUS_GOOD)
+    {
+      for (i = 0; i < reply.num_replies; ++i)
+	if (reply.replies[i].status != SANE_STATUS_GOOD)
+	  {
+	    DBG (1, "flush_options: setting option %d failed (%s)\n",
+		 s->pending[i].option,
+		 sane_strstatus (reply.replies[i].status));
+	    if (status == SANE_STATUS_GOOD)
+	      status = reply.replies[i].status;
+	  }
+	else
+	  info |= reply.replies[i].info;
+    }
+  sanei_w_arena_end (&s->hw->wire);
+  free_pending_options (s);
+
+  /* the frontend was told nothing changed when the values were deferred:
+     the options it holds may be stale whatever the backend changed */
+  if (info)
+    s->pending_info |= SANE_INFO_RELOAD_OPTIONS
+      | (info & SANE_INFO_RELOAD_PARAMS);
+  return status;
+}
+
 
 #ifdef WITH_AVAHI
 static void
@@ -961,6 +1802,7 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
        (version_code) ? "!=" : "==");
 
   devlist = NULL;
+  devlist_time = 0;
   first_device = NULL;
   first_handle = NULL;
 
@@ -1045,6 +1887,73 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
 	      continue;
 	    }
 
+	  if (strstr(device_name, "read_ahead") != NULL)
+	    {
+	      char *end;
+	      long size;
+
+	      optval = strchr(device_name, '=');
+
+	      if (!optval)
+		continue;
+
+	      optval = sanei_config_skip_whitespace (++optval);
+	      size = strtol (optval, &end, 10);
+	      if (*end == 'k' || *end == 'K')
+		size *= 1024;
+	      else if (*end == 'm' || *end == 'M')
+		size *= 1024 * 1024;
+	      if (size == 0)
+		read_ahead_size = 0;
+	      else if (size < NET_MIN_READ_AHEAD || size > NET_MAX_READ_AHEAD)
+		DBG (1, "sane_init: read_ahead %s out of range, ignored\n",
+		     optval);
+	      else
+		read_ahead_size = size;
+#ifndef USE_PTHREAD
+	      if (read_ahead_size)
+		DBG (1, "sane_init: read_ahead needs pthreads, ignored\n");
+#endif
+	      DBG (2, "sane_init: read ahead set to %lu bytes\n",
+		   (u_long) read_ahead_size);
+
+	      continue;
+	    }
+
+	  if (strstr(device_name, "batch_options") != NULL)
+	    {
+	      optval = strchr(device_name, '=');
+
+	      if (!optval)
+		continue;
+
+	      optval = sanei_config_skip_whitespace (++optval);
+	      batch_options = (strncmp (optval, "yes", 3) == 0);
+	      DBG (2, "sane_init: batch options %s\n",
+		   batch_options ? "enabled" : "disabled");
+
+	      continue;
+	    }
+
+	  if (strstr(device_name, "device_list_ttl") != NULL)
+	    {
+	      optval = strchr(device_name, '=');
+
+	      if (!optval)
+		continue;
+
+	      optval = sanei_config_skip_whitespace (++optval);
+	      if ((optval != NULL) && (*optval != '\0'))
+		{
+		  device_list_ttl = atoi(optval);
+
+		  DBG (2, "sane_init: device list kept for %d seconds\n",
+		       device_list_ttl);
+		}
+
+	      continue;
+	    }
+
 	  DBG (2, "sane_init: trying to add %s\n", device_name);
 	  add_device (device_name, 0);
 	}
@@ -1150,6 +2059,7 @@ sane_exit (void)
 	}
       if (dev->name)
 	free ((void *) dev->name);
+      free_option_cache (dev);
 
 #ifdef NET_USES_AF_INDEP      
       if (dev->addr)
@@ -1186,12 +2096,13 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
 {
   static int devlist_size = 0, devlist_len = 0;
   static const SANE_Device *empty_devlist[1] = { 0 };
-  SANE_Get_Devices_Reply reply;
-  SANE_Status status;
+  SANE_Get_Devices_Reply *reply;
+  Net_Probe *probe;
   Net_Device *dev;
   char *full_name;
-  int i, num_devs;
+  int i, h, num_hosts, num_devs;
   size_t len;
+  time_t now;
 #define ASSERT_SPACE(n)                                                    \
   {                                                                        \
     if (devlist_len + (n) > devlist_size)                                  \
@@ -1204,7 +2115,7 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
         if (!devlist)                                                      \
           {                                                                \
              DBG (1, "sane_get_devices: not enough memory\n");	           \
-             return SANE_STATUS_NO_MEM;                                    \
+             goto no_mem;                                                  \
           }                                                                \
       }                                                                    \
   }
@@ -1217,6 +2128,16 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
       return SANE_STATUS_GOOD;
     }
 
+  now = time (NULL);
+  if (devlist && devlist_time && device_list_ttl > 0
+      && now >= devlist_time && now - devlist_time < device_list_ttl)
+    {
+      DBG (2, "sane_get_devices: reusing device list from %ld s ago\n",
+	   (long) (now - devlist_time));
+      *device_list = devlist;
+      return SANE_STATUS_GOOD;
+    }
+
   if (devlist)
     {
       DBG (2, "sane_get_devices: freeing devlist\n");
@@ -1235,33 +2156,31 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
     }
   devlist_len = 0;
   devlist_size = 0;
+  devlist_time = 0;
 
-  for (dev = first_device; dev; dev = dev->next)
+  for (num_hosts = 0, dev = first_device; dev; dev = dev->next)
+    ++num_hosts;
+  probe = calloc (num_hosts > 0 ? num_hosts : 1, sizeof (probe[0]));
+  if (!probe)
     {
-      if (dev->ctl < 0)
-	{
-	  status = connect_dev (dev);
-	  if (status != SANE_STATUS_GOOD)
-	    {
-	      DBG (1, "sane_get_devices: ignoring failure to connect to %s\n",
-		   dev->name);
-	      continue;
-	    }
-	}
-      sanei_w_call (&dev->wire, SANE_NET_GET_DEVICES,
-		    (WireCodecFunc) sanei_w_void, 0,
-		    (WireCodecFunc) sanei_w_get_devices_reply, &reply);
-      if (reply.status != SANE_STATUS_GOOD)
-	{
-	  DBG (1, "sane_get_devices: ignoring rpc-returned status %s\n",
-	       sane_strstatus (reply.status));
-	  sanei_w_free (&dev->wire,
-			(WireCodecFunc) sanei_w_get_devices_reply, &reply);
-	  continue;
-	}
+      DBG (1, "sane_get_devices: not enough memory\n");
+      return SANE_STATUS_NO_MEM;
+    }
+  for (h = 0, dev = first_device; dev; dev = dev->next)
+    probe[h++].dev = dev;
+
+  probe_hosts (probe, num_hosts);
+
+  /* merge the lists, in the order the hosts are configured: */
+  for (h = 0; h < num_hosts; ++h)
+    {
+      if (probe[h].state != PROBE_DONE)
+	continue;
+      dev = probe[h].dev;
+      reply = &probe[h].reply;
 
       /* count the number of devices for this backend: */
-      for (num_devs = 0; reply.device_list[num_devs]; ++num_devs);
+      for (num_devs = 0; reply->device_list[num_devs]; ++num_devs);
 
       ASSERT_SPACE (num_devs);
 
@@ -1276,7 +2195,7 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
 	  /* create a new device entry with a device name that is the
 	     sum of the backend name a colon and the backend's device
 	     name: */
-	  len = strlen (dev->name) + 1 + strlen (reply.device_list[i]->name);
+	  len = strlen (dev->name) + 1 + strlen (reply->device_list[i]->name);
 
 #ifdef ENABLE_IPV6
 	  if (strchr (dev->name, ':') != NULL)
@@ -1290,10 +2209,7 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
 	  if (!mem)
 	    {
 	      DBG (1, "sane_get_devices: not enough free memory\n");
-	      sanei_w_free (&dev->wire,
-			    (WireCodecFunc) sanei_w_get_devices_reply,
-			    &reply);
-	      return SANE_STATUS_NO_MEM;
+	      goto no_mem;
 	    }
 
 	  memset (mem, 0, sizeof (*dev) + len);
@@ -1312,14 +2228,14 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
 #endif /* ENABLE_IPV6 */
 
 	  strcat (full_name, ":");
-	  strcat (full_name, reply.device_list[i]->name);
+	  strcat (full_name, reply->device_list[i]->name);
 	  DBG (3, "sane_get_devices: got %s\n", full_name);
 
 	  rdev = (SANE_Device *) mem;
 	  rdev->name = full_name;
-	  rdev->vendor = strdup (reply.device_list[i]->vendor);
-	  rdev->model = strdup (reply.device_list[i]->model);
-	  rdev->type = strdup (reply.device_list[i]->type);
+	  rdev->vendor = strdup (reply->device_list[i]->vendor);
+	  rdev->model = strdup (reply->device_list[i]->model);
+	  rdev->type = strdup (reply->device_list[i]->type);
 
 	  if ((!rdev->vendor) || (!rdev->model) || (!rdev->type))
 	    {
@@ -1331,26 +2247,51 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
 	      if (rdev->type)
 		free ((void *) rdev->type);
 	      free (rdev);
-	      sanei_w_free (&dev->wire,
-			    (WireCodecFunc) sanei_w_get_devices_reply,
-			    &reply);
-	      return SANE_STATUS_NO_MEM;
+	      goto no_mem;
 	    }
 
 	  devlist[devlist_len++] = rdev;
 	}
       /* now free up the rpc return value: */
-      sanei_w_free (&dev->wire,
-		    (WireCodecFunc) sanei_w_get_devices_reply, &reply);
+      sanei_w_arena_end (&dev->wire);
+      probe[h].state = PROBE_FAILED;
     }
+  free (probe);
+  probe = NULL;
 
   /* terminate device list with NULL entry: */
   ASSERT_SPACE (1);
   devlist[devlist_len++] = 0;
+  devlist_time = now;
 
   *device_list = devlist;
   DBG (2, "sane_get_devices: finished (%d devices)\n", devlist_len - 1);
   return SANE_STATUS_GOOD;
+
+no_mem:
+  if (probe)
+    {
+      for (h = 0; h < num_hosts; ++h)
+	if (probe[h].state == PROBE_DONE)
+	  sanei_w_arena_end (&probe[h].dev->wire);
+      free (probe);
+    }
+  /* leave no unterminated list behind */
+  if (devlist)
+    {
+      for (i = 0; i < devlist_len; ++i)
+	{
+	  free ((void *) devlist[i]->vendor);
+	  free ((void *) devlist[i]->model);
+	  free ((void *) devlist[i]->type);
+	  free ((void *) devlist[i]);
+	}
+      free (devlist);
+      devlist = 0;
+    }
+  devlist_len = 0;
+  devlist_size = 0;
+  return SANE_STATUS_NO_MEM;
 }
 
 SANE_Status
@@ -1586,6 +2527,7 @@ sane_open (SANE_String_Const full_name, SANE_Handle * meta_handle)
   memset (s, 0, sizeof (*s));
   s->hw = dev;
   s->handle = handle;
+  s->name = strdup (dev_name);
   s->data = -1;
   s->next = first_handle;
   s->local_opt.desc = 0;
@@ -1640,16 +2582,12 @@ sane_close (SANE_Handle handle)
   else
     first_handle = s->next;
 
-  if (s->opt.num_options)
-    {
-      DBG (2, "sane_close: removing cached option descriptors\n");
-      sanei_w_set_dir (&s->hw->wire, WIRE_FREE);
-      s->hw->wire.status = 0;
-      sanei_w_option_descriptor_array (&s->hw->wire, &s->opt);
-      if (s->hw->wire.status)
-	DBG (1, "sane_close: couldn't free sanei_w_option_descriptor_array "
-	     "(%s)\n", sane_strstatus (s->hw->wire.status));
-    }
+  DBG (2, "sane_close: removing cached option descriptors\n");
+  free_descriptors (&s->opt);
+
+  free_pending_options (s);
+  if (s->pending)
+    free (s->pending);
 
   DBG (2, "sane_close: removing local option descriptors\n");
   for (option_number = 0; option_number < s->local_opt.num_options;
@@ -1662,11 +2600,21 @@ sane_close (SANE_Handle handle)
   sanei_w_call (&s->hw->wire, SANE_NET_CLOSE,
 		(WireCodecFunc) sanei_w_word, &s->handle,
 		(WireCodecFunc) sanei_w_word, &ack);
+#ifdef USE_PTHREAD
+  if (s->read_ahead)
+    stop_read_ahead (s);
+#endif
   if (s->data >= 0)
     {
       DBG (2, "sane_close: closing data pipe\n");
       close (s->data);
     }
+  if (s->packed)
+    free (s->packed);
+  if (s->unpacked)
+    free (s->unpacked);
+  if (s->name)
+    free (s->name);
   free (s);
   DBG (2, "sane_close: done\n");
 }
@@ -1679,6 +2627,18 @@ sane_get_option_descriptor (SANE_Handle handle, SANE_Int option)
 
   DBG (3, "sane_get_option_descriptor: option %d\n", option);
 
+  if (s->num_pending > 0)
+    {
+      status = flush_options (s);
+      if (status != SANE_STATUS_GOOD)
+	{
+	  /* can't be returned from here */
+	  DBG (1, "sane_get_option_descriptor: deferred option requests "
+	       "failed (%s)\n", sane_strstatus (status));
+	  s->pending_status = status;
+	}
+    }
+
   if (!s->options_valid)
     {
       DBG (3, "sane_get_option_descriptor: getting option descriptors\n");
@@ -1699,6 +2659,58 @@ sane_get_option_descriptor (SANE_Handle handle, SANE_Int option)
   return s->local_opt.desc[option];
 }
 
+/* sane_control_option() with protocol version 5, where the descriptors
+   changed by the request come with the reply */
+static SANE_Status
+control_one_option (Net_Scanner * s, SANE_Control_Option_Req * req,
+		    SANE_Word * info)
+{
+  SANE_Control_Options_Req batch;
+  SANE_Control_Options_Reply reply;
+  SANE_Control_Option_Reply *r;
+  SANE_Status status;
+
+  batch.handle = s->handle;
+  batch.num_requests = 1;
+  batch.requests = req;
+  sanei_w_arena_begin (&s->hw->wire);
+  status = call_control_options (s, &batch, &reply);
+  if (status != SANE_STATUS_GOOD)
+    {
+      sanei_w_arena_end (&s->hw->wire);
+      return status;
+    }
+
+  r = reply.replies;
+  status = r->status;
+  if (status == SANE_STATUS_GOOD)
+    {
+      if (info)
+	{
+	  *info = r->info | s->pending_info;
+	  s->pending_info = 0;
+	}
+      if (req->value_size > 0)
+	{
+	  if (req->value_size == r->value_size)
+	    memcpy (req->value, r->value, r->value_size);
+	  else
+	    DBG (1, "control_one_option: size changed from %d to %d\n",
+		 req->value_size, r->value_size);
+	}
+    }
+  sanei_w_arena_end (&s->hw->wire);
+
+  DBG (2, "control_one_option: done (%s)\n", sane_strstatus (status));
+  if (status == SANE_STATUS_GOOD && !info && !s->options_valid)
+    {
+      DBG (2, "control_one_option: reloading options as frontend does not "
+	   "care\n");
+      status = fetch_options (s);
+    }
+  return status;
+}
+
 SANE_Status
 sane_control_option (SANE_Handle handle, SANE_Int option,
 		     SANE_Action action, void *value, SANE_Word * info)
@@ -1745,6 +2757,28 @@ sane_control_option (SANE_Handle handle, SANE_Int option,
       break;
     }
 
+  if (s->pending_status == SANE_STATUS_GOOD
+      && action == SANE_ACTION_SET_VALUE
+      && defer_option (s, option, value, value_size))
+    {
+      if (info)
+	{
+	  *info = s->pending_info;
+	  s->pending_info = 0;
+	}
+      return SANE_STATUS_GOOD;
+    }
+  if (s->num_pending > 0 || s->pending_status != SANE_STATUS_GOOD)
+    {
+      /* send the deferred requests first, they may change this option */
+      status = flush_options (s);
+      if (status == SANE_STATUS_GOOD && !s->options_valid)
+	status = fetch_options (s);
+      if (status != SANE_STATUS_GOOD)
+	return status;
+      return sane_control_option (handle, option, action, value, info);
+    }
+
   /* Avoid leaking memory bits */
   if (value && (action != SANE_ACTION_SET_VALUE))
     memset (value, 0, value_size);
@@ -1760,6 +2794,9 @@ sane_control_option (SANE_Handle handle, SANE_Int option,
   req.value_size = value_size;
   req.value = value;
 
+  if (s->hw->wire.version >= SANEI_NET_PROTOCOL_BATCH)
+    return control_one_option (s, &req, info);
+
   local_info = 0;
 
   DBG (3, "sane_control_option: remote control option\n");
@@ -1840,6 +2877,10 @@ sane_get_parameters (SANE_Handle handle, SANE_Parameters * params)
       return SANE_STATUS_INVAL;
     }
 
+  status = flush_options (s);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
   DBG (3, "sane_get_parameters: remote get parameters\n");
   sanei_w_call (&s->hw->wire, SANE_NET_GET_PARAMETERS,
 		(WireCodecFunc) sanei_w_word, &s->handle,
@@ -1847,7 +2888,7 @@ sane_get_parameters (SANE_Handle handle, SANE_Parameters * params)
 
   status = reply.status;
   *params = reply.params;
-  depth = reply.params.depth;
+  s->depth = reply.params.depth;
   sanei_w_free (&s->hw->wire,
 		(WireCodecFunc) sanei_w_get_parameters_reply, &reply);
 
@@ -1875,8 +2916,12 @@ sane_start (SANE_Handle handle)
 
   DBG (3, "sane_start\n");
 
-  hang_over = -1;
-  left_over = -1;
+  status = flush_options (s);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
+  s->hang_over = -1;
+  s->left_over = -1;
 
   if (s->data >= 0)
     {
@@ -1928,12 +2973,12 @@ sane_start (SANE_Handle handle)
       port = reply.port;
       if (reply.byte_order == 0x1234)
 	{
-	  server_big_endian = 0;
+	  s->server_big_endian = 0;
 	  DBG (1, "sane_start: server has little endian byte order\n");
 	}
       else
 	{
-	  server_big_endian = 1;
+	  s->server_big_endian = 1;
 	  DBG (1, "sane_start: server has big endian byte order\n");
 	}
 
@@ -1990,6 +3035,9 @@ sane_start (SANE_Handle handle)
   s->data = fd;
   s->reclen_buf_offset = 0;
   s->bytes_remaining = 0;
+#ifdef USE_PTHREAD
+  start_read_ahead (s);
+#endif
   DBG (3, "sane_start: done (%s)\n", sane_strstatus (status));
   return status;
 }
@@ -2010,8 +3058,12 @@ sane_start (SANE_Handle handle)
 
   DBG (3, "sane_start\n");
 
-  hang_over = -1;
-  left_over = -1;
+  status = flush_options (s);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
+  s->hang_over = -1;
+  s->left_over = -1;
 
   if (s->data >= 0)
     {
@@ -2046,12 +3098,12 @@ sane_start (SANE_Handle handle)
       port = reply.port;
       if (reply.byte_order == 0x1234)
 	{
-	  server_big_endian = 0;
+	  s->server_big_endian = 0;
 	  DBG (1, "sane_start: server has little endian byte order\n");
 	}
       else
 	{
-	  server_big_endian = 1;
+	  s->server_big_endian = 1;
 	  DBG (1, "sane_start: server has big endian byte order\n");
 	}
 
@@ -2097,68 +3149,407 @@ sane_start (SANE_Handle handle)
   s->data = fd;
   s->reclen_buf_offset = 0;
   s->bytes_remaining = 0;
+#ifdef USE_PTHREAD
+  start_read_ahead (s);
+#endif
   DBG (3, "sane_start: done (%s)\n", sane_strstatus (status));
   return status;
 }
 #endif /* NET_USES_AF_INDEP */
 
 
-SANE_Status
-sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
-	   SANE_Int * length)
+/* On a compressed connection, reads the rest of the record whose
+   header has been read and decompresses it into s->unpacked.  Returns
+   SANE_STATUS_GOOD with s->bytes_remaining > 0 if the record hasn't
+   arrived completely yet in non-blocking mode. */
+static SANE_Status
+fetch_packed_record (Net_Scanner * s)
 {
-  Net_Scanner *s = handle;
+  SANEI_Compress_Codec codec;
+  SANE_Status status;
+  size_t raw_len;
   ssize_t nread;
-  SANE_Int cnt;
-  SANE_Int start_cnt;
-  SANE_Int end_cnt;
-  SANE_Byte swap_buf;
-  SANE_Byte temp_hang_over;
-  int is_even;
+  clock_t start;
+  void *p;
 
-  DBG (3, "sane_read: handle=%p, data=%p, max_length=%d, length=%p\n",
-       handle, data, max_length, (void *) length);
-  if (!length)
+  if (s->packed_len == 0)
     {
-      DBG (1, "sane_read: length == NULL\n");
-      return SANE_STATUS_INVAL;
+      if (s->bytes_remaining < 5 || s->bytes_remaining > NET_MAX_RECORD)
+	{
+	  DBG (1, "fetch_packed_record: bad record length %lu\n",
+	       (u_long) s->bytes_remaining);
+	  return SANE_STATUS_IO_ERROR;
+	}
+      if (s->bytes_remaining > s->packed_size)
+	{
+	  p = realloc (s->packed, s->bytes_remaining);
+	  if (!p)
+	    return SANE_STATUS_NO_MEM;
+	  s->packed = p;
+	  s->packed_size = s->bytes_remaining;
+	}
     }
 
-  is_even = 1;
-  *length = 0;
+  while (s->bytes_remaining > 0)
+    {
+      nread = read (s->data, s->packed + s->packed_len, s->bytes_remaining);
+      if (nread < 0 && errno == EAGAIN)
+	return SANE_STATUS_GOOD;
+      if (nread <= 0)
+	{
+	  DBG (1, "fetch_packed_record: read failed (%s)\n",
+	       nread < 0 ? strerror (errno) : "end of file");
+	  return SANE_STATUS_IO_ERROR;
+	}
+      s->packed_len += nread;
+      s->bytes_remaining -= nread;
+    }
+
+  codec = (SANEI_Compress_Codec) s->packed[0];
+  raw_len = (((u_long) s->packed[1] << 24) | ((u_long) s->packed[2] << 16)
+	     | ((u_long) s->packed[3] << 8) | ((u_long) s->packed[4] << 0));
+  if (raw_len > NET_MAX_RECORD)
+    {
+      DBG (1, "fetch_packed_record: bad uncompressed length %lu\n",
+	   (u_long) raw_len);
+      return SANE_STATUS_IO_ERROR;
+    }
+  if (raw_len > s->unpacked_size)
+    {
+      p = realloc (s->unpacked, raw_len);
+      if (!p)
+	return SANE_STATUS_NO_MEM;
+      s->unpacked = p;
+      s->unpacked_size = raw_len;
+    }
+
+  start = clock ();
+  status = sanei_decompress (codec, s->packed + 5, s->packed_len - 5,
+			     s->unpacked, raw_len);
+  s->cpu += clock () - start;
+  if (status != SANE_STATUS_GOOD)
+    {
+      DBG (1, "fetch_packed_record: can't decompress %lu bytes with codec "
+	   "%d (%s)\n", (u_long) s->packed_len - 5, codec,
+	   sane_strstatus (status));
+      return SANE_STATUS_IO_ERROR;
+    }
+  DBG (3, "fetch_packed_record: %lu bytes decompressed to %lu\n",
+       (u_long) s->packed_len - 5, (u_long) raw_len);
+
+  s->bytes_packed += s->packed_len + 4;
+  s->bytes_unpacked += raw_len;
+  s->unpacked_len = raw_len;
+  s->unpacked_pos = 0;
+  s->packed_len = 0;
+  return SANE_STATUS_GOOD;
+}
+
+#ifdef USE_PTHREAD
+/* Reads exactly LEN bytes from the data connection, returns 0 on error or
+   end of file. */
+static int
+read_ahead_full (int fd, void *buf, size_t len)
+{
+  SANE_Byte *p = buf;
+  ssize_t nread;
+
+  while (len > 0)
+    {
+      nread = read (fd, p, len);
+      if (nread < 0 && errno == EINTR)
+	continue;
+      if (nread <= 0)
+	return 0;
+      p += nread;
+      len -= nread;
+    }
+  return 1;
+}
+
+/* Wakes up sane_read() and the select fd; called with the lock held. */
+static void
+read_ahead_notify (struct Net_Read_Ahead *ra)
+{
+  char ch = 0;
+
+  if (!ra->notified && write (ra->notify[1], &ch, 1) == 1)
+    ra->notified = 1;
+  pthread_cond_broadcast (&ra->cond);
+}
 
-  /* If there's a left over, i.e. a byte already in the correct byte order,
-     return it immediately; otherwise read may fail with a SANE_STATUS_EOF and
-     the caller never can read the last byte */
-  if ((depth == 16) && (server_big_endian != client_big_endian))
+/* Waits for free space in the ring and returns the size of the free
+   contiguous block after the data, or 0 if cancelled. Stores the start
+   of the block in *DEST. */
+static size_t
+read_ahead_space (struct Net_Read_Ahead *ra, SANE_Byte ** dest)
+{
+  size_t end, space;
+
+  pthread_mutex_lock (&ra->lock);
+  while (ra->len == ra->size && !ra->cancel)
+    pthread_cond_wait (&ra->cond, &ra->lock);
+  end = (ra->start + ra->len) % ra->size;
+  space = ra->size - ra->len;
+  if (space > ra->size - end)
+    space = ra->size - end;
+  if (ra->cancel)
+    space = 0;
+  *dest = ra->ring + end;
+  pthread_mutex_unlock (&ra->lock);
+  return space;
+}
+
+/* Appends LEN bytes just read to the end of the ring. */
+static void
+read_ahead_commit (struct Net_Read_Ahead *ra, size_t len)
+{
+  pthread_mutex_lock (&ra->lock);
+  ra->len += len;
+  read_ahead_notify (ra);
+  pthread_mutex_unlock (&ra->lock);
+}
+
+static void *
+read_ahead_thread (void *arg)
+{
+  Net_Scanner *s = arg;
+  struct Net_Read_Ahead *ra = s->read_ahead;
+  SANE_Status status = SANE_STATUS_GOOD;
+  SANE_Byte header[4], *dest;
+  size_t space, pos;
+  ssize_t nread;
+  char ch;
+
+  DBG (3, "read_ahead_thread: started, %lu byte ring\n", (u_long) ra->size);
+  while (status == SANE_STATUS_GOOD)
     {
-      if (left_over > -1)
+      if (!read_ahead_full (s->data, header, 4))
 	{
-	  DBG (3, "sane_read: left_over from previous call, return "
-	       "immediately\n");
-	  /* return the byte, we've currently scanned; hang_over becomes 
-	     left_over */
-	  *data = (SANE_Byte) left_over;
-	  left_over = -1;
-	  *length = 1;
+	  DBG (1, "read_ahead_thread: can't read record length (%s)\n",
+	       strerror (errno));
+	  status = SANE_STATUS_IO_ERROR;
+	  break;
+	}
+      s->bytes_remaining = (((u_long) header[0] << 24)
+			    | ((u_long) header[1] << 16)
+			    | ((u_long) header[2] << 8)
+			    | ((u_long) header[3] << 0));
+      if (s->bytes_remaining == 0xffffffff)
+	{
+	  s->bytes_remaining = 0;
+	  if (!read_ahead_full (s->data, &ch, 1))
+	    {
+	      DBG (1, "read_ahead_thread: failed to read error code\n");
+	      ch = SANE_STATUS_IO_ERROR;
+	    }
+	  status = (SANE_Status) ch;
+	  break;
+	}
+
+      if (s->hw->wire.version >= SANEI_NET_PROTOCOL_COMPRESS)
+	{
+	  s->packed_len = 0;
+	  status = fetch_packed_record (s);
+	  for (pos = 0; status == SANE_STATUS_GOOD && pos < s->unpacked_len;
+	       pos += space)
+	    {
+	      space = read_ahead_space (ra, &dest);
+	      if (space == 0)
+		status = SANE_STATUS_CANCELLED;
+	      else
+		{
+		  if (space > s->unpacked_len - pos)
+		    space = s->unpacked_len - pos;
+		  memcpy (dest, s->unpacked + pos, space);
+		  read_ahead_commit (ra, space);
+		}
+	    }
+	  s->unpacked_len = s->unpacked_pos = 0;
+	  continue;
+	}
+
+      while (status == SANE_STATUS_GOOD && s->bytes_remaining > 0)
+	{
+	  space = read_ahead_space (ra, &dest);
+	  if (space == 0)
+	    {
+	      status = SANE_STATUS_CANCELLED;
+	      break;
+	    }
+	  if (space > s->bytes_remaining)
+	    space = s->bytes_remaining;
+	  /* the reader only touches the data before this block */
+	  nread = read (s->data, dest, space);
+	  if (nread < 0 && errno == EINTR)
+	    continue;
+	  if (nread <= 0)
+	    {
+	      DBG (1, "read_ahead_thread: read failed (%s)\n",
+		   nread < 0 ? strerror (errno) : "end of file");
+	      status = SANE_STATUS_IO_ERROR;
+	    }
+	  else
+	    {
+	      s->bytes_remaining -= nread;
+	      read_ahead_commit (ra, nread);
+	    }
+	}
+    }
+
+  pthread_mutex_lock (&ra->lock);
+  if (ra->cancel)
+    status = SANE_STATUS_CANCELLED;
+  DBG (3, "read_ahead_thread: done (%s)\n", sane_strstatus (status));
+  ra->status = status;
+  ra->done = 1;
+  read_ahead_notify (ra);
+  pthread_mutex_unlock (&ra->lock);
+  return NULL;
+}
+
+/* Starts the read-ahead thread of a scan if enabled in net.conf; the scan
+   just reads the socket itself if that fails. */
+static void
+start_read_ahead (Net_Scanner * s)
+{
+  struct Net_Read_Ahead *ra;
+
+  if (read_ahead_size == 0)
+    return;
+
+  ra = calloc (1, sizeof (*ra));
+  if (!ra)
+    return;
+  ra->ring = malloc (read_ahead_size);
+  if (!ra->ring || pipe (ra->notify) < 0)
+    {
+      DBG (1, "start_read_ahead: can't set up read ahead (%s)\n",
+	   ra->ring ? strerror (errno) : "out of memory");
+      free (ra->ring);
+      free (ra);
+      return;
+    }
+  fcntl (ra->notify[0], F_SETFL, O_NONBLOCK);
+  fcntl (ra->notify[1], F_SETFL, O_NONBLOCK);
+  ra->size = read_ahead_size;
+  pthread_mutex_init (&ra->lock, NULL);
+  pthread_cond_init (&ra->cond, NULL);
+
+  s->read_ahead = ra;
+  if (pthread_create (&ra->thread, NULL, read_ahead_thread, s) != 0)
+    {
+      DBG (1, "start_read_ahead: can't create thread\n");
+      s->read_ahead = NULL;
+      pthread_mutex_destroy (&ra->lock);
+      pthread_cond_destroy (&ra->cond);
+      close (ra->notify[0]);
+      close (ra->notify[1]);
+      free (ra->ring);
+      free (ra);
+    }
+}
+
+/* Stops the read-ahead thread; the data connection is left open. */
+static void
+stop_read_ahead (Net_Scanner * s)
+{
+  struct Net_Read_Ahead *ra = s->read_ahead;
+
+  pthread_mutex_lock (&ra->lock);
+  ra->cancel = 1;
+  pthread_cond_broadcast (&ra->cond);
+  pthread_mutex_unlock (&ra->lock);
+  /* wake the thread if it's blocked reading */
+  shutdown (s->data, SHUT_RDWR);
+  pthread_join (ra->thread, NULL);
+
+  pthread_mutex_destroy (&ra->lock);
+  pthread_cond_destroy (&ra->cond);
+  close (ra->notify[0]);
+  close (ra->notify[1]);
+  free (ra->ring);
+  free (ra);
+  s->read_ahead = NULL;
+  s->bytes_remaining = 0;
+}
+
+/* Copies up to MAX_LENGTH bytes of buffered image data to DATA, waiting
+   for the thread unless in non-blocking mode. */
+static SANE_Status
+read_ahead_get (Net_Scanner * s, SANE_Byte * data, SANE_Int max_length,
+		ssize_t * nread)
+{
+  struct Net_Read_Ahead *ra = s->read_ahead;
+  SANE_Status status;
+  size_t len, chunk;
+  char buf[16];
+
+  *nread = 0;
+  pthread_mutex_lock (&ra->lock);
+  while (ra->len == 0 && !ra->done && !ra->nonblocking)
+    pthread_cond_wait (&ra->cond, &ra->lock);
+
+  if (ra->len == 0)
+    {
+      status = ra->status;
+      if (!ra->done)
+	{
+	  pthread_mutex_unlock (&ra->lock);
 	  return SANE_STATUS_GOOD;
 	}
+      pthread_mutex_unlock (&ra->lock);
+      DBG (2, "read_ahead_get: end of data (%s)\n", sane_strstatus (status));
+      do_cancel (s);
+      return status;
     }
 
-  if (s->data < 0)
+  len = ra->len;
+  if (len > (size_t) max_length)
+    len = max_length;
+  chunk = ra->size - ra->start;
+  if (chunk > len)
+    chunk = len;
+  memcpy (data, ra->ring + ra->start, chunk);
+  memcpy (data + chunk, ra->ring, len - chunk);
+  ra->start = (ra->start + len) % ra->size;
+  ra->len -= len;
+  if (ra->len == 0 && !ra->done && ra->notified)
     {
-      DBG (1, "sane_read: data pipe doesn't exist, scan cancelled?\n");
-      return SANE_STATUS_CANCELLED;
+      /* ring is empty, make the select fd block again */
+      while (read (ra->notify[0], buf, sizeof (buf)) > 0)
+	;
+      ra->notified = 0;
     }
+  pthread_cond_broadcast (&ra->cond);
+  pthread_mutex_unlock (&ra->lock);
+
+  *nread = len;
+  return SANE_STATUS_GOOD;
+}
+#endif /* USE_PTHREAD */
+
+/* Reads up to MAX_LENGTH bytes of image data from the data connection
+   into DATA, a record header first if the last record is finished.
+   Stores the number of bytes read in *NREAD, which is 0 if no data is
+   available yet in non-blocking mode. */
+static SANE_Status
+read_record_data (Net_Scanner * s, SANE_Byte * data, SANE_Int max_length,
+		  ssize_t * nread)
+{
+  SANE_Status status;
+  ssize_t n;
 
-  if (s->bytes_remaining == 0)
+  *nread = 0;
+
+  if (s->bytes_remaining == 0 && s->unpacked_pos == s->unpacked_len)
     {
       /* boy, is this painful or what? */
       
       DBG (4, "sane_read: reading packet length\n");
-      nread = read (s->data, s->reclen_buf + s->reclen_buf_offset,
-		    4 - s->reclen_buf_offset);
-      if (nread < 0)
+      n = read (s->data, s->reclen_buf + s->reclen_buf_offset,
+		4 - s->reclen_buf_offset);
+      if (n < 0)
 	{
 	  DBG (3, "sane_read: read failed (%s)\n", strerror (errno));
 	  if (errno == EAGAIN)
@@ -2173,9 +3564,9 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
 	      return SANE_STATUS_IO_ERROR;
 	    }
 	}
-      DBG (4, "sane_read: read %lu bytes, %d from 4 total\n", (u_long) nread,
+      DBG (4, "sane_read: read %lu bytes, %d from 4 total\n", (u_long) n,
 	   s->reclen_buf_offset);
-      s->reclen_buf_offset += nread;
+      s->reclen_buf_offset += n;
       if (s->reclen_buf_offset < 4)
 	{
 	  DBG (4, "sane_read: enough for now\n");
@@ -2211,114 +3602,163 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
 	}
     }
 
-  if (max_length > (SANE_Int) s->bytes_remaining)
-    max_length = s->bytes_remaining;
-
-  nread = read (s->data, data, max_length);
-  
-  if (nread < 0)
+  if (s->hw->wire.version >= SANEI_NET_PROTOCOL_COMPRESS)
     {
-      DBG (2, "sane_read: error code %s\n", strerror (errno));
-      if (errno == EAGAIN)
-	return SANE_STATUS_GOOD;
-      else
+      if (s->unpacked_pos == s->unpacked_len)
 	{
-	  DBG (1, "sane_read: cancelling scan\n");
-	  do_cancel (s);
-	  return SANE_STATUS_IO_ERROR;
+	  status = fetch_packed_record (s);
+	  if (status != SANE_STATUS_GOOD)
+	    {
+	      DBG (1, "sane_read: cancelling scan\n");
+	      do_cancel (s);
+	      return status;
+	    }
+	  if (s->bytes_remaining > 0)
+	    return SANE_STATUS_GOOD;	/* try again later */
 	}
-    }
 
-  s->bytes_remaining -= nread;
+      n = s->unpacked_len - s->unpacked_pos;
+      if (n > max_length)
+	n = max_length;
+      memcpy (data, s->unpacked + s->unpacked_pos, n);
+      s->unpacked_pos += n;
+    }
+  else
+    {
+      if (max_length > (SANE_Int) s->bytes_remaining)
+	max_length = s->bytes_remaining;
 
-  *length = nread;
-  /* Check whether we are scanning with a depth of 16 bits/pixel and whether
-     server and client have different byte order. If this is true, then it's
-     neccessary to check whether read returned an odd number. If an odd number
-     has been returned, we must save the last byte.
-  */
-  if ((depth == 16) && (server_big_endian != client_big_endian))
-    {
-      DBG (1,"sane_read: client/server have different byte order; "
-	   "must swap\n");
-      /* special case: 1 byte scanned and hang_over */
-      if ((nread == 1) && (hang_over > -1))
-	{
-	  /* return the byte, we've currently scanned; hang_over becomes 
-	     left_over */
-	  left_over = hang_over;
-	  hang_over = -1;
-	  return SANE_STATUS_GOOD;
-	}
-      /* check whether an even or an odd number of bytes has been scanned */
-      if ((nread % 2) == 0)
-        is_even = 1;
-      else
-        is_even = 0;
-      /* check, whether there's a hang over from a previous call;
-	 in this case we memcopy the data up one byte */
-      if ((nread > 1) && (hang_over > -1))
-	{
-	  /* store last byte */
-	  temp_hang_over = *(data + nread - 1);
-	  memmove (data + 1, data, nread - 1);
-	  *data = (SANE_Byte) hang_over;
-	  /* what happens with the last byte depends on whether the number
-	     of bytes is even or odd */
-	  if (is_even == 1)
-	    {
-	      /* number of bytes is even; no new hang_over, exchange last
-		 byte with hang over; last byte becomes left_over */
-	      left_over = *(data + nread - 1);
-	      *(data + nread - 1) = temp_hang_over;
-	      hang_over = -1;
-	      start_cnt = 0;
-	      /* last byte already swapped */
-	      end_cnt = nread - 2;
-	    }
+      n = read (s->data, data, max_length);
+  
+      if (n < 0)
+	{
+	  DBG (2, "sane_read: error code %s\n", strerror (errno));
+	  if (errno == EAGAIN)
+	    return SANE_STATUS_GOOD;
 	  else
 	    {
-	      /* number of bytes is odd; last byte becomes new hang_over */
-	      hang_over = temp_hang_over;
-	      left_over = -1;
-	      start_cnt = 0;
-	      end_cnt = nread - 1;
+	      DBG (1, "sane_read: cancelling scan\n");
+	      do_cancel (s);
+	      return SANE_STATUS_IO_ERROR;
 	    }
 	}
-      else if (nread == 1)
+
+      s->bytes_remaining -= n;
+    }
+
+  *nread = n;
+  return SANE_STATUS_GOOD;
+}
+
+/* Reads up to MAX_LENGTH bytes of image data into DATA; the read-ahead
+   ring or the data connection. */
+static SANE_Status
+read_data (Net_Scanner * s, SANE_Byte * data, SANE_Int max_length,
+	   ssize_t * nread)
+{
+#ifdef USE_PTHREAD
+  if (s->read_ahead)
+    return read_ahead_get (s, data, max_length, nread);
+#endif
+  return read_record_data (s, data, max_length, nread);
+}
+
+SANE_Status
+sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
+	   SANE_Int * length)
+{
+  Net_Scanner *s = handle;
+  ssize_t nread;
+  SANE_Byte *dest;
+  SANE_Byte byte;
+  SANE_Status status;
+  int swap, start;
+
+  DBG (3, "sane_read: handle=%p, data=%p, max_length=%d, length=%p\n",
+       handle, data, max_length, (void *) length);
+  if (!length)
+    {
+      DBG (1, "sane_read: length == NULL\n");
+      return SANE_STATUS_INVAL;
+    }
+
+  *length = 0;
+
+  /* With 16 bits/sample and client and server of different byte order,
+     the samples are swapped here.  A sample split between two reads
+     leaves its first byte in hang_over, which has to come after the
+     first byte of the next read.  left_over is a byte already swapped
+     that didn't fit into a buffer of length 1; return it immediately,
+     otherwise read may fail with a SANE_STATUS_EOF and the caller never
+     can read the last byte. */
+  swap = (s->depth == 16 && s->server_big_endian != client_big_endian);
+  if (swap && s->left_over > -1)
+    {
+      DBG (3, "sane_read: left_over from previous call, return "
+	   "immediately\n");
+      *data = (SANE_Byte) s->left_over;
+      s->left_over = -1;
+      *length = 1;
+      return SANE_STATUS_GOOD;
+    }
+
+  if (s->data < 0)
+    {
+      DBG (1, "sane_read: data pipe doesn't exist, scan cancelled?\n");
+      return SANE_STATUS_CANCELLED;
+    }
+
+  if (swap && s->hang_over > -1)
+    {
+      if (max_length == 1)
 	{
-	  /* if only one byte has been read, save it as hang_over and return
-	     length=0 */
-	  hang_over = (int) *data;
-	  *length = 0;
+	  /* the byte read comes first, hang_over becomes left_over */
+	  status = read_data (s, &byte, 1, &nread);
+	  if (status != SANE_STATUS_GOOD || nread == 0)
+	    return status;
+	  *data = byte;
+	  s->left_over = s->hang_over;
+	  s->hang_over = -1;
+	  *length = 1;
 	  return SANE_STATUS_GOOD;
 	}
-      else
+      /* leave room for hang_over after the first byte read */
+      dest = data + 1;
+      max_length--;
+    }
+  else
+    dest = data;
+
+  status = read_data (s, dest, max_length, &nread);
+  if (status != SANE_STATUS_GOOD || nread == 0)
+    return status;
+
+  *length = nread;
+  if (swap)
+    {
+      start = 0;
+      if (dest != data)
 	{
-	  /* no hang_over; test for even or odd byte number */
-	  if(is_even == 1)
-	    {
-	      start_cnt = 0;
-	      end_cnt = *length;
-	    }
-	  else
-	    {
-	      start_cnt = 0;
-	      hang_over = *(data + *length - 1);
-	      *length -= 1;
-	      end_cnt = *length;
-	    }
+	  data[0] = data[1];
+	  data[1] = (SANE_Byte) s->hang_over;
+	  s->hang_over = -1;
+	  *length += 1;
+	  start = 2;
 	}
-      /* swap the bytes */
-      for (cnt = start_cnt; cnt < end_cnt - 1; cnt += 2)
+      if ((*length - start) % 2)
 	{
-	  swap_buf = *(data + cnt);
-	  *(data + cnt) = *(data + cnt + 1);
-	  *(data + cnt + 1) = swap_buf;
+	  *length -= 1;
+	  s->hang_over = data[*length];
 	}
+      sanei_swap_16 (data + start, *length - start);
     }
-  DBG (3, "sane_read: %lu bytes read, %lu remaining\n", (u_long) nread,
-       (u_long) s->bytes_remaining);
+#ifdef USE_PTHREAD
+  if (s->read_ahead)
+    DBG (3, "sane_read: %lu bytes read ahead\n", (u_long) nread);
+  else
+#endif
+    DBG (3, "sane_read: %lu bytes read, %lu remaining\n", (u_long) nread,
+	 (u_long) (s->bytes_remaining + s->unpacked_len - s->unpacked_pos));
 
   return SANE_STATUS_GOOD;
 }
@@ -2350,6 +3790,17 @@ sane_set_io_mode (SANE_Handle handle, SANE_Bool non_blocking)
       return SANE_STATUS_INVAL;
     }
 
+#ifdef USE_PTHREAD
+  if (s->read_ahead)
+    {
+      /* the thread keeps the socket blocking */
+      pthread_mutex_lock (&s->read_ahead->lock);
+      s->read_ahead->nonblocking = non_blocking;
+      pthread_mutex_unlock (&s->read_ahead->lock);
+      return SANE_STATUS_GOOD;
+    }
+#endif
+
   if (fcntl (s->data, F_SETFL, non_blocking ? O_NONBLOCK : 0) < 0)
     {
       DBG (1, "sane_set_io_mode: fcntl failed (%s)\n", strerror (errno));
@@ -2373,6 +3824,10 @@ sane_get_select_fd (SANE_Handle handle, SANE_Int * fd)
     }
 
   *fd = s->data;
+#ifdef USE_PTHREAD
+  if (s->read_ahead)
+    *fd = s->read_ahead->notify[0];
+#endif
   DBG (3, "sane_get_select_fd: done; *fd = %d\n", *fd);
   return SANE_STATUS_GOOD;
 }
@@ -45,6 +45,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #include "../include/sane/sanei_wire.h"
 #include "../include/sane/config.h"
@@ -62,6 +63,7 @@ typedef struct Net_Device
     int ctl;			/* socket descriptor (or -1) */
     Wire wire;
     int auth_active;
+    struct Net_Option_Cache *option_cache; /* descriptors of its devices */
   }
 Net_Device;
 
@@ -72,14 +74,38 @@ typedef struct Net_Scanner
 
     int options_valid;			/* are the options current? */
     SANE_Option_Descriptor_Array opt, local_opt;
+    SANE_Word desc_version;	/* of opt on the server (version 6) */
 
     SANE_Word handle;		/* remote handle (it's a word, not a ptr!) */
+    char *name;			/* remote device name */
 
     int data;			/* data socket descriptor */
     int reclen_buf_offset;
     u_char reclen_buf[4];
     size_t bytes_remaining;	/* how many bytes left in this record? */
 
+    /* compressed data connection (protocol version 4): */
+    SANE_Byte *packed;		/* the record as received */
+    size_t packed_size, packed_len;
+    SANE_Byte *unpacked;	/* and decompressed */
+    size_t unpacked_size, unpacked_len, unpacked_pos;
+    double bytes_packed, bytes_unpacked;
+    clock_t cpu;		/* time spent decompressing */
+
+    struct Net_Read_Ahead *read_ahead;	/* prefetch thread (or NULL) */
+
+    /* option requests deferred by batch_options (protocol version 5): */
+    SANE_Control_Option_Req *pending;
+    int num_pending;
+    SANE_Word pending_info;	/* info not returned to the frontend yet */
+    SANE_Status pending_status;	/* failure not reported yet */
+
+    /* 16 bit samples from a server of the other byte order: */
+    int depth;			/* bits per sample */
+    int server_big_endian;
+    int hang_over;		/* first byte of a split sample, or -1 */
+    int left_over;		/* swapped byte not returned yet, or -1 */
+
     /* device (host) info: */
     Net_Device *hw;
   }
@@ -75,6 +75,7 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include <sys/wait.h>
@@ -87,7 +88,8 @@
 #else
 /* 
  * This replacement poll() using select() is only designed to cover
- * our needs in run_standalone(). It should probably be extended...
+ * our needs in run_standalone() and do_scan(): POLLIN and POLLOUT,
+ * with negative fds ignored.
  */
 struct pollfd
 {
@@ -98,6 +100,9 @@ struct pollfd
 
 #define POLLIN 0x0001
 #define POLLERR 0x0002
+#define POLLOUT 0x0004
+#define POLLHUP 0x0008
+#define POLLNVAL 0x0010
 
 int
 poll (struct pollfd *ufds, unsigned int nfds, int timeout);
@@ -108,6 +113,7 @@ poll (struct pollfd *ufds, unsigned int nfds, int timeout)
   struct pollfd *fdp;
 
   fd_set rfds;
+  fd_set wfds;
   fd_set efds;
   struct timeval tv;
   int maxfd = 0;
@@ -118,15 +124,22 @@ poll (struct pollfd *ufds, unsigned int nfds, int timeout)
   tv.tv_usec = (timeout - tv.tv_sec * 1000) * 1000;
 
   FD_ZERO (&rfds);
+  FD_ZERO (&wfds);
   FD_ZERO (&efds);
 
   for (i = 0, fdp = ufds; i < nfds; i++, fdp++)
     {
       fdp->revents = 0;
 
+      if (fdp->fd < 0)
+	continue;
+
       if (fdp->events & POLLIN)
 	FD_SET (fdp->fd, &rfds);
 
+      if (fdp->events & POLLOUT)
+	FD_SET (fdp->fd, &wfds);
+
       FD_SET (fdp->fd, &efds);
 
       maxfd = (fdp->fd > maxfd) ? fdp->fd : maxfd;
@@ -134,17 +147,34 @@ poll (struct pollfd *ufds, unsigned int nfds, int timeout)
 
   maxfd++;
 
-  ret = select (maxfd, &rfds, NULL, &efds, &tv);
+  ret = select (maxfd, &rfds, &wfds, &efds, (timeout < 0) ? NULL : &tv);
 
   if (ret < 0)
-    return ret;
+    {
+      if (errno == EBADF)
+	{
+	  /* tell the caller which fd it was, like poll() does */
+	  for (i = 0, fdp = ufds; i < nfds; i++, fdp++)
+	    if (fdp->fd >= 0 && fcntl (fdp->fd, F_GETFL) < 0)
+	      fdp->revents = POLLNVAL;
+	  return 1;
+	}
+      return ret;
+    }
 
   for (i = 0, fdp = ufds; i < nfds; i++, fdp++)
     {
+      if (fdp->fd < 0)
+	continue;
+
       if (fdp->events & POLLIN)
 	if (FD_ISSET (fdp->fd, &rfds))
 	  fdp->revents |= POLLIN;
 
+      if (fdp->events & POLLOUT)
+	if (FD_ISSET (fdp->fd, &wfds))
+	  fdp->revents |= POLLOUT;
+
       if (FD_ISSET (fdp->fd, &efds))
 	fdp->revents |= POLLERR;
     }
@@ -183,9 +213,11 @@ static AvahiEntryGroup *avahi_group = NULL;
 #include "../include/sane/sanei.h"
 #include "../include/sane/sanei_net.h"
 #include "../include/sane/sanei_codec_bin.h"
+#include "../include/sane/sanei_compress.h"
 #include "../include/sane/sanei_config.h"
 
 #include "../include/sane/sanei_auth.h"
+#include "../include/md5.h"
 
 #ifndef EXIT_SUCCESS
 # define EXIT_SUCCESS   0
@@ -230,19 +262,150 @@ int numchildren;
 #define SANED_SERVICE_PORT   6566
 #define SANED_SERVICE_PORT_S "6566"
 
+/* Idle control connections are dropped after this many seconds */
+#define SANED_IDLE_TIMEOUT   3600
+
+/* Receive timeout on control connections in multi-client mode, so that
+   a client that stops in the middle of a request can't stall the others;
+   also how long a new connection may take to send SANE_NET_INIT */
+#define SANED_RECV_TIMEOUT   30
+
+/* Multi-client mode: largest SANE_NET_INIT request, and how often one
+   that came in partly is looked at again */
+#define SANED_MAX_INIT_REQUEST 1024
+#define SANED_INIT_POLL_MS   100
+
+struct Connection;
+
+/* Counters for the statistics dumped on SIGUSR1, kept for every
+   connection, every device and all of them together */
+#define SANED_NUM_PROCS  (SANE_NET_GET_OPTION_CHANGES + 1)
+
+typedef struct
+{
+  u_long rpc_calls[SANED_NUM_PROCS];
+  double rpc_secs[SANED_NUM_PROCS];	/* from request to reply */
+  double rpc_max_secs[SANED_NUM_PROCS];
+  u_long opens;
+  double open_secs;		/* in sane_open() */
+  u_long starts;
+  double start_secs;		/* in sane_start() */
+  u_long scans;
+  double scan_bytes;
+  double scan_secs;
+  double read_secs;		/* in sane_read() */
+  double stall_secs;		/* buffer full, waiting for the client */
+}
+Stats;
+
+typedef struct Device_Stats
+{
+  struct Device_Stats *next;
+  char *name;
+  Stats stats;
+}
+Device_Stats;
+
 typedef struct
 {
   u_int inuse:1;		/* is this handle in use? */
   u_int scanning:1;		/* are we scanning? */
   u_int docancel:1;		/* cancel the current scan */
+  u_int idle:1;			/* closed by its client, but kept open */
   SANE_Handle handle;		/* backends handle */
+  struct Connection *owner;	/* connection that opened it */
+  /* for handing an idle handle to the next open (multi-client mode) */
+  char *name;			/* device name it was opened with */
+  char *client;			/* address of the client that opened it */
+  time_t idle_since;
+  Device_Stats *device;		/* statistics of the device */
+  /* copies of the option descriptors and the version of the descriptor
+     set each last changed in, to send a client only the ones that
+     changed (protocol version 5 on) */
+  SANE_Option_Descriptor **desc;
+  SANE_Word *changed;
+  SANE_Word num_desc;
+  SANE_Word desc_version;
+  SANE_Word client_version;	/* version the client got last */
+  char digest[33];		/* of version 1, as opened (version 6) */
 }
 Handle;
 
+/* The image data of a handle on its way from the backend to the
+   client's data connection: a ring buffer of records, each a 4-byte
+   length and that many bytes, ending with 0xffffffff and a status
+   byte.  From protocol version 4 on, the bytes of a record are a
+   codec byte, the 4-byte uncompressed length and the (compressed)
+   data. */
+typedef struct
+{
+  int h;			/* handle being scanned */
+  int data_fd;			/* data connection to the client */
+  int be_fd;			/* backend's select fd, or -1 */
+  SANE_Bool nonblocking;	/* backend supports non-blocking reads */
+  SANE_Byte *buf;
+  int buf_size;
+  int max_record;		/* most image bytes in one record */
+  int reader;			/* where the next record goes */
+  int writer;			/* next byte to send */
+  int bytes_in_buf;
+  int status_dirty;		/* the final status still has to be queued */
+  SANE_Status status;
+  int record_header;		/* bytes between length and data: 0 or 5 */
+  /* compression: records are read into raw and compressed into
+     packed before they go into buf */
+  SANEI_Compress_Codec codec;
+  SANE_Byte *raw;
+  SANE_Byte *packed;
+  /* for the throughput report */
+  struct timeval start;
+  double bytes_read;
+  double bytes_packed;		/* size of the compressed records */
+  clock_t cpu;			/* time spent compressing */
+  int records;
+  int writes;
+  double read_secs;		/* in sane_read() */
+  double stall_secs;		/* buffer full, waiting for the client */
+  double full_since;		/* when the buffer filled up, or 0 */
+}
+Scan;
+
+/* A client's control connection.  Outside of multi-client mode, each
+   saned process has just one. */
+typedef struct Connection
+{
+  struct Connection *next;
+  Wire wire;
+  char *remote_ip;		/* numeric address of the client */
+  char *username;		/* user name sent with SANE_NET_INIT */
+#ifdef SANED_USES_AF_INDEP
+  union {
+    struct sockaddr_storage ss;
+    struct sockaddr sa;
+    struct sockaddr_in sin;
+#ifdef ENABLE_IPV6
+    struct sockaddr_in6 sin6;
+#endif
+  } remote_address;
+  int remote_address_len;
+#else
+  struct in_addr remote_address;
+#endif /* SANED_USES_AF_INDEP */
+  time_t last_request;
+  int initialized;		/* SANE_NET_INIT has been answered */
+  int init_partial;		/* part of SANE_NET_INIT has come in */
+  int data_listen_fd;		/* waiting for the data connection, or -1 */
+  int data_h;			/* handle data_listen_fd is for */
+  Scan *scan;			/* scan in progress (multi-client mode) */
+  u_long session;		/* number of the connection, for statistics */
+  time_t connected;
+  Stats stats;
+}
+Connection;
+
 static SANE_Net_Procedure_Number current_request;
 static const char *prog_name;
 static int can_authorize;
-static Wire wire;
 static int num_handles;
 static int debug;
 static int run_mode;
@@ -254,30 +417,47 @@ static union
 }
 byte_order;
 
+/* The connection whose request is being processed */
+static Connection *conn;
+
+/* Multi-client mode: one process serves all connections, and keeps the
+   backends initialized and the device list cached between them */
+static SANE_Bool multi_client = SANE_FALSE;
+static Connection *connections;
+static SANE_Bool backend_initialized = SANE_FALSE;
+static int device_cache_ttl = 60;
+/* How long a handle closed by a client is kept open for the next open
+   of the same device by the same client, 0 to close it right away */
+static int handle_idle_time = 0;
+
+/* Size of the ring buffer between backend and data connection */
+#define SANED_MIN_DATA_BUFFER   8192
+static int data_buffer_size = 1024 * 1024;
+
+/* Statistics: the file SIGUSR1 appends them to (the log if NULL), the
+   totals over all connections and the ones of each device */
+static char *stats_file;
+static Stats total_stats;
+static Device_Stats *device_stats;
+static u_long num_sessions;
+static volatile sig_atomic_t stats_requested;
+static double request_start;	/* when the current request came in */
+
+/* Offer compression of the data connection to clients that support it */
+static SANE_Bool compression = SANE_FALSE;
+
+/* Version code of the backends, part of the descriptor digests */
+static SANE_Word backend_version;
+
 /* The default-user name.  This is not used to imply any rights.  All
    it does is save a remote user some work by reducing the amount of
    text s/he has to type when authentication is requested.  */
 static const char *default_username = "saned-user";
-static char *remote_ip;
 
 /* data port range */
 static in_port_t data_port_lo;
 static in_port_t data_port_hi;
 
-#ifdef SANED_USES_AF_INDEP
-static union {
-  struct sockaddr_storage ss;
-  struct sockaddr sa;
-  struct sockaddr_in sin;
-#ifdef ENABLE_IPV6
-  struct sockaddr_in6 sin6;
-#endif
-} remote_address;
-static int remote_address_len;
-#else
-static struct in_addr remote_address;
-#endif /* SANED_USES_AF_INDEP */
-
 #ifndef _PATH_HEQUIV
 # define _PATH_HEQUIV   "/etc/hosts.equiv"
 #endif
@@ -332,8 +512,258 @@ saned_debug_call (int level, const char *fmt, ...)
 static void
 reset_watchdog (void)
 {
-  if (!debug)
-    alarm (3600);
+  if (conn)
+    conn->last_request = time (NULL);
+  /* In multi-client mode the alarm would take all connections down;
+     run_multi_client() drops idle ones by itself. */
+  if (!debug && !multi_client)
+    alarm (SANED_IDLE_TIMEOUT);
+}
+
+
+/* Statistics */
+
+static const char *proc_names[SANED_NUM_PROCS] = {
+  "init", "get_devices", "open", "close", "get_option_descriptors",
+  "control_option", "get_parameters", "start", "cancel", "authorize",
+  "exit", "control_options", "get_option_changes"
+};
+
+static double
+stats_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Returns the statistics of device NAME, or NULL if out of memory */
+static Device_Stats *
+stats_device (SANE_String_Const name)
+{
+  Device_Stats *d;
+
+  for (d = device_stats; d; d = d->next)
+    if (strcmp (d->name, name) == 0)
+      return d;
+
+  d = calloc (1, sizeof (*d));
+  if (d == NULL)
+    return NULL;
+  d->name = strdup (name);
+  if (d->name == NULL)
+    {
+      free (d);
+      return NULL;
+    }
+  d->next = device_stats;
+  device_stats = d;
+  return d;
+}
+
+static void
+stats_add_rpc (Stats * st, int proc, double secs)
+{
+  st->rpc_calls[proc]++;
+  st->rpc_secs[proc] += secs;
+  if (secs > st->rpc_max_secs[proc])
+    st->rpc_max_secs[proc] = secs;
+}
+
+/* Accounts the request being processed, once its reply is out.  Does
+   nothing if that has been done already. */
+static void
+stats_request_done (void)
+{
+  double secs;
+
+  if (request_start <= 0 || (int) current_request < 0
+      || current_request >= SANED_NUM_PROCS)
+    return;
+  secs = stats_now () - request_start;
+  request_start = 0;
+  stats_add_rpc (&total_stats, current_request, secs);
+  if (conn)
+    stats_add_rpc (&conn->stats, current_request, secs);
+}
+
+/* Accounts a call of sane_open() (START false) or sane_start() on
+   handle H that took SECS, to the connection, the device and the
+   totals */
+static void
+stats_add_call (int h, int start, double secs)
+{
+  Stats *st[3];
+  int i;
+
+  st[0] = &total_stats;
+  st[1] = conn ? &conn->stats : NULL;
+  st[2] = (h >= 0 && handle[h].device) ? &handle[h].device->stats : NULL;
+  for (i = 0; i < 3; ++i)
+    if (st[i] && start)
+      {
+	st[i]->starts++;
+	st[i]->start_secs += secs;
+      }
+    else if (st[i])
+      {
+	st[i]->opens++;
+	st[i]->open_secs += secs;
+      }
+}
+
+static void
+stats_add_scan (Stats * st, const Scan * s, double secs)
+{
+  st->scans++;
+  st->scan_bytes += s->bytes_read;
+  st->scan_secs += secs;
+  st->read_secs += s->read_secs;
+  st->stall_secs += s->stall_secs;
+}
+
+/* Writes LINE to FP, or to the log if FP is NULL */
+static void
+stats_put (FILE * fp, const char *line)
+{
+  if (fp)
+    fprintf (fp, "%s\n", line);
+  else if (log_to_syslog)
+    syslog (LOG_INFO, "%s", line);
+  else
+    fprintf (stderr, "[saned] %s\n", line);
+}
+
+/* Writes the counters of ST as lines of `key=value' pairs: a line
+   starting with WHAT (`session id=3 ...', `device name=...', `total')
+   with the open, start and scan counters, and a line starting with
+   `rpc' and KEY (`session=3', `total') for each procedure that was
+   called. */
+static void
+stats_write (FILE * fp, const char *what, const char *key, const Stats * st)
+{
+  char line[512];
+  int i;
+
+  sprintf (line, "%.200s opens=%lu open_ms=%.3f starts=%lu start_ms=%.3f "
+	   "scans=%lu bytes=%.0f scan_ms=%.3f kb_per_s=%.1f read_ms=%.3f "
+	   "stall_ms=%.3f", what, st->opens, st->open_secs * 1000,
+	   st->starts, st->start_secs * 1000, st->scans, st->scan_bytes,
+	   st->scan_secs * 1000,
+	   (st->scan_secs > 0) ? st->scan_bytes / 1024 / st->scan_secs : 0.0,
+	   st->read_secs * 1000, st->stall_secs * 1000);
+  stats_put (fp, line);
+
+  for (i = 0; i < SANED_NUM_PROCS; ++i)
+    if (st->rpc_calls[i])
+      {
+	sprintf (line, "rpc %.200s proc=%s calls=%lu ms=%.3f max_ms=%.3f",
+		 key, proc_names[i], st->rpc_calls[i],
+		 st->rpc_secs[i] * 1000, st->rpc_max_secs[i] * 1000);
+	stats_put (fp, line);
+      }
+}
+
+static void
+stats_write_session (FILE * fp, const Connection * c, int ended)
+{
+  char what[256], key[32];
+
+  sprintf (what, "session id=%lu client=%.64s user=%.64s age=%ld%s",
+	   c->session, c->remote_ip ? c->remote_ip : "-",
+	   c->username ? c->username : "-",
+	   (long) (time (NULL) - c->connected), ended ? " ended=1" : "");
+  sprintf (key, "session=%lu", c->session);
+  stats_write (fp, what, key, &c->stats);
+}
+
+static FILE *
+stats_open (void)
+{
+  FILE *fp;
+
+  if (!stats_file)
+    return NULL;
+  fp = fopen (stats_file, "a");
+  if (!fp)
+    DBG (DBG_ERR, "stats_open: can't open %s (%s)\n", stats_file,
+	 strerror (errno));
+  return fp;
+}
+
+/* Writes the statistics of all connections of this process, of all
+   devices and the totals, framed by `begin' and `end' lines */
+static void
+stats_dump (void)
+{
+  Device_Stats *d;
+  Connection *c;
+  char line[256];
+  FILE *fp;
+
+  fp = stats_open ();
+  if (stats_file && !fp)
+    return;
+
+  sprintf (line, "begin time=%ld pid=%ld sessions=%lu", (long) time (NULL),
+	   (long) getpid (), num_sessions);
+  stats_put (fp, line);
+  if (conn && !multi_client)
+    stats_write_session (fp, conn, 0);
+  for (c = connections; c; c = c->next)
+    stats_write_session (fp, c, 0);
+  for (d = device_stats; d; d = d->next)
+    {
+      sprintf (line, "device name=%.200s", d->name);
+      stats_write (fp, line, line + 7, &d->stats);
+    }
+  stats_write (fp, "total", "total", &total_stats);
+  stats_put (fp, "end");
+  if (fp)
+    fclose (fp);
+}
+
+/* Writes the statistics of connection C, which is going away, to the
+   stats_file */
+static void
+stats_session_ended (const Connection * c)
+{
+  FILE *fp = stats_open ();
+
+  if (fp)
+    {
+      stats_write_session (fp, c, 1);
+      fclose (fp);
+    }
+}
+
+static void
+sig_usr1_handler (int signum)
+{
+  stats_requested = 1;
+  signal (signum, sig_usr1_handler);
+}
+
+/* Dumps the statistics if SIGUSR1 came in since the last call.  The
+   process that forks connections passes it on to the processes
+   serving them instead. */
+static void
+check_stats (void)
+{
+  struct saned_child *child;
+
+  if (!stats_requested)
+    return;
+  stats_requested = 0;
+
+  if (!multi_client && !conn)
+    {
+      for (child = children; child; child = child->next)
+	kill (child->pid, SIGUSR1);
+      return;
+    }
+  stats_dump ();
 }
 
 static void
@@ -356,9 +786,9 @@ auth_callback (SANE_String_Const res,
       return;
     }
 
-  if (wire.status)
+  if (conn->wire.status)
     {
-      DBG(DBG_ERR, "auth_callback: bad status %d\n", wire.status);
+      DBG(DBG_ERR, "auth_callback: bad status %d\n", conn->wire.status);
       return;
     }
 
@@ -370,7 +800,7 @@ auth_callback (SANE_String_Const res,
 
 	memset (&reply, 0, sizeof (reply));
 	reply.resource_to_authorize = (char *) res;
-	sanei_w_reply (&wire, (WireCodecFunc) sanei_w_open_reply, &reply);
+	sanei_w_reply (&conn->wire, (WireCodecFunc) sanei_w_open_reply, &reply);
       }
       break;
 
@@ -380,18 +810,29 @@ auth_callback (SANE_String_Const res,
 
 	memset (&reply, 0, sizeof (reply));
 	reply.resource_to_authorize = (char *) res;
-	sanei_w_reply (&wire,
+	sanei_w_reply (&conn->wire,
 		       (WireCodecFunc) sanei_w_control_option_reply, &reply);
       }
       break;
 
+    case SANE_NET_CONTROL_OPTIONS:
+      {
+	SANE_Control_Options_Reply reply;
+
+	memset (&reply, 0, sizeof (reply));
+	reply.resource_to_authorize = (char *) res;
+	sanei_w_reply (&conn->wire,
+		       (WireCodecFunc) sanei_w_control_options_reply, &reply);
+      }
+      break;
+
     case SANE_NET_START:
       {
 	SANE_Start_Reply reply;
 
 	memset (&reply, 0, sizeof (reply));
 	reply.resource_to_authorize = (char *) res;
-	sanei_w_reply (&wire, (WireCodecFunc) sanei_w_start_reply, &reply);
+	sanei_w_reply (&conn->wire, (WireCodecFunc) sanei_w_start_reply, &reply);
       }
       break;
 
@@ -402,20 +843,20 @@ auth_callback (SANE_String_Const res,
       break;
     }
 
-  if (wire.status)
+  if (conn->wire.status)
     {
-      DBG(DBG_ERR, "auth_callback: bad status %d\n", wire.status);
+      DBG(DBG_ERR, "auth_callback: bad status %d\n", conn->wire.status);
       return;
     }
 
   reset_watchdog ();
 
-  sanei_w_set_dir (&wire, WIRE_DECODE);
-  sanei_w_word (&wire, &word);
+  sanei_w_set_dir (&conn->wire, WIRE_DECODE);
+  sanei_w_word (&conn->wire, &word);
 
-  if (wire.status)
+  if (conn->wire.status)
     {
-      DBG(DBG_ERR, "auth_callback: bad status %d\n", wire.status);
+      DBG(DBG_ERR, "auth_callback: bad status %d\n", conn->wire.status);
       return;
     }
 
@@ -429,10 +870,10 @@ auth_callback (SANE_String_Const res,
       return;
     }
 
-  sanei_w_authorization_req (&wire, &req);
-  if (wire.status)
+  sanei_w_authorization_req (&conn->wire, &req);
+  if (conn->wire.status)
     {
-      DBG(DBG_ERR, "auth_callback: bad status %d\n", wire.status);
+      DBG(DBG_ERR, "auth_callback: bad status %d\n", conn->wire.status);
       return;
     }
 
@@ -446,8 +887,8 @@ auth_callback (SANE_String_Const res,
 	   "auth_callback: got auth for resource %s (expected resource=%s)\n",
 	   res, req.resource);
     }
-  sanei_w_free (&wire, (WireCodecFunc) sanei_w_authorization_req, &req);
-  sanei_w_reply (&wire, (WireCodecFunc) sanei_w_word, &ack);
+  sanei_w_free (&conn->wire, (WireCodecFunc) sanei_w_authorization_req, &req);
+  sanei_w_reply (&conn->wire, (WireCodecFunc) sanei_w_word, &ack);
 }
 
 static void
@@ -471,7 +912,8 @@ quit (int signum)
       sane_close (handle[i].handle);
 
   sane_exit ();
-  sanei_w_exit (&wire);
+  if (conn)
+    sanei_w_exit (&conn->wire);
   if (handle)
     free (handle);
   DBG (DBG_WARN, "quit: exiting\n");
@@ -520,23 +962,110 @@ get_free_handle (void)
 # undef ALLOC_INCREMENT
 }
 
+static void forget_descriptors (int h);
+
 static void
 close_handle (int h)
 {
   if (h >= 0 && handle[h].inuse)
     {
       sane_close (handle[h].handle);
+      forget_descriptors (h);
+      free (handle[h].name);
+      free (handle[h].client);
+      handle[h].name = NULL;
+      handle[h].client = NULL;
+      handle[h].idle = 0;
       handle[h].inuse = 0;
     }
 }
 
+/* SANE_NET_CLOSE of handle H.  With handle_idle_time, the backend
+   handle stays open, so that the next open of the device by the same
+   client skips the backend's firmware upload, warm-up and calibration.
+   It keeps the option values it was left with. */
+static void
+park_handle (int h)
+{
+  Handle *hp;
+
+  if (h < 0)
+    return;
+  hp = handle + h;
+  if (!multi_client || handle_idle_time <= 0 || !hp->name || !hp->client
+      || hp->scanning)
+    {
+      close_handle (h);
+      return;
+    }
+
+  DBG (DBG_MSG, "park_handle: keeping handle %d of `%s' open for %d s\n",
+       h, hp->name, handle_idle_time);
+  sane_cancel (hp->handle);
+  forget_descriptors (h);
+  hp->desc_version = 0;
+  hp->client_version = 0;
+  hp->docancel = 0;
+  hp->owner = NULL;
+  hp->idle = 1;
+  hp->idle_since = time (NULL);
+}
+
+/* Returns the idle handle of device NAME that was opened by the client
+   of this connection, or -1.  Idle handles of NAME other clients left
+   behind are closed, as the device can be opened only once. */
+static int
+reuse_handle (const char *name)
+{
+  int h, found = -1;
+
+  for (h = 0; h < num_handles; ++h)
+    if (handle[h].inuse && handle[h].idle
+	&& strcmp (handle[h].name, name) == 0)
+      {
+	if (found < 0 && conn->remote_ip
+	    && strcmp (handle[h].client, conn->remote_ip) == 0)
+	  found = h;
+	else
+	  {
+	    DBG (DBG_MSG, "reuse_handle: closing handle %d of %s\n", h,
+		 handle[h].client);
+	    close_handle (h);
+	  }
+      }
+  if (found >= 0)
+    {
+      DBG (DBG_MSG, "reuse_handle: reusing handle %d of `%s'\n", found,
+	   name);
+      handle[found].idle = 0;
+    }
+  return found;
+}
+
+/* Closes the handles that have been idle for handle_idle_time */
+static void
+expire_handles (time_t now)
+{
+  int h;
+
+  for (h = 0; h < num_handles; ++h)
+    if (handle[h].inuse && handle[h].idle
+	&& now - handle[h].idle_since >= handle_idle_time)
+      {
+	DBG (DBG_MSG, "expire_handles: closing idle handle %d of `%s'\n", h,
+	     handle[h].name);
+	close_handle (h);
+      }
+}
+
 static SANE_Word
 decode_handle (Wire * w, const char *op)
 {
   SANE_Word h;
 
   sanei_w_word (w, &h);
-  if (w->status || (unsigned) h >= (unsigned) num_handles || !handle[h].inuse)
+  if (w->status || (unsigned) h >= (unsigned) num_handles || !handle[h].inuse
+      || handle[h].owner != conn)
     {
       DBG (DBG_ERR,
 	   "decode_handle: %s: error while decoding handle argument "
@@ -546,389 +1075,466 @@ decode_handle (Wire * w, const char *op)
   return h;
 }
 
+static void
+forget_descriptors (int h)
+{
+  int i;
 
+  for (i = 0; i < handle[h].num_desc; ++i)
+    sanei_net_free_option_descriptor (handle[h].desc[i]);
+  free (handle[h].desc);
+  free (handle[h].changed);
+  handle[h].desc = NULL;
+  handle[h].changed = NULL;
+  handle[h].num_desc = 0;
+}
 
-/* Convert a number of bits to an 8-bit bitmask */
-static unsigned int cidrtomask[9] = { 0x00, 0x80, 0xC0, 0xE0, 0xF0,
-				      0xF8, 0xFC, 0xFE, 0xFF };
-
-#ifdef SANED_USES_AF_INDEP
-static SANE_Bool
-check_v4_in_range (struct sockaddr_in *sin, char *base_ip, char *netmask)
+/* Brings the copies of handle H's option descriptors up to date.  The
+   ones that changed get the next version of the descriptor set; one
+   that can't be copied counts as changed again next time. */
+static SANE_Status
+update_descriptors (int h)
 {
-  int cidr;
-  int i, err;
-  char *end;
-  uint32_t mask; 
-  struct sockaddr_in *base;
-  struct addrinfo hints;
-  struct addrinfo *res;
-  SANE_Bool ret = SANE_FALSE;
+  Handle *hp = handle + h;
+  const SANE_Option_Descriptor *d;
+  SANE_Word i, num = 0, version = hp->desc_version + 1;
 
-  cidr = -1;
-  cidr = strtol (netmask, &end, 10);
-  
-  /* Sanity check on the cidr value */
-  if ((cidr < 0) || (cidr > 32) || (end == netmask))
+  sane_control_option (hp->handle, 0, SANE_ACTION_GET_VALUE, &num, 0);
+  if (num != hp->num_desc)
     {
-      DBG (DBG_ERR, "check_v4_in_range: invalid CIDR value (%s) !\n", netmask);
-      return SANE_FALSE;
+      forget_descriptors (h);
+      if (num <= 0)
+	return SANE_STATUS_GOOD;
+      hp->desc = calloc (num, sizeof (hp->desc[0]));
+      hp->changed = calloc (num, sizeof (hp->changed[0]));
+      if (!hp->desc || !hp->changed)
+	{
+	  DBG (DBG_ERR, "update_descriptors: not enough memory\n");
+	  forget_descriptors (h);
+	  return SANE_STATUS_NO_MEM;
+	}
+      hp->num_desc = num;
     }
 
-  mask = 0;
-  cidr -= 8;
-
-  /* Build a bitmask out of the CIDR value */  
-  for (i = 3; cidr >= 0; i--)
+  for (i = 0; i < num; ++i)
     {
-      mask |= (0xff << (8 * i));
-      cidr -= 8;
+      d = sane_get_option_descriptor (hp->handle, i);
+      if (hp->changed[i] && sanei_net_same_option_descriptor (hp->desc[i], d))
+	continue;
+      sanei_net_free_option_descriptor (hp->desc[i]);
+      hp->desc[i] = d ? sanei_net_copy_option_descriptor (d) : NULL;
+      hp->changed[i] = version;
+      hp->desc_version = version;
     }
-  
-  if (cidr < 0)
-    mask |= (cidrtomask[cidr + 8] << (8 * i));
-
-  mask = htonl (mask);
+  DBG (DBG_DBG, "update_descriptors: %d options, version %d\n", num,
+       hp->desc_version);
+  return SANE_STATUS_GOOD;
+}
 
-  /* get a sockaddr_in representing the base IP address */
-  memset (&hints, 0, sizeof (struct addrinfo));
-  hints.ai_flags = AI_NUMERICHOST;
-  hints.ai_family = PF_INET;
-  
-  err = getaddrinfo (base_ip, NULL, &hints, &res);
-  if (err)
+/* Returns the option descriptors of handle H that changed after version
+   SINCE of its descriptor set, in an array of *NUM changes that refers
+   to the copies until they are updated.  Returns NULL if there isn't
+   enough memory or there are no options. */
+static SANE_Option_Change *
+descriptor_changes (int h, SANE_Word since, SANE_Word * num)
+{
+  Handle *hp = handle + h;
+  SANE_Option_Change *changes;
+  SANE_Word i;
+
+  *num = 0;
+  if (hp->num_desc <= 0)
+    return NULL;
+  changes = malloc (hp->num_desc * sizeof (changes[0]));
+  if (!changes)
     {
-      DBG (DBG_DBG, "check_v4_in_range: getaddrinfo() failed: %s\n", gai_strerror (err));
-      return SANE_FALSE;
+      DBG (DBG_ERR, "descriptor_changes: not enough memory\n");
+      return NULL;
     }
-
-  base = (struct sockaddr_in *) res->ai_addr;
-
-  /*
-   * Check that the address belongs to the specified subnet, using the bitmask.
-   * The address is represented by a 32bit integer.
-   */
-  if ((base->sin_addr.s_addr & mask) == (sin->sin_addr.s_addr & mask))
-    ret = SANE_TRUE;
-  
-  freeaddrinfo (res);
-  
-  return ret;
+  for (i = 0; i < hp->num_desc; ++i)
+    if (hp->changed[i] > since)
+      {
+	changes[*num].index = i;
+	changes[*num].desc = hp->desc[i];
+	++*num;
+      }
+  DBG (DBG_MSG, "descriptor_changes: %d of %d option descriptors changed "
+       "since version %d\n", *num, hp->num_desc, since);
+  return changes;
 }
 
-
-# ifdef ENABLE_IPV6
-
-static SANE_Bool
-check_v6_in_range (struct sockaddr_in6 *sin6, char *base_ip, char *netmask)
+/* The descriptor set as hashed by digest_descriptors() */
+typedef struct
 {
-  int cidr;
-  int i, err;
-  unsigned int mask[16];
-  char *end;
-  struct sockaddr_in6 *base;
-  struct addrinfo hints;
-  struct addrinfo *res;
-  SANE_Bool ret = SANE_TRUE;
+  char *data;
+  size_t len, size;
+  int failed;			/* out of memory */
+}
+Digest_Buffer;
 
-  cidr = -1;
-  cidr = strtol (netmask, &end, 10);
+static void
+digest_bytes (Digest_Buffer * b, const void *data, size_t len)
+{
+  char *p;
+  size_t size;
 
-  /* Sanity check on the cidr value */
-  if ((cidr < 0) || (cidr > 128) || (end == netmask))
+  if (b->failed)
+    return;
+  if (b->len + len > b->size)
     {
-      DBG (DBG_ERR, "check_v6_in_range: invalid CIDR value (%s) !\n", netmask);
-      return SANE_FALSE;
+      size = b->size ? b->size : 4096;
+      while (size < b->len + len)
+	size *= 2;
+      p = realloc (b->data, size);
+      if (!p)
+	{
+	  b->failed = 1;
+	  return;
+	}
+      b->data = p;
+      b->size = size;
     }
+  memcpy (b->data + b->len, data, len);
+  b->len += len;
+}
 
-  memset (mask, 0, (16 * sizeof (unsigned int)));
-  cidr -= 8;
-  
-  /* Build a bitmask out of the CIDR value */
-  for (i = 0; cidr >= 0; i++)
+static void
+digest_string (Digest_Buffer * b, SANE_String_Const str)
+{
+  digest_bytes (b, str ? str : "", str ? strlen (str) + 1 : 0);
+  digest_bytes (b, str ? "+" : "-", 1);
+}
+
+/* Sets the digest of handle H's descriptor set, which with the backend
+   version identifies it for a client that cached it: the MD5 of the
+   descriptors serialized field by field, in hex */
+static void
+digest_descriptors (int h)
+{
+  Handle *hp = handle + h;
+  const SANE_Option_Descriptor *d;
+  const SANE_Word *w;
+  Digest_Buffer b;
+  unsigned char md5[16];
+  SANE_Word i, k;
+
+  hp->digest[0] = '\0';
+  memset (&b, 0, sizeof (b));
+  digest_bytes (&b, &backend_version, sizeof (backend_version));
+  for (i = 0; i < hp->num_desc; ++i)
     {
-      mask[i] = 0xff;
-      cidr -= 8;
+      d = hp->desc[i];
+      if (!d)
+	{
+	  /* can't tell what a client would cache */
+	  free (b.data);
+	  return;
+	}
+      digest_string (&b, d->name);
+      digest_string (&b, d->title);
+      digest_string (&b, d->desc);
+      digest_bytes (&b, &d->type, sizeof (d->type));
+      digest_bytes (&b, &d->unit, sizeof (d->unit));
+      digest_bytes (&b, &d->size, sizeof (d->size));
+      digest_bytes (&b, &d->cap, sizeof (d->cap));
+      digest_bytes (&b, &d->constraint_type, sizeof (d->constraint_type));
+      switch (d->constraint_type)
+	{
+	case SANE_CONSTRAINT_RANGE:
+	  if (d->constraint.range)
+	    digest_bytes (&b, d->constraint.range, sizeof (SANE_Range));
+	  break;
+	case SANE_CONSTRAINT_WORD_LIST:
+	  w = d->constraint.word_list;
+	  if (w)
+	    digest_bytes (&b, w, (w[0] + 1) * sizeof (w[0]));
+	  break;
+	case SANE_CONSTRAINT_STRING_LIST:
+	  for (k = 0; d->constraint.string_list
+		 && d->constraint.string_list[k]; ++k)
+	    digest_string (&b, d->constraint.string_list[k]);
+	  break;
+	default:
+	  break;
+	}
     }
-  
-  if (cidr < 0)
-    mask[i] = cidrtomask[cidr + 8];
-  
-  /* get a sockaddr_in6 representing the base IP address */
-  memset (&hints, 0, sizeof (struct addrinfo));
-  hints.ai_flags = AI_NUMERICHOST;
-  hints.ai_family = PF_INET6;
 
-  err = getaddrinfo (base_ip, NULL, &hints, &res);
-  if (err)
+  if (b.failed)
+    DBG (DBG_ERR, "digest_descriptors: not enough memory\n");
+  else
     {
-      DBG (DBG_DBG, "check_v6_in_range: getaddrinfo() failed: %s\n", gai_strerror (err));
-      return SANE_FALSE;
+      md5_buffer (b.data, b.len, md5);
+      for (k = 0; k < 16; ++k)
+	sprintf (hp->digest + 2 * k, "%02x", md5[k]);
     }
+  free (b.data);
+}
 
-  base = (struct sockaddr_in6 *) res->ai_addr;
 
-  /*
-   * Check that the address belongs to the specified subnet.
-   * The address is reprensented by an array of 16 8bit integers.
-   */
-  for (i = 0; i < 16; i++)
-    {
-      if ((base->sin6_addr.s6_addr[i] & mask[i]) != (sin6->sin6_addr.s6_addr[i] & mask[i]))
-	{
-	  ret = SANE_FALSE;
-	  break;
-	}
-    }
-  
-  freeaddrinfo (res);
-  
-  return ret;
+
+/* Access control list: the host entries of hosts.equiv and saned.conf,
+   compiled into address prefixes when saned starts and again on SIGHUP.
+   Host names are resolved then, so admitting a connection reads no
+   file and asks no DNS server. */
+typedef struct
+{
+  int family;			/* AF_INET, AF_INET6, or AF_UNSPEC for `+' */
+  int prefix;			/* number of leading bits that must match */
+  u_char addr[16];
+  char *entry;			/* the line it came from, for the log */
 }
-# endif /* ENABLE_IPV6 */
-#else /* !SANED_USES_AF_INDEP */
+Host_Rule;
+
+static Host_Rule *host_rules;
+static int num_host_rules;
+static int max_host_rules;
+static SANE_Bool host_rules_loaded = SANE_FALSE;
+static volatile sig_atomic_t reload_requested;
+
+static const u_char v4mapped_prefix[12] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+/* Whether the first BITS bits of A and B are the same */
 static SANE_Bool
-check_v4_in_range (struct in_addr *inaddr, struct in_addr *base, char *netmask)
+prefix_match (const u_char * a, const u_char * b, int bits)
 {
-  int cidr;
-  int i;
-  char *end;
-  uint32_t mask; 
-  SANE_Bool ret = SANE_FALSE;
+  int bytes = bits / 8;
+
+  if (memcmp (a, b, bytes) != 0)
+    return SANE_FALSE;
+  bits %= 8;
+  if (bits && ((a[bytes] ^ b[bytes]) & (0xff00 >> bits) & 0xff))
+    return SANE_FALSE;
+  return SANE_TRUE;
+}
 
-  cidr = -1;
-  cidr = strtol (netmask, &end, 10);
-  
-  /* sanity check on the cidr value */
-  if ((cidr < 0) || (cidr > 32) || (end == netmask))
+/* Adds a rule matching the first PREFIX bits of ADDR.  IPv4-mapped IPv6
+   addresses become IPv4 ones, which is what check_host looks up. */
+static void
+add_host_rule (int family, const u_char * addr, int prefix,
+	       const char *entry)
+{
+  Host_Rule *rule;
+
+  if (family == AF_INET6 && prefix >= 96
+      && memcmp (addr, v4mapped_prefix, 12) == 0)
     {
-      DBG (DBG_ERR, "check_v4_in_range: invalid CIDR value (%s) !\n", netmask);
-      return SANE_FALSE;
+      family = AF_INET;
+      addr += 12;
+      prefix -= 96;
     }
 
-  mask = 0;
-  cidr -= 8;
-  
-  /* Build a bitmask out of the CIDR value */
-  for (i = 3; cidr >= 0; i--)
+  if (num_host_rules == max_host_rules)
     {
-      mask |= (0xff << (8 * i));
-      cidr -= 8;
+      rule = realloc (host_rules,
+		      (max_host_rules + 16) * sizeof (Host_Rule));
+      if (rule == NULL)
+	{
+	  DBG (DBG_ERR, "add_host_rule: not enough memory for `%s'\n", entry);
+	  return;
+	}
+      host_rules = rule;
+      max_host_rules += 16;
     }
-  
-  if (cidr < 0)
-    mask |= (cidrtomask[cidr + 8] << (8 * i));
-
-  mask = htonl (mask);
 
-  /*
-   * Check that the address belongs to the specified subnet, using the bitmask.
-   * The address is represented by a 32bit integer.
-   */
-  if ((base->s_addr & mask) == (inaddr->s_addr & mask))
-    ret = SANE_TRUE;
-  
-  return ret;
+  rule = host_rules + num_host_rules;
+  memset (rule, 0, sizeof (*rule));
+  rule->family = family;
+  rule->prefix = prefix;
+  if (family == AF_INET)
+    memcpy (rule->addr, addr, 4);
+  else if (family == AF_INET6)
+    memcpy (rule->addr, addr, 16);
+  rule->entry = strdup (entry);
+  if (rule->entry == NULL)
+    return;
+  ++num_host_rules;
 }
-#endif /* SANED_USES_AF_INDEP */
-
-
 
-/* Access control */
-#ifdef SANED_USES_AF_INDEP
-static SANE_Status
-check_host (int fd)
+/* Adds a rule for each address NAME resolves to */
+static void
+add_host_addresses (const char *name, const char *entry)
 {
-  struct sockaddr_in *sin = NULL;
-#ifdef ENABLE_IPV6
-  struct sockaddr_in6 *sin6;
-#endif /* ENABLE_IPV6 */
+#ifdef SANED_USES_AF_INDEP
   struct addrinfo hints;
   struct addrinfo *res;
   struct addrinfo *resp;
-  int j, access_ok = 0;
   int err;
-  char text_addr[64];
+
+  memset (&hints, 0, sizeof (hints));
 #ifdef ENABLE_IPV6
-  SANE_Bool IPv4map = SANE_FALSE;
-  char *remote_ipv4 = NULL; /* in case we have an IPv4-mapped address (eg ::ffff:127.0.0.1) */
-  char *tmp;
-  struct addrinfo *remote_ipv4_addr = NULL;
+  hints.ai_family = PF_UNSPEC;
+#else
+  hints.ai_family = PF_INET;
 #endif /* ENABLE_IPV6 */
-  char config_line_buf[1024];
-  char *config_line;
-  char *netmask;
-  char hostname[MAXHOSTNAMELEN];
-
-  int len;
-  FILE *fp;
-
-  /* Get address of remote host */
-  remote_address_len = sizeof (remote_address.ss);
-  if (getpeername (fd, &remote_address.sa, (socklen_t *) &remote_address_len) < 0)
-    {
-      DBG (DBG_ERR, "check_host: getpeername failed: %s\n", strerror (errno));
-      remote_ip = strdup ("[error]");
-      return SANE_STATUS_INVAL;
-    }
+  hints.ai_socktype = SOCK_STREAM;
 
-  err = getnameinfo (&remote_address.sa, remote_address_len,
-		     hostname, sizeof (hostname), NULL, 0, NI_NUMERICHOST);
+  err = getaddrinfo (name, NULL, &hints, &res);
   if (err)
     {
-      DBG (DBG_DBG, "check_host: getnameinfo failed: %s\n", gai_strerror(err));
-      remote_ip = strdup ("[error]");
-      return SANE_STATUS_INVAL;
+      DBG (DBG_MSG, "add_host_addresses: `%s' isn't an IP address "
+	   "and can't be found in DNS: %s\n", name, gai_strerror (err));
+      return;
     }
-  else
-    remote_ip = strdup (hostname);
 
+  for (resp = res; resp != NULL; resp = resp->ai_next)
+    {
+      if (resp->ai_family == AF_INET)
+	add_host_rule (AF_INET, (u_char *)
+		       &((struct sockaddr_in *) resp->ai_addr)->sin_addr,
+		       32, entry);
 #ifdef ENABLE_IPV6
-  sin6 = &remote_address.sin6;
+      else if (resp->ai_family == AF_INET6)
+	add_host_rule (AF_INET6,
+		       ((struct sockaddr_in6 *) resp->ai_addr)->sin6_addr.s6_addr,
+		       128, entry);
+#endif /* ENABLE_IPV6 */
+    }
+  freeaddrinfo (res);
+#else /* !SANED_USES_AF_INDEP */
+  struct hostent *he;
+  int i;
 
-  if (SANE_IN6_IS_ADDR_V4MAPPED (sin6->sin6_addr.s6_addr))
+  he = gethostbyname (name);
+  if (!he)
     {
-      DBG (DBG_DBG, "check_host: detected an IPv4-mapped address\n");
-      remote_ipv4 = remote_ip + 7;
-      IPv4map = SANE_TRUE;
-
-      memset (&hints, 0, sizeof (struct addrinfo));
-      hints.ai_flags = AI_NUMERICHOST;
-      hints.ai_family = PF_INET;
-      
-      err = getaddrinfo (remote_ipv4, NULL, &hints, &res);
-      if (err)
-	{
-	  DBG (DBG_DBG, "check_host: getaddrinfo() failed: %s\n", gai_strerror (err));
-	  IPv4map = SANE_FALSE; /* we failed, remote_ipv4_addr points to nothing */
-	}
-      else
-	{
-	  remote_ipv4_addr = res;
-	  sin = (struct sockaddr_in *)res->ai_addr;
-	}
+      DBG (DBG_MSG, "add_host_addresses: `%s' isn't an IP address "
+	   "and can't be found in DNS: %s\n", name, hstrerror (h_errno));
+      return;
     }
-#endif /* ENABLE_IPV6 */
+  if (he->h_addrtype != AF_INET || he->h_length != 4)
+    {
+      DBG (DBG_ERR, "add_host_addresses: can't use the address of `%s' "
+	   "(only IPv4 is supported)\n", name);
+      return;
+    }
+  for (i = 0; he->h_addr_list[i]; i++)
+    add_host_rule (AF_INET, (u_char *) he->h_addr_list[i], 32, entry);
+#endif /* SANED_USES_AF_INDEP */
+}
 
-  DBG (DBG_WARN, "check_host: access by remote host: %s\n", remote_ip);
+/* Compiles one line of an access list into rules */
+static void
+compile_host_line (char *line)
+{
+  u_char addr[16];
+  char *netmask;
+  char *end;
+  char *entry;
+  int family, prefix, max_prefix;
+
+  entry = strdup (line);
+  if (entry == NULL)
+    return;
 
-  /* Always allow access from local host. Do it here to avoid DNS lookups
-     and reading saned.conf. */
+  /* look for a subnet specification */
+  netmask = strchr (line, '/');
+  if (netmask != NULL)
+    *netmask++ = '\0';
 
 #ifdef ENABLE_IPV6
-  if (IPv4map == SANE_TRUE)
+  /* IPv6 addresses are enclosed in [] */
+  if (*line == '[')
     {
-      if (IN_LOOPBACK (ntohl (sin->sin_addr.s_addr)))
+      line++;
+      end = strchr (line, ']');
+      if (end == NULL)
 	{
-	  DBG (DBG_MSG,
-	       "check_host: remote host is IN_LOOPBACK: access granted\n");
-	  freeaddrinfo (remote_ipv4_addr);
-	  return SANE_STATUS_GOOD;
+	  DBG (DBG_ERR, "compile_host_line: malformed IPv6 address, "
+	       "skipping: `%s'\n", entry);
+	  free (entry);
+	  return;
 	}
-      freeaddrinfo (remote_ipv4_addr);
+      *end = '\0';
     }
 #endif /* ENABLE_IPV6 */
 
-  sin = &remote_address.sin;
-
-  switch (SS_FAMILY(remote_address.ss))
+  if (strcmp (line, "+") == 0)
     {
-      case AF_INET:
-	if (IN_LOOPBACK (ntohl (sin->sin_addr.s_addr)))
-	  {
-	    DBG (DBG_MSG,
-		 "check_host: remote host is IN_LOOPBACK: access granted\n");
-	    return SANE_STATUS_GOOD;
-	  }
-	break;
-#ifdef ENABLE_IPV6
-      case AF_INET6:
-	if (SANE_IN6_IS_ADDR_LOOPBACK (sin6->sin6_addr.s6_addr))
-	  {
-	    DBG (DBG_MSG,
-		 "check_host: remote host is IN6_LOOPBACK: access granted\n");
-	    return SANE_STATUS_GOOD;
-	  }
-	break;
-#endif /* ENABLE_IPV6 */
-      default:
-	break;
+      add_host_rule (AF_UNSPEC, NULL, 0, entry);
+      free (entry);
+      return;
     }
 
-  DBG (DBG_DBG, "check_host: remote host is not IN_LOOPBACK"
-#ifdef ENABLE_IPV6
-       " nor IN6_LOOPBACK"
-#endif /* ENABLE_IPV6 */
-       "\n");
-
-
-  /* Get name of local host */
-  if (gethostname (hostname, sizeof (hostname)) < 0)
+  if (inet_pton (AF_INET, line, addr) > 0)
     {
-      DBG (DBG_ERR, "check_host: gethostname failed: %s\n", strerror (errno));
-      return SANE_STATUS_INVAL;
+      family = AF_INET;
+      max_prefix = 32;
     }
-  DBG (DBG_DBG, "check_host: local hostname: %s\n", hostname);
-
-  /* Get local addresses */
-  memset (&hints, 0, sizeof (hints));
-  hints.ai_flags = AI_CANONNAME;
 #ifdef ENABLE_IPV6
-  hints.ai_family = PF_UNSPEC;
-#else
-  hints.ai_family = PF_INET;
+  else if (inet_pton (AF_INET6, line, addr) > 0)
+    {
+      family = AF_INET6;
+      max_prefix = 128;
+    }
 #endif /* ENABLE_IPV6 */
+  else
+    {
+      if (netmask != NULL)
+	DBG (DBG_ERR, "compile_host_line: subnet base must be an IP address, "
+	     "skipping: `%s'\n", entry);
+      else
+	add_host_addresses (line, entry);
+      free (entry);
+      return;
+    }
 
-  err = getaddrinfo (hostname, NULL, &hints, &res);
-  if (err)
+  prefix = max_prefix;
+  if (netmask != NULL)
     {
-      DBG (DBG_ERR, "check_host: getaddrinfo for local hostname failed: %s\n",
-	   gai_strerror (err));
+      prefix = strtol (netmask, &end, 10);
 
-      /* Proceed even if the local hostname does not resolve */
-      if (err != EAI_NONAME)
-	return SANE_STATUS_INVAL;
+      /* Sanity check on the cidr value */
+      if (prefix < 0 || prefix > max_prefix || end == netmask)
+	{
+	  DBG (DBG_ERR, "compile_host_line: invalid CIDR value (%s), "
+	       "skipping: `%s'\n", netmask, entry);
+	  free (entry);
+	  return;
+	}
     }
+  add_host_rule (family, addr, prefix, entry);
+  free (entry);
+}
+
+static void
+free_host_rules (void)
+{
+  int i;
+
+  for (i = 0; i < num_host_rules; i++)
+    free (host_rules[i].entry);
+  num_host_rules = 0;
+}
+
+/* (Re)builds the access list from the addresses of the local host,
+   PATH_NET_CONFIG and /etc/hosts.equiv */
+static void
+load_host_rules (void)
+{
+  char config_line_buf[1024];
+  char hostname[MAXHOSTNAMELEN];
+  FILE *fp;
+  int j;
+
+  free_host_rules ();
+  host_rules_loaded = SANE_TRUE;
+
+  /* Clients on the local host may connect through one of its outside
+     addresses */
+  if (gethostname (hostname, sizeof (hostname)) < 0)
+    DBG (DBG_ERR, "load_host_rules: gethostname failed: %s\n",
+	 strerror (errno));
   else
     {
-      for (resp = res; resp != NULL; resp = resp->ai_next)
-	{
-	  DBG (DBG_DBG, "check_host: local hostname(s) (from DNS): %s\n",
-	       resp->ai_canonname);
-	  
-	  err = getnameinfo (resp->ai_addr, resp->ai_addrlen, text_addr,
-			     sizeof (text_addr), NULL, 0, NI_NUMERICHOST);
-	  if (err)
-		strncpy (text_addr, "[error]", 8);
-
-#ifdef ENABLE_IPV6	  
-	  if ((strcasecmp (text_addr, remote_ip) == 0) ||
-	      ((IPv4map == SANE_TRUE) && (strcmp (text_addr, remote_ipv4) == 0)))
-#else
-	  if (strcmp (text_addr, remote_ip) == 0)
-#endif /* ENABLE_IPV6 */
-	    {
-	      DBG (DBG_MSG, "check_host: remote host has same addr as local: access granted\n");
-	      
-	      freeaddrinfo (res);
-	      res = NULL;
-
-	      return SANE_STATUS_GOOD;
-	    }
-	}
-      
-      freeaddrinfo (res);
-      res = NULL;
-      
-      DBG (DBG_DBG, 
-	   "check_host: remote host doesn't have same addr as local\n");
+      DBG (DBG_DBG, "load_host_rules: local hostname: %s\n", hostname);
+      add_host_addresses (hostname, "(local host)");
     }
 
-  /* must be a remote host: check contents of PATH_NET_CONFIG or
-     /etc/hosts.equiv if former doesn't exist: */
   for (j = 0; j < NELEMS (config_file_names); ++j)
     {
-      DBG (DBG_DBG, "check_host: opening config file: %s\n",
+      DBG (DBG_DBG, "load_host_rules: opening config file: %s\n",
 	   config_file_names[j]);
       if (config_file_names[j][0] == '/')
 	fp = fopen (config_file_names[j], "r");
@@ -937,196 +1543,153 @@ check_host (int fd)
       if (!fp)
 	{
 	  DBG (DBG_MSG,
-	       "check_host: can't open config file: %s (%s)\n",
+	       "load_host_rules: can't open config file: %s (%s)\n",
 	       config_file_names[j], strerror (errno));
 	  continue;
 	}
-      
-      while (!access_ok && sanei_config_read (config_line_buf, 
-					      sizeof (config_line_buf), fp))
+
+      while (sanei_config_read (config_line_buf, sizeof (config_line_buf), fp))
 	{
-	  config_line = config_line_buf; /* from now on, use a pointer */
-	  DBG (DBG_DBG, "check_host: config file line: `%s'\n", config_line);
-	  if (config_line[0] == '#')
-	    continue;           /* ignore comments */
+	  if (config_line_buf[0] == '#')
+	    continue;		/* ignore comments */
 
-	  if (strchr (config_line, '='))
-	    continue;           /* ignore lines with an = sign */
+	  if (strchr (config_line_buf, '='))
+	    continue;		/* ignore lines with an = sign */
 
-	  len = strlen (config_line);
-	  if (!len)
+	  if (!strlen (config_line_buf))
 	    continue;		/* ignore empty lines */
 
-	  /* look for a subnet specification */
-	  netmask = strchr (config_line, '/');
-	  if (netmask != NULL)
-	    {
-	      *netmask = '\0';
-	      netmask++;
-	      DBG (DBG_DBG, "check_host: subnet with base IP = %s, CIDR netmask = %s\n",
-		   config_line, netmask);
-	    }
+	  compile_host_line (config_line_buf);
+	}
+      fclose (fp);
+    }
+
+  DBG (DBG_MSG, "load_host_rules: %d access list entries\n", num_host_rules);
+}
+
+static void
+sig_hup_handler (int signum)
+{
+  reload_requested = 1;
+  signal (signum, sig_hup_handler);
+}
+
+/* Reloads the access list if SIGHUP came in since the last call.  Only
+   the processes that accept connections need it. */
+static void
+check_reload (void)
+{
+  if (!reload_requested)
+    return;
+  reload_requested = 0;
+
+  if (!multi_client && conn)
+    return;
+  DBG (DBG_WARN, "check_reload: reloading the access list\n");
+  load_host_rules ();
+}
+
+/* Looks up address ADDR of family FAMILY (AF_INET for IPv4-mapped ones)
+   in the access list */
+static SANE_Status
+match_host_rules (int family, const u_char * addr)
+{
+  Host_Rule *rule;
+
+  if (!host_rules_loaded)
+    load_host_rules ();
 
+  for (rule = host_rules; rule < host_rules + num_host_rules; rule++)
+    {
+      if (rule->family == AF_UNSPEC
+	  || (rule->family == family
+	      && prefix_match (rule->addr, addr, rule->prefix)))
+	{
+	  DBG (DBG_DBG, "check_host: access granted from IP address %s "
+	       "(`%s')\n", conn->remote_ip, rule->entry);
+	  return SANE_STATUS_GOOD;
+	}
+    }
+  return SANE_STATUS_ACCESS_DENIED;
+}
+
+/* Access control */
+#ifdef SANED_USES_AF_INDEP
+static SANE_Status
+check_host (int fd)
+{
+  struct sockaddr_in *sin;
 #ifdef ENABLE_IPV6
-	  /* IPv6 addresses are enclosed in [] */
-	  if (*config_line == '[')
-	    {
-	      config_line++;
-	      tmp = strchr (config_line, ']');
-	      if (tmp == NULL)
-		{
-		  DBG (DBG_ERR,
-		       "check_host: malformed IPv6 address in config file, skipping: [%s\n",
-		       config_line);
-		  continue;
-		}
-	      *tmp = '\0';
-	    }
+  struct sockaddr_in6 *sin6;
 #endif /* ENABLE_IPV6 */
+  const u_char *addr;
+  uint32_t addr4;
+  int family;
+  int err;
+  char hostname[MAXHOSTNAMELEN];
 
-	  if (strcmp (config_line, "+") == 0)
-	    {
-	      access_ok = 1;
-	      DBG (DBG_DBG, 
-		   "check_host: access granted from any host (`+')\n");
-	    }
-	  /* compare remote_ip (remote IP address) to the config_line */
-	  else if (strcasecmp (config_line, remote_ip) == 0)
-	    {
-	      access_ok = 1;
-	      DBG (DBG_DBG,
-		   "check_host: access granted from IP address %s\n", remote_ip);
-	    }
-#ifdef ENABLE_IPV6
-	  else if ((IPv4map == SANE_TRUE) && (strcmp (config_line, remote_ipv4) == 0))
-	    {
-	      access_ok = 1;
-	      DBG (DBG_DBG,
-		   "check_host: access granted from IP address %s (IPv4-mapped)\n", remote_ip);
-	    }
-	  /* handle IP ranges, take care of the IPv4map stuff */
-	  else if (netmask != NULL)
-	    {
-	      if (strchr (config_line, ':') != NULL) /* is a v6 address */
-		{
-		  if (SS_FAMILY(remote_address.ss) == AF_INET6)
-		    {
-		      if (check_v6_in_range (sin6, config_line, netmask))
-			{
-			  access_ok = 1;
-			  DBG (DBG_DBG, "check_host: access granted from IP address %s (in subnet [%s]/%s)\n",
-			       remote_ip, config_line, netmask);
-			}
-		    }
-		}
-	      else /* is a v4 address */
-		{
-		  if (IPv4map == SANE_TRUE)
-		    {
-		      /* get a sockaddr_in representing the v4-mapped IP address */
-		      memset (&hints, 0, sizeof (struct addrinfo));
-		      hints.ai_flags = AI_NUMERICHOST;
-		      hints.ai_family = PF_INET;
-		      
-		      err = getaddrinfo (remote_ipv4, NULL, &hints, &res);
-		      if (err)
-			DBG (DBG_DBG, "check_host: getaddrinfo() failed: %s\n", gai_strerror (err));
-		      else
-			sin = (struct sockaddr_in *)res->ai_addr;
-		    }
+  /* Get address of remote host */
+  conn->remote_address_len = sizeof (conn->remote_address.ss);
+  if (getpeername (fd, &conn->remote_address.sa, (socklen_t *) &conn->remote_address_len) < 0)
+    {
+      DBG (DBG_ERR, "check_host: getpeername failed: %s\n", strerror (errno));
+      conn->remote_ip = strdup ("[error]");
+      return SANE_STATUS_INVAL;
+    }
 
-		  if ((SS_FAMILY(remote_address.ss) == AF_INET) ||
-		      (IPv4map == SANE_TRUE))
-		    {
-		      
-		      if (check_v4_in_range (sin, config_line, netmask))
-			{
-			  DBG (DBG_DBG, "check_host: access granted from IP address %s (in subnet %s/%s)\n",
-			       ((IPv4map == SANE_TRUE) ? remote_ipv4 : remote_ip), config_line, netmask);
-			  access_ok = 1;
-			}
-		      else
-			{
-			  /* restore the old sin pointer */
-			  sin = &remote_address.sin;
-			}
-		      
-		      if (res != NULL)
-			{
-			  freeaddrinfo (res);
-			  res = NULL;
-			}
-		    }
-		}
-	    }
-#else /* !ENABLE_IPV6 */
-	  /* handle IP ranges */
-	  else if (netmask != NULL)
-	    {
-	      if (check_v4_in_range (sin, config_line, netmask))
-		{
-		  access_ok = 1;
-		  DBG (DBG_DBG, "check_host: access granted from IP address %s (in subnet %s/%s)\n",
-		       remote_ip, config_line, netmask);
-		}
-	    }
-#endif /* ENABLE_IPV6 */
-	  else
-	    {
-	      memset (&hints, 0, sizeof (hints));
-	      hints.ai_flags = AI_CANONNAME;
+  err = getnameinfo (&conn->remote_address.sa, conn->remote_address_len,
+		     hostname, sizeof (hostname), NULL, 0, NI_NUMERICHOST);
+  if (err)
+    {
+      DBG (DBG_DBG, "check_host: getnameinfo failed: %s\n", gai_strerror(err));
+      conn->remote_ip = strdup ("[error]");
+      return SANE_STATUS_INVAL;
+    }
+  else
+    conn->remote_ip = strdup (hostname);
+
+  DBG (DBG_WARN, "check_host: access by remote host: %s\n", conn->remote_ip);
+
+  family = SS_FAMILY (conn->remote_address.ss);
+  switch (family)
+    {
+      case AF_INET:
+	sin = &conn->remote_address.sin;
+	addr = (const u_char *) &sin->sin_addr;
+	break;
 #ifdef ENABLE_IPV6
-	      hints.ai_family = PF_UNSPEC;
-#else
-	      hints.ai_family = PF_INET;
-#endif /* ENABLE_IPV6 */
-	      
-	      err = getaddrinfo (config_line, NULL, &hints, &res);
-	      if (err)
-		{
-		  DBG (DBG_DBG, 
-		       "check_host: getaddrinfo for `%s' failed: %s\n",
-		       config_line, gai_strerror (err));
-		  DBG (DBG_MSG, "check_host: entry isn't an IP address "
-		       "and can't be found in DNS\n");
-		  continue;
-		}
-	      else
-		{
-		  for (resp = res; resp != NULL; resp = resp->ai_next)
-		    {
-		      err = getnameinfo (resp->ai_addr, resp->ai_addrlen, text_addr,
-					 sizeof (text_addr), NULL, 0, NI_NUMERICHOST);
-		      if (err)
-			strncpy (text_addr, "[error]", 8);
-		      
-		      DBG (DBG_MSG,  
-			   "check_host: DNS lookup returns IP address: %s\n", 
-			   text_addr); 
-		      
-#ifdef ENABLE_IPV6			  
-		      if ((strcasecmp (text_addr, remote_ip) == 0) ||
-			  ((IPv4map == SANE_TRUE) && (strcmp (text_addr, remote_ipv4) == 0)))
-#else
-		      if (strcmp (text_addr, remote_ip) == 0)
+      case AF_INET6:
+	sin6 = &conn->remote_address.sin6;
+	addr = sin6->sin6_addr.s6_addr;
+	if (SANE_IN6_IS_ADDR_V4MAPPED (addr))
+	  {
+	    DBG (DBG_DBG, "check_host: detected an IPv4-mapped address\n");
+	    family = AF_INET;
+	    addr += 12;
+	  }
+	else if (SANE_IN6_IS_ADDR_LOOPBACK (addr))
+	  {
+	    DBG (DBG_MSG,
+		 "check_host: remote host is IN6_LOOPBACK: access granted\n");
+	    return SANE_STATUS_GOOD;
+	  }
+	break;
 #endif /* ENABLE_IPV6 */
-			access_ok = 1;
-		      
-		      if (access_ok)
-			break;
-		    }
-		  freeaddrinfo (res);
-		  res = NULL;
-		}
-	    }
-	}
-      fclose (fp);
+      default:
+	return SANE_STATUS_ACCESS_DENIED;
     }
-  
-  if (access_ok)
-    return SANE_STATUS_GOOD;
-  
-  return SANE_STATUS_ACCESS_DENIED;
+
+  /* Always allow access from local host */
+  if (family == AF_INET)
+    memcpy (&addr4, addr, 4);
+  if (family == AF_INET && IN_LOOPBACK (ntohl (addr4)))
+    {
+      DBG (DBG_MSG,
+	   "check_host: remote host is IN_LOOPBACK: access granted\n");
+      return SANE_STATUS_GOOD;
+    }
+
+  return match_host_rules (family, addr);
 }
 
 #else /* !SANED_USES_AF_INDEP */
@@ -1135,192 +1698,33 @@ static SANE_Status
 check_host (int fd)
 {
   struct sockaddr_in sin;
-  int j, access_ok = 0;
-  struct hostent *he;
-  char text_addr[64];
-  char config_line_buf[1024];
-  char *config_line;
-  char *netmask;
-  char hostname[MAXHOSTNAMELEN];
   char *r_hostname;
-  static struct in_addr config_line_address;
-  
   int len;
-  FILE *fp;
 
   /* Get address of remote host */
   len = sizeof (sin);
   if (getpeername (fd, (struct sockaddr *) &sin, (socklen_t *) &len) < 0)
     {
       DBG (DBG_ERR, "check_host: getpeername failed: %s\n", strerror (errno));
-      remote_ip = strdup ("[error]");
+      conn->remote_ip = strdup ("[error]");
       return SANE_STATUS_INVAL;
     }
   r_hostname = inet_ntoa (sin.sin_addr);
-  remote_ip = strdup (r_hostname);
+  conn->remote_ip = strdup (r_hostname);
   DBG (DBG_WARN, "check_host: access by remote host: %s\n", 
-       remote_ip);
+       conn->remote_ip);
   /* Save remote address for check of control and data connections */
-  memcpy (&remote_address, &sin.sin_addr, sizeof (remote_address));
+  memcpy (&conn->remote_address, &sin.sin_addr, sizeof (conn->remote_address));
 
-  /* Always allow access from local host. Do it here to avoid DNS lookups
-     and reading saned.conf. */
+  /* Always allow access from local host */
   if (IN_LOOPBACK (ntohl (sin.sin_addr.s_addr)))
     {
       DBG (DBG_MSG,
 	   "check_host: remote host is IN_LOOPBACK: access accepted\n");
       return SANE_STATUS_GOOD;
     }
-  DBG (DBG_DBG, "check_host: remote host is not IN_LOOPBACK\n");
-
-  /* Get name of local host */
-  if (gethostname (hostname, sizeof (hostname)) < 0)
-    {
-      DBG (DBG_ERR, "check_host: gethostname failed: %s\n", strerror (errno));
-      return SANE_STATUS_INVAL;
-    }
-  DBG (DBG_DBG, "check_host: local hostname: %s\n", hostname);
-
-  /* Get local address */
-  he = gethostbyname (hostname);
-
-  if (!he)
-    {
-      DBG (DBG_ERR, "check_host: gethostbyname for local hostname failed: %s\n",
-	   hstrerror (h_errno));
-
-      /* Proceed even if the local hostname doesn't resolve */
-      if (h_errno != HOST_NOT_FOUND)
-	return SANE_STATUS_INVAL;
-    }
-  else
-    {
-      DBG (DBG_DBG, "check_host: local hostname (from DNS): %s\n",
-	   he->h_name);
-  
-      if ((he->h_length == 4) || (he->h_addrtype == AF_INET))
-	{
-	  if (!inet_ntop (he->h_addrtype, he->h_addr_list[0], text_addr,
-			  sizeof (text_addr)))
-	    strcpy (text_addr, "[error]");
-	  DBG (DBG_DBG, "check_host: local host address (from DNS): %s\n",
-	       text_addr);
-	  if (memcmp (he->h_addr_list[0], &remote_address.s_addr, 4) == 0)   
-	    {
-	      DBG (DBG_MSG, 
-		   "check_host: remote host has same addr as local: "
-		   "access accepted\n");
-	      return SANE_STATUS_GOOD;
-	    }
-	}
-      else
-	{
-	  DBG (DBG_ERR, "check_host: can't get local address "
-	       "(only IPv4 is supported)\n");
-	}
-
-      DBG (DBG_DBG,
-	   "check_host: remote host doesn't have same addr as local\n");
-    }
 
-  /* must be a remote host: check contents of PATH_NET_CONFIG or
-     /etc/hosts.equiv if former doesn't exist: */
-  for (j = 0; j < NELEMS (config_file_names); ++j)
-    {
-      DBG (DBG_DBG, "check_host: opening config file: %s\n",
-	   config_file_names[j]);
-      if (config_file_names[j][0] == '/')
-	fp = fopen (config_file_names[j], "r");
-      else
-	fp = sanei_config_open (config_file_names[j]);
-      if (!fp)
-	{
-	  DBG (DBG_MSG,
-	       "check_host: can't open config file: %s (%s)\n",
-	       config_file_names[j], strerror (errno));
-	  continue;
-	}
-      
-      while (!access_ok && sanei_config_read (config_line_buf, 
-					      sizeof (config_line_buf), fp))
-	{
-	  config_line = config_line_buf; /* from now on, use a pointer */
-	  DBG (DBG_DBG, "check_host: config file line: `%s'\n", config_line);
-	  if (config_line[0] == '#')
-	    continue;           /* ignore comments */
-
-	  if (strchr (config_line, '='))
-	    continue;           /* ignore lines with an = sign */
-
-	  len = strlen (config_line);
-	  if (!len)
-	    continue;		/* ignore empty lines */
-
-	  /* look for a subnet specification */
-	  netmask = strchr (config_line, '/');
-	  if (netmask != NULL)
-	    {
-	      *netmask = '\0';
-	      netmask++;
-	      DBG (DBG_DBG, "check_host: subnet with base IP = %s, CIDR netmask = %s\n",
-		   config_line, netmask);
-	    }
-
-	  if (strcmp (config_line, "+") == 0)
-	    {
-	      access_ok = 1;
-	      DBG (DBG_DBG, 
-		   "check_host: access accepted from any host (`+')\n");
-	    }
-	  else
-	    {
-	      if (inet_pton (AF_INET, config_line, &config_line_address) > 0)
-		{
-		  if (memcmp (&remote_address.s_addr, 
-			      &config_line_address.s_addr, 4) == 0)
-		    access_ok = 1;
-		  else if (netmask != NULL)
-		    {
-		      if (check_v4_in_range (&remote_address, &config_line_address, netmask))
-			{
-			  access_ok = 1;
-			  DBG (DBG_DBG, "check_host: access granted from IP address %s (in subnet %s/%s)\n",
-			       remote_ip, config_line, netmask);
-			}
-		    }
-		}
-	      else
-		{
-		  DBG (DBG_DBG, 
-		       "check_host: inet_pton for `%s' failed\n",
-		       config_line);
-		  he = gethostbyname (config_line);
-		  if (!he)
-		    {
-		      DBG (DBG_DBG, 
-			   "check_host: gethostbyname for `%s' failed: %s\n",
-			   config_line, hstrerror (h_errno));
-		      DBG (DBG_MSG, "check_host: entry isn't an IP address "
-			   "and can't be found in DNS\n");
-		      continue;
-		    }
-		  if (!inet_ntop (he->h_addrtype, he->h_addr_list[0],
-				  text_addr, sizeof (text_addr)))
-		    strcpy (text_addr, "[error]");
-		  DBG (DBG_MSG, 
-		       "check_host: DNS lookup returns IP address: %s\n",
-		       text_addr);
-		  if (memcmp (&remote_address.s_addr, 
-			      he->h_addr_list[0], 4) == 0)
-		    access_ok = 1;
-		}
-	    }
-	}
-      fclose (fp);
-      if (access_ok)
-	return SANE_STATUS_GOOD;
-    }
-  return SANE_STATUS_ACCESS_DENIED;
+  return match_host_rules (AF_INET, (const u_char *) &sin.sin_addr);
 }
 
 #endif /* SANED_USES_AF_INDEP */
@@ -1338,7 +1742,7 @@ init (Wire * w)
   status = check_host (w->io.fd);
   if (status != SANE_STATUS_GOOD)
     {
-      DBG (DBG_WARN, "init: access by host %s denied\n", remote_ip);
+      DBG (DBG_WARN, "init: access by host %s denied\n", conn->remote_ip);
       return -1;
     }
   else
@@ -1366,9 +1770,21 @@ init (Wire * w)
       return -1;
     }
 
+  /* Use batched option requests and descriptor changes if the client
+     knows them, and compress the data connection if it can decode it */
   w->version = SANEI_NET_PROTOCOL_VERSION;
+  if (SANE_VERSION_BUILD (req.version_code) >= SANEI_NET_PROTOCOL_DELTA)
+    w->version = SANEI_NET_PROTOCOL_DELTA;
+  else if (SANE_VERSION_BUILD (req.version_code) >= SANEI_NET_PROTOCOL_BATCH)
+    w->version = SANEI_NET_PROTOCOL_BATCH;
+  else if (compression
+	   && SANE_VERSION_BUILD (req.version_code)
+	   >= SANEI_NET_PROTOCOL_COMPRESS)
+    w->version = SANEI_NET_PROTOCOL_COMPRESS;
+  DBG (DBG_MSG, "init: client protocol version %d, using %d\n",
+       SANE_VERSION_BUILD (req.version_code), w->version);
   if (req.username)
-    default_username = strdup (req.username);
+    conn->username = strdup (req.username);
 
   sanei_w_free (w, (WireCodecFunc) sanei_w_init_req, &req);
   if (w->status)
@@ -1377,15 +1793,17 @@ init (Wire * w)
       return -1;
     }
 
-  reply.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR,
-					  SANEI_NET_PROTOCOL_VERSION);
+  reply.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR, w->version);
 
   DBG (DBG_WARN, "init: access granted to %s@%s\n",
-       default_username, remote_ip);
+       conn->username ? conn->username : default_username, conn->remote_ip);
 
-  if (status == SANE_STATUS_GOOD)
+  if (status == SANE_STATUS_GOOD && backend_initialized)
+    DBG (DBG_MSG, "init: backends are already initialized\n");
+  else if (status == SANE_STATUS_GOOD)
     {
       status = sane_init (&be_version_code, auth_callback);
+      backend_version = be_version_code;
       if (status != SANE_STATUS_GOOD)
 	DBG (DBG_ERR, "init: failed to initialize backend (%s)\n",
 	     sane_strstatus (status));
@@ -1397,6 +1815,11 @@ init (Wire * w)
 	       SANE_VERSION_MAJOR (be_version_code), V_MAJOR);
 	  status = SANE_STATUS_INVAL;
 	}
+
+      /* In multi-client mode they stay initialized for the next
+	 connections. */
+      if (status == SANE_STATUS_GOOD && multi_client)
+	backend_initialized = SANE_TRUE;
     }
   reply.status = status;
   if (status != SANE_STATUS_GOOD)
@@ -1429,6 +1852,7 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
   int fd, len;
   in_port_t data_port;
   int ret;
+  double start;
 
   be_handle = handle[h].handle;
 
@@ -1492,6 +1916,7 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
     {
       DBG (DBG_ERR, "start_scan: failed to bind address (%s)\n",
 	   strerror (errno));
+      close (fd);
       reply->status = SANE_STATUS_IO_ERROR;
       return -1;
     }
@@ -1500,6 +1925,7 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
     {
       DBG (DBG_ERR, "start_scan: failed to make socket listen (%s)\n",
 	   strerror (errno));
+      close (fd);
       reply->status = SANE_STATUS_IO_ERROR;
       return -1;
     }
@@ -1508,6 +1934,7 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
     {
       DBG (DBG_ERR, "start_scan: failed to obtain socket address (%s)\n",
 	   strerror (errno));
+      close (fd);
       reply->status = SANE_STATUS_IO_ERROR;
       return -1;
     }
@@ -1530,7 +1957,9 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
 
   DBG (DBG_MSG, "start_scan: using port %d for data\n", reply->port);
 
+  start = stats_now ();
   reply->status = sane_start (be_handle);
+  stats_add_call (h, 1, stats_now () - start);
   if (reply->status == SANE_STATUS_GOOD)
     {
       handle[h].scanning = 1;
@@ -1550,6 +1979,7 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
   int fd, len;
   in_port_t data_port;
   int ret;
+  double start;
 
   be_handle = handle[h].handle;
 
@@ -1562,250 +1992,628 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
       return -1;
     }
 
-  fd = socket (AF_INET, SOCK_STREAM, 0);
-  if (fd < 0)
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      DBG (DBG_ERR, "start_scan: failed to obtain data socket (%s)\n",
+	   strerror (errno));
+      reply->status = SANE_STATUS_IO_ERROR;
+      return -1;
+    }
+
+  /* Try to bind a port between data_port_lo and data_port_hi for the data connection */
+  for (data_port = data_port_lo; data_port <= data_port_hi; data_port++)
+    {
+      sin.sin_port = htons(data_port);
+
+      DBG(DBG_INFO, "start_scan: trying to bind data port %d\n", data_port);
+
+      ret = bind (fd, (struct sockaddr *) &sin, len);
+      if (ret == 0)
+        break;
+    }
+
+  if (ret < 0)
+    {
+      DBG (DBG_ERR, "start_scan: failed to bind address (%s)\n",
+	   strerror (errno));
+      close (fd);
+      reply->status = SANE_STATUS_IO_ERROR;
+      return -1;
+    }
+
+  if (listen (fd, 1) < 0)
+    {
+      DBG (DBG_ERR, "start_scan: failed to make socket listen (%s)\n",
+	   strerror (errno));
+      close (fd);
+      reply->status = SANE_STATUS_IO_ERROR;
+      return -1;
+    }
+
+  if (getsockname (fd, (struct sockaddr *) &sin, (socklen_t *) &len) < 0)
+    {
+      DBG (DBG_ERR, "start_scan: failed to obtain socket address (%s)\n",
+	   strerror (errno));
+      close (fd);
+      reply->status = SANE_STATUS_IO_ERROR;
+      return -1;
+    }
+
+  reply->port = ntohs (sin.sin_port);
+
+  DBG (DBG_MSG, "start_scan: using port %d for data\n", reply->port);
+
+  start = stats_now ();
+  reply->status = sane_start (be_handle);
+  stats_add_call (h, 1, stats_now () - start);
+  if (reply->status == SANE_STATUS_GOOD)
+    {
+      handle[h].scanning = 1;
+      handle[h].docancel = 0;
+    }
+
+  return fd;
+}
+#endif /* SANED_USES_AF_INDEP */
+
+static int
+store_reclen (SANE_Byte * buf, size_t buf_size, int i, size_t reclen)
+{
+  buf[i++] = (reclen >> 24) & 0xff;
+  if (i >= (int) buf_size)
+    i = 0;
+  buf[i++] = (reclen >> 16) & 0xff;
+  if (i >= (int) buf_size)
+    i = 0;
+  buf[i++] = (reclen >> 8) & 0xff;
+  if (i >= (int) buf_size)
+    i = 0;
+  buf[i++] = (reclen >> 0) & 0xff;
+  if (i >= (int) buf_size)
+    i = 0;
+  return i;
+}
+
+/* Sets up S to scan handle H to DATA_FD in the record format of
+   protocol VERSION, compressed if that allows and saned is configured
+   to.  Returns -1 if there's not enough memory. */
+static int
+scan_init (Scan * s, int h, int data_fd, int version)
+{
+  SANE_Handle be_handle = handle[h].handle;
+  SANE_Parameters params;
+
+  DBG (3, "do_scan: start\n");
+
+  memset (s, 0, sizeof (*s));
+  s->buf_size = data_buffer_size;
+  s->max_record = s->buf_size / 4;
+  if (s->max_record < SANED_MIN_DATA_BUFFER)
+    s->max_record = s->buf_size;
+  s->buf = malloc (s->buf_size);
+
+  s->codec = SANEI_COMPRESS_NONE;
+  if (version >= SANEI_NET_PROTOCOL_COMPRESS)
+    s->record_header = 5;
+  if (s->record_header && compression
+      && sane_get_parameters (be_handle, &params) == SANE_STATUS_GOOD)
+    {
+      s->codec = sanei_compress_codec (params.depth);
+      s->raw = malloc (s->max_record);
+      s->packed = malloc (s->max_record);
+      DBG (DBG_MSG, "do_scan: compressing %d bit frame with %s\n",
+	   params.depth, s->codec == SANEI_COMPRESS_RLE ? "RLE" : "LZ");
+    }
+
+  if (s->buf == NULL
+      || (s->codec != SANEI_COMPRESS_NONE
+	  && (s->raw == NULL || s->packed == NULL)))
+    {
+      DBG (DBG_ERR, "do_scan: can't allocate %d byte buffer\n", s->buf_size);
+      free (s->buf);
+      free (s->raw);
+      free (s->packed);
+      return -1;
+    }
+
+  s->h = h;
+  s->data_fd = data_fd;
+  s->status = SANE_STATUS_GOOD;
+  gettimeofday (&s->start, NULL);
+
+  s->nonblocking = (sane_set_io_mode (be_handle, SANE_TRUE)
+		    == SANE_STATUS_GOOD);
+  if (sane_get_select_fd (be_handle, &s->be_fd) != SANE_STATUS_GOOD)
+    s->be_fd = -1;
+  return 0;
+}
+
+/* Room needed to read another record: its length, at least a byte, and
+   the final status record */
+#define SCAN_MIN_SPACE (4 + 1 + 5)
+
+/* Sets up DATA and BE to poll the data connection and the backend's
+   select fd for whatever the scan is waiting on; fds it isn't waiting
+   on are set to -1.  Returns the poll timeout to use: 0 when a backend
+   without a select fd has to be polled, -1 otherwise. */
+static int
+scan_poll_fds (Scan * s, struct pollfd *data, struct pollfd *be)
+{
+  data->fd = be->fd = -1;
+  data->events = be->events = 0;
+  data->revents = be->revents = 0;
+
+  if (s->bytes_in_buf)
+    {
+      data->fd = s->data_fd;
+      data->events = POLLOUT;
+    }
+  if (s->status == SANE_STATUS_GOOD
+      && s->buf_size - s->bytes_in_buf >= SCAN_MIN_SPACE)
+    {
+      if (s->be_fd < 0)
+	return 0;
+      be->fd = s->be_fd;
+      be->events = POLLIN;
+    }
+  return -1;
+}
+
+/* Reads up to MAX bytes of what the backend has ready into BUF, a
+   ring of BUF_SIZE bytes, at POS.  A backend that can't do non-blocking
+   reads gets a single sane_read().  Returns the number of bytes read. */
+static int
+scan_fill (Scan * s, SANE_Byte * buf, int buf_size, int pos, int max)
+{
+  SANE_Handle be_handle = handle[s->h].handle;
+  int nbytes, record = 0;
+  SANE_Int length;
+  double start;
+
+  do
+    {
+      nbytes = max - record;
+      if (pos + nbytes > buf_size)
+	nbytes = buf_size - pos;
+
+      DBG (DBG_INFO,
+	   "do_scan: trying to read %d bytes from scanner\n", nbytes);
+      start = stats_now ();
+      s->status = sane_read (be_handle, buf + pos, nbytes, &length);
+      s->read_secs += stats_now () - start;
+      DBG (DBG_INFO, "do_scan: read %d bytes from scanner\n", length);
+      if (s->status != SANE_STATUS_GOOD)
+	break;
+
+      record += length;
+      pos = (pos + length) % buf_size;
+    }
+  while (s->nonblocking && length > 0 && record < max);
+
+  return record;
+}
+
+/* Copies LEN bytes from DATA into the ring at the reader. */
+static void
+scan_put (Scan * s, const SANE_Byte * data, int len)
+{
+  int n = len;
+
+  if (s->reader + n > s->buf_size)
+    n = s->buf_size - s->reader;
+  memcpy (s->buf + s->reader, data, n);
+  memcpy (s->buf, data + n, len - n);
+  s->reader = (s->reader + len) % s->buf_size;
+}
+
+/* Compresses the RECORD bytes in s->raw into a record in the ring, or
+   stores them as they are if they don't get smaller. */
+static void
+scan_put_packed (Scan * s, int record)
+{
+  SANEI_Compress_Codec codec = s->codec;
+  const SANE_Byte *data = s->packed;
+  clock_t start;
+  int n;
+
+  start = clock ();
+  n = (int) sanei_compress (codec, s->raw, record, s->packed, record - 1);
+  s->cpu += clock () - start;
+  if (n == 0)
+    {
+      codec = SANEI_COMPRESS_NONE;
+      data = s->raw;
+      n = record;
+    }
+
+  s->reader = store_reclen (s->buf, s->buf_size, s->reader, n + 5);
+  s->buf[s->reader] = codec;
+  s->reader = (s->reader + 1) % s->buf_size;
+  s->reader = store_reclen (s->buf, s->buf_size, s->reader, record);
+  scan_put (s, data, n);
+  s->bytes_in_buf += n + 9;
+  s->bytes_packed += n + 5;
+}
+
+/* Reads what the backend has ready into a single record, of up to a
+   quarter of the buffer so that sending can start early. */
+static void
+scan_read (Scan * s)
+{
+  int i, space, record;
+
+  space = s->buf_size - s->bytes_in_buf - SCAN_MIN_SPACE + 1;
+  space -= s->record_header;
+  if (space <= 0)
+    return;
+  if (space > s->max_record)
+    space = s->max_record;
+
+  if (s->codec != SANEI_COMPRESS_NONE)
+    {
+      record = scan_fill (s, s->raw, s->max_record, 0, space);
+      if (record > 0)
+	scan_put_packed (s, record);
+    }
+  else
+    {
+      /* reserve 4 bytes to store the length of the data record, and
+	 the header of an uncompressed record of version 4 on: */
+      i = s->reader;
+      s->reader = (s->reader + 4 + s->record_header) % s->buf_size;
+      record = scan_fill (s, s->buf, s->buf_size, s->reader, space);
+      if (record > 0)
+	{
+	  i = store_reclen (s->buf, s->buf_size, i,
+			    record + s->record_header);
+	  if (s->record_header)
+	    {
+	      s->buf[i] = SANEI_COMPRESS_NONE;
+	      store_reclen (s->buf, s->buf_size, (i + 1) % s->buf_size,
+			    record);
+	    }
+	  s->reader = (s->reader + record) % s->buf_size;
+	  s->bytes_in_buf += record + 4 + s->record_header;
+	}
+      else
+	s->reader = i;		/* restore reader index */
+    }
+
+  reset_watchdog ();
+
+  if (record > 0)
     {
-      DBG (DBG_ERR, "start_scan: failed to obtain data socket (%s)\n",
-	   strerror (errno));
-      reply->status = SANE_STATUS_IO_ERROR;
-      return -1;
+      s->bytes_read += record;
+      s->records++;
     }
 
-  /* Try to bind a port between data_port_lo and data_port_hi for the data connection */
-  for (data_port = data_port_lo; data_port <= data_port_hi; data_port++)
+  if (s->status != SANE_STATUS_GOOD)
     {
-      sin.sin_port = htons(data_port);
+      s->status_dirty = 1;
+      DBG (DBG_MSG, "do_scan: status = `%s'\n", sane_strstatus (s->status));
+    }
+}
 
-      DBG(DBG_INFO, "start_scan: trying to bind data port %d\n", data_port);
+/* Sends as much of the buffer as the data connection takes, both sides
+   of the ring's wrap in one writev().  Returns -1 if the client has
+   gone away. */
+static int
+scan_write (Scan * s)
+{
+  struct iovec iov[2];
+  long int nwritten;
+  int n = 1;
 
-      ret = bind (fd, (struct sockaddr *) &sin, len);
-      if (ret == 0)
-        break;
+  iov[0].iov_base = s->buf + s->writer;
+  iov[0].iov_len = s->bytes_in_buf;
+  if (s->writer + s->bytes_in_buf > s->buf_size)
+    {
+      iov[0].iov_len = s->buf_size - s->writer;
+      iov[1].iov_base = s->buf;
+      iov[1].iov_len = s->bytes_in_buf - iov[0].iov_len;
+      n = 2;
     }
 
-  if (ret < 0)
+  DBG (DBG_INFO,
+       "do_scan: trying to write %d bytes to client\n", s->bytes_in_buf);
+  nwritten = writev (s->data_fd, iov, n);
+  DBG (DBG_INFO, "do_scan: wrote %ld bytes to client\n", nwritten);
+  if (nwritten < 0)
     {
-      DBG (DBG_ERR, "start_scan: failed to bind address (%s)\n",
-	   strerror (errno));
-      reply->status = SANE_STATUS_IO_ERROR;
+      if (errno == EAGAIN || errno == EINTR)
+	return 0;
+      DBG (DBG_ERR, "do_scan: write failed (%s)\n", strerror (errno));
       return -1;
     }
+  s->writes++;
+  s->bytes_in_buf -= nwritten;
+  s->writer = (s->writer + nwritten) % s->buf_size;
+  return 0;
+}
 
-  if (listen (fd, 1) < 0)
+/* Moves the scan along after poll() returned DATA_REVENTS for the data
+   connection and BE_REVENTS for the backend's select fd: reads another
+   record from the backend and sends what's buffered to the client.
+   Returns 0 once everything, down to the final status, has been sent
+   or the client has gone away. */
+static int
+scan_step (Scan * s, short data_revents, short be_revents)
+{
+  int did_read = 0;
+
+  if (be_revents & POLLNVAL)
     {
-      DBG (DBG_ERR, "start_scan: failed to make socket listen (%s)\n",
-	   strerror (errno));
-      reply->status = SANE_STATUS_IO_ERROR;
-      return -1;
+      /* This normally happens when a backend closes a select
+	 filedescriptor when reaching the end of file.  So
+	 pass back this status to the client: */
+      s->be_fd = -1;
+      /* only set status_dirty if EOF hasn't been already detected */
+      if (s->status == SANE_STATUS_GOOD)
+	s->status_dirty = 1;
+      s->status = SANE_STATUS_EOF;
+      DBG (DBG_INFO, "do_scan: select_fd was closed --> EOF\n");
     }
-
-  if (getsockname (fd, (struct sockaddr *) &sin, (socklen_t *) &len) < 0)
+  else if (s->status == SANE_STATUS_GOOD && (s->be_fd < 0 || be_revents)
+	   && s->buf_size - s->bytes_in_buf >= SCAN_MIN_SPACE)
     {
-      DBG (DBG_ERR, "start_scan: failed to obtain socket address (%s)\n",
-	   strerror (errno));
-      reply->status = SANE_STATUS_IO_ERROR;
-      return -1;
+      scan_read (s);
+      did_read = 1;
     }
 
-  reply->port = ntohs (sin.sin_port);
+  if (s->status_dirty && s->buf_size - s->bytes_in_buf >= 5)
+    {
+      s->status_dirty = 0;
+      s->reader = store_reclen (s->buf, s->buf_size, s->reader, 0xffffffff);
+      s->buf[s->reader] = s->status;
+      s->reader = (s->reader + 1) % s->buf_size;
+      s->bytes_in_buf += 5;
+      DBG (DBG_MSG, "do_scan: statuscode `%s' was added to buffer\n",
+	   sane_strstatus (s->status));
+    }
 
-  DBG (DBG_MSG, "start_scan: using port %d for data\n", reply->port);
+  /* Don't wait for another poll() to send what was just read; the
+     data connection is non-blocking */
+  if (s->bytes_in_buf && (data_revents || did_read))
+    {
+      if (scan_write (s) < 0)
+	{
+	  s->status = SANE_STATUS_CANCELLED;
+	  return 0;
+	}
+    }
 
-  reply->status = sane_start (be_handle);
-  if (reply->status == SANE_STATUS_GOOD)
+  /* time the backend can't be read because the client lags behind */
+  if (s->status == SANE_STATUS_GOOD
+      && s->buf_size - s->bytes_in_buf < SCAN_MIN_SPACE)
     {
-      handle[h].scanning = 1;
-      handle[h].docancel = 0;
+      if (s->full_since == 0)
+	s->full_since = stats_now ();
+    }
+  else if (s->full_since != 0)
+    {
+      s->stall_secs += stats_now () - s->full_since;
+      s->full_since = 0;
     }
 
-  return fd;
+  return s->status == SANE_STATUS_GOOD || s->bytes_in_buf > 0
+    || s->status_dirty;
 }
-#endif /* SANED_USES_AF_INDEP */
 
-static int
-store_reclen (SANE_Byte * buf, size_t buf_size, int i, size_t reclen)
+static void
+scan_done (Scan * s)
 {
-  buf[i++] = (reclen >> 24) & 0xff;
-  if (i >= (int) buf_size)
-    i = 0;
-  buf[i++] = (reclen >> 16) & 0xff;
-  if (i >= (int) buf_size)
-    i = 0;
-  buf[i++] = (reclen >> 8) & 0xff;
-  if (i >= (int) buf_size)
-    i = 0;
-  buf[i++] = (reclen >> 0) & 0xff;
-  if (i >= (int) buf_size)
-    i = 0;
-  return i;
+  struct timeval now;
+  double secs;
+
+  gettimeofday (&now, NULL);
+  secs = (now.tv_sec - s->start.tv_sec)
+    + (now.tv_usec - s->start.tv_usec) / 1000000.0;
+  if (s->full_since != 0)
+    s->stall_secs += stats_now () - s->full_since;
+  DBG (DBG_MSG, "do_scan: done, status=%s\n", sane_strstatus (s->status));
+  DBG (DBG_MSG, "do_scan: %.0f bytes in %.2f s (%.0f KB/s), "
+       "%d records, %d writes, %d byte buffer\n", s->bytes_read, secs,
+       (secs > 0) ? s->bytes_read / 1024 / secs : 0.0, s->records,
+       s->writes, s->buf_size);
+  DBG (DBG_MSG, "do_scan: %.0f ms in sane_read(), %.0f ms waiting for "
+       "the client\n", s->read_secs * 1000, s->stall_secs * 1000);
+  stats_add_scan (&total_stats, s, secs);
+  if (conn)
+    stats_add_scan (&conn->stats, s, secs);
+  if (handle[s->h].device)
+    stats_add_scan (&handle[s->h].device->stats, s, secs);
+  if (s->codec != SANEI_COMPRESS_NONE)
+    DBG (DBG_MSG, "do_scan: %s compressed to %.0f bytes (ratio %.2f) "
+	 "in %.0f ms of CPU time\n",
+	 s->codec == SANEI_COMPRESS_RLE ? "RLE" : "LZ", s->bytes_packed,
+	 (s->bytes_packed > 0) ? s->bytes_read / s->bytes_packed : 0.0,
+	 (double) s->cpu * 1000 / CLOCKS_PER_SEC);
+
+  free (s->buf);
+  free (s->raw);
+  free (s->packed);
+  s->buf = s->raw = s->packed = NULL;
+  handle[s->h].docancel = 0;
+  handle[s->h].scanning = 0;
 }
 
 static void
 do_scan (Wire * w, int h, int data_fd)
 {
-  int num_fds, be_fd = -1, reader, writer, bytes_in_buf, status_dirty = 0;
-  SANE_Handle be_handle = handle[h].handle;
-  struct timeval tv, *timeout = 0;
-  fd_set rd_set, rd_mask, wr_set, wr_mask;
-  SANE_Byte buf[8192];
-  SANE_Status status;
-  long int nwritten;
-  SANE_Int length;
-  size_t nbytes;
-  
-  DBG (3, "do_scan: start\n");
-
-  FD_ZERO (&rd_mask);
-  FD_SET (w->io.fd, &rd_mask);
-  num_fds = w->io.fd + 1;
+  struct pollfd fds[3];
+  Scan scan;
+  int running = 1, timeout;
 
-  FD_ZERO (&wr_mask);
-  FD_SET (data_fd, &wr_mask);
-  if (data_fd >= num_fds)
-    num_fds = data_fd + 1;
-
-  sane_set_io_mode (be_handle, SANE_TRUE);
-  if (sane_get_select_fd (be_handle, &be_fd) == SANE_STATUS_GOOD)
-    {
-      FD_SET (be_fd, &rd_mask);
-      if (be_fd >= num_fds)
-	num_fds = be_fd + 1;
-    }
-  else
+  if (scan_init (&scan, h, data_fd, w->version) < 0)
     {
-      memset (&tv, 0, sizeof (tv));
-      timeout = &tv;
+      sane_cancel (handle[h].handle);
+      handle[h].scanning = 0;
+      handle[h].docancel = 0;
+      return;
     }
 
-  status = SANE_STATUS_GOOD;
-  reader = writer = bytes_in_buf = 0;
+  fds[0].fd = w->io.fd;
+  fds[0].events = POLLIN;
   do
     {
-      rd_set = rd_mask;
-      wr_set = wr_mask;
-      if (select (num_fds, &rd_set, &wr_set, 0, timeout) < 0)
+      check_stats ();
+      timeout = scan_poll_fds (&scan, &fds[1], &fds[2]);
+      if (poll (fds, 3, timeout) < 0)
 	{
-	  if (be_fd >= 0 && errno == EBADF)
-	    {
-	      /* This normally happens when a backend closes a select
-		 filedescriptor when reaching the end of file.  So
-		 pass back this status to the client: */
-	      FD_CLR (be_fd, &rd_mask);
-	      be_fd = -1;
-	      /* only set status_dirty if EOF hasn't been already detected */
-	      if (status == SANE_STATUS_GOOD) 
-		status_dirty = 1; 
-	      status = SANE_STATUS_EOF;
-	      DBG (DBG_INFO, "do_scan: select_fd was closed --> EOF\n");
-	      continue;
-	    }
-	  else
-	    {
-	      status = SANE_STATUS_IO_ERROR;
-	      DBG (DBG_ERR, "do_scan: select failed (%s)\n", strerror (errno));
-	      break;
-	    }
+	  if (errno == EINTR)
+	    continue;
+	  scan.status = SANE_STATUS_IO_ERROR;
+	  DBG (DBG_ERR, "do_scan: poll failed (%s)\n", strerror (errno));
+	  break;
 	}
 
-      if (bytes_in_buf)
+      running = scan_step (&scan, fds[1].revents, fds[2].revents);
+
+      if (fds[0].revents)
 	{
-	  if (FD_ISSET (data_fd, &wr_set))
-	    {
-	      if (bytes_in_buf > 0)
-		{
-		  /* write more input data */
-		  nbytes = bytes_in_buf;
-		  if (writer + nbytes > sizeof (buf))
-		    nbytes = sizeof (buf) - writer;
-		  DBG (DBG_INFO, 
-		       "do_scan: trying to write %d bytes to client\n",
-		       nbytes);
-		  nwritten = write (data_fd, buf + writer, nbytes);
-		  DBG (DBG_INFO, 
-		       "do_scan: wrote %ld bytes to client\n", nwritten);
-		  if (nwritten < 0)
-		    {
-		      DBG (DBG_ERR, "do_scan: write failed (%s)\n",
-			   strerror (errno));
-		      status = SANE_STATUS_CANCELLED;
-		      break;
-		    }
-		  bytes_in_buf -= nwritten;
-		  writer += nwritten;
-		  if (writer == sizeof (buf))
-		    writer = 0;
-		}
-	    }
+	  DBG (DBG_MSG,
+	       "do_scan: processing RPC request on fd %d\n", w->io.fd);
+	  if (process_request (w) < 0 || handle[h].docancel)
+	    break;
 	}
-      else if (status == SANE_STATUS_GOOD
-	       && (timeout || FD_ISSET (be_fd, &rd_set)))
-	{
-	  int i;
+    }
+  while (running);
+  scan_done (&scan);
+}
 
-	  /* get more input data */
+/* sane_get_devices(), remembered for device_cache_ttl seconds in
+   multi-client mode so that every client doesn't pay for a bus scan */
+static SANE_Status
+get_devices (const SANE_Device *** device_list)
+{
+  static const SANE_Device **cached_list;
+  static time_t cached_at;
+  SANE_Status status;
+  time_t now;
 
-	  /* reserve 4 bytes to store the length of the data record: */
-	  i = reader;
-	  reader += 4;
-	  if (reader >= (int) sizeof (buf))
-	    reader -= sizeof(buf);
+  if (!multi_client)
+    return sane_get_devices (device_list, SANE_TRUE);
 
-	  assert (bytes_in_buf == 0);
-	  nbytes = sizeof (buf) - 4;
-	  if (reader + nbytes > sizeof (buf))
-	    nbytes = sizeof (buf) - reader;
+  now = time (NULL);
+  if (cached_list && now - cached_at < device_cache_ttl)
+    {
+      DBG (DBG_DBG, "get_devices: using device list from %lds ago\n",
+	   (long) (now - cached_at));
+      *device_list = cached_list;
+      return SANE_STATUS_GOOD;
+    }
 
-	  DBG (DBG_INFO,
-	       "do_scan: trying to read %d bytes from scanner\n", nbytes);
-	  status = sane_read (be_handle, buf + reader, nbytes, &length);
-	  DBG (DBG_INFO,
-	       "do_scan: read %d bytes from scanner\n", length);
+  status = sane_get_devices (device_list, SANE_TRUE);
+  cached_list = (status == SANE_STATUS_GOOD) ? *device_list : NULL;
+  cached_at = now;
+  return status;
+}
 
-	  reset_watchdog ();
+/* Accepts the data connection of a scan on the listening socket FD,
+   which is closed, and checks that it comes from the client's host.
+   Returns the non-blocking data connection, or -1. */
+static int
+accept_data_connection (int fd)
+{
+  int data_fd;
+#ifdef SANED_USES_AF_INDEP
+  struct sockaddr_storage ss;
+  char text_addr[64];
+  int len;
+  int error;
 
-	  reader += length;
-	  if (reader >= (int) sizeof (buf))
-	    reader = 0;
-	  bytes_in_buf += length + 4;
+  data_fd = accept (fd, 0, 0);
+  close (fd);
+  if (data_fd < 0)
+    {
+      DBG (DBG_ERR, "process_request: accept failed! (%s)\n",
+	   strerror (errno));
+      return -1;
+    }
 
-	  if (status != SANE_STATUS_GOOD)
-	    {
-	      reader = i;	/* restore reader index */
-	      status_dirty = 1;
-	      DBG (DBG_MSG,
-		   "do_scan: status = `%s'\n", sane_strstatus(status));
-	    }
-	  else
-	    store_reclen (buf, sizeof (buf), i, length);
-	}
+  /* Get address of remote host */
+  len = sizeof (ss);
+  if (getpeername (data_fd, (struct sockaddr *) &ss, (socklen_t *) &len) < 0)
+    {
+      DBG (DBG_ERR, "process_request: getpeername failed: %s\n",
+	   strerror (errno));
+      close (data_fd);
+      return -1;
+    }
 
-      if (status_dirty && sizeof (buf) - bytes_in_buf >= 5)
-	{
-	  status_dirty = 0;
-	  reader = store_reclen (buf, sizeof (buf), reader, 0xffffffff);
-	  buf[reader] = status;
-	  bytes_in_buf += 5;
-	  DBG (DBG_MSG, "do_scan: statuscode `%s' was added to buffer\n", 
-	       sane_strstatus(status));
-	}
+  error = getnameinfo ((struct sockaddr *) &ss, len, text_addr,
+		       sizeof (text_addr), NULL, 0, NI_NUMERICHOST);
+  if (error)
+    {
+      DBG (DBG_ERR, "process_request: getnameinfo failed: %s\n",
+	   gai_strerror (error));
+      close (data_fd);
+      return -1;
+    }
 
-      if (FD_ISSET (w->io.fd, &rd_set))
-	{
-	  DBG (DBG_MSG,
-	       "do_scan: processing RPC request on fd %d\n", w->io.fd);
-	  process_request (w);
-	  if (handle[h].docancel)
-	    break;
-	}
+  DBG (DBG_MSG, "process_request: access to data port from %s\n",
+       text_addr);
+
+  if (strcmp (text_addr, conn->remote_ip) != 0)
+    {
+      DBG (DBG_ERR, "process_request: however, only %s is authorized\n",
+	   text_addr);
+      DBG (DBG_ERR, "process_request: configuration problem or attack?\n");
+      close (data_fd);
+      return -1;
+    }
+
+#else /* !SANED_USES_AF_INDEP */
+  struct sockaddr_in sin;
+  int len;
+
+  data_fd = accept (fd, 0, 0);
+  close (fd);
+  if (data_fd < 0)
+    {
+      DBG (DBG_ERR, "process_request: accept failed! (%s)\n",
+	   strerror (errno));
+      return -1;
+    }
+
+  /* Get address of remote host */
+  len = sizeof (sin);
+  if (getpeername (data_fd, (struct sockaddr *) &sin,
+		   (socklen_t *) &len) < 0)
+    {
+      DBG (DBG_ERR, "process_request: getpeername failed: %s\n",
+	   strerror (errno));
+      close (data_fd);
+      return -1;
+    }
+
+  if (memcmp (&conn->remote_address, &sin.sin_addr,
+	      sizeof (conn->remote_address)) != 0)
+    {
+      DBG (DBG_ERR,
+	   "process_request: access to data port from %s\n",
+	   inet_ntoa (sin.sin_addr));
+      DBG (DBG_ERR,
+	   "process_request: however, only %s is authorized\n",
+	   inet_ntoa (conn->remote_address));
+      DBG (DBG_ERR,
+	   "process_request: configuration problem or attack?\n");
+      close (data_fd);
+      return -1;
     }
-  while (status == SANE_STATUS_GOOD || bytes_in_buf > 0 || status_dirty);
-  DBG (DBG_MSG, "do_scan: done, status=%s\n", sane_strstatus (status));
-  handle[h].docancel = 0;
-  handle[h].scanning = 0;
+  else
+    DBG (DBG_MSG, "process_request: access to data port from %s\n",
+	 inet_ntoa (sin.sin_addr));
+#endif /* SANED_USES_AF_INDEP */
+
+  fcntl (data_fd, F_SETFL, O_NONBLOCK);
+  shutdown (data_fd, 0);
+  return data_fd;
 }
 
 static int
-process_request (Wire * w)
+dispatch_request (Wire * w)
 {
   SANE_Handle be_handle;
   SANE_Word h, word;
@@ -1823,6 +2631,7 @@ process_request (Wire * w)
     }
 
   current_request = word;
+  request_start = stats_now ();
 
   DBG (DBG_MSG, "process_request: got request %d\n", current_request);
 
@@ -1833,8 +2642,7 @@ process_request (Wire * w)
 	SANE_Get_Devices_Reply reply;
 
 	reply.status =
-	  sane_get_devices ((const SANE_Device ***) &reply.device_list,
-			    SANE_TRUE);
+	  get_devices ((const SANE_Device ***) &reply.device_list);
 	sanei_w_reply (w, (WireCodecFunc) sanei_w_get_devices_reply, &reply);
       }
       break;
@@ -1844,6 +2652,8 @@ process_request (Wire * w)
 	SANE_Open_Reply reply;
 	SANE_Handle be_handle;
 	SANE_String name, resource;
+	SANE_String_Const dev_name;
+	double open_secs = -1;
 
 	sanei_w_string (w, &name);
 	if (w->status)
@@ -1864,6 +2674,8 @@ process_request (Wire * w)
 
 	can_authorize = 1;
 
+	h = -1;
+	dev_name = name;
 	resource = strdup (name);
 	
 	if (strlen(resource) == 0) {
@@ -1873,7 +2685,7 @@ process_request (Wire * w)
 	  DBG(DBG_DBG, "process_request: (open) strlen(resource) == 0\n");
 	  free (resource);
 
-	  if ((i = sane_get_devices (&device_list, SANE_TRUE)) != 
+	  if ((i = get_devices (&device_list)) != 
 	      SANE_STATUS_GOOD) 
 	    {
 	      DBG(DBG_ERR, "process_request: (open) sane_get_devices failed\n");
@@ -1893,6 +2705,7 @@ process_request (Wire * w)
 	    }
 
 	  resource = strdup (device_list[0]->name);
+	  dev_name = device_list[0]->name;
 	}
 
 	if (strchr (resource, ':'))
@@ -1913,12 +2726,19 @@ process_request (Wire * w)
 		 resource);
 	    free (resource);
 	    memset (&reply, 0, sizeof (reply));	/* avoid leaking bits */
-	    reply.status = sane_open (name, &be_handle);
-	    DBG (DBG_MSG, "process_request: sane_open returned: %s\n", 
-		 sane_strstatus (reply.status));
+	    if (multi_client && handle_idle_time > 0)
+	      h = reuse_handle (dev_name);
+	    if (h < 0)
+	      {
+		open_secs = stats_now ();
+		reply.status = sane_open (name, &be_handle);
+		open_secs = stats_now () - open_secs;
+		DBG (DBG_MSG, "process_request: sane_open returned: %s\n", 
+		     sane_strstatus (reply.status));
+	      }
 	  }
 
-	if (reply.status == SANE_STATUS_GOOD)
+	if (reply.status == SANE_STATUS_GOOD && h < 0)
 	  {
 	    h = get_free_handle ();
 	    if (h < 0)
@@ -1926,9 +2746,27 @@ process_request (Wire * w)
 	    else
 	      {
 		handle[h].handle = be_handle;
-		reply.handle = h;
+		handle[h].device = stats_device (dev_name);
+		if (multi_client && handle_idle_time > 0 && conn->remote_ip
+		    && strcmp (conn->remote_ip, "[error]") != 0)
+		  {
+		    handle[h].name = strdup (dev_name);
+		    handle[h].client = strdup (conn->remote_ip);
+		  }
 	      }
 	  }
+	if (open_secs >= 0)
+	  stats_add_call (reply.status == SANE_STATUS_GOOD ? h : -1, 0,
+			  open_secs);
+	if (reply.status == SANE_STATUS_GOOD)
+	  {
+	    handle[h].owner = conn;
+	    reply.handle = h;
+	    if (w->version >= SANEI_NET_PROTOCOL_BATCH)
+	      update_descriptors (h);
+	    if (w->version >= SANEI_NET_PROTOCOL_DELTA)
+	      digest_descriptors (h);
+	  }
 
 	can_authorize = 0;
 
@@ -1942,7 +2780,7 @@ process_request (Wire * w)
 	SANE_Word ack = 0;
 
 	h = decode_handle (w, "close");
-	close_handle (h);
+	park_handle (h);
 	sanei_w_reply (w, (WireCodecFunc) sanei_w_word, &ack);
       }
       break;
@@ -1965,6 +2803,9 @@ process_request (Wire * w)
 
 	sanei_w_reply (w,(WireCodecFunc) sanei_w_option_descriptor_array,
 		       &opt);
+	if (w->version >= SANEI_NET_PROTOCOL_BATCH
+	    && update_descriptors (h) == SANE_STATUS_GOOD)
+	  handle[h].client_version = handle[h].desc_version;
 
 	free (opt.desc);
       }
@@ -1977,7 +2818,7 @@ process_request (Wire * w)
 
 	sanei_w_control_option_req (w, &req);
 	if (w->status || (unsigned) req.handle >= (unsigned) num_handles
-	    || !handle[req.handle].inuse)
+	    || !handle[req.handle].inuse || handle[req.handle].owner != conn)
 	  {
 	    DBG (DBG_ERR,
 		 "process_request: (control_option) "
@@ -2005,6 +2846,140 @@ process_request (Wire * w)
       }
       break;
 
+    case SANE_NET_CONTROL_OPTIONS:
+      {
+	SANE_Control_Options_Req req;
+	SANE_Control_Options_Reply reply;
+	SANE_Control_Option_Req *r;
+	SANE_Control_Option_Reply *rr;
+	SANE_Word reload = 0;
+	Handle *hp;
+
+	memset (&req, 0, sizeof (req));
+	sanei_w_control_options_req (w, &req);
+	if (w->status || w->version < SANEI_NET_PROTOCOL_BATCH
+	    || (unsigned) req.handle >= (unsigned) num_handles
+	    || !handle[req.handle].inuse || handle[req.handle].owner != conn)
+	  {
+	    DBG (DBG_ERR,
+		 "process_request: (control_options) "
+		 "error while decoding args h=%d (%s)\n"
+		 , req.handle, strerror (w->status));
+	    return 1;
+	  }
+
+	memset (&reply, 0, sizeof (reply));	/* avoid leaking bits */
+	if (req.num_requests > 0)
+	  {
+	    reply.replies = calloc (req.num_requests, sizeof (*rr));
+	    if (!reply.replies)
+	      {
+		DBG (DBG_ERR, "process_request: (control_options) "
+		     "not enough memory for %d replies\n", req.num_requests);
+		sanei_w_free (w, (WireCodecFunc) sanei_w_control_options_req,
+			      &req);
+		return 1;
+	      }
+	  }
+	reply.num_replies = req.num_requests;
+
+	can_authorize = 1;
+
+	be_handle = handle[req.handle].handle;
+	for (i = 0; i < req.num_requests; ++i)
+	  {
+	    r = req.requests + i;
+	    rr = reply.replies + i;
+	    rr->status = sane_control_option (be_handle, r->option,
+					      r->action, r->value, &rr->info);
+	    if (rr->status == SANE_STATUS_GOOD)
+	      reload |= rr->info & SANE_INFO_RELOAD_OPTIONS;
+	    rr->value_type = r->value_type;
+	    rr->value_size = r->value_size;
+	    rr->value = r->value;
+	  }
+
+	can_authorize = 0;
+
+	sane_control_option (be_handle, 0, SANE_ACTION_GET_VALUE,
+			     &reply.num_options, 0);
+	if (reload)
+	  {
+	    /* the descriptors that changed since the client got them, or
+	       -1 options to have it fetch them all */
+	    hp = handle + req.handle;
+	    if (update_descriptors (req.handle) == SANE_STATUS_GOOD)
+	      reply.changes = descriptor_changes (req.handle,
+						  hp->client_version,
+						  &reply.num_changes);
+	    if (reply.num_options != hp->num_desc
+		|| (!reply.changes && hp->num_desc > 0))
+	      reply.num_options = -1;
+	    else
+	      hp->client_version = hp->desc_version;
+	  }
+
+	sanei_w_reply (w, (WireCodecFunc) sanei_w_control_options_reply,
+		       &reply);
+	free (reply.changes);
+	free (reply.replies);
+	sanei_w_free (w, (WireCodecFunc) sanei_w_control_options_req, &req);
+      }
+      break;
+
+    case SANE_NET_GET_OPTION_CHANGES:
+      {
+	SANE_Get_Option_Changes_Req req;
+	SANE_Get_Option_Changes_Reply reply;
+	SANE_Word since = 0;
+	Handle *hp;
+
+	memset (&req, 0, sizeof (req));
+	sanei_w_get_option_changes_req (w, &req);
+	if (w->status || w->version < SANEI_NET_PROTOCOL_DELTA
+	    || (unsigned) req.handle >= (unsigned) num_handles
+	    || !handle[req.handle].inuse || handle[req.handle].owner != conn)
+	  {
+	    DBG (DBG_ERR,
+		 "process_request: (get_option_changes) "
+		 "error while decoding args h=%d (%s)\n"
+		 , req.handle, strerror (w->status));
+	    return 1;
+	  }
+	hp = handle + req.handle;
+
+	/* changes since the version the client has, since the handle was
+	   opened if it cached the descriptors it had then, or all */
+	memset (&reply, 0, sizeof (reply));
+	reply.status = update_descriptors (req.handle);
+	if (req.version > 0 && req.version <= hp->desc_version)
+	  since = req.version;
+	else if (req.version == 0 && req.digest && hp->digest[0]
+		 && strcmp (req.digest, hp->digest) == 0)
+	  since = 1;
+	if (reply.status == SANE_STATUS_GOOD)
+	  {
+	    reply.changes = descriptor_changes (req.handle, since,
+						&reply.num_changes);
+	    if (!reply.changes && hp->num_desc > 0)
+	      reply.status = SANE_STATUS_NO_MEM;
+	  }
+	if (reply.status == SANE_STATUS_GOOD)
+	  {
+	    reply.version = hp->desc_version;
+	    reply.digest = hp->digest;
+	    reply.num_options = hp->num_desc;
+	    hp->client_version = hp->desc_version;
+	  }
+
+	sanei_w_reply (w, (WireCodecFunc) sanei_w_get_option_changes_reply,
+		       &reply);
+	free (reply.changes);
+	sanei_w_free (w, (WireCodecFunc) sanei_w_get_option_changes_req,
+		      &req);
+      }
+      break;
+
     case SANE_NET_GET_PARAMETERS:
       {
 	SANE_Get_Parameters_Reply reply;
@@ -2032,111 +3007,43 @@ process_request (Wire * w)
 
 	memset (&reply, 0, sizeof (reply));	/* avoid leaking bits */
 	reply.byte_order = SANE_NET_LITTLE_ENDIAN;
-	if (byte_order.w != 1)
-	  reply.byte_order = SANE_NET_BIG_ENDIAN;
-
-	if (handle[h].scanning)
-	  reply.status = SANE_STATUS_DEVICE_BUSY;
-	else
-	  fd = start_scan (w, h, &reply);
-
-	sanei_w_reply (w, (WireCodecFunc) sanei_w_start_reply, &reply);
-
-#ifdef SANED_USES_AF_INDEP
-	if (reply.status == SANE_STATUS_GOOD)
-	  {
-	    struct sockaddr_storage ss;
-	    char text_addr[64];
-	    int len;
-	    int error;
-
-	    DBG (DBG_MSG, "process_request: waiting for data connection\n");
-	    data_fd = accept (fd, 0, 0);
-	    close (fd);
-
-	    /* Get address of remote host */
-	    len = sizeof (ss);
-	    if (getpeername (data_fd, (struct sockaddr *) &ss, (socklen_t *) &len) < 0)
-	      {
-		DBG (DBG_ERR, "process_request: getpeername failed: %s\n",
-		     strerror (errno));
-		return 1;
-	      }
-
-	    error = getnameinfo ((struct sockaddr *) &ss, len, text_addr,
-				 sizeof (text_addr), NULL, 0, NI_NUMERICHOST);
-	    if (error)
-	      {
-		DBG (DBG_ERR, "process_request: getnameinfo failed: %s\n",
-		     gai_strerror (error));
-		return 1;
-	      }
+	if (byte_order.w != 1)
+	  reply.byte_order = SANE_NET_BIG_ENDIAN;
 
-	    DBG (DBG_MSG, "process_request: access to data port from %s\n",
-		 text_addr);
-	    
-	    if (strcmp (text_addr, remote_ip) != 0)
-	      {
-		DBG (DBG_ERR, "process_request: however, only %s is authorized\n",
-		     text_addr);
-		DBG (DBG_ERR, "process_request: configuration problem or attack?\n");
-		close (data_fd);
-		data_fd = -1;
-		return -1;
-	      }
+	/* In multi-client mode, one scan at a time per connection */
+	if (handle[h].scanning
+	    || (multi_client && (conn->scan || conn->data_listen_fd >= 0)))
+	  reply.status = SANE_STATUS_DEVICE_BUSY;
+	else
+	  fd = start_scan (w, h, &reply);
 
-#else /* !SANED_USES_AF_INDEP */
+	sanei_w_reply (w, (WireCodecFunc) sanei_w_start_reply, &reply);
+	/* the scan isn't part of the request */
+	stats_request_done ();
 
-	if (reply.status == SANE_STATUS_GOOD)
+	if (reply.status != SANE_STATUS_GOOD)
+	  {
+	    if (fd >= 0)
+	      close (fd);
+	  }
+	else if (multi_client)
+	  {
+	    /* run_multi_client() accepts the data connection when it
+	       comes in, and runs the scan along with everything else */
+	    conn->data_listen_fd = fd;
+	    conn->data_h = h;
+	  }
+	else
 	  {
-	    struct sockaddr_in sin;
-	    int len;
-
 	    DBG (DBG_MSG, "process_request: waiting for data connection\n");
-	    data_fd = accept (fd, 0, 0);
-	    close (fd);
-
-	    /* Get address of remote host */
-	    len = sizeof (sin);
-	    if (getpeername (data_fd, (struct sockaddr *) &sin, 
-			     (socklen_t *) &len) < 0)
-	      {
-		DBG (DBG_ERR, "process_request: getpeername failed: %s\n",
-		     strerror (errno));
-		return 1;
-	      }
-
-	    if (memcmp (&remote_address, &sin.sin_addr,
-			sizeof (remote_address)) != 0)
-	      {
-		DBG (DBG_ERR, 
-		     "process_request: access to data port from %s\n",
-		     inet_ntoa (sin.sin_addr));
-		DBG (DBG_ERR, 
-		     "process_request: however, only %s is authorized\n",
-		     inet_ntoa (remote_address));
-		DBG (DBG_ERR, 
-		     "process_request: configuration problem or attack?\n");
-		close (data_fd);
-		data_fd = -1;
-		return -1;
-	      }
-	    else
-	      DBG (DBG_MSG, "process_request: access to data port from %s\n",
-		   inet_ntoa (sin.sin_addr));
-#endif /* SANED_USES_AF_INDEP */
-
+	    data_fd = accept_data_connection (fd);
 	    if (data_fd < 0)
 	      {
 		sane_cancel (handle[h].handle);
 		handle[h].scanning = 0;
 		handle[h].docancel = 0;
-		DBG (DBG_ERR, "process_request: accept failed! (%s)\n",
-		     strerror (errno));
-		return 1;
+		return -1;
 	      }
-	    fcntl (data_fd, F_SETFL, 1);      /* set non-blocking */
-	    shutdown (data_fd, 0);
 	    do_scan (w, h, data_fd);
 	    close (data_fd);
 	  }
@@ -2173,6 +3080,22 @@ process_request (Wire * w)
   return 0;
 }
 
+/* Serves one request.  Everything decoded for it comes from the wire's
+   arena and goes away in one piece when the reply is out, whichever
+   way the request ended. */
+static int
+process_request (Wire * w)
+{
+  int ret;
+
+  sanei_w_arena_begin (w);
+  ret = dispatch_request (w);
+  sanei_w_arena_end (w);
+  stats_request_done ();
+  check_stats ();
+  return ret;
+}
+
 
 static int
 wait_child (pid_t pid, int *status, int options)
@@ -2238,21 +3161,12 @@ add_child (pid_t pid)
 
 
 static void
-handle_connection (int fd)
+set_nodelay (int fd)
 {
 #ifdef TCP_NODELAY
   int on = 1;
   int level = -1;
-#endif
 
-  DBG (DBG_DBG, "handle_connection: processing client connection\n");
-
-  wire.io.fd = fd;
-
-  signal (SIGALRM, quit);
-  signal (SIGPIPE, quit);
-
-#ifdef TCP_NODELAY
 # ifdef SOL_TCP
   level = SOL_TCP;
 # else /* !SOL_TCP */
@@ -2269,20 +3183,77 @@ handle_connection (int fd)
   }
 # endif	/* SOL_TCP */
   if (level == -1
-      || setsockopt (wire.io.fd, level, TCP_NODELAY, &on, sizeof (on)))
+      || setsockopt (fd, level, TCP_NODELAY, &on, sizeof (on)))
     DBG (DBG_WARN, "handle_connection: failed to put socket in TCP_NODELAY mode (%s)",
 	 strerror (errno));
+#else
+  fd = fd;
 #endif /* !TCP_NODELAY */
+}
+
+static Connection *
+new_connection (int fd)
+{
+  Connection *c;
+
+  c = calloc (1, sizeof (Connection));
+  if (c == NULL)
+    {
+      DBG (DBG_ERR, "new_connection: out of memory\n");
+      return NULL;
+    }
+
+  sanei_w_init (&c->wire, sanei_codec_bin_init);
+  if (c->wire.status)
+    {
+      free (c);
+      return NULL;
+    }
+  c->wire.io.fd = fd;
+  c->wire.io.read = read;
+  c->wire.io.write = write;
+  c->data_listen_fd = -1;
+  c->last_request = time (NULL);
+  c->connected = c->last_request;
+  c->session = ++num_sessions;
+  return c;
+}
+
+static void
+free_connection (Connection * c)
+{
+  sanei_w_exit (&c->wire);
+  if (c->remote_ip)
+    free (c->remote_ip);
+  if (c->username)
+    free (c->username);
+  free (c);
+}
+
+static void
+handle_connection (int fd)
+{
+  DBG (DBG_DBG, "handle_connection: processing client connection\n");
+
+  conn = new_connection (fd);
+  if (conn == NULL)
+    return;
+
+  signal (SIGALRM, quit);
+  signal (SIGPIPE, quit);
+
+  set_nodelay (fd);
 
-  if (init (&wire) < 0)
+  if (init (&conn->wire) < 0)
     return;
 
   while (1)
     {
       reset_watchdog ();
-      if (process_request (&wire) < 0)
+      if (process_request (&conn->wire) < 0)
 	break;
     }  
+  stats_session_ended (conn);
 }
 
 static void
@@ -2697,6 +3668,78 @@ read_config (void)
                   DBG (DBG_INFO, "read_config: data port range: %d - %d\n", data_port_lo, data_port_hi);
                 }
             }
+          else if (strstr (config_line, "multi_client") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              multi_client = (strncmp (optval, "yes", 3) == 0);
+              DBG (DBG_INFO, "read_config: multi-client mode %s\n",
+                   multi_client ? "enabled" : "disabled");
+            }
+          else if (strstr (config_line, "compression") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              compression = (strncmp (optval, "yes", 3) == 0);
+              DBG (DBG_INFO, "read_config: compression %s\n",
+                   compression ? "enabled" : "disabled");
+            }
+          else if (strstr (config_line, "device_cache_ttl") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              val = strtol (optval, &endval, 10);
+              if ((optval == endval) || (val < 0))
+                {
+                  DBG (DBG_ERR, "read_config: invalid value for device_cache_ttl\n");
+                  continue;
+                }
+              device_cache_ttl = val;
+              DBG (DBG_INFO, "read_config: device list cached for %d s\n",
+                   device_cache_ttl);
+            }
+          else if (strstr (config_line, "stats_file") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              if (*optval == '\0')
+                continue;
+              free (stats_file);
+              stats_file = strdup (optval);
+              DBG (DBG_INFO, "read_config: statistics go to %s\n", optval);
+            }
+          else if (strstr (config_line, "handle_idle_time") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              val = strtol (optval, &endval, 10);
+              if ((optval == endval) || (val < 0))
+                {
+                  DBG (DBG_ERR, "read_config: invalid value for handle_idle_time\n");
+                  continue;
+                }
+              handle_idle_time = val;
+              DBG (DBG_INFO, "read_config: closed handles kept open for %d s\n",
+                   handle_idle_time);
+            }
+          else if (strstr (config_line, "data_buffer_size") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              val = strtol (optval, &endval, 10);
+              if ((optval == endval) || (val <= 0))
+                {
+                  DBG (DBG_ERR, "read_config: invalid value for data_buffer_size\n");
+                  continue;
+                }
+              if (*endval == 'k' || *endval == 'K')
+                val *= 1024;
+              else if (*endval == 'm' || *endval == 'M')
+                val *= 1024 * 1024;
+              if (val < SANED_MIN_DATA_BUFFER || val > 256 * 1024 * 1024)
+                {
+                  DBG (DBG_ERR, "read_config: data_buffer_size must be "
+                       "between 8k and 256M\n");
+                  continue;
+                }
+              data_buffer_size = val;
+              DBG (DBG_INFO, "read_config: data buffer is %d bytes\n",
+                   data_buffer_size);
+            }
         }
       fclose (fp);
       DBG (DBG_INFO, "read_config: done reading config\n");
@@ -2771,7 +3814,7 @@ do_bindings_family (int family, int *nfds, struct pollfd **fds, struct addrinfo
 	}
 
       DBG (DBG_DBG, "do_bindings: [%d] listen ()\n", i);
-      if (listen (fd, 1) < 0)
+      if (listen (fd, SOMAXCONN) < 0)
 	{
 	  DBG (DBG_ERR, "do_bindings: [%d] listen failed: %s\n", i, strerror (errno));
 
@@ -2909,7 +3952,7 @@ do_bindings (int *nfds, struct pollfd **fds)
     }
 
   DBG (DBG_DBG, "do_bindings: listen ()\n");
-  if (listen (fd, 1) < 0)
+  if (listen (fd, SOMAXCONN) < 0)
     {
       DBG (DBG_ERR, "do_bindings: listen failed: %s", strerror (errno));
       bail_out (1);
@@ -2922,6 +3965,347 @@ do_bindings (int *nfds, struct pollfd **fds)
 #endif /* SANED_USES_AF_INDEP */
 
 
+/* Multi-client mode */
+
+static void
+end_scan (Connection * c)
+{
+  close (c->scan->data_fd);
+  scan_done (c->scan);
+  free (c->scan);
+  c->scan = NULL;
+}
+
+/* A new control connection waits for its SANE_NET_INIT request like
+   any other one, so that a client that is slow to send it can't hold
+   up the others */
+static void
+add_connection (int fd)
+{
+  struct timeval tv;
+
+  DBG (DBG_DBG, "add_connection: new client connection on fd %d\n", fd);
+
+  conn = new_connection (fd);
+  if (conn == NULL)
+    {
+      close (fd);
+      return;
+    }
+
+  set_nodelay (fd);
+
+  tv.tv_sec = SANED_RECV_TIMEOUT;
+  tv.tv_usec = 0;
+  if (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0)
+    DBG (DBG_WARN, "add_connection: failed to set receive timeout (%s)\n",
+	 strerror (errno));
+
+  conn->next = connections;
+  connections = conn;
+  conn = NULL;
+}
+
+/* Whether all of C's SANE_NET_INIT request has come in, so that init()
+   reads it without waiting: 1 if it has (or C sent something else,
+   which init() rejects), 0 if not yet, -1 if C closed the connection */
+static int
+init_request_arrived (Connection * c)
+{
+  u_char buf[SANED_MAX_INIT_REQUEST];
+  u_long word[3];
+  ssize_t n;
+  int i;
+
+  n = recv (c->wire.io.fd, buf, sizeof (buf), MSG_PEEK);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    return 0;
+  if (n <= 0)
+    return -1;
+
+  /* procedure number, version code, then the user name as length and
+     bytes; the words are big endian */
+  for (i = 0; i < 3 && n >= 4 * (i + 1); ++i)
+    word[i] = ((u_long) buf[4 * i] << 24) | (buf[4 * i + 1] << 16)
+      | (buf[4 * i + 2] << 8) | buf[4 * i + 3];
+  if (i > 0 && word[0] != SANE_NET_INIT)
+    return 1;
+  if (i < 3)
+    return 0;
+  if (word[2] > sizeof (buf) - 12)
+    {
+      DBG (DBG_ERR, "init_request_arrived: user name of %lu bytes\n",
+	   word[2]);
+      return -1;
+    }
+  return (u_long) n >= 12 + word[2];
+}
+
+/* Closes connection C and whatever handles it left open */
+static void
+drop_connection (Connection * c)
+{
+  Connection **p;
+  int h;
+
+  DBG (DBG_MSG, "drop_connection: closing connection from %s\n",
+       c->remote_ip ? c->remote_ip : "a new client");
+
+  if (c->scan)
+    end_scan (c);
+  if (c->data_listen_fd >= 0)
+    {
+      close (c->data_listen_fd);
+      c->data_listen_fd = -1;
+    }
+
+  for (h = 0; h < num_handles; ++h)
+    if (handle[h].inuse && handle[h].owner == c)
+      {
+	/* not every backend cancels in sane_close(), and the backend
+	   outlives this connection */
+	sane_cancel (handle[h].handle);
+	handle[h].scanning = 0;
+	close_handle (h);
+      }
+
+  for (p = &connections; *p; p = &(*p)->next)
+    if (*p == c)
+      {
+	*p = c->next;
+	break;
+      }
+
+  if (c->initialized)
+    stats_session_ended (c);
+  close (c->wire.io.fd);
+  free_connection (c);
+}
+
+/* Handles what poll() reported on connection C: the data connection
+   coming in, progress of a scan, and a request on the control
+   connection.  PFD is what run_multi_client() polled for C.  Returns -1
+   if C should be dropped. */
+static int
+serve_connection (Connection * c, struct pollfd *pfd)
+{
+  Handle *hp;
+  int data_fd, ret;
+
+  if (!c->initialized)
+    {
+      if (!pfd[0].revents && !c->init_partial)
+	return 0;
+      ret = init_request_arrived (c);
+      c->init_partial = ret == 0;
+      if (ret <= 0)
+	return ret;
+      if (init (&c->wire) < 0)
+	return -1;
+      c->initialized = 1;
+      return 0;
+    }
+
+  if (c->scan)
+    {
+      if (!scan_step (c->scan, pfd[1].revents, pfd[2].revents))
+	end_scan (c);
+    }
+  else if (c->data_listen_fd >= 0 && pfd[1].revents)
+    {
+      hp = &handle[c->data_h];
+      data_fd = accept_data_connection (c->data_listen_fd);
+      c->data_listen_fd = -1;
+      if (data_fd >= 0)
+	{
+	  c->scan = malloc (sizeof (Scan));
+	  if (c->scan == NULL
+	      || scan_init (c->scan, c->data_h, data_fd, c->wire.version) < 0)
+	    {
+	      DBG (DBG_ERR, "serve_connection: out of memory\n");
+	      if (c->scan)
+		free (c->scan);
+	      c->scan = NULL;
+	      close (data_fd);
+	    }
+	}
+      if (c->scan == NULL)
+	{
+	  sane_cancel (hp->handle);
+	  hp->scanning = 0;
+	  hp->docancel = 0;
+	  return -1;
+	}
+    }
+
+  if (pfd[0].revents)
+    {
+      DBG (DBG_MSG,
+	   "serve_connection: processing RPC request on fd %d\n", pfd[0].fd);
+      reset_watchdog ();
+      if (process_request (&c->wire) < 0)
+	return -1;
+
+      /* A cancel or close ends the handle's scan */
+      if (c->scan)
+	{
+	  hp = &handle[c->scan->h];
+	  if (!hp->inuse || hp->docancel)
+	    end_scan (c);
+	}
+      else if (c->data_listen_fd >= 0)
+	{
+	  hp = &handle[c->data_h];
+	  if (!hp->inuse || hp->docancel)
+	    {
+	      close (c->data_listen_fd);
+	      c->data_listen_fd = -1;
+	      hp->scanning = 0;
+	      hp->docancel = 0;
+	    }
+	}
+    }
+  return 0;
+}
+
+/* Serves every client from this process: one poll() over the listening
+   sockets, the control and data connections of all clients and the
+   select fds of the backends that are scanning.  Backends are
+   initialized by the first client, and stay so.  Backend calls and
+   RPCs other than the image data still block, so they are served one
+   at a time. */
+static void
+run_multi_client (struct pollfd **fds, int *nfds)
+{
+  struct pollfd *pfds = NULL;
+  struct pollfd *fdp;
+  Connection *c, *next;
+  int max_pfds = 0, npfds;
+  int timeout, ret, fd, i;
+  time_t now;
+
+  signal (SIGPIPE, SIG_IGN);
+
+  DBG (DBG_MSG, "run_multi_client: waiting for control connections\n");
+
+  while (1)
+    {
+      check_stats ();
+      check_reload ();
+
+      /* The listening sockets, then three entries per connection:
+	 control connection, data connection (or the socket it will
+	 come in on), backend select fd */
+      npfds = *nfds;
+      for (c = connections; c; c = c->next)
+	npfds += 3;
+      if (npfds > max_pfds)
+	{
+	  max_pfds = npfds + 3 * 8;
+	  fdp = realloc (pfds, max_pfds * sizeof (struct pollfd));
+	  if (fdp == NULL)
+	    {
+	      DBG (DBG_ERR, "run_multi_client: not enough memory for fds\n");
+	      bail_out (1);
+	    }
+	  pfds = fdp;
+	}
+      memcpy (pfds, *fds, *nfds * sizeof (struct pollfd));
+
+      timeout = 500;
+      for (c = connections, fdp = pfds + *nfds; c; c = c->next, fdp += 3)
+	{
+	  fdp[0].fd = c->wire.io.fd;
+	  fdp[0].events = POLLIN;
+	  if (c->init_partial)
+	    {
+	      /* stays readable: look again in a while */
+	      fdp[0].fd = -1;
+	      if (timeout > SANED_INIT_POLL_MS)
+		timeout = SANED_INIT_POLL_MS;
+	    }
+	  if (c->scan)
+	    {
+	      if (scan_poll_fds (c->scan, &fdp[1], &fdp[2]) == 0)
+		timeout = 0;
+	    }
+	  else
+	    {
+	      fdp[1].fd = c->data_listen_fd;
+	      fdp[1].events = POLLIN;
+	      fdp[2].fd = -1;
+	      fdp[2].events = 0;
+	    }
+	}
+
+      ret = poll (pfds, npfds, timeout);
+      if (ret < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  DBG (DBG_ERR, "run_multi_client: poll failed: %s\n",
+	       strerror (errno));
+	  bail_out (1);
+	}
+
+      /* Wait for children */
+      while (wait_child (-1, NULL, WNOHANG) > 0)
+	;
+
+      now = time (NULL);
+      for (c = connections, fdp = pfds + *nfds; c; c = next, fdp += 3)
+	{
+	  next = c->next;
+	  conn = c;
+	  if (serve_connection (c, fdp) < 0)
+	    drop_connection (c);
+	  else if (!c->scan
+		   && now - c->last_request > (c->initialized
+					       ? SANED_IDLE_TIMEOUT
+					       : SANED_RECV_TIMEOUT))
+	    {
+	      DBG (DBG_WARN, "run_multi_client: %s has been idle for too long\n",
+		   c->remote_ip ? c->remote_ip : "a new client");
+	      drop_connection (c);
+	    }
+	}
+      conn = NULL;
+      if (handle_idle_time > 0)
+	expire_handles (now);
+
+      for (i = 0, fdp = pfds; i < *nfds; i++, fdp++)
+	{
+	  /* Error on an fd */
+	  if (fdp->revents & (POLLERR | POLLHUP | POLLNVAL))
+	    {
+	      for (i = 0, fdp = *fds; i < *nfds; i++, fdp++)
+		close (fdp->fd);
+
+	      free (*fds);
+
+	      DBG (DBG_WARN, "run_multi_client: invalid fd in set, attempting to re-bind\n");
+
+	      /* Reopen sockets */
+	      do_bindings (nfds, fds);
+
+	      break;
+	    }
+	  else if (! (fdp->revents & POLLIN))
+	    continue;
+
+	  fd = accept (fdp->fd, 0, 0);
+	  if (fd < 0)
+	    {
+	      DBG (DBG_ERR, "run_multi_client: accept failed: %s", strerror (errno));
+	      continue;
+	    }
+
+	  add_connection (fd);
+	}
+    }
+}
+
+
 static void
 run_standalone (int argc, char **argv)
 {
@@ -3095,10 +4479,24 @@ run_standalone (int argc, char **argv)
   /* NOT REACHED (Avahi process) */
 #endif /* WITH_AVAHI */
 
+  /* Compile the access list once; the processes serving connections
+     inherit it */
+  load_host_rules ();
+  signal (SIGHUP, sig_hup_handler);
+
+  if (multi_client)
+    {
+      run_multi_client (&fds, &nfds);
+
+      /* NOT REACHED */
+    }
+
   DBG (DBG_MSG, "run_standalone: waiting for control connection\n");
 
   while (1)
     {
+      check_stats ();
+      check_reload ();
       ret = poll (fds, nfds, 500);
       if (ret < 0)
 	{
@@ -3238,6 +4636,12 @@ run_inetd (int argc, char **argv)
 
       close (dave_null);
     }
+  if (multi_client)
+    {
+      DBG (DBG_WARN, "run_inetd: multi_client is only supported in standalone mode\n");
+      multi_client = SANE_FALSE;
+    }
+
 #ifndef HAVE_OS2_H
   /* Unused in this function */
   argc = argc;
@@ -3299,14 +4703,11 @@ main (int argc, char *argv[])
     openlog ("saned", LOG_PID | LOG_CONS, LOG_DAEMON);
 
   read_config ();
+  signal (SIGUSR1, sig_usr1_handler);
 
   byte_order.w = 0;
   byte_order.ch = 1;
 
-  sanei_w_init (&wire, sanei_codec_bin_init);
-  wire.io.read = read;
-  wire.io.write = write;
-
 #ifdef SANED_USES_AF_INDEP
   strcat(options, "AF-indep");
 # ifdef ENABLE_IPV6
@@ -2,16 +2,93 @@
 #ifndef NACL_JSCALL_H__
 #define NACL_JSCALL_H__
 
+#include <stdint.h>
+
 #include <map>
 #include <string>
+#include <tr1/memory>
+#include <vector>
 
 #include <pthread.h>
 
 #include "ppapi/cpp/completion_callback.h"
 #include "ppapi/cpp/instance.h"
+#include "ppapi/cpp/var_array_buffer.h"
 
 namespace scanley {
 
+// Requests and replies travel between the module and the page as frames in a
+// pp::VarArrayBuffer; one buffer may carry any number of frames back to back.
+// Each frame is a 12 byte little endian header followed by raw payload:
+//
+//   uint32 id       request id; a reply carries the id of its request
+//   uint16 opcode   what to do (requests); echoed back in replies
+//   uint16 status   0 on success (replies); 0 in requests
+//   uint32 length   number of payload bytes following the header
+const size_t kJSFrameHeaderBytes = 12;
+
+enum JSOpcode {
+  kJSOpText = 0,  // payload is a text command, e.g. "USB:FIND_DEVICES"
+  kJSOpImageParams = 1,  // image streaming, see sane/nacl_stream.h
+  kJSOpImageData = 2,
+  // 0x100 and up: USB requests, see sane/nacl_usb.h
+};
+
+// Status a cancelled call completes with; never sent on the wire.
+const uint16_t kJSStatusCancelled = 0xffff;
+
+// Most bytes of fixed parameters a binary request can carry ahead of its
+// payload (see CallAsync()).
+const size_t kJSMaxParamBytes = 32;
+
+class SynchronousJavaScriptCaller;
+
+// One outstanding request to JavaScript. Each call has its own condition
+// variable, so a reply wakes only the thread waiting on that call.
+class JavaScriptCall {
+ public:
+  ~JavaScriptCall();
+
+  // Blocks until the reply has arrived, then returns it. If the call was
+  // made with a reply buffer the payload went there and this is empty.
+  const std::string& Wait();
+  // Like Wait(), but gives up after timeout_ms (negative means forever).
+  // Returns true if the call is done.
+  bool TimedWait(int timeout_ms);
+  bool done();
+
+  // Only meaningful once done.
+  uint16_t status() const { return status_; }
+  // Payload bytes received (possibly more than fit in the reply buffer).
+  size_t reply_length() const { return reply_length_; }
+
+ private:
+  friend class SynchronousJavaScriptCaller;
+  explicit JavaScriptCall(pthread_mutex_t* mutex);
+
+  pthread_mutex_t* mutex_;  // owned by the SynchronousJavaScriptCaller
+  pthread_cond_t cond_;
+  bool done_;
+
+  uint16_t opcode_;
+  std::string request_;  // keeps text requests alive until sent
+  unsigned char params_[kJSMaxParamBytes];
+  size_t params_length_;
+  const unsigned char* payload_;
+  size_t payload_length_;
+  // In-place calls: the whole message, header space included.
+  pp::VarArrayBuffer buffer_;
+  bool in_place_;
+
+  unsigned char* reply_buf_;  // may be NULL
+  size_t reply_capacity_;
+  size_t reply_length_;
+  uint16_t status_;
+  std::string reply_;
+};
+
+typedef std::tr1::shared_ptr<JavaScriptCall> JavaScriptCallHandle;
+
 class SynchronousJavaScriptCaller {
  public:
   explicit SynchronousJavaScriptCaller(pp::Instance* instance);
@@ -23,16 +100,48 @@ class SynchronousJavaScriptCaller {
   // The main Call method, used by non-main thread to synchronously call JS
   std::string Call(const std::string& request);
 
-  // Called from main thread
-  void HandleReply(size_t idx, const std::string& reply);
+  // Queues a text request and returns immediately. Any number of calls may
+  // be in flight at once; requests queued before the main thread gets
+  // around to Run() are sent to the page together in a single message.
+  JavaScriptCallHandle CallAsync(const std::string& request);
+
+  // Queues a binary request whose frame payload is params (copied here, at
+  // most kJSMaxParamBytes) followed by payload. payload must stay valid
+  // until the call is done; it is copied exactly once, straight into the
+  // outgoing ArrayBuffer. If reply_buf is given, the reply payload is copied
+  // straight into it (truncated to reply_capacity) instead of into a
+  // std::string, so it too must outlive the call.
+  JavaScriptCallHandle CallAsync(uint16_t opcode,
+                                 const void* params, size_t params_length,
+                                 const void* payload, size_t payload_length,
+                                 void* reply_buf, size_t reply_capacity);
+
+  // Queues a binary request that is sent as a message of its own, straight
+  // from buffer: its first kJSFrameHeaderBytes are left for the frame header
+  // and the payload_length bytes after them are the payload. Nothing is
+  // copied, so buffer must not be touched until the call is done.
+  JavaScriptCallHandle CallAsyncInPlace(uint16_t opcode,
+                                        const pp::VarArrayBuffer& buffer,
+                                        size_t payload_length);
+
+  // Forgets about a call: a late reply is dropped without touching its
+  // buffers, and the call completes now with kJSStatusCancelled. Returns
+  // false if the call had already completed.
+  bool Cancel(const JavaScriptCallHandle& call);
+
+  // Called from main thread with a buffer of reply frames. Returns false if
+  // the buffer is malformed.
+  bool HandleReply(pp::VarArrayBuffer replies);
 
  private:
+  JavaScriptCallHandle Queue(const JavaScriptCallHandle& call);
+
   pthread_mutex_t mutex_;
-  pthread_cond_t cond_;
-  size_t next_id_;
-  
-  std::map<size_t, std::string> outbox_;
-  std::map<size_t, std::string> inbox_;
+  uint32_t next_id_;
+  bool run_pending_;  // Run() has been scheduled on the main thread
+
+  std::vector<std::pair<uint32_t, JavaScriptCallHandle> > outbox_;
+  std::map<uint32_t, JavaScriptCallHandle> in_flight_;
 
   pp::Instance* pp_instance_;
 };
@@ -0,0 +1,161 @@
+// copyright...
+
+#ifndef SANE_NACL_PIPE_H__
+#define SANE_NACL_PIPE_H__
+
+#include <poll.h>
+#include <stddef.h>
+#include <sys/select.h>
+#include <sys/types.h>
+
+#include <set>
+#include <tr1/memory>
+#include <vector>
+
+#include <pthread.h>
+
+namespace scanley {
+
+// Lets one thread sleep until any of several FakePipes changes state.
+// Pipes call Notify() on every registered waiter when they become readable,
+// writable or hung up.
+class PipeWaiter {
+ public:
+  PipeWaiter();
+  ~PipeWaiter();
+
+  void Notify();
+  // Waits until Notify() has been called since the last Wait(), or until
+  // timeout_ms elapses (negative means forever). Returns false on timeout.
+  bool Wait(int timeout_ms);
+
+ private:
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  bool notified_;
+};
+
+// An in-process replacement for a unix pipe, used because NaCl has no pipe().
+// Data lives in a fixed-capacity ring buffer; Read() and Write() copy whole
+// spans with memcpy and only wake the other side when the ring changes from
+// empty to non-empty or from full to non-full.
+class FakePipe {
+ public:
+  static const size_t kDefaultCapacity = 64 * 1024;
+
+  explicit FakePipe(size_t capacity = kDefaultCapacity);
+  ~FakePipe();
+
+  // Like read(2) on a pipe: blocks until at least one byte is available
+  // (unless nonblocking), then returns as much as is buffered, up to len.
+  // Returns 0 (EOF) once the write end is closed and the ring is drained.
+  ssize_t Read(unsigned char* buf, size_t len);
+  // Like write(2) on a pipe: a blocking write returns only when all of buf
+  // has been queued; a nonblocking write may be partial. Fails with EPIPE
+  // once the read end is closed.
+  ssize_t Write(const unsigned char* buf, size_t len);
+
+  void SetReadNonblock(bool nonblock);
+  void SetWriteNonblock(bool nonblock);
+  bool ReadNonblock();
+  bool WriteNonblock();
+
+  void CloseReader();
+  void CloseWriter();
+
+  // poll(2)-style readiness of one end of the pipe.
+  short ReaderEvents();
+  short WriterEvents();
+
+  void AddWaiter(PipeWaiter* waiter);
+  void RemoveWaiter(PipeWaiter* waiter);
+
+  size_t capacity() const { return capacity_; }
+
+ private:
+  // Copies up to len bytes in/out of the ring, handling wrap-around.
+  // Must be called with mutex_ held. Returns the number of bytes copied.
+  size_t CopyIn(const unsigned char* buf, size_t len);
+  size_t CopyOut(unsigned char* buf, size_t len);
+
+  // Must be called with mutex_ held.
+  void NotifyWaiters();
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t not_empty_;
+  pthread_cond_t not_full_;
+  std::set<PipeWaiter*> waiters_;
+
+  unsigned char* buf_;
+  const size_t capacity_;
+  size_t size_;
+  size_t next_read_;  // index into buf_
+
+  bool read_nonblock_:1;
+  bool write_nonblock_:1;
+  bool reader_closed_:1;
+  bool writer_closed_:1;
+
+  // Not copyable
+  FakePipe(const FakePipe&);
+  void operator=(const FakePipe&);
+};
+
+// Hands out file descriptor numbers for FakePipes. Fake fds occupy the top
+// half of [0, FD_SETSIZE) so that they can be used with select() and are
+// unlikely to collide with real descriptors. Slots are recycled through a
+// free list, so allocation, lookup and close are all O(1).
+//
+// The libc calls send an fd to the manager only while it is an open pipe
+// (Owns()); a real fd with a number in that range goes to the real call,
+// unless a pipe has the same number at the time. poll() and select() can't
+// wait for pipes and real fds at once: a call with both fails with EINVAL.
+class FakePipeManager {
+ public:
+  explicit FakePipeManager(size_t pipe_capacity = FakePipe::kDefaultCapacity);
+  ~FakePipeManager();
+
+  static const int kFirstFd = FD_SETSIZE / 2;
+  static const int kMaxFds = FD_SETSIZE - kFirstFd;
+
+  static bool IsFakeFd(int fd) {
+    return fd >= kFirstFd && fd < kFirstFd + kMaxFds;
+  }
+
+  int Pipe(int pipe_fd[2]);
+  int Close(int fd);
+  // Whether fd is an open fake fd.
+  bool Owns(int fd);
+
+  ssize_t Read(int fd, unsigned char* buf, size_t len);
+  ssize_t Write(int fd, const unsigned char* buf, size_t len);
+  int FcntlF_SETFL(int fd, long flags);
+  // O_RDONLY or O_WRONLY, and O_NONBLOCK if set.
+  int FcntlF_GETFL(int fd);
+
+  // Same contract as poll(2) and select(2), but every fd must be a fake fd.
+  int Poll(struct pollfd* fds, nfds_t nfds, int timeout_ms);
+  int Select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds,
+             struct timeval* timeout);
+
+ private:
+  struct Slot {
+    Slot() : in_use(false), is_reader(false) {}
+    std::tr1::shared_ptr<FakePipe> pipe;
+    bool in_use;
+    bool is_reader;
+  };
+
+  // Copies the slot for fd into *slot. Returns false (and sets errno to
+  // EBADF) if fd is not an open fake fd.
+  bool Lookup(int fd, Slot* slot);
+
+  pthread_mutex_t mutex_;
+  size_t pipe_capacity_;  // ring size of each new pipe
+  std::vector<Slot> slots_;  // indexed by fd - kFirstFd
+  std::vector<int> free_;  // free slot indexes, lowest on top
+};
+
+}  // namespace scanley
+
+#endif  // SANE_NACL_PIPE_H__
@@ -0,0 +1,84 @@
+// copyright...
+
+#ifndef SANE_NACL_STREAM_H__
+#define SANE_NACL_STREAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+#include "ppapi/cpp/var_array_buffer.h"
+#include "sane/nacl_jscall.h"
+#include "sane/sane.h"
+
+namespace scanley {
+
+// Streams scanned image data to the page as it is read.
+//
+// Before each frame the page gets a kJSOpImageParams request whose payload
+// is the frame's SANE_Parameters:
+//
+//   uint32 frame number, uint32 format, uint32 last_frame,
+//   uint32 bytes_per_line, int32 pixels_per_line, int32 lines (-1 if
+//   unknown), uint32 depth
+//
+// followed by kJSOpImageData requests, one per chunk of image data:
+//
+//   uint32 frame number, uint32 offset of the data in the frame,
+//   uint32 flags (kImageChunkLast on the frame's final chunk),
+//   uint32 reserved, then the data
+//
+// The page replies to each chunk once it is done with it (status nonzero to
+// stop the scan). Chunks live in a fixed pool of ArrayBuffers: sane_read()
+// fills them in place and they are posted as they are, so each byte is
+// copied once on its way from the backend to the page, and at most the pool
+// is in flight. Once the pool is used up, reading waits for the page.
+class ImageStreamer {
+ public:
+  static const size_t kDefaultChunkBytes = 128 * 1024;
+  static const int kDefaultChunks = 4;
+  static const size_t kParamsBytes = 28;
+  static const size_t kChunkHeaderBytes = 16;
+  static const uint32_t kImageChunkLast = 1;
+
+  // chunk_bytes is the image data per chunk, headers not included.
+  ImageStreamer(SynchronousJavaScriptCaller* caller,
+                size_t chunk_bytes = kDefaultChunkBytes,
+                int chunks = kDefaultChunks);
+
+  // Streams the frame of a started scan. Returns SANE_STATUS_EOF once the
+  // page has acknowledged all of it, SANE_STATUS_CANCELLED if the page asked
+  // to stop, or the backend's error.
+  SANE_Status StreamFrame(SANE_Handle handle);
+
+  // Streams frames until the last one, starting each after the first.
+  SANE_Status StreamImage(SANE_Handle handle);
+
+  uint64_t bytes_streamed() const { return bytes_streamed_; }
+
+ private:
+  struct Chunk {
+    pp::VarArrayBuffer buffer;
+    JavaScriptCallHandle call;  // set while in flight
+  };
+
+  // Waits for the oldest chunk in flight and returns it to the pool. Returns
+  // false if the page rejected it.
+  bool Reclaim();
+  // Waits for every chunk in flight. Returns false if any was rejected.
+  bool ReclaimAll();
+
+  SynchronousJavaScriptCaller* caller_;
+  size_t chunk_bytes_;
+  std::vector<Chunk> chunks_;
+  std::vector<Chunk*> free_;
+  std::deque<Chunk*> in_flight_;
+  uint32_t frame_number_;
+  uint64_t bytes_streamed_;
+};
+
+}  // namespace scanley
+
+#endif  // SANE_NACL_STREAM_H__
@@ -0,0 +1,58 @@
+// copyright...
+
+#ifndef SANE_NACL_USB_H__
+#define SANE_NACL_USB_H__
+
+#include <stddef.h>
+
+namespace scanley {
+
+// USB requests sent to the page through SynchronousJavaScriptCaller (see
+// nacl_jscall.h for the framing). sanei/nacl_usb.cc implements the libusb-1.0
+// API that sanei_usb uses on top of these; the page maps them onto the
+// browser's USB API.
+//
+// Integers are little endian. The reply status of a USB request is the
+// negated libusb_error code, so 0 is success and 7 is LIBUSB_ERROR_TIMEOUT.
+enum UsbOpcode {
+  // request: nothing
+  // reply:   for each device: uint32 device id, uint8 bus, uint8 address,
+  //          uint16 reserved, 18 byte raw device descriptor
+  kUsbOpGetDevices = 0x100,
+  // request: uint32 device id, uint8 configuration index
+  // reply:   the raw configuration descriptor, all wTotalLength bytes of it
+  kUsbOpGetConfigDescriptor,
+  // request: uint32 device id
+  // reply:   uint32 handle
+  kUsbOpOpen,
+  // request: uint32 handle
+  kUsbOpClose,
+  // request: uint32 handle, uint32 interface
+  kUsbOpClaimInterface,
+  kUsbOpReleaseInterface,
+  // request: uint32 handle, uint32 interface, uint32 alternate setting
+  kUsbOpSetInterfaceAltSetting,
+  // request: uint32 handle, int32 configuration
+  kUsbOpSetConfiguration,
+  // request: uint32 handle, uint8 endpoint
+  kUsbOpClearHalt,
+  // request: uint32 handle
+  kUsbOpResetDevice,
+  // request: uint32 handle, uint8 bmRequestType, uint8 bRequest,
+  //          uint16 wValue, uint16 wIndex, uint16 wLength, uint32 timeout ms,
+  //          then wLength bytes of data for host-to-device transfers
+  // reply:   the data read (device-to-host), or uint32 bytes written
+  kUsbOpControlTransfer,
+  // request: uint32 handle, uint8 endpoint, 3 reserved bytes, uint32 length,
+  //          uint32 timeout ms, then length bytes of data for OUT endpoints
+  // reply:   the data read (IN endpoints), or uint32 bytes written
+  kUsbOpBulkTransfer,
+  kUsbOpInterruptTransfer,
+};
+
+const size_t kUsbDeviceRecordBytes = 8 + 18;
+const size_t kUsbTransferParamBytes = 16;
+
+}  // namespace scanley
+
+#endif  // SANE_NACL_USB_H__
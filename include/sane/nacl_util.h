@@ -3,6 +3,7 @@
 #ifndef SANE_NACL_UTIL_H__
 #define SANE_NACL_UTIL_H__
 
+#include <stdint.h>
 #include <stdio.h>
 
 #include <pthread.h>
@@ -43,6 +44,25 @@ class ScopedPthreadUnlock {
   pthread_mutex_t* mutex_;
 };
 
+// Little endian accessors for the binary messages exchanged with JavaScript.
+inline void PutLE16(unsigned char* out, uint16_t value) {
+  out[0] = value & 0xff;
+  out[1] = value >> 8;
+}
+
+inline void PutLE32(unsigned char* out, uint32_t value) {
+  PutLE16(out, value & 0xffff);
+  PutLE16(out + 2, value >> 16);
+}
+
+inline uint16_t GetLE16(const unsigned char* in) {
+  return in[0] | (in[1] << 8);
+}
+
+inline uint32_t GetLE32(const unsigned char* in) {
+  return GetLE16(in) | (static_cast<uint32_t>(GetLE16(in + 2)) << 16);
+}
+
 template<typename Map, typename Key>
 bool MapContainsKey(const Map& the_map, const Key& the_key) {
   return the_map.find(the_key) != the_map.end();
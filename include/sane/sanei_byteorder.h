@@ -0,0 +1,74 @@
+/* sane - Scanner Access Now Easy.
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it under
+   the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+   for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.  If not, write to the Free
+   Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_byteorder.h
+ * Byte order conversion of image data.
+ *
+ * 16 bit samples travel between saned and the net backend in the byte
+ * order of the server, and have to be swapped on a client of the other
+ * order. Words of the wire protocol are big endian and are swapped in
+ * bulk on little endian hosts. The conversion works in place and uses
+ * SSE2 or AVX2 where the compiler targets them.
+ *
+ * @sa sanei_net.h
+ */
+
+#ifndef sanei_byteorder_h
+#define sanei_byteorder_h
+
+#include <stddef.h>
+
+#include "../include/sane/sane.h"
+
+/** Swap the bytes of 16 bit words in place.
+ *
+ * @param data the words, which need not be aligned
+ * @param len length of @p data in bytes; an odd last byte is left alone
+ */
+extern void sanei_swap_16 (SANE_Byte * data, size_t len);
+
+/** Reverse the bytes of 32 bit words in place.
+ *
+ * @param data the words, which need not be aligned
+ * @param len length of @p data in bytes; up to three last bytes are left
+ * alone
+ */
+extern void sanei_swap_32 (SANE_Byte * data, size_t len);
+
+#endif /* sanei_byteorder_h */
@@ -0,0 +1,122 @@
+/* sane - Scanner Access Now Easy.
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it under
+   the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+   for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.  If not, write to the Free
+   Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_compress.h
+ * Compression of image data on the saned data connection.
+ *
+ * Two codecs are provided: PackBits run-length encoding, which suits
+ * lineart (1 bit per sample) frames, and a byte-oriented LZ77 codec in
+ * the style of LZ4 for 8 and 16 bit frames. Both are fast enough to keep
+ * up with a scanner on either end of the connection, and neither needs
+ * more memory than a small table on the stack.
+ *
+ * The compressed formats carry no header: the caller has to transmit the
+ * codec and the uncompressed length along with the data.
+ *
+ * @sa sanei_net.h
+ */
+
+#ifndef sanei_compress_h
+#define sanei_compress_h
+
+#include <stddef.h>
+
+#include "../include/sane/sane.h"
+
+/** Codec identifiers, as sent on the wire. */
+typedef enum
+  {
+    SANEI_COMPRESS_NONE = 0,	/**< data is stored as is */
+    SANEI_COMPRESS_RLE = 1,	/**< PackBits run-length encoding */
+    SANEI_COMPRESS_LZ = 2	/**< LZ77, LZ4 block format */
+  }
+SANEI_Compress_Codec;
+
+/** Choose a codec for a frame.
+ *
+ * @param depth bits per sample of the frame
+ *
+ * @return SANEI_COMPRESS_RLE for lineart, SANEI_COMPRESS_LZ otherwise
+ */
+extern SANEI_Compress_Codec sanei_compress_codec (SANE_Int depth);
+
+/** Largest compressed size of @p len bytes of input.
+ *
+ * A buffer of this size always holds the output of sanei_compress().
+ */
+extern size_t sanei_compress_bound (size_t len);
+
+/** Compress a block of data.
+ *
+ * @param codec codec to use
+ * @param in data to compress
+ * @param in_len length of @p in
+ * @param out where to store the compressed data
+ * @param out_size size of @p out
+ *
+ * @return the length of the compressed data, or 0 if it doesn't fit into
+ * @p out or if @p codec isn't known. The caller should then send the
+ * data uncompressed.
+ */
+extern size_t sanei_compress (SANEI_Compress_Codec codec,
+			      const SANE_Byte * in, size_t in_len,
+			      SANE_Byte * out, size_t out_size);
+
+/** Decompress a block of data.
+ *
+ * The input is checked: corrupt data is reported, never read or written
+ * out of bounds.
+ *
+ * @param codec codec the data was compressed with
+ * @param in compressed data
+ * @param in_len length of @p in
+ * @param out where to store the uncompressed data
+ * @param out_len uncompressed length, as sent by the compressing side
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success, @p out_len bytes were stored
+ * - SANE_STATUS_IO_ERROR - the data is corrupt or doesn't decompress to
+ *   exactly @p out_len bytes
+ * - SANE_STATUS_UNSUPPORTED - unknown codec
+ */
+extern SANE_Status sanei_decompress (SANEI_Compress_Codec codec,
+				     const SANE_Byte * in, size_t in_len,
+				     SANE_Byte * out, size_t out_len);
+
+#endif /* sanei_compress_h */
@@ -49,6 +49,7 @@
  * - Despeckle (replace dots of significantly different color with background)
  * - Blank detection (check if density is over a threshold)
  * - Rotate (detect and correct 90 degree increment rotations)
+ * - Streaming (blank detection, edges and skew as the lines arrive)
  *
  * Note that these functions are simplistic, and are expected to change.
  * Patches and suggestions are welcome.
@@ -71,6 +72,7 @@ extern void sanei_magic_init( void );
  *
  * @return
  * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory for the working buffers
  * - SANE_STATUS_INVAL - invalid image parameters
  */
 extern SANE_Status
@@ -97,6 +99,35 @@ extern SANE_Status
 sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
   int dpiX, int dpiY, int * centerX, int * centerY, double * finSlope);
 
+/** Find the skew of the media inside the image, multi-resolution version
+ *
+ * Like sanei_magic_findSkew(), but the top edge is first found on a copy
+ * of the image that is scale times smaller in both directions, then the
+ * slope is fitted to the transitions of the full image near that edge.
+ * Larger values of scale are faster, but small or low contrast media
+ * may be missed. The scale is reduced for narrow images, on which the
+ * slope can not be seen. With scale 1 this is sanei_magic_findSkew().
+ *
+ * @param params describes image
+ * @param buffer contains image data
+ * @param dpiX horizontal resolution
+ * @param dpiY vertical resolution
+ * @param[out] centerX horizontal coordinate of center of rotation
+ * @param[out] centerY vertical coordinate of center of rotation
+ * @param[out] finSlope slope of rotation
+ * @param scale 1 for full resolution, else 2, 4 or 8
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - invalid image parameters
+ * - SANE_STATUS_UNSUPPORTED - slope angle too shallow to detect
+ */
+extern SANE_Status
+sanei_magic_findSkew2(SANE_Parameters * params, SANE_Byte * buffer,
+  int dpiX, int dpiY, int * centerX, int * centerY, double * finSlope,
+  int scale);
+
 /** Correct the skew of the media inside the image, via simple rotation
  *
  * @param params describes image
@@ -115,6 +146,45 @@ extern SANE_Status
 sanei_magic_rotate (SANE_Parameters * params, SANE_Byte * buffer,
   int centerX, int centerY, double slope, int bg_color);
 
+/** Interpolation methods for sanei_magic_rotate2() */
+#define SANEI_MAGIC_NEAREST  0	/**< copy the nearest source pixel */
+#define SANEI_MAGIC_BILINEAR 1	/**< blend the four nearest source pixels */
+
+/** Correct the skew of the media inside the image, enhanced version
+ *
+ * Like sanei_magic_rotate(), which is this with SANEI_MAGIC_NEAREST,
+ * but the interpolation can be chosen. Bilinear interpolation gives
+ * smoother edges on grayscale and color images, lineart is always
+ * sampled. Large images are split in bands of rows, rotated in
+ * parallel if sane-backends was built with pthread support.
+ *
+ * @param params describes image
+ * @param buffer contains image data
+ * @param centerX horizontal coordinate of center of rotation
+ * @param centerY vertical coordinate of center of rotation
+ * @param slope slope of rotation
+ * @param bg_color the replacement color for edges exposed by rotation
+ * @param interp SANEI_MAGIC_NEAREST or SANEI_MAGIC_BILINEAR
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - invalid image parameters
+ */
+extern SANE_Status
+sanei_magic_rotate2 (SANE_Parameters * params, SANE_Byte * buffer,
+  int centerX, int centerY, double slope, int bg_color, int interp);
+
+/** Set how many bands sanei_magic_rotate2() splits an image in
+ *
+ * Each band is rotated by a thread of its own if sane-backends was
+ * built with pthread support. Bands are never smaller than 256 rows.
+ *
+ * @param threads most bands, 0 (the default) for one per online CPU
+ */
+extern void
+sanei_magic_setThreads (int threads);
+
 /** Find the edges of the media inside the image, parallel to image edges
  *
  * @param params describes image
@@ -135,6 +205,34 @@ extern SANE_Status
 sanei_magic_findEdges(SANE_Parameters * params, SANE_Byte * buffer,
   int dpiX, int dpiY, int * top, int * bot, int * left, int * right);
 
+/** Find the edges of the media inside the image, multi-resolution version
+ *
+ * Like sanei_magic_findEdges(), but the edges are first found on a copy
+ * of the image that is scale times smaller in both directions, then
+ * searched for again on the full image, only near those. Lineart is
+ * always searched in full. With scale 1 this is sanei_magic_findEdges().
+ *
+ * @param params describes image
+ * @param buffer contains image data
+ * @param dpiX horizontal resolution
+ * @param dpiY vertical resolution
+ * @param[out] top vertical offset to upper edge of media
+ * @param[out] bot vertical offset to lower edge of media
+ * @param[out] left horizontal offset to left edge of media
+ * @param[out] right horizontal offset to right edge of media
+ * @param scale 1 for full resolution, else 2, 4 or 8
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - invalid image parameters
+ * - SANE_STATUS_UNSUPPORTED - edges could not be detected
+ */
+extern SANE_Status
+sanei_magic_findEdges2(SANE_Parameters * params, SANE_Byte * buffer,
+  int dpiX, int dpiY, int * top, int * bot, int * left, int * right,
+  int scale);
+
 /** Crop the image, parallel to image edges
  *
  * @param params describes image
@@ -219,4 +317,122 @@ extern SANE_Status
 sanei_magic_turn(SANE_Parameters * params, SANE_Byte * buffer,
   int angle);
 
+/** State of the streaming analysis of one page */
+typedef struct sanei_magic_stream SANEI_Magic_Stream;
+
+/** Start the analysis of a page, whose lines will be written to it
+ *
+ * The statistics for blank detection, edges and skew are kept up to date
+ * as the lines arrive, so only the page itself has to be buffered, and
+ * only if it is going to be cropped or rotated.
+ *
+ * @param params describes image, lines is -1 if the height is not known
+ * @param dpiX horizontal resolution
+ * @param dpiY vertical resolution
+ * @param[out] stream new stream, to be closed with
+ * sanei_magic_streamClose()
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - invalid image parameters
+ */
+extern SANE_Status
+sanei_magic_streamOpen (SANE_Parameters * params, int dpiX, int dpiY,
+  SANEI_Magic_Stream ** stream);
+
+/** Add image data to the page
+ *
+ * The data does not have to end on a line boundary, the rest of a line
+ * is expected with the next write.
+ *
+ * @param stream the page
+ * @param buffer image data
+ * @param len bytes in buffer
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - page finished, or longer than its known height
+ */
+extern SANE_Status
+sanei_magic_streamWrite (SANEI_Magic_Stream * stream, SANE_Byte * buffer,
+  int len);
+
+/** End the page
+ *
+ * Completes the statistics that need the bottom of the page. A partial
+ * line is dropped.
+ *
+ * @param stream the page
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_INVAL - no lines were written
+ */
+extern SANE_Status
+sanei_magic_streamFinish (SANEI_Magic_Stream * stream);
+
+/** Check if the page is blank, as sanei_magic_isBlank2() would
+ *
+ * A page is known not to be blank as soon as a dark enough block has
+ * been seen. If the height of the page is known, a blank page is known
+ * once the last block that counts is complete, at least 1/4 inch before
+ * the end. Otherwise, only when the page is finished.
+ *
+ * @param stream the page
+ * @param thresh threshold value (0-100)
+ *
+ * @return
+ * - SANE_STATUS_GOOD - page is not blank
+ * - SANE_STATUS_NO_DOCS - page is blank
+ * - SANE_STATUS_DEVICE_BUSY - not known yet, write more lines
+ */
+extern SANE_Status
+sanei_magic_streamIsBlank (SANEI_Magic_Stream * stream, double thresh);
+
+/** Find the edges of the media on a finished page
+ *
+ * Gives the same result as sanei_magic_findEdges() on the whole page.
+ *
+ * @param stream the page
+ * @param[out] top vertical offset to upper edge of media
+ * @param[out] bot vertical offset to lower edge of media
+ * @param[out] left horizontal offset to left edge of media
+ * @param[out] right horizontal offset to right edge of media
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_INVAL - page not finished
+ * - SANE_STATUS_UNSUPPORTED - edges could not be detected
+ */
+extern SANE_Status
+sanei_magic_streamFindEdges (SANEI_Magic_Stream * stream,
+  int * top, int * bot, int * left, int * right);
+
+/** Find the skew of the media on a finished page
+ *
+ * Gives the same result as sanei_magic_findSkew() on the whole page.
+ *
+ * @param stream the page
+ * @param[out] centerX horizontal coordinate of center of rotation
+ * @param[out] centerY vertical coordinate of center of rotation
+ * @param[out] finSlope slope of rotation
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_INVAL - page not finished
+ * - SANE_STATUS_UNSUPPORTED - slope angle too shallow to detect
+ */
+extern SANE_Status
+sanei_magic_streamFindSkew (SANEI_Magic_Stream * stream,
+  int * centerX, int * centerY, double * finSlope);
+
+/** Free the stream
+ *
+ * @param stream the page, may be NULL
+ */
+extern void
+sanei_magic_streamClose (SANEI_Magic_Stream * stream);
+
 #endif /* SANEI_MAGIC_H */
@@ -22,6 +22,26 @@
 
 #define SANEI_NET_PROTOCOL_VERSION	3
 
+/* From protocol version 4 on, saned may compress the data connection:
+   each data record starts with a codec byte (see sanei_compress.h) and
+   the 4-byte uncompressed length.  The client offers it with the version
+   of its SANE_NET_INIT request; the version in saned's reply is the one
+   the connection uses. */
+#define SANEI_NET_PROTOCOL_COMPRESS	4
+
+/* Protocol version 5 adds SANE_NET_CONTROL_OPTIONS, which performs a
+   vector of option requests in one round trip and returns the
+   descriptors they changed.  Its data connection has the record format
+   of version 4, but the records are only compressed if saned is
+   configured to. */
+#define SANEI_NET_PROTOCOL_BATCH	5
+
+/* Protocol version 6 adds SANE_NET_GET_OPTION_CHANGES, which returns the
+   option descriptors that changed since a version of a handle's
+   descriptor set.  Version 1 is the set as the device was opened; its
+   digest lets a client that cached it skip the download. */
+#define SANEI_NET_PROTOCOL_DELTA	6
+
 typedef enum
   {
     SANE_NET_LITTLE_ENDIAN = 0x1234,
@@ -41,7 +61,9 @@ typedef enum
     SANE_NET_START,
     SANE_NET_CANCEL,
     SANE_NET_AUTHORIZE,
-    SANE_NET_EXIT
+    SANE_NET_EXIT,
+    SANE_NET_CONTROL_OPTIONS,
+    SANE_NET_GET_OPTION_CHANGES
   }
 SANE_Net_Procedure_Number;
 
@@ -103,6 +125,54 @@ typedef struct
   }
 SANE_Control_Option_Reply;
 
+/* The handle of the individual requests isn't transmitted, nor the
+   resource_to_authorize of the individual replies. */
+typedef struct
+  {
+    SANE_Word handle;
+    SANE_Word num_requests;
+    SANE_Control_Option_Req *requests;
+  }
+SANE_Control_Options_Req;
+
+typedef struct
+  {
+    SANE_Word index;
+    SANE_Option_Descriptor *desc;
+  }
+SANE_Option_Change;
+
+typedef struct
+  {
+    SANE_Word num_replies;
+    SANE_Control_Option_Reply *replies;
+    SANE_Word num_options;	/* after the requests; -1: fetch them all */
+    SANE_Word num_changes;
+    SANE_Option_Change *changes; /* descriptors that differ from the last
+				    ones sent for the handle */
+    SANE_String resource_to_authorize;
+  }
+SANE_Control_Options_Reply;
+
+typedef struct
+  {
+    SANE_Word handle;
+    SANE_Word version;		/* of the descriptors the client has, or 0 */
+    SANE_String digest;		/* with version 0, of the ones it cached */
+  }
+SANE_Get_Option_Changes_Req;
+
+typedef struct
+  {
+    SANE_Status status;
+    SANE_Word version;
+    SANE_String digest;		/* of version 1 */
+    SANE_Word num_options;
+    SANE_Word num_changes;
+    SANE_Option_Change *changes;
+  }
+SANE_Get_Option_Changes_Reply;
+
 typedef struct
   {
     SANE_Status status;
@@ -136,9 +206,27 @@ extern void sanei_w_option_descriptor_array (Wire *w,
 extern void sanei_w_control_option_req (Wire *w, SANE_Control_Option_Req *req);
 extern void sanei_w_control_option_reply (Wire *w,
 					  SANE_Control_Option_Reply *reply);
+extern void sanei_w_control_options_req (Wire *w,
+					 SANE_Control_Options_Req *req);
+extern void sanei_w_control_options_reply (Wire *w,
+					   SANE_Control_Options_Reply *reply);
+extern void sanei_w_get_option_changes_req (Wire *w,
+					    SANE_Get_Option_Changes_Req *req);
+extern void sanei_w_get_option_changes_reply (Wire *w,
+					      SANE_Get_Option_Changes_Reply *reply);
 extern void sanei_w_get_parameters_reply (Wire *w,
 					  SANE_Get_Parameters_Reply *reply);
 extern void sanei_w_start_reply (Wire *w, SANE_Start_Reply *reply);
 extern void sanei_w_authorization_req (Wire *w, SANE_Authorization_Req *req);
 
+/* Deep copies of option descriptors, to tell which ones changed:
+   sanei_net_copy_option_descriptor() returns NULL if there isn't enough
+   memory. */
+extern SANE_Option_Descriptor *
+sanei_net_copy_option_descriptor (const SANE_Option_Descriptor *d);
+extern void sanei_net_free_option_descriptor (SANE_Option_Descriptor *d);
+extern SANE_Bool
+sanei_net_same_option_descriptor (const SANE_Option_Descriptor *a,
+				  const SANE_Option_Descriptor *b);
+
 #endif /* sanei_net_h */
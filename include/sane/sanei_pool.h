@@ -0,0 +1,127 @@
+/* sane - Scanner Access Now Easy.
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it under
+   the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+   for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.  If not, write to the Free
+   Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_pool.h
+ * A small pool of worker threads for image post-processing.
+ *
+ * A backend that has read both sides of a duplex page, or an image cut
+ * into bands, can hand each piece to the pool as a job and go on with
+ * other work.  Every submitted job returns a handle that works as a
+ * future: sanei_pool_join() waits for the job to finish and returns its
+ * status.  A backend joins its jobs before it delivers the data they
+ * work on.
+ *
+ * Jobs are started in the order they were submitted.  A job may submit
+ * further jobs, but must not join a job that was submitted after it.
+ *
+ * Without thread support, or if no thread could be started, every job
+ * is run by sanei_pool_submit() itself, so callers need no special
+ * case.
+ *
+ * @sa sanei_magic.h
+ */
+
+#ifndef sanei_pool_h
+#define sanei_pool_h
+
+#include "../include/sane/sane.h"
+
+/** A pool of worker threads. */
+typedef struct sanei_pool SANEI_Pool;
+
+/** A submitted job, to be joined exactly once. */
+typedef struct sanei_pool_job SANEI_Pool_Job;
+
+/** The work to be done by a job.
+ *
+ * @param arg the argument given to sanei_pool_submit()
+ *
+ * @return the status handed to sanei_pool_join()
+ */
+typedef SANE_Status (*SANEI_Pool_Func) (void *arg);
+
+/** Create a pool.
+ *
+ * @param threads number of worker threads, 0 for one per online CPU
+ * @param pool where to store the new pool
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success, even if no thread could be started
+ * - SANE_STATUS_NO_MEM - not enough memory
+ */
+extern SANE_Status sanei_pool_create (int threads, SANEI_Pool ** pool);
+
+/** Number of worker threads of a pool.
+ *
+ * @return 0 if jobs are run by sanei_pool_submit()
+ */
+extern int sanei_pool_threads (SANEI_Pool * pool);
+
+/** Queue a job.
+ *
+ * @param pool the pool
+ * @param func the work to do
+ * @param arg argument for @p func
+ * @param job where to store the handle of the job
+ *
+ * @return
+ * - SANE_STATUS_GOOD - the job was queued, or has already been run
+ * - SANE_STATUS_NO_MEM - not enough memory, @p func was not called
+ */
+extern SANE_Status sanei_pool_submit (SANEI_Pool * pool,
+				      SANEI_Pool_Func func, void *arg,
+				      SANEI_Pool_Job ** job);
+
+/** Wait for a job to finish and release it.
+ *
+ * @param job the handle returned by sanei_pool_submit()
+ *
+ * @return the status returned by the job's function
+ */
+extern SANE_Status sanei_pool_join (SANEI_Pool_Job * job);
+
+/** Stop the worker threads and free a pool.
+ *
+ * All jobs submitted to the pool have to be joined first.
+ *
+ * @param pool the pool, may be NULL
+ */
+extern void sanei_pool_destroy (SANEI_Pool * pool);
+
+#endif /* sanei_pool_h */
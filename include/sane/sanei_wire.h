@@ -60,6 +60,9 @@ struct Wire;
 typedef void (*WireCodecFunc) (struct Wire *w, void *val_ptr);
 typedef ssize_t (*WireReadFunc) (int fd, void * buf, size_t len);
 typedef ssize_t (*WireWriteFunc) (int fd, const void * buf, size_t len);
+/* transfers NUM elements at V in one go */
+typedef void (*WireBulkFunc) (struct Wire *w, void *v, size_t num);
+struct WireArenaBlock;
 
 typedef struct Wire
   {
@@ -73,6 +76,8 @@ typedef struct Wire
 	WireCodecFunc w_char;
 	WireCodecFunc w_word;
 	WireCodecFunc w_string;
+	WireBulkFunc w_bytes;	/* optional: arrays of bytes or chars */
+	WireBulkFunc w_words;	/* optional: arrays of words */
       }
     codec;
     struct
@@ -90,6 +95,15 @@ typedef struct Wire
 	WireWriteFunc write;
       }
     io;
+    struct
+      {
+	int depth;		/* nesting of sanei_w_arena_begin() */
+	struct WireArenaBlock *blocks;	/* newest first */
+	size_t used;		/* bytes handed out from the newest block */
+	size_t hint;		/* size for the next first block */
+	int base_memory;	/* allocated_memory at the outermost begin */
+      }
+    arena;
   }
 Wire;
 
@@ -126,7 +140,23 @@ extern void sanei_w_set_dir (Wire *w, WireDirection dir);
 extern void sanei_w_call (Wire *w, SANE_Word proc_num,
 			  WireCodecFunc w_arg, void *arg,
 			  WireCodecFunc w_reply, void *reply);
+/* The two halves of sanei_w_call(), for a caller waiting on several
+   wires at once: */
+extern void sanei_w_send (Wire *w, SANE_Word proc_num,
+			  WireCodecFunc w_arg, void *arg);
+extern void sanei_w_receive (Wire *w, WireCodecFunc w_reply, void *reply);
 extern void sanei_w_reply (Wire *w, WireCodecFunc w_reply, void *reply);
 extern void sanei_w_free (Wire *w, WireCodecFunc w_reply, void *reply);
 
+/* Between sanei_w_arena_begin() and the matching sanei_w_arena_end(),
+   decoded values are carved out of blocks owned by the wire instead of
+   being malloc()ed one by one.  sanei_w_free() does nothing then; the
+   outermost sanei_w_arena_end() releases everything decoded since the
+   outermost begin at once, so no decoded value may be used after it.
+   Pairs may nest. */
+extern void sanei_w_arena_begin (Wire *w);
+extern void sanei_w_arena_end (Wire *w);
+/* malloc() or, inside an arena, a piece of the arena */
+extern void *sanei_w_alloc (Wire *w, size_t size);
+
 #endif /* sanei_wire_h */
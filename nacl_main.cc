@@ -40,8 +40,10 @@
 #include "ppapi/cpp/instance.h"
 #include "ppapi/cpp/module.h"
 #include "ppapi/cpp/var.h"
+#include "ppapi/cpp/var_array_buffer.h"
 
 #include "sane/nacl_jscall.h"
+#include "sane/nacl_stream.h"
 #include "sane/nacl_util.h"
 #include "sane/sane.h"
 
@@ -53,8 +55,6 @@ using std::vector;
 using std::tr1::shared_ptr;
 
 namespace scanley {
-class FakePipeManager;
-
 void *LaunchSane(void *args) {
   printf("about to call sane_init\n");
   SANE_Status rc = sane_init(NULL, NULL);
@@ -78,10 +78,39 @@ void *LaunchSane(void *args) {
   }
   printf("done listing devices\n");
   // TODO(sdk_user): 1. Make this function handle the incoming message.
+  return NULL;
+}
+
+// Scans a page on the first device, streaming it to the page as it goes.
+void ScanToPage(SynchronousJavaScriptCaller* caller) {
+  const SANE_Device** device_list;
+  SANE_Status rc = sane_get_devices(&device_list, SANE_TRUE);
+  if (rc != SANE_STATUS_GOOD || !device_list[0]) {
+    printf("no device to scan with\n");
+    return;
+  }
+  SANE_Handle handle;
+  rc = sane_open(device_list[0]->name, &handle);
+  if (rc != SANE_STATUS_GOOD) {
+    printf("sane_open failed: %s\n", sane_strstatus(rc));
+    return;
+  }
+  rc = sane_start(handle);
+  if (rc == SANE_STATUS_GOOD) {
+    ImageStreamer streamer(caller);
+    rc = streamer.StreamImage(handle);
+    printf("scan done: %s, %llu bytes\n", sane_strstatus(rc),
+           static_cast<unsigned long long>(streamer.bytes_streamed()));
+  } else {
+    printf("sane_start failed: %s\n", sane_strstatus(rc));
+  }
+  sane_close(handle);
 }
 }  // namespace scanley
 
 
+using scanley::ScopedPthreadLock;
+
 /// The Instance class.  One of these exists for each instance of your NaCl
 /// module on the web page.  The browser will ask the Module object to create
 /// a new Instance for each occurence of the <embed> tag that has these
@@ -96,11 +125,17 @@ class HelloTutorialInstance : public pp::Instance {
   pthread_t sane_thread_;
   bool started_;
 
+  pthread_mutex_t scan_mutex_;
+  bool sane_joined_;  // LaunchSane() has finished
+  bool scanning_;
+
  public:
   /// The constructor creates the plugin-side instance.
   /// @param[in] instance the handle to the browser-side plugin instance.
   explicit HelloTutorialInstance(PP_Instance instance)
-      : pp::Instance(instance), started_(false), js_caller_(this) {
+      : pp::Instance(instance), started_(false), sane_joined_(false),
+        scanning_(false), js_caller_(this) {
+    pthread_mutex_init(&scan_mutex_, NULL);
     if (!g_js_caller)
       g_js_caller = &js_caller_;
   }
@@ -111,22 +146,46 @@ class HelloTutorialInstance : public pp::Instance {
     PostMessage(var_reply);
   }
 
-  // Returns true if handled
+  // Replies to JS calls arrive as ArrayBuffers of frames (see
+  // nacl_jscall.h). Returns true if handled
   bool HandleJSCallReply(const pp::Var& msg) {
-    if (!msg.is_string())
-      return false;
-    string str = msg.AsString();
-    printf("Got message: [%s]\n", str.c_str());
-    size_t idx = 0;
-    int rc = sscanf(str.c_str(), "%zu:", &idx);
-    if (rc <= 0)
-      return false;
-    size_t colon = str.find(':');
-    if (colon == string::npos)
+    if (!msg.is_array_buffer())
       return false;
-    string after_colon = str.substr(colon + 1);
-    js_caller_.HandleReply(idx, after_colon);
-    return true;
+    return js_caller_.HandleReply(pp::VarArrayBuffer(msg));
+  }
+
+  static void* StaticScan(void* self) {
+    static_cast<HelloTutorialInstance*>(self)->Scan();
+    return NULL;
+  }
+
+  void Scan() {
+    {
+      ScopedPthreadLock lock(&scan_mutex_);
+      if (!sane_joined_) {
+        pthread_join(sane_thread_, NULL);
+        sane_joined_ = true;
+      }
+    }
+    scanley::ScanToPage(&js_caller_);
+    ScopedPthreadLock lock(&scan_mutex_);
+    scanning_ = false;
+  }
+
+  // "scan" from the page starts a scan, streamed back with ImageStreamer.
+  void StartScan() {
+    ScopedPthreadLock lock(&scan_mutex_);
+    if (scanning_)
+      return;
+    pthread_t scan_thread;
+    int rc = pthread_create(&scan_thread, NULL, &StaticScan, this);
+    if (rc) {
+      printf("pthread_create returned: %d\n", rc);
+      PostString("pthread_create failed");
+      return;
+    }
+    pthread_detach(scan_thread);
+    scanning_ = true;
   }
 
   /// Handler for messages coming in from the browser via postMessage().  The
@@ -144,8 +203,11 @@ class HelloTutorialInstance : public pp::Instance {
     if (HandleJSCallReply(msg))
       return;
 
-    if (started_)
+    if (started_) {
+      if (msg.is_string() && msg.AsString() == "scan")
+        StartScan();
       return;
+    }
     started_ = true;
     int rc = pthread_create(&sane_thread_, NULL, scanley::LaunchSane, NULL);
     if (rc) {
@@ -184,270 +246,14 @@ Module* CreateModule() {
 }
 }  // namespace pp
 
-namespace scanley {
-
-const size_t kBufBytes = 64 * 1024;
-
-class FakePipe {
- public:
-  FakePipe();
-
-  ssize_t Read(unsigned char* buf, size_t len);
-  ssize_t Write(const unsigned char* buf, size_t len);
-  void SetReadNonblock(bool nonblock) {
-    ScopedPthreadLock lock(&mutex_);
-    read_nonblock_ = nonblock;
-  }
-  void SetWriteNonblock(bool nonblock) {
-    ScopedPthreadLock lock(&mutex_);
-    write_nonblock_ = nonblock;
-  }
-
- private:
-  pthread_cond_t cond_;
-  pthread_mutex_t mutex_;
-
-  unsigned char buf_[kBufBytes];
-  size_t size_;
-  size_t next_read_;  // index into buf_
-
-  size_t NextWrite() const { return (next_read_ + size_) % kBufBytes; }
-
-  bool read_nonblock_:1;
-  bool write_nonblock_:1;
-};
-
-FakePipe::FakePipe()
-    : read_nonblock_(false), write_nonblock_(false) {
-  pthread_cond_init(&cond_, NULL);
-  pthread_mutex_init(&mutex_, NULL);
-}
-
-ssize_t FakePipe::Write(const unsigned char* buf, size_t len) {
-  ScopedPthreadLock lock(&mutex_);
-  for (size_t in_pos = 0; in_pos < len; in_pos++) {
-    if (size_ < kBufBytes) {
-      // Write another byte now
-      buf_[NextWrite()] = buf[in_pos];
-      size_++;
-
-      // Kick other thread(s) incase they can read more now.
-      int rc = pthread_cond_broadcast(&cond_);
-      if (rc)
-        printf("ERR: pthread_cond_broadcast: %d\n", rc);
-    } else {
-      // Can't write another byte now.
-      if (write_nonblock_) {
-        // Will return early
-        if (in_pos > 0) {
-          // We at least wrote some bytes. Return partial amount
-          return in_pos;
-        } else {
-          errno = EAGAIN;
-          return -1;
-        }
-      } else {
-        // Time to block until there is space to write
-        int rc = pthread_cond_wait(&cond_, &mutex_);
-        if (rc)
-          printf("ERR: (write) pthread_cond_wait: %d\n", rc);
-      }
-    }
-  }
-  return len;  // Full write success
-}
-
-ssize_t FakePipe::Read(unsigned char* buf, size_t len) {
-  ScopedPthreadLock lock(&mutex_);
-  // TODO(adlr): optimize
-  for (size_t out_pos = 0; out_pos < len; out_pos++) {
-    if (size_) {
-      // Can read another byte now
-      buf[out_pos] = buf_[next_read_];
-      next_read_ = (next_read_ + 1) % kBufBytes;
-      size_--;
-
-      // Kick other thread(s) incase they can write more now.
-      int rc = pthread_cond_broadcast(&cond_);
-      if (rc)
-        printf("ERR: pthread_cond_broadcast: %d\n", rc);
-    } else {
-      // Can't read another byte.
-      if (read_nonblock_) {
-        // Will return early
-        if (out_pos > 0) {
-          // We at least read some bytes. Return partial amount
-          return out_pos;
-        } else {
-          errno = EAGAIN;
-          return -1;
-        }
-      } else {
-        // Time to block until there is data to read
-        int rc = pthread_cond_wait(&cond_, &mutex_);
-        if (rc)
-          printf("ERR: pthread_cond_wait: %d\n", rc);
-      }
-    }
-  }
-  return len;  // full read success
-}
-
-class FakePipeManager {
- public:
-  FakePipeManager();
-  int Pipe(int pipe_fd[2]);
-
-  ssize_t Read(int fd, unsigned char* buf, size_t len);
-  ssize_t Write(int fd, const unsigned char* buf, size_t len);
-  int FcntlF_SETFL(int fd, long flags);
-
- private:
-  pthread_mutex_t mutex_;
-  // maps of fd->FakePipe
-  map<int, shared_ptr<FakePipe> > readers_;
-  map<int, shared_ptr<FakePipe> > writers_;
-};
-
-FakePipeManager::FakePipeManager() {
-  pthread_mutex_init(&mutex_, NULL);
-}
-
-int FakePipeManager::Pipe(int pipe_fd[2]) {
-  shared_ptr<FakePipe> new_pipe(new FakePipe);
-  ScopedPthreadLock lock(&mutex_);
-  
-  vector<int> fds;
-
-  // Find unused file descriptors
-  for (int fd = 0; fds.size() < 2; fd++) {
-    if (fd > 200) {
-      printf("Pipe: ran out of fds\n");
-      return -1;
-    }
-    if (MapContainsKey(readers_, fd) || MapContainsKey(writers_, fd))
-      continue;
-    fds.push_back(fd);
-  }
-  readers_[fds[0]] = new_pipe;
-  writers_[fds[1]] = new_pipe;
-  pipe_fd[0] = fds[0];
-  pipe_fd[1] = fds[1];
-}
-
-ssize_t FakePipeManager::Read(int fd, unsigned char* buf, size_t len) {
-  FakePipe* pipe = NULL;
-  {
-    ScopedPthreadLock lock(&mutex_);
-    if (!MapContainsKey(readers_, fd)) {
-      printf("no such fd for reading: %d\n", fd);
-      return -1;
-    }
-    pipe = readers_[fd].get();
-  }
-  return pipe->Read(buf, len);
-}
-
-ssize_t FakePipeManager::Write(int fd, const unsigned char* buf, size_t len) {
-  FakePipe* pipe = NULL;
-  {
-    ScopedPthreadLock lock(&mutex_);
-    if (!MapContainsKey(writers_, fd)) {
-      printf("no such fd for writing: %d\n", fd);
-      return -1;
-    }
-    pipe = writers_[fd].get();
-  }
-  return pipe->Write(buf, len);
-}
-
-int FakePipeManager::FcntlF_SETFL(int fd, long flags) {
-  FakePipe* pipe = NULL;
-  bool is_reader = false;
-  {
-    ScopedPthreadLock lock(&mutex_);
-    if (MapContainsKey(writers_, fd)) {
-      pipe = writers_[fd].get();
-    } else if (MapContainsKey(readers_, fd)) {
-      pipe = readers_[fd].get();
-      is_reader = true;
-    } else {
-      printf("Missing pipe for fcntl fd %d\n", fd);
-      return -1;
-    }
-  }
-
-  if (is_reader)
-    pipe->SetReadNonblock((flags & O_NONBLOCK) != 0);
-  else
-    pipe->SetWriteNonblock((flags & O_NONBLOCK) != 0);
-
-  return 0;
-}
-
-}  // namespace scanley
-
-using scanley::FakePipeManager;
-using scanley::ScopedPthreadLock;
-
-namespace {
-
-FakePipeManager* g_fake_pipe_manager = NULL;
-pthread_mutex_t g_fake_pipe_manager_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-}  // namespace {}
+// pipe(), read(), write(), close(), fcntl(), poll() and select() for the
+// fake pipes are in sanei/nacl_pipe.cc.
 
 extern "C" {
 
-  int pipe(int pipefd[2]) {
-    {
-      ScopedPthreadLock lock(&g_fake_pipe_manager_mutex);
-      if (!g_fake_pipe_manager) {
-        g_fake_pipe_manager = new FakePipeManager;
-      }
-    }
-    return g_fake_pipe_manager->Pipe(pipefd);
-  }
-
-  ssize_t pipe_write(int fd, const void *buf, size_t count) {
-    if (!g_fake_pipe_manager) {
-      printf("No pipe manager!\n");
-      return -1;
-    }
-    return g_fake_pipe_manager->Write(fd, reinterpret_cast<const unsigned char*>(buf), count);
-  }
-
-  ssize_t pipe_read(int fd, void *buf, size_t count) {
-    if (!g_fake_pipe_manager) {
-      printf("No pipe manager (read)!\n");
-      return -1;
-    }
-    return g_fake_pipe_manager->Read(fd, reinterpret_cast<unsigned char*>(buf), count);
-  }
-
-  int fcntl(int fd, int cmd, ...) {
-    switch(cmd) {
-      case F_SETFL: {
-        if (!g_fake_pipe_manager) {
-          printf("No pipe manager (read)!\n");
-          return -1;
-        }
-        long flags = 0;
-
-        va_list ap;
-        va_start(ap, cmd);
-        flags = va_arg(ap, long);
-        va_end(ap);
-        return g_fake_pipe_manager->FcntlF_SETFL(fd, flags);
-      }        
-      default: {
-        printf("Unhandled fcntl(fd=%d, cmd=%d)\n", fd, cmd);
-        return -1;
-      }
-    }
-  }
+// NaCl's libc lacks these.
+#ifdef __native_client__
 
-// Signal stubs
 int sigpending(sigset_t *set) {
   return -1;  // error
 }
@@ -480,4 +286,5 @@ int sigpending(sigset_t *set) {
   int sanei_sigprocmask(int how, const sigset_t *set, sigset_t *oldset) {
     return -1;
   }
+#endif  // __native_client__
 }
@@ -2,23 +2,80 @@
 
 #include "sane/nacl_jscall.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
 #include <string>
 #include <map>
 #include <utility>
 
-#include "ppapi/cpp/message_loop.h"
+#include "ppapi/cpp/module.h"
 
 #include "sane/nacl_util.h"
 
 using std::string;
 using std::map;
 using std::pair;
+using std::vector;
 
 namespace scanley {
 
+JavaScriptCall::JavaScriptCall(pthread_mutex_t* mutex)
+    : mutex_(mutex),
+      done_(false),
+      opcode_(kJSOpText),
+      params_length_(0),
+      payload_(NULL),
+      payload_length_(0),
+      in_place_(false),
+      reply_buf_(NULL),
+      reply_capacity_(0),
+      reply_length_(0),
+      status_(0) {
+  pthread_cond_init(&cond_, NULL);
+}
+
+JavaScriptCall::~JavaScriptCall() {
+  pthread_cond_destroy(&cond_);
+}
+
+const string& JavaScriptCall::Wait() {
+  ScopedPthreadLock lock(mutex_);
+  while (!done_)
+    pthread_cond_wait(&cond_, mutex_);
+  return reply_;
+}
+
+bool JavaScriptCall::TimedWait(int timeout_ms) {
+  if (timeout_ms < 0) {
+    Wait();
+    return true;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  struct timespec deadline;
+  long nsec = now.tv_usec * 1000L + (timeout_ms % 1000) * 1000000L;
+  deadline.tv_sec = now.tv_sec + timeout_ms / 1000 + nsec / 1000000000L;
+  deadline.tv_nsec = nsec % 1000000000L;
+
+  ScopedPthreadLock lock(mutex_);
+  while (!done_) {
+    if (pthread_cond_timedwait(&cond_, mutex_, &deadline) == ETIMEDOUT)
+      break;
+  }
+  return done_;
+}
+
+bool JavaScriptCall::done() {
+  ScopedPthreadLock lock(mutex_);
+  return done_;
+}
+
 SynchronousJavaScriptCaller::SynchronousJavaScriptCaller(
     pp::Instance* instance)
-    : next_id_(0), pp_instance_(instance) {
+    : next_id_(0), run_pending_(false), pp_instance_(instance) {
   pthread_mutex_init(&mutex_, NULL);
 }
 
@@ -28,68 +85,210 @@ void SynchronousJavaScriptCaller::StaticRun(void* self, int32_t unused) {
   me->Run();
 }
 
+namespace {
+
+void PutFrameHeader(unsigned char* out, uint32_t id, uint16_t opcode,
+                    size_t length) {
+  PutLE32(out, id);
+  PutLE16(out + 4, opcode);
+  PutLE16(out + 6, 0);
+  PutLE32(out + 8, length);
+}
+
+}  // namespace {}
+
+// Sends everything in the outbox, in order: runs of ordinary frames are
+// batched into one ArrayBuffer each, in-place calls go as they are.
 void SynchronousJavaScriptCaller::Run() {
-  printf("JS Run() called\n");
-  ScopedPthreadLock lock(&mutex_);
-  printf("JS Run() got lock\n");
-  while (!outbox_.empty()) {
-    const pair<size_t, string>& msg = *outbox_.begin();
-    char buf[msg.second.size() + 20];
-    int rc = snprintf(buf, sizeof(buf), "%zu:%s", msg.first, msg.second.c_str());
-    if (rc <= 0) {
-      fprintf(stderr, "snprintf failed");
-      return;
-    }
-    outbox_.erase(outbox_.begin());
+  vector<pp::VarArrayBuffer> messages;
+  {
+    // Payloads are copied with the lock held so that Cancel() can't return,
+    // and the caller free a payload, while it is being read.
+    ScopedPthreadLock lock(&mutex_);
+    run_pending_ = false;
+
+    size_t begin = 0;
+    while (begin < outbox_.size()) {
+      const JavaScriptCall* first = outbox_[begin].second.get();
+      if (first->in_place_) {
+        pp::VarArrayBuffer buffer(first->buffer_);
+        PutFrameHeader(static_cast<unsigned char*>(buffer.Map()),
+                       outbox_[begin].first, first->opcode_,
+                       first->payload_length_);
+        buffer.Unmap();
+        messages.push_back(buffer);
+        begin++;
+        continue;
+      }
 
-    ScopedPthreadUnlock unlock(&mutex_);
+      size_t end = begin;
+      size_t total = 0;
+      for (; end < outbox_.size() && !outbox_[end].second->in_place_; end++)
+        total += kJSFrameHeaderBytes + outbox_[end].second->params_length_ +
+            outbox_[end].second->payload_length_;
 
-    pp::Var pp_msg = pp::Var(buf);
-    printf("Posting message: %s\n", buf);
-    pp_instance_->PostMessage(pp_msg);
+      pp::VarArrayBuffer pp_msg(total);
+      unsigned char* out = static_cast<unsigned char*>(pp_msg.Map());
+      for (size_t i = begin; i < end; i++) {
+        const JavaScriptCall* call = outbox_[i].second.get();
+        PutFrameHeader(out, outbox_[i].first, call->opcode_,
+                       call->params_length_ + call->payload_length_);
+        out += kJSFrameHeaderBytes;
+        memcpy(out, call->params_, call->params_length_);
+        out += call->params_length_;
+        if (call->payload_length_)
+          memcpy(out, call->payload_, call->payload_length_);
+        out += call->payload_length_;
+      }
+      pp_msg.Unmap();
+      messages.push_back(pp_msg);
+      begin = end;
+    }
+    outbox_.clear();
   }
+  for (size_t i = 0; i < messages.size(); i++)
+    pp_instance_->PostMessage(messages[i]);
 }
 
 string SynchronousJavaScriptCaller::Call(const string& request) {
-  printf("Entering Call(%s)\n", request.c_str());
+  return CallAsync(request)->Wait();
+}
+
+JavaScriptCallHandle SynchronousJavaScriptCaller::CallAsync(
+    const string& request) {
+  JavaScriptCallHandle call(new JavaScriptCall(&mutex_));
+  call->request_ = request;
+  call->payload_ = reinterpret_cast<const unsigned char*>(
+      call->request_.data());
+  call->payload_length_ = call->request_.size();
+  return Queue(call);
+}
+
+JavaScriptCallHandle SynchronousJavaScriptCaller::CallAsync(
+    uint16_t opcode, const void* params, size_t params_length,
+    const void* payload, size_t payload_length,
+    void* reply_buf, size_t reply_capacity) {
+  JavaScriptCallHandle call(new JavaScriptCall(&mutex_));
+  call->opcode_ = opcode;
+  if (params_length > kJSMaxParamBytes) {
+    fprintf(stderr, "CallAsync: %zu bytes of params is too many\n",
+            params_length);
+    params_length = kJSMaxParamBytes;
+  }
+  memcpy(call->params_, params, params_length);
+  call->params_length_ = params_length;
+  call->payload_ = static_cast<const unsigned char*>(payload);
+  call->payload_length_ = payload_length;
+  call->reply_buf_ = static_cast<unsigned char*>(reply_buf);
+  call->reply_capacity_ = reply_capacity;
+  return Queue(call);
+}
+
+JavaScriptCallHandle SynchronousJavaScriptCaller::CallAsyncInPlace(
+    uint16_t opcode, const pp::VarArrayBuffer& buffer, size_t payload_length) {
+  if (buffer.ByteLength() < kJSFrameHeaderBytes + payload_length) {
+    fprintf(stderr, "CallAsyncInPlace: %zu byte payload in a %u byte buffer\n",
+            payload_length, buffer.ByteLength());
+    payload_length = buffer.ByteLength() < kJSFrameHeaderBytes ? 0 :
+        buffer.ByteLength() - kJSFrameHeaderBytes;
+  }
+  JavaScriptCallHandle call(new JavaScriptCall(&mutex_));
+  call->opcode_ = opcode;
+  call->buffer_ = buffer;
+  call->in_place_ = true;
+  call->payload_length_ = payload_length;
+  return Queue(call);
+}
+
+JavaScriptCallHandle SynchronousJavaScriptCaller::Queue(
+    const JavaScriptCallHandle& call) {
   ScopedPthreadLock lock(&mutex_);
-  size_t idx = next_id_++;
-  printf("  lock acquired: %zu\n", idx);
-  outbox_[idx] = request;
-
-  pp::Module::Get()->core()->CallOnMainThread(
-      0,
-      pp::CompletionCallback(&StaticRun, this),
-      PP_OK);
-
-
-  //int rc = pp::MessageLoop::GetForMainThread().PostWork(*this, 0);
-  //const char* rc_text = "unknown";
-  //switch (rc) {
-  //  case PP_OK: rc_text = "PP_OK"; break;
-  //  case PP_ERROR_BADRESOURCE: rc_text = "PP_ERROR_BADRESOURCE"; break;
-  //  case PP_ERROR_BADARGUMENT: rc_text = "PP_ERROR_BADARGUMENT"; break;
-  //  case PP_ERROR_FAILED: rc_text = "PP_ERROR_FAILED"; break;
-  //}
-  //printf("PostWork returned %d %s\n", rc, rc_text);
-  do {
-    printf("waiting for work to be completed: %zu\n", idx);
-    pthread_cond_wait(&cond_, &mutex_);
-  } while (!MapContainsKey(inbox_, idx));
-  // Got reply
-  string reply = inbox_[idx];
-  printf("got reply: [%s] %zu\n", reply.c_str(), idx);
-  inbox_.erase(idx);
-  return reply;
+  uint32_t idx = next_id_++;
+  in_flight_[idx] = call;
+  outbox_.push_back(std::make_pair(idx, call));
+
+  // One Run() drains the whole outbox, so only schedule another if none is
+  // pending already.
+  if (!run_pending_) {
+    run_pending_ = true;
+    pp::Module::Get()->core()->CallOnMainThread(
+        0,
+        pp::CompletionCallback(&StaticRun, this),
+        PP_OK);
+  }
+  return call;
+}
+
+bool SynchronousJavaScriptCaller::Cancel(const JavaScriptCallHandle& call) {
+  ScopedPthreadLock lock(&mutex_);
+  if (call->done_)
+    return false;
+  for (map<uint32_t, JavaScriptCallHandle>::iterator it = in_flight_.begin();
+       it != in_flight_.end(); ++it) {
+    if (it->second == call) {
+      in_flight_.erase(it);
+      break;
+    }
+  }
+  // If Run() hasn't sent it yet, don't send it at all: the payload may be
+  // freed as soon as we return.
+  for (size_t i = 0; i < outbox_.size(); i++) {
+    if (outbox_[i].second == call) {
+      outbox_.erase(outbox_.begin() + i);
+      break;
+    }
+  }
+  call->status_ = kJSStatusCancelled;
+  call->done_ = true;
+  pthread_cond_broadcast(&call->cond_);
+  return true;
 }
 
 // Called from main thread
-void SynchronousJavaScriptCaller::HandleReply(
-    size_t idx, const std::string& reply) {
-  printf("HandleReply(%s) called\n", reply.c_str());
+bool SynchronousJavaScriptCaller::HandleReply(pp::VarArrayBuffer replies) {
+  size_t size = replies.ByteLength();
+  const unsigned char* in = static_cast<const unsigned char*>(replies.Map());
+  const unsigned char* end = in + size;
+  bool ok = true;
+
   ScopedPthreadLock lock(&mutex_);
-  inbox_[idx] = reply;
-  pthread_cond_broadcast(&cond_);
+  while (in < end) {
+    if (static_cast<size_t>(end - in) < kJSFrameHeaderBytes) {
+      fprintf(stderr, "HandleReply: truncated frame header\n");
+      ok = false;
+      break;
+    }
+    uint32_t idx = GetLE32(in);
+    uint16_t status = GetLE16(in + 6);
+    size_t length = GetLE32(in + 8);
+    in += kJSFrameHeaderBytes;
+    if (static_cast<size_t>(end - in) < length) {
+      fprintf(stderr, "HandleReply: truncated payload for id %u\n", idx);
+      ok = false;
+      break;
+    }
+
+    map<uint32_t, JavaScriptCallHandle>::iterator it = in_flight_.find(idx);
+    if (it == in_flight_.end()) {
+      fprintf(stderr, "HandleReply: no call with id %u\n", idx);
+    } else {
+      JavaScriptCall* call = it->second.get();
+      if (call->reply_buf_) {
+        memcpy(call->reply_buf_, in,
+               length < call->reply_capacity_ ? length : call->reply_capacity_);
+      } else {
+        call->reply_.assign(reinterpret_cast<const char*>(in), length);
+      }
+      call->reply_length_ = length;
+      call->status_ = status;
+      call->done_ = true;
+      pthread_cond_broadcast(&call->cond_);
+      in_flight_.erase(it);
+    }
+    in += length;
+  }
+  replies.Unmap();
+  return ok;
 }
 
 }  // namespace scanley
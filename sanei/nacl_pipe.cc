@@ -0,0 +1,736 @@
+// copyright...
+
+#include "sane/nacl_pipe.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __native_client__
+#include <irt.h>
+#else
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+
+#include "sane/nacl_util.h"
+
+using std::tr1::shared_ptr;
+using std::vector;
+
+namespace scanley {
+
+namespace {
+
+// Converts a relative timeout to the absolute time pthread_cond_timedwait
+// wants.
+struct timespec DeadlineFromNow(int timeout_ms) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  struct timespec deadline;
+  deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+  long nsec = now.tv_usec * 1000L + (timeout_ms % 1000) * 1000000L;
+  deadline.tv_sec += nsec / 1000000000L;
+  deadline.tv_nsec = nsec % 1000000000L;
+  return deadline;
+}
+
+}  // namespace {}
+
+PipeWaiter::PipeWaiter() : notified_(false) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+}
+
+PipeWaiter::~PipeWaiter() {
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void PipeWaiter::Notify() {
+  ScopedPthreadLock lock(&mutex_);
+  notified_ = true;
+  pthread_cond_signal(&cond_);
+}
+
+bool PipeWaiter::Wait(int timeout_ms) {
+  ScopedPthreadLock lock(&mutex_);
+  if (timeout_ms < 0) {
+    while (!notified_)
+      pthread_cond_wait(&cond_, &mutex_);
+  } else {
+    struct timespec deadline = DeadlineFromNow(timeout_ms);
+    while (!notified_) {
+      int rc = pthread_cond_timedwait(&cond_, &mutex_, &deadline);
+      if (rc == ETIMEDOUT)
+        break;
+      if (rc)
+        printf("ERR: pthread_cond_timedwait: %d\n", rc);
+    }
+  }
+  bool notified = notified_;
+  notified_ = false;
+  return notified;
+}
+
+const size_t FakePipe::kDefaultCapacity;
+
+FakePipe::FakePipe(size_t capacity)
+    : buf_(new unsigned char[capacity ? capacity : kDefaultCapacity]),
+      capacity_(capacity ? capacity : kDefaultCapacity),
+      size_(0),
+      next_read_(0),
+      read_nonblock_(false),
+      write_nonblock_(false),
+      reader_closed_(false),
+      writer_closed_(false) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&not_empty_, NULL);
+  pthread_cond_init(&not_full_, NULL);
+}
+
+FakePipe::~FakePipe() {
+  pthread_cond_destroy(&not_full_);
+  pthread_cond_destroy(&not_empty_);
+  pthread_mutex_destroy(&mutex_);
+  delete[] buf_;
+}
+
+void FakePipe::SetReadNonblock(bool nonblock) {
+  ScopedPthreadLock lock(&mutex_);
+  read_nonblock_ = nonblock;
+}
+
+void FakePipe::SetWriteNonblock(bool nonblock) {
+  ScopedPthreadLock lock(&mutex_);
+  write_nonblock_ = nonblock;
+}
+
+bool FakePipe::ReadNonblock() {
+  ScopedPthreadLock lock(&mutex_);
+  return read_nonblock_;
+}
+
+bool FakePipe::WriteNonblock() {
+  ScopedPthreadLock lock(&mutex_);
+  return write_nonblock_;
+}
+
+void FakePipe::CloseReader() {
+  ScopedPthreadLock lock(&mutex_);
+  reader_closed_ = true;
+  // Blocked writers must notice so they can fail with EPIPE.
+  pthread_cond_broadcast(&not_full_);
+  NotifyWaiters();
+}
+
+void FakePipe::CloseWriter() {
+  ScopedPthreadLock lock(&mutex_);
+  writer_closed_ = true;
+  // Blocked readers must notice so they can return EOF.
+  pthread_cond_broadcast(&not_empty_);
+  NotifyWaiters();
+}
+
+short FakePipe::ReaderEvents() {
+  ScopedPthreadLock lock(&mutex_);
+  short events = 0;
+  if (size_ > 0)
+    events |= POLLIN;
+  if (writer_closed_)
+    events |= POLLHUP;
+  return events;
+}
+
+short FakePipe::WriterEvents() {
+  ScopedPthreadLock lock(&mutex_);
+  if (reader_closed_)
+    return POLLERR;
+  return size_ < capacity_ ? POLLOUT : 0;
+}
+
+void FakePipe::AddWaiter(PipeWaiter* waiter) {
+  ScopedPthreadLock lock(&mutex_);
+  waiters_.insert(waiter);
+}
+
+void FakePipe::RemoveWaiter(PipeWaiter* waiter) {
+  ScopedPthreadLock lock(&mutex_);
+  waiters_.erase(waiter);
+}
+
+void FakePipe::NotifyWaiters() {
+  for (std::set<PipeWaiter*>::iterator it = waiters_.begin();
+       it != waiters_.end(); ++it)
+    (*it)->Notify();
+}
+
+size_t FakePipe::CopyIn(const unsigned char* buf, size_t len) {
+  len = std::min(len, capacity_ - size_);
+  size_t next_write = next_read_ + size_;
+  if (next_write >= capacity_)
+    next_write -= capacity_;
+  // First span runs up to the end of buf_, the second (if any) from the start.
+  size_t first = std::min(len, capacity_ - next_write);
+  memcpy(buf_ + next_write, buf, first);
+  memcpy(buf_, buf + first, len - first);
+  size_ += len;
+  return len;
+}
+
+size_t FakePipe::CopyOut(unsigned char* buf, size_t len) {
+  len = std::min(len, size_);
+  size_t first = std::min(len, capacity_ - next_read_);
+  memcpy(buf, buf_ + next_read_, first);
+  memcpy(buf + first, buf_, len - first);
+  next_read_ += len;
+  if (next_read_ >= capacity_)
+    next_read_ -= capacity_;
+  size_ -= len;
+  return len;
+}
+
+ssize_t FakePipe::Write(const unsigned char* buf, size_t len) {
+  ScopedPthreadLock lock(&mutex_);
+  size_t in_pos = 0;
+  while (in_pos < len) {
+    if (reader_closed_) {
+      if (in_pos > 0)
+        return in_pos;
+      errno = EPIPE;
+      return -1;
+    }
+    if (size_ == capacity_) {
+      // Can't write another byte now.
+      if (write_nonblock_) {
+        if (in_pos > 0)
+          return in_pos;  // We at least wrote some bytes.
+        errno = EAGAIN;
+        return -1;
+      }
+      // Time to block until there is space to write
+      int rc = pthread_cond_wait(&not_full_, &mutex_);
+      if (rc)
+        printf("ERR: (write) pthread_cond_wait: %d\n", rc);
+      continue;
+    }
+    bool was_empty = size_ == 0;
+    in_pos += CopyIn(buf + in_pos, len - in_pos);
+    if (was_empty) {
+      // Kick reader(s) that may be waiting for data.
+      int rc = pthread_cond_broadcast(&not_empty_);
+      if (rc)
+        printf("ERR: pthread_cond_broadcast: %d\n", rc);
+      NotifyWaiters();
+    }
+  }
+  return len;  // Full write success
+}
+
+ssize_t FakePipe::Read(unsigned char* buf, size_t len) {
+  if (len == 0)
+    return 0;
+  ScopedPthreadLock lock(&mutex_);
+  while (size_ == 0) {
+    if (writer_closed_)
+      return 0;  // EOF
+    if (read_nonblock_) {
+      errno = EAGAIN;
+      return -1;
+    }
+    // Time to block until there is data to read
+    int rc = pthread_cond_wait(&not_empty_, &mutex_);
+    if (rc)
+      printf("ERR: pthread_cond_wait: %d\n", rc);
+  }
+  bool was_full = size_ == capacity_;
+  size_t out = CopyOut(buf, len);
+  if (was_full) {
+    // Kick writer(s) that may be waiting for space.
+    int rc = pthread_cond_broadcast(&not_full_);
+    if (rc)
+      printf("ERR: pthread_cond_broadcast: %d\n", rc);
+    NotifyWaiters();
+  }
+  return out;
+}
+
+const int FakePipeManager::kFirstFd;
+const int FakePipeManager::kMaxFds;
+
+FakePipeManager::FakePipeManager(size_t pipe_capacity)
+    : pipe_capacity_(pipe_capacity), slots_(kMaxFds) {
+  pthread_mutex_init(&mutex_, NULL);
+  free_.reserve(kMaxFds);
+  for (int i = kMaxFds - 1; i >= 0; i--)
+    free_.push_back(i);
+}
+
+FakePipeManager::~FakePipeManager() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+int FakePipeManager::Pipe(int pipe_fd[2]) {
+  shared_ptr<FakePipe> new_pipe(new FakePipe(pipe_capacity_));
+  ScopedPthreadLock lock(&mutex_);
+  if (free_.size() < 2) {
+    printf("Pipe: ran out of fds\n");
+    errno = EMFILE;
+    return -1;
+  }
+  for (int i = 0; i < 2; i++) {
+    int index = free_.back();
+    free_.pop_back();
+    Slot* slot = &slots_[index];
+    slot->pipe = new_pipe;
+    slot->in_use = true;
+    slot->is_reader = i == 0;
+    pipe_fd[i] = kFirstFd + index;
+  }
+  return 0;
+}
+
+int FakePipeManager::Close(int fd) {
+  Slot slot;
+  {
+    ScopedPthreadLock lock(&mutex_);
+    if (!IsFakeFd(fd) || !slots_[fd - kFirstFd].in_use) {
+      errno = EBADF;
+      return -1;
+    }
+    Slot* live = &slots_[fd - kFirstFd];
+    slot = *live;
+    live->pipe.reset();
+    live->in_use = false;
+    free_.push_back(fd - kFirstFd);
+  }
+  if (slot.is_reader)
+    slot.pipe->CloseReader();
+  else
+    slot.pipe->CloseWriter();
+  return 0;
+}
+
+bool FakePipeManager::Owns(int fd) {
+  ScopedPthreadLock lock(&mutex_);
+  return IsFakeFd(fd) && slots_[fd - kFirstFd].in_use;
+}
+
+bool FakePipeManager::Lookup(int fd, Slot* slot) {
+  ScopedPthreadLock lock(&mutex_);
+  if (!IsFakeFd(fd) || !slots_[fd - kFirstFd].in_use) {
+    errno = EBADF;
+    return false;
+  }
+  *slot = slots_[fd - kFirstFd];
+  return true;
+}
+
+ssize_t FakePipeManager::Read(int fd, unsigned char* buf, size_t len) {
+  Slot slot;
+  if (!Lookup(fd, &slot) || !slot.is_reader) {
+    printf("no such fd for reading: %d\n", fd);
+    errno = EBADF;
+    return -1;
+  }
+  return slot.pipe->Read(buf, len);
+}
+
+ssize_t FakePipeManager::Write(int fd, const unsigned char* buf, size_t len) {
+  Slot slot;
+  if (!Lookup(fd, &slot) || slot.is_reader) {
+    printf("no such fd for writing: %d\n", fd);
+    errno = EBADF;
+    return -1;
+  }
+  return slot.pipe->Write(buf, len);
+}
+
+int FakePipeManager::FcntlF_SETFL(int fd, long flags) {
+  Slot slot;
+  if (!Lookup(fd, &slot)) {
+    printf("Missing pipe for fcntl fd %d\n", fd);
+    return -1;
+  }
+
+  if (slot.is_reader)
+    slot.pipe->SetReadNonblock((flags & O_NONBLOCK) != 0);
+  else
+    slot.pipe->SetWriteNonblock((flags & O_NONBLOCK) != 0);
+
+  return 0;
+}
+
+int FakePipeManager::FcntlF_GETFL(int fd) {
+  Slot slot;
+  if (!Lookup(fd, &slot))
+    return -1;
+
+  if (slot.is_reader)
+    return O_RDONLY | (slot.pipe->ReadNonblock() ? O_NONBLOCK : 0);
+  return O_WRONLY | (slot.pipe->WriteNonblock() ? O_NONBLOCK : 0);
+}
+
+int FakePipeManager::Poll(struct pollfd* fds, nfds_t nfds, int timeout_ms) {
+  // Hold a reference to every polled pipe so a concurrent Close() can't
+  // free it while we're registered as a waiter.
+  vector<Slot> slots(nfds);
+  PipeWaiter waiter;
+  for (nfds_t i = 0; i < nfds; i++) {
+    if (fds[i].fd < 0 || !Lookup(fds[i].fd, &slots[i]))
+      continue;
+    slots[i].pipe->AddWaiter(&waiter);
+  }
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  int ready = 0;
+  for (;;) {
+    ready = 0;
+    for (nfds_t i = 0; i < nfds; i++) {
+      fds[i].revents = 0;
+      if (fds[i].fd < 0)
+        continue;
+      if (!slots[i].in_use) {
+        fds[i].revents = POLLNVAL;
+      } else {
+        short events = slots[i].is_reader ? slots[i].pipe->ReaderEvents()
+                                          : slots[i].pipe->WriterEvents();
+        // POLLHUP and POLLERR are reported whether or not they were asked for.
+        fds[i].revents = events & (fds[i].events | POLLHUP | POLLERR);
+      }
+      if (fds[i].revents)
+        ready++;
+    }
+    if (ready || timeout_ms == 0)
+      break;
+    int remaining_ms = -1;
+    if (timeout_ms > 0) {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      int elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 +
+          (now.tv_usec - start.tv_usec) / 1000;
+      if (elapsed_ms >= timeout_ms)
+        break;
+      remaining_ms = timeout_ms - elapsed_ms;
+    }
+    waiter.Wait(remaining_ms);
+  }
+
+  for (nfds_t i = 0; i < nfds; i++) {
+    if (slots[i].in_use)
+      slots[i].pipe->RemoveWaiter(&waiter);
+  }
+  return ready;
+}
+
+int FakePipeManager::Select(int nfds, fd_set* readfds, fd_set* writefds,
+                            fd_set* exceptfds, struct timeval* timeout) {
+  vector<struct pollfd> fds;
+  for (int fd = 0; fd < nfds; fd++) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = 0;
+    pfd.revents = 0;
+    if (readfds && FD_ISSET(fd, readfds))
+      pfd.events |= POLLIN;
+    if (writefds && FD_ISSET(fd, writefds))
+      pfd.events |= POLLOUT;
+    if (exceptfds && FD_ISSET(fd, exceptfds))
+      pfd.events |= POLLPRI;
+    if (!pfd.events)
+      continue;
+    if (!Owns(fd)) {
+      errno = EBADF;
+      return -1;
+    }
+    fds.push_back(pfd);
+  }
+
+  int timeout_ms = -1;
+  if (timeout)
+    timeout_ms = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+  int rc = Poll(fds.empty() ? NULL : &fds[0], fds.size(), timeout_ms);
+  if (rc < 0)
+    return rc;
+
+  for (size_t i = 0; i < fds.size(); i++) {
+    if (fds[i].revents & POLLNVAL) {
+      errno = EBADF;
+      return -1;
+    }
+  }
+  if (readfds)
+    FD_ZERO(readfds);
+  if (writefds)
+    FD_ZERO(writefds);
+  if (exceptfds)
+    FD_ZERO(exceptfds);
+  int ready = 0;
+  for (size_t i = 0; i < fds.size(); i++) {
+    short revents = fds[i].revents;
+    // A hung-up or broken pipe selects as readable/writable, as on unix.
+    if ((fds[i].events & POLLIN) && (revents & (POLLIN | POLLHUP))) {
+      FD_SET(fds[i].fd, readfds);
+      ready++;
+    }
+    if ((fds[i].events & POLLOUT) && (revents & (POLLOUT | POLLERR))) {
+      FD_SET(fds[i].fd, writefds);
+      ready++;
+    }
+  }
+  return ready;
+}
+
+}  // namespace scanley
+
+// The libc side of the fake pipes. Backends call pipe(), read(), write(),
+// close(), fcntl(), poll() and select() as usual; these send the open pipes
+// of one FakePipeManager to it and every other fd to the real call.
+
+namespace {
+
+using scanley::FakePipeManager;
+using scanley::ScopedPthreadLock;
+
+FakePipeManager* g_fake_pipe_manager = NULL;
+pthread_mutex_t g_fake_pipe_manager_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The manager if fd is one of its open pipes, else NULL: the fd is real.
+FakePipeManager* PipeOwner(int fd) {
+  FakePipeManager* manager = g_fake_pipe_manager;
+  return manager && manager->Owns(fd) ? manager : NULL;
+}
+
+#ifdef __native_client__
+// NaCl's libc has no poll(), select() or fcntl(), and its read(), write()
+// and close() are the ones being replaced, so real fds go to the IRT.
+const struct nacl_irt_fdio* Fdio() {
+  static struct nacl_irt_fdio fdio;
+  static bool found = nacl_interface_query(NACL_IRT_FDIO_v0_1, &fdio,
+                                           sizeof(fdio)) == sizeof(fdio);
+  return found ? &fdio : NULL;
+}
+
+// Turns an IRT error number into the libc convention.
+int IrtResult(int error, int result) {
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return result;
+}
+#endif
+
+ssize_t RealRead(int fd, void* buf, size_t count) {
+#ifdef __native_client__
+  size_t nread = 0;
+  return IrtResult(Fdio() ? Fdio()->read(fd, buf, count, &nread) : ENOSYS,
+                   nread);
+#else
+  return syscall(SYS_read, fd, buf, count);
+#endif
+}
+
+ssize_t RealWrite(int fd, const void* buf, size_t count) {
+#ifdef __native_client__
+  size_t nwrote = 0;
+  return IrtResult(Fdio() ? Fdio()->write(fd, buf, count, &nwrote) : ENOSYS,
+                   nwrote);
+#else
+  return syscall(SYS_write, fd, buf, count);
+#endif
+}
+
+int RealClose(int fd) {
+#ifdef __native_client__
+  return IrtResult(Fdio() ? Fdio()->close(fd) : ENOSYS, 0);
+#else
+  return syscall(SYS_close, fd);
+#endif
+}
+
+int RealFcntl(int fd, int cmd, long arg) {
+#ifdef __native_client__
+  fprintf(stderr, "nacl_pipe: fcntl(%d, %d) on a real fd\n", fd, cmd);
+  errno = ENOSYS;
+  return -1;
+#else
+  return syscall(SYS_fcntl, fd, cmd, arg);
+#endif
+}
+
+// Waits for timeout_ms (forever if negative) when there is nothing to poll;
+// select(0, NULL, NULL, NULL, &tv) is a common way to sleep.
+int Sleep(int timeout_ms) {
+  struct timespec ts;
+  if (timeout_ms < 0) {
+    ts.tv_sec = 365 * 24 * 3600;
+    ts.tv_nsec = 0;
+  } else {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  }
+  nanosleep(&ts, NULL);
+  return 0;
+}
+
+int RealPoll(struct pollfd* fds, nfds_t nfds, int timeout_ms) {
+#ifdef __native_client__
+  if (nfds == 0)
+    return Sleep(timeout_ms);
+  errno = ENOSYS;
+  return -1;
+#else
+  struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  return syscall(SYS_ppoll, fds, nfds, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+#endif
+}
+
+int RealSelect(int nfds, fd_set* readfds, fd_set* writefds,
+               fd_set* exceptfds, struct timeval* timeout) {
+#ifdef __native_client__
+  if (nfds == 0)
+    return Sleep(timeout ? timeout->tv_sec * 1000 + timeout->tv_usec / 1000
+                         : -1);
+  errno = ENOSYS;
+  return -1;
+#else
+  struct timespec ts;
+  if (timeout) {
+    ts.tv_sec = timeout->tv_sec;
+    ts.tv_nsec = timeout->tv_usec * 1000L;
+  }
+  return syscall(SYS_pselect6, nfds, readfds, writefds, exceptfds,
+                 timeout ? &ts : NULL, NULL);
+#endif
+}
+
+}  // namespace {}
+
+extern "C" {
+
+int pipe(int pipefd[2]) {
+  {
+    ScopedPthreadLock lock(&g_fake_pipe_manager_mutex);
+    if (!g_fake_pipe_manager)
+      g_fake_pipe_manager = new FakePipeManager;
+  }
+  return g_fake_pipe_manager->Pipe(pipefd);
+}
+
+ssize_t read(int fd, void* buf, size_t count) {
+  FakePipeManager* manager = PipeOwner(fd);
+  if (!manager)
+    return RealRead(fd, buf, count);
+  return manager->Read(fd, static_cast<unsigned char*>(buf), count);
+}
+
+ssize_t write(int fd, const void* buf, size_t count) {
+  FakePipeManager* manager = PipeOwner(fd);
+  if (!manager)
+    return RealWrite(fd, buf, count);
+  return manager->Write(fd, static_cast<const unsigned char*>(buf), count);
+}
+
+int close(int fd) {
+  FakePipeManager* manager = PipeOwner(fd);
+  if (!manager)
+    return RealClose(fd);
+  return manager->Close(fd);
+}
+
+int fcntl(int fd, int cmd, ...) {
+  // Only some commands have a third argument.
+  long arg = 0;
+  va_list ap;
+  va_start(ap, cmd);
+  switch (cmd) {
+    case F_DUPFD:
+#ifdef F_DUPFD_CLOEXEC
+    case F_DUPFD_CLOEXEC:
+#endif
+    case F_SETFD:
+    case F_SETFL:
+#ifdef F_SETOWN
+    case F_SETOWN:
+#endif
+      arg = va_arg(ap, int);
+      break;
+    case F_GETLK:
+    case F_SETLK:
+    case F_SETLKW:
+      arg = reinterpret_cast<long>(va_arg(ap, struct flock*));
+      break;
+  }
+  va_end(ap);
+
+  FakePipeManager* manager = PipeOwner(fd);
+  if (!manager)
+    return RealFcntl(fd, cmd, arg);
+  switch (cmd) {
+    case F_GETFL:
+      return manager->FcntlF_GETFL(fd);
+    case F_SETFL:
+      return manager->FcntlF_SETFL(fd, arg);
+  }
+  fprintf(stderr, "nacl_pipe: fcntl(%d, %d) not supported on a pipe\n", fd,
+          cmd);
+  errno = EINVAL;
+  return -1;
+}
+
+int poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+  FakePipeManager* manager = NULL;
+  nfds_t fake = 0;
+  for (nfds_t i = 0; i < nfds; i++) {
+    FakePipeManager* owner = PipeOwner(fds[i].fd);
+    if (owner) {
+      manager = owner;
+      fake++;
+    }
+  }
+  if (fake == 0)
+    return RealPoll(fds, nfds, timeout);
+  if (fake != nfds) {
+    fprintf(stderr, "nacl_pipe: poll can't mix pipes and other fds\n");
+    errno = EINVAL;
+    return -1;
+  }
+  return manager->Poll(fds, nfds, timeout);
+}
+
+int select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds,
+           struct timeval* timeout) {
+  FakePipeManager* manager = NULL;
+  int fake = 0, real = 0;
+  for (int fd = 0; fd < nfds; fd++) {
+    if (!(readfds && FD_ISSET(fd, readfds)) &&
+        !(writefds && FD_ISSET(fd, writefds)) &&
+        !(exceptfds && FD_ISSET(fd, exceptfds)))
+      continue;
+    FakePipeManager* owner = PipeOwner(fd);
+    if (owner) {
+      manager = owner;
+      fake++;
+    } else {
+      real++;
+    }
+  }
+  if (fake == 0)
+    return RealSelect(nfds, readfds, writefds, exceptfds, timeout);
+  if (real) {
+    fprintf(stderr, "nacl_pipe: select can't mix pipes and other fds\n");
+    errno = EINVAL;
+    return -1;
+  }
+  return manager->Select(nfds, readfds, writefds, exceptfds, timeout);
+}
+
+}  // extern "C"
@@ -0,0 +1,127 @@
+// copyright...
+
+#include "sane/nacl_stream.h"
+
+#include <stdio.h>
+
+#include "sane/nacl_util.h"
+
+namespace scanley {
+
+const size_t ImageStreamer::kDefaultChunkBytes;
+const int ImageStreamer::kDefaultChunks;
+const size_t ImageStreamer::kParamsBytes;
+const size_t ImageStreamer::kChunkHeaderBytes;
+const uint32_t ImageStreamer::kImageChunkLast;
+
+ImageStreamer::ImageStreamer(SynchronousJavaScriptCaller* caller,
+                             size_t chunk_bytes, int chunks)
+    : caller_(caller),
+      chunk_bytes_(chunk_bytes),
+      chunks_(chunks),
+      frame_number_(0),
+      bytes_streamed_(0) {
+  for (size_t i = 0; i < chunks_.size(); i++) {
+    chunks_[i].buffer = pp::VarArrayBuffer(
+        kJSFrameHeaderBytes + kChunkHeaderBytes + chunk_bytes_);
+    free_.push_back(&chunks_[i]);
+  }
+}
+
+bool ImageStreamer::Reclaim() {
+  Chunk* chunk = in_flight_.front();
+  in_flight_.pop_front();
+  chunk->call->Wait();
+  bool ok = chunk->call->status() == 0;
+  chunk->call.reset();
+  free_.push_back(chunk);
+  return ok;
+}
+
+bool ImageStreamer::ReclaimAll() {
+  bool ok = true;
+  while (!in_flight_.empty())
+    ok = Reclaim() && ok;
+  return ok;
+}
+
+SANE_Status ImageStreamer::StreamFrame(SANE_Handle handle) {
+  SANE_Parameters params;
+  SANE_Status status = sane_get_parameters(handle, &params);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
+  uint32_t frame = frame_number_++;
+  unsigned char header[kParamsBytes];
+  PutLE32(header, frame);
+  PutLE32(header + 4, params.format);
+  PutLE32(header + 8, params.last_frame);
+  PutLE32(header + 12, params.bytes_per_line);
+  PutLE32(header + 16, params.pixels_per_line);
+  PutLE32(header + 20, params.lines);
+  PutLE32(header + 24, params.depth);
+  JavaScriptCallHandle params_call = caller_->CallAsync(
+      kJSOpImageParams, header, sizeof(header), NULL, 0, NULL, 0);
+
+  uint32_t offset = 0;
+  bool page_ok = true;
+  while (status == SANE_STATUS_GOOD) {
+    if (free_.empty() && !Reclaim()) {
+      page_ok = false;
+      break;
+    }
+    Chunk* chunk = free_.back();
+    free_.pop_back();
+
+    unsigned char* base = static_cast<unsigned char*>(chunk->buffer.Map());
+    unsigned char* data = base + kJSFrameHeaderBytes + kChunkHeaderBytes;
+    size_t filled = 0;
+    while (filled < chunk_bytes_) {
+      SANE_Int length = 0;
+      status = sane_read(handle, data + filled, chunk_bytes_ - filled,
+                         &length);
+      if (status != SANE_STATUS_GOOD)
+        break;
+      filled += length;
+    }
+    bool last = status != SANE_STATUS_GOOD;
+    unsigned char* chunk_header = base + kJSFrameHeaderBytes;
+    PutLE32(chunk_header, frame);
+    PutLE32(chunk_header + 4, offset);
+    PutLE32(chunk_header + 8, last ? kImageChunkLast : 0);
+    PutLE32(chunk_header + 12, 0);
+    chunk->buffer.Unmap();
+
+    chunk->call = caller_->CallAsyncInPlace(kJSOpImageData, chunk->buffer,
+                                            kChunkHeaderBytes + filled);
+    in_flight_.push_back(chunk);
+    offset += filled;
+    bytes_streamed_ += filled;
+  }
+
+  page_ok = ReclaimAll() && page_ok;
+  params_call->Wait();
+  if (!page_ok || params_call->status() != 0) {
+    fprintf(stderr, "ImageStreamer: page stopped frame %u\n", frame);
+    sane_cancel(handle);
+    return SANE_STATUS_CANCELLED;
+  }
+  return status;
+}
+
+SANE_Status ImageStreamer::StreamImage(SANE_Handle handle) {
+  for (;;) {
+    SANE_Status status = StreamFrame(handle);
+    if (status != SANE_STATUS_EOF)
+      return status;
+    SANE_Parameters params;
+    status = sane_get_parameters(handle, &params);
+    if (status != SANE_STATUS_GOOD || params.last_frame)
+      return status == SANE_STATUS_GOOD ? SANE_STATUS_EOF : status;
+    status = sane_start(handle);
+    if (status != SANE_STATUS_GOOD)
+      return status;
+  }
+}
+
+}  // namespace scanley
@@ -1,144 +1,691 @@
 // copyright...
+//
+// libusb-1.0 for NaCl: every call is forwarded to the page as a binary
+// request (see sane/nacl_usb.h) through the JavaScript caller. Synchronous
+// calls block on their reply; transfers submitted with libusb_submit_transfer
+// are all sent at once and completed from libusb_handle_events*.
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <deque>
 #include <string>
+#include <vector>
 
 #include <libusb.h>
 #include "ppapi/cpp/module.h"
 
 #include "sane/nacl_jscall.h"
+#include "sane/nacl_usb.h"
+#include "sane/nacl_util.h"
 
 extern scanley::SynchronousJavaScriptCaller* g_js_caller;
 
+using scanley::GetLE16;
+using scanley::GetLE32;
+using scanley::JavaScriptCallHandle;
+using scanley::PutLE16;
+using scanley::PutLE32;
+using scanley::ScopedPthreadLock;
+using std::deque;
 using std::string;
-
-#define ENTRY fprintf(stderr, "%s entered\n", __func__)
+using std::vector;
 
 struct libusb_device {
-  int js_id;
+  uint32_t js_id;
+  uint8_t bus;
+  uint8_t address;
+  int refcount;
+  struct libusb_device_descriptor desc;
+};
 
-  uint16_t vendor_id;
-  uint16_t product_id;
+struct libusb_device_handle {
+  libusb_device* dev;
+  uint32_t js_handle;
 };
 
+namespace {
+
+// Extra time given to the page to report a timeout itself before we give up
+// on a reply.
+const int kReplyGraceMs = 2000;
+
+// Requests without a timeout of their own (device list, open, descriptors,
+// claim, halt, reset...) get this long, plus the grace.
+const unsigned int kSimpleCallTimeoutMs = 1000;
+
+// A transfer handed to libusb_submit_transfer() and not yet completed.
+struct InFlightTransfer {
+  struct libusb_transfer* transfer;
+  JavaScriptCallHandle call;
+  unsigned char out_actual[4];  // reply to an OUT transfer
+  bool is_out;
+};
+
+pthread_mutex_t g_usb_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Guarded by g_usb_mutex, in submission order. As with libusb, a transfer
+// completes from the first libusb_handle_events*() call after its reply,
+// not after the transfers submitted before it; the page answers the
+// transfers of one endpoint in order, so those still complete in order.
+deque<InFlightTransfer*> g_in_flight;
+
+int StatusToError(uint16_t status) {
+  if (status == scanley::kJSStatusCancelled)
+    return LIBUSB_ERROR_INTERRUPTED;
+  return -static_cast<int>(status);
+}
+
+// Waits for call to complete, allowing the page timeout_ms (0 is forever)
+// plus some grace. Returns a libusb_error.
+int WaitForCall(const JavaScriptCallHandle& call, unsigned int timeout_ms) {
+  int wait_ms = timeout_ms ? timeout_ms + kReplyGraceMs : -1;
+  if (!call->TimedWait(wait_ms)) {
+    fprintf(stderr, "nacl_usb: no reply from page, cancelling\n");
+    if (g_js_caller->Cancel(call))
+      return LIBUSB_ERROR_TIMEOUT;
+  }
+  return StatusToError(call->status());
+}
+
+// Issues a request whose reply is small and goes to *reply.
+int SimpleCall(uint16_t opcode, const unsigned char* params,
+               size_t params_length, string* reply) {
+  if (!g_js_caller) {
+    fprintf(stderr, "no JS caller\n");
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+  JavaScriptCallHandle call = g_js_caller->CallAsync(
+      opcode, params, params_length, NULL, 0, NULL, 0);
+  int rc = WaitForCall(call, kSimpleCallTimeoutMs);
+  if (reply && !rc)
+    *reply = call->Wait();
+  return rc;
+}
+
+int HandleCall(uint16_t opcode, libusb_device_handle* handle,
+               uint32_t arg1, uint32_t arg2, size_t nargs) {
+  unsigned char params[12];
+  PutLE32(params, handle->js_handle);
+  PutLE32(params + 4, arg1);
+  PutLE32(params + 8, arg2);
+  return SimpleCall(opcode, params, 4 + 4 * nargs, NULL);
+}
+
+void ParseDeviceDescriptor(const unsigned char* raw,
+                           struct libusb_device_descriptor* desc) {
+  desc->bLength = raw[0];
+  desc->bDescriptorType = raw[1];
+  desc->bcdUSB = GetLE16(raw + 2);
+  desc->bDeviceClass = raw[4];
+  desc->bDeviceSubClass = raw[5];
+  desc->bDeviceProtocol = raw[6];
+  desc->bMaxPacketSize0 = raw[7];
+  desc->idVendor = GetLE16(raw + 8);
+  desc->idProduct = GetLE16(raw + 10);
+  desc->bcdDevice = GetLE16(raw + 12);
+  desc->iManufacturer = raw[14];
+  desc->iProduct = raw[15];
+  desc->iSerialNumber = raw[16];
+  desc->bNumConfigurations = raw[17];
+}
+
+template<typename T>
+T* CopyToArray(const vector<T>& items) {
+  if (items.empty())
+    return NULL;
+  T* array = new T[items.size()];
+  for (size_t i = 0; i < items.size(); i++)
+    array[i] = items[i];
+  return array;
+}
+
+// Builds libusb's descriptor tree out of a raw configuration descriptor.
+// Class- and vendor-specific descriptors are skipped.
+int ParseConfigDescriptor(const unsigned char* raw, size_t length,
+                          struct libusb_config_descriptor** config) {
+  if (length < LIBUSB_DT_CONFIG_SIZE || raw[1] != LIBUSB_DT_CONFIG)
+    return LIBUSB_ERROR_IO;
+
+  struct libusb_config_descriptor* result =
+      new struct libusb_config_descriptor;
+  memset(result, 0, sizeof(*result));
+  result->bLength = raw[0];
+  result->bDescriptorType = raw[1];
+  result->wTotalLength = GetLE16(raw + 2);
+  result->bNumInterfaces = raw[4];
+  result->bConfigurationValue = raw[5];
+  result->iConfiguration = raw[6];
+  result->bmAttributes = raw[7];
+  result->MaxPower = raw[8];
+
+  // altsettings[interface] and the endpoints of each of those altsettings
+  vector<vector<struct libusb_interface_descriptor> > altsettings;
+  vector<vector<vector<struct libusb_endpoint_descriptor> > > endpoints;
+  vector<int> interface_numbers;
+
+  size_t pos = raw[0];
+  while (pos + 2 <= length) {
+    size_t len = raw[pos];
+    uint8_t type = raw[pos + 1];
+    if (len < 2 || pos + len > length)
+      break;
+    const unsigned char* d = raw + pos;
+    if (type == LIBUSB_DT_INTERFACE && len >= LIBUSB_DT_INTERFACE_SIZE) {
+      struct libusb_interface_descriptor alt;
+      memset(&alt, 0, sizeof(alt));
+      alt.bLength = d[0];
+      alt.bDescriptorType = d[1];
+      alt.bInterfaceNumber = d[2];
+      alt.bAlternateSetting = d[3];
+      alt.bNumEndpoints = d[4];
+      alt.bInterfaceClass = d[5];
+      alt.bInterfaceSubClass = d[6];
+      alt.bInterfaceProtocol = d[7];
+      alt.iInterface = d[8];
+      size_t i = 0;
+      while (i < interface_numbers.size() && interface_numbers[i] != d[2])
+        i++;
+      if (i == interface_numbers.size()) {
+        interface_numbers.push_back(d[2]);
+        altsettings.resize(i + 1);
+        endpoints.resize(i + 1);
+      }
+      altsettings[i].push_back(alt);
+      endpoints[i].resize(altsettings[i].size());
+    } else if (type == LIBUSB_DT_ENDPOINT && len >= LIBUSB_DT_ENDPOINT_SIZE &&
+               !altsettings.empty()) {
+      struct libusb_endpoint_descriptor ep;
+      memset(&ep, 0, sizeof(ep));
+      ep.bLength = d[0];
+      ep.bDescriptorType = d[1];
+      ep.bEndpointAddress = d[2];
+      ep.bmAttributes = d[3];
+      ep.wMaxPacketSize = GetLE16(d + 4);
+      ep.bInterval = d[6];
+      if (len >= LIBUSB_DT_ENDPOINT_AUDIO_SIZE) {
+        ep.bRefresh = d[7];
+        ep.bSynchAddress = d[8];
+      }
+      // Endpoints belong to the most recent interface descriptor.
+      endpoints.back().back().push_back(ep);
+    }
+    pos += len;
+  }
+
+  vector<struct libusb_interface> interfaces(altsettings.size());
+  for (size_t i = 0; i < altsettings.size(); i++) {
+    for (size_t a = 0; a < altsettings[i].size(); a++) {
+      altsettings[i][a].bNumEndpoints = endpoints[i][a].size();
+      altsettings[i][a].endpoint = CopyToArray(endpoints[i][a]);
+    }
+    interfaces[i].altsetting = CopyToArray(altsettings[i]);
+    interfaces[i].num_altsetting = altsettings[i].size();
+  }
+  result->bNumInterfaces = interfaces.size();
+  result->interface = CopyToArray(interfaces);
+  *config = result;
+  return LIBUSB_SUCCESS;
+}
+
+// Fills in the params of a control or bulk/interrupt request.
+void PutTransferParams(unsigned char* params, libusb_device_handle* handle,
+                       unsigned char endpoint, uint32_t length,
+                       unsigned int timeout) {
+  memset(params, 0, scanley::kUsbTransferParamBytes);
+  PutLE32(params, handle->js_handle);
+  params[4] = endpoint;
+  PutLE32(params + 8, length);
+  PutLE32(params + 12, timeout);
+}
+
+void PutControlParams(unsigned char* params, libusb_device_handle* handle,
+                      const unsigned char* setup, unsigned int timeout) {
+  // setup is the 8 byte setup packet, already little endian.
+  PutLE32(params, handle->js_handle);
+  memcpy(params + 4, setup, LIBUSB_CONTROL_SETUP_SIZE);
+  PutLE32(params + 12, timeout);
+}
+
+enum libusb_transfer_status ErrorToTransferStatus(int error) {
+  switch (error) {
+    case LIBUSB_SUCCESS: return LIBUSB_TRANSFER_COMPLETED;
+    case LIBUSB_ERROR_TIMEOUT: return LIBUSB_TRANSFER_TIMED_OUT;
+    case LIBUSB_ERROR_PIPE: return LIBUSB_TRANSFER_STALL;
+    case LIBUSB_ERROR_NO_DEVICE: return LIBUSB_TRANSFER_NO_DEVICE;
+    case LIBUSB_ERROR_OVERFLOW: return LIBUSB_TRANSFER_OVERFLOW;
+    case LIBUSB_ERROR_INTERRUPTED: return LIBUSB_TRANSFER_CANCELLED;
+    default: return LIBUSB_TRANSFER_ERROR;
+  }
+}
+
+// Fills in the results of a finished transfer and runs its callback.
+void CompleteTransfer(InFlightTransfer* in_flight) {
+  struct libusb_transfer* transfer = in_flight->transfer;
+  const JavaScriptCallHandle& call = in_flight->call;
+  int error = StatusToError(call->status());
+  if (in_flight->is_out) {
+    transfer->actual_length = error ? 0 : GetLE32(in_flight->out_actual);
+  } else {
+    size_t capacity = transfer->length;
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+      capacity -= LIBUSB_CONTROL_SETUP_SIZE;
+    transfer->actual_length = call->reply_length() < capacity ?
+        call->reply_length() : capacity;
+    if (!error && call->reply_length() > capacity)
+      error = LIBUSB_ERROR_OVERFLOW;
+  }
+  transfer->status = ErrorToTransferStatus(error);
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+      (transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK)) {
+    int expected = transfer->length;
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+      expected -= LIBUSB_CONTROL_SETUP_SIZE;
+    if (transfer->actual_length < expected)
+      transfer->status = LIBUSB_TRANSFER_ERROR;
+  }
+  delete in_flight;
+
+  uint8_t flags = transfer->flags;
+  if (transfer->callback)
+    transfer->callback(transfer);
+  if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+    libusb_free_transfer(transfer);
+}
+
+}  // namespace {}
+
 int libusb_init(libusb_context **ctx) {
-  ENTRY;
+  if (ctx)
+    *ctx = NULL;
   return 0;
 }
 
 void libusb_set_debug(libusb_context *ctx, int level) {
-  ENTRY;
 }
 
 void libusb_exit(libusb_context *ctx) {
-  ENTRY;
 }
 
 ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
                                            libusb_device ***list) {
-  ENTRY;
-  if (!g_js_caller) {
-    fprintf(stderr, "no JS caller\n");
-    return 0;
-  }
-  string result = g_js_caller->Call("USB:FIND_DEVICES");
-  fprintf(stderr, "get devices, got js reply: %s\n", result.c_str());
+  string reply;
+  int rc = SimpleCall(scanley::kUsbOpGetDevices, NULL, 0, &reply);
+  if (rc < 0)
+    return rc;
 
-  return 0;
+  size_t count = reply.size() / scanley::kUsbDeviceRecordBytes;
+  libusb_device** devices = new libusb_device*[count + 1];
+  const unsigned char* record =
+      reinterpret_cast<const unsigned char*>(reply.data());
+  for (size_t i = 0; i < count; i++) {
+    libusb_device* dev = new libusb_device;
+    dev->js_id = GetLE32(record);
+    dev->bus = record[4];
+    dev->address = record[5];
+    dev->refcount = 1;
+    ParseDeviceDescriptor(record + 8, &dev->desc);
+    devices[i] = dev;
+    record += scanley::kUsbDeviceRecordBytes;
+  }
+  devices[count] = NULL;
+  *list = devices;
+  return count;
 }
+
 void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
                                          int unref_devices) {
-  ENTRY;
+  if (!list)
+    return;
+  if (unref_devices) {
+    for (size_t i = 0; list[i]; i++)
+      libusb_unref_device(list[i]);
+  }
+  delete[] list;
 }
 
 uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev) {
-  ENTRY;
-  return 0;
+  return dev->bus;
 }
 uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev) {
-  ENTRY;
-  return 0;
+  return dev->address;
 }
 int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev,
                                              struct libusb_device_descriptor *desc) {
-  ENTRY;
+  *desc = dev->desc;
   return 0;
 }
 int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **handle) {
-  ENTRY;
+  unsigned char params[4];
+  PutLE32(params, dev->js_id);
+  string reply;
+  int rc = SimpleCall(scanley::kUsbOpOpen, params, sizeof(params), &reply);
+  if (rc < 0)
+    return rc;
+  if (reply.size() < 4)
+    return LIBUSB_ERROR_IO;
+  libusb_device_handle* result = new libusb_device_handle;
+  result->dev = libusb_ref_device(dev);
+  result->js_handle =
+      GetLE32(reinterpret_cast<const unsigned char*>(reply.data()));
+  *handle = result;
   return 0;
 }
 void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle) {
-  ENTRY;
+  if (!dev_handle)
+    return;
+  HandleCall(scanley::kUsbOpClose, dev_handle, 0, 0, 0);
+  libusb_unref_device(dev_handle->dev);
+  delete dev_handle;
 }
 int LIBUSB_CALL libusb_get_config_descriptor(libusb_device *dev,
                                              uint8_t config_index, struct libusb_config_descriptor **config) {
-  ENTRY;
-  return 0;
+  unsigned char params[5];
+  PutLE32(params, dev->js_id);
+  params[4] = config_index;
+  string reply;
+  int rc = SimpleCall(scanley::kUsbOpGetConfigDescriptor, params,
+                      sizeof(params), &reply);
+  if (rc < 0)
+    return rc;
+  return ParseConfigDescriptor(
+      reinterpret_cast<const unsigned char*>(reply.data()), reply.size(),
+      config);
 }
 void LIBUSB_CALL libusb_free_config_descriptor(
     struct libusb_config_descriptor *config) {
-  ENTRY;
+  if (!config)
+    return;
+  for (int i = 0; i < config->bNumInterfaces; i++) {
+    const struct libusb_interface* iface = &config->interface[i];
+    for (int a = 0; a < iface->num_altsetting; a++)
+      delete[] iface->altsetting[a].endpoint;
+    delete[] iface->altsetting;
+  }
+  delete[] config->interface;
+  delete config;
 }
 libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev) {
-  ENTRY;
+  ScopedPthreadLock lock(&g_usb_mutex);
+  dev->refcount++;
   return dev;
 }
+void LIBUSB_CALL libusb_unref_device(libusb_device *dev) {
+  if (!dev)
+    return;
+  {
+    ScopedPthreadLock lock(&g_usb_mutex);
+    if (--dev->refcount > 0)
+      return;
+  }
+  delete dev;
+}
+libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle) {
+  return dev_handle->dev;
+}
 
 int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev,
                                        int interface_number) {
-  ENTRY;
-  return 0;
+  return HandleCall(scanley::kUsbOpClaimInterface, dev, interface_number, 0, 1);
 }
 int LIBUSB_CALL libusb_release_interface(libusb_device_handle *dev,
                                          int interface_number) {
-  ENTRY;
-  return 0;
+  return HandleCall(scanley::kUsbOpReleaseInterface, dev, interface_number, 0,
+                    1);
 }
 int LIBUSB_CALL libusb_clear_halt(libusb_device_handle *dev,
                                   unsigned char endpoint) {
-  ENTRY;
-  return 0;
+  unsigned char params[5];
+  PutLE32(params, dev->js_handle);
+  params[4] = endpoint;
+  return SimpleCall(scanley::kUsbOpClearHalt, params, sizeof(params), NULL);
 }
 int LIBUSB_CALL libusb_reset_device(libusb_device_handle *dev) {
-  ENTRY;
-  return 0;
+  return HandleCall(scanley::kUsbOpResetDevice, dev, 0, 0, 0);
 }
+
+namespace {
+
+// Shared by bulk and interrupt transfers.
+int DataTransfer(uint16_t opcode, libusb_device_handle *dev_handle,
+                 unsigned char endpoint, unsigned char *data, int length,
+                 int *actual_length, unsigned int timeout) {
+  if (!g_js_caller)
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  unsigned char params[scanley::kUsbTransferParamBytes];
+  PutTransferParams(params, dev_handle, endpoint, length, timeout);
+  bool is_out = (endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT;
+  unsigned char out_actual[4] = { 0 };
+  JavaScriptCallHandle call = is_out ?
+      g_js_caller->CallAsync(opcode, params, sizeof(params), data, length,
+                             out_actual, sizeof(out_actual)) :
+      g_js_caller->CallAsync(opcode, params, sizeof(params), NULL, 0,
+                             data, length);
+  int rc = WaitForCall(call, timeout);
+  if (actual_length) {
+    if (is_out)
+      *actual_length = rc ? 0 : GetLE32(out_actual);
+    else
+      *actual_length = call->reply_length() < static_cast<size_t>(length) ?
+          call->reply_length() : length;
+  }
+  if (!rc && !is_out && call->reply_length() > static_cast<size_t>(length))
+    rc = LIBUSB_ERROR_OVERFLOW;
+  return rc;
+}
+
+}  // namespace {}
+
 int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
                                      unsigned char endpoint, unsigned char *data, int length,
                                      int *actual_length, unsigned int timeout) {
-  ENTRY;
-  return 0;
+  return DataTransfer(scanley::kUsbOpBulkTransfer, dev_handle, endpoint, data,
+                      length, actual_length, timeout);
 }
 int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle *dev,
                                                  int interface_number, int alternate_setting) {
-  ENTRY;
-  return 0;
+  return HandleCall(scanley::kUsbOpSetInterfaceAltSetting, dev,
+                    interface_number, alternate_setting, 2);
 }
 
 int LIBUSB_CALL libusb_get_configuration(libusb_device_handle *dev,
                                          int *config) {
-  ENTRY;
+  unsigned char value = 0;
+  int rc = libusb_control_transfer(
+      dev, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_CONFIGURATION, 0, 0,
+      &value, 1, 1000);
+  if (rc < 0)
+    return rc;
+  *config = value;
   return 0;
 }
 
 int LIBUSB_CALL libusb_set_configuration(libusb_device_handle *dev,
                                          int configuration) {
-  ENTRY;
-  return 0;
+  return HandleCall(scanley::kUsbOpSetConfiguration, dev, configuration, 0, 1);
 }
 int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
                                         uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
                                         unsigned char *data, uint16_t wLength, unsigned int timeout) {
-  ENTRY;
-  return 0;
+  if (!g_js_caller)
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  unsigned char setup[LIBUSB_CONTROL_SETUP_SIZE];
+  setup[0] = request_type;
+  setup[1] = bRequest;
+  PutLE16(setup + 2, wValue);
+  PutLE16(setup + 4, wIndex);
+  PutLE16(setup + 6, wLength);
+  unsigned char params[scanley::kUsbTransferParamBytes];
+  PutControlParams(params, dev_handle, setup, timeout);
+
+  bool is_out = (request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT;
+  unsigned char out_actual[4] = { 0 };
+  JavaScriptCallHandle call = is_out ?
+      g_js_caller->CallAsync(scanley::kUsbOpControlTransfer, params,
+                             sizeof(params), data, wLength,
+                             out_actual, sizeof(out_actual)) :
+      g_js_caller->CallAsync(scanley::kUsbOpControlTransfer, params,
+                             sizeof(params), NULL, 0, data, wLength);
+  int rc = WaitForCall(call, timeout);
+  if (rc < 0)
+    return rc;
+  if (is_out)
+    return GetLE32(out_actual);
+  if (call->reply_length() > wLength)
+    return LIBUSB_ERROR_OVERFLOW;
+  return call->reply_length();
 }
 
 int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle,
                                           unsigned char endpoint, unsigned char *data, int length,
                                           int *actual_length, unsigned int timeout) {
-  ENTRY;
+  return DataTransfer(scanley::kUsbOpInterruptTransfer, dev_handle, endpoint,
+                      data, length, actual_length, timeout);
+}
+
+// Asynchronous transfers
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets) {
+  size_t size = sizeof(struct libusb_transfer) +
+      iso_packets * sizeof(struct libusb_iso_packet_descriptor);
+  struct libusb_transfer* transfer =
+      static_cast<struct libusb_transfer*>(calloc(1, size));
+  if (transfer)
+    transfer->num_iso_packets = iso_packets;
+  return transfer;
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer) {
+  if (!transfer)
+    return;
+  if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)
+    free(transfer->buffer);
+  free(transfer);
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer) {
+  if (!g_js_caller)
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  InFlightTransfer* in_flight = new InFlightTransfer;
+  in_flight->transfer = transfer;
+  memset(in_flight->out_actual, 0, sizeof(in_flight->out_actual));
+
+  unsigned char params[scanley::kUsbTransferParamBytes];
+  uint16_t opcode;
+  unsigned char* data = transfer->buffer;
+  size_t length = transfer->length;
+  switch (transfer->type) {
+    case LIBUSB_TRANSFER_TYPE_CONTROL:
+      if (length < LIBUSB_CONTROL_SETUP_SIZE) {
+        delete in_flight;
+        return LIBUSB_ERROR_INVALID_PARAM;
+      }
+      opcode = scanley::kUsbOpControlTransfer;
+      PutControlParams(params, transfer->dev_handle, transfer->buffer,
+                       transfer->timeout);
+      in_flight->is_out = (transfer->buffer[0] & LIBUSB_ENDPOINT_DIR_MASK) ==
+          LIBUSB_ENDPOINT_OUT;
+      data += LIBUSB_CONTROL_SETUP_SIZE;
+      length = GetLE16(transfer->buffer + 6);
+      break;
+    case LIBUSB_TRANSFER_TYPE_BULK:
+    case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+      opcode = transfer->type == LIBUSB_TRANSFER_TYPE_BULK ?
+          scanley::kUsbOpBulkTransfer : scanley::kUsbOpInterruptTransfer;
+      PutTransferParams(params, transfer->dev_handle, transfer->endpoint,
+                        length, transfer->timeout);
+      in_flight->is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) ==
+          LIBUSB_ENDPOINT_OUT;
+      break;
+    default:
+      delete in_flight;
+      return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+
+  ScopedPthreadLock lock(&g_usb_mutex);
+  if (in_flight->is_out)
+    in_flight->call = g_js_caller->CallAsync(
+        opcode, params, sizeof(params), data, length,
+        in_flight->out_actual, sizeof(in_flight->out_actual));
+  else
+    in_flight->call = g_js_caller->CallAsync(
+        opcode, params, sizeof(params), NULL, 0, data, length);
+  g_in_flight.push_back(in_flight);
+  return 0;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer) {
+  JavaScriptCallHandle call;
+  {
+    ScopedPthreadLock lock(&g_usb_mutex);
+    for (size_t i = 0; i < g_in_flight.size(); i++) {
+      if (g_in_flight[i]->transfer == transfer) {
+        call = g_in_flight[i]->call;
+        break;
+      }
+    }
+  }
+  if (!call || !g_js_caller->Cancel(call))
+    return LIBUSB_ERROR_NOT_FOUND;
+  // The callback runs, with LIBUSB_TRANSFER_CANCELLED, from the next
+  // libusb_handle_events*() call.
+  return 0;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx,
+    struct timeval *tv, int *completed) {
+  int timeout_ms = tv ? tv->tv_sec * 1000 + tv->tv_usec / 1000 : -1;
+  JavaScriptCallHandle oldest;
+  {
+    ScopedPthreadLock lock(&g_usb_mutex);
+    if (completed && *completed)
+      return 0;
+    if (!g_in_flight.empty())
+      oldest = g_in_flight.front()->call;
+  }
+  if (oldest) {
+    oldest->TimedWait(timeout_ms);
+  } else if (timeout_ms > 0) {
+    // Nothing can complete; behave like libusb and sleep out the timeout.
+    usleep(timeout_ms * 1000);
+    return 0;
+  }
+
+  // Pick out everything that has finished, then run the callbacks without
+  // the lock held, since they usually submit the next transfer.
+  vector<InFlightTransfer*> done;
+  {
+    ScopedPthreadLock lock(&g_usb_mutex);
+    for (deque<InFlightTransfer*>::iterator it = g_in_flight.begin();
+         it != g_in_flight.end();) {
+      if ((*it)->call->done()) {
+        done.push_back(*it);
+        it = g_in_flight.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (size_t i = 0; i < done.size(); i++)
+    CompleteTransfer(done[i]);
   return 0;
 }
 
+int LIBUSB_CALL libusb_handle_events_timeout(libusb_context *ctx,
+    struct timeval *tv) {
+  return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+int LIBUSB_CALL libusb_handle_events_completed(libusb_context *ctx,
+    int *completed) {
+  struct timeval tv = { 60, 0 };
+  return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+int LIBUSB_CALL libusb_handle_events(libusb_context *ctx) {
+  return libusb_handle_events_completed(ctx, NULL);
+}
+
 scanley::SynchronousJavaScriptCaller* g_js_caller;
@@ -0,0 +1,126 @@
+/* sane - Scanner Access Now Easy.
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it under
+   the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+   for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.  If not, write to the Free
+   Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/* Byte order conversion of image data, see sanei_byteorder.h. */
+
+#include "../include/sane/config.h"
+
+#if defined (__AVX2__)
+# include <immintrin.h>
+#elif defined (__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_byteorder.h"
+
+void
+sanei_swap_16 (SANE_Byte * data, size_t len)
+{
+  SANE_Byte *end = data + (len & ~(size_t) 1);
+  SANE_Byte tmp;
+
+#if defined (__AVX2__)
+  /* a word swapped is the word shifted left and right by 8, or'ed */
+  while (end - data >= 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((__m256i *) data);
+      v = _mm256_or_si256 (_mm256_slli_epi16 (v, 8), _mm256_srli_epi16 (v, 8));
+      _mm256_storeu_si256 ((__m256i *) data, v);
+      data += 32;
+    }
+#endif
+#if defined (__AVX2__) || defined (__SSE2__)
+  while (end - data >= 16)
+    {
+      __m128i v = _mm_loadu_si128 ((__m128i *) data);
+      v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+      _mm_storeu_si128 ((__m128i *) data, v);
+      data += 16;
+    }
+#endif
+  for (; data < end; data += 2)
+    {
+      tmp = data[0];
+      data[0] = data[1];
+      data[1] = tmp;
+    }
+}
+
+void
+sanei_swap_32 (SANE_Byte * data, size_t len)
+{
+  SANE_Byte *end = data + (len & ~(size_t) 3);
+  SANE_Byte tmp;
+
+#if defined (__AVX2__)
+  const __m256i order = _mm256_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4,
+					  11, 10, 9, 8, 15, 14, 13, 12,
+					  3, 2, 1, 0, 7, 6, 5, 4,
+					  11, 10, 9, 8, 15, 14, 13, 12);
+
+  while (end - data >= 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((__m256i *) data);
+      v = _mm256_shuffle_epi8 (v, order);
+      _mm256_storeu_si256 ((__m256i *) data, v);
+      data += 32;
+    }
+#endif
+#if defined (__AVX2__) || defined (__SSE2__)
+  /* swap the halves of each word, then the bytes of each half */
+  while (end - data >= 16)
+    {
+      __m128i v = _mm_loadu_si128 ((__m128i *) data);
+      v = _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (v, 0xb1), 0xb1);
+      v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+      _mm_storeu_si128 ((__m128i *) data, v);
+      data += 16;
+    }
+#endif
+  for (; data < end; data += 4)
+    {
+      tmp = data[0];
+      data[0] = data[3];
+      data[3] = tmp;
+      tmp = data[1];
+      data[1] = data[2];
+      data[2] = tmp;
+    }
+}
@@ -239,7 +239,15 @@ ascii_w_string (Wire *w, void *v)
 	  while (!done);
 
 	  str[len - 1] = '\0';
-	  *s = realloc (str, len);
+	  if (w->arena.depth > 0)
+	    {
+	      *s = sanei_w_alloc (w, len);
+	      if (*s)
+		memcpy (*s, str, len);
+	      free (str);
+	    }
+	  else
+	    *s = realloc (str, len);
 
 	  if (*s == 0)
 	    {
@@ -269,7 +277,7 @@ ascii_w_string (Wire *w, void *v)
       break;
 
     case WIRE_FREE:
-      if (*s)
+      if (*s && w->arena.depth <= 0)
 	free (*s);
       break;
     }
@@ -47,6 +47,7 @@
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei_wire.h"
 #include "../include/sane/sanei_codec_bin.h"
+#include "../include/sane/sanei_byteorder.h"
 
 static void
 bin_w_byte (Wire *w, void *v)
@@ -129,6 +130,82 @@ bin_w_word (Wire *w, void *v)
     }
 }
 
+/* Copies LEN bytes between V and the wire.  With STEP 4, V holds words
+   that are reversed to and from big endian byte order on the way. */
+static void
+bin_w_bulk (Wire *w, SANE_Byte *v, size_t len, size_t step)
+{
+  size_t n;
+  ssize_t nread;
+#ifndef WORDS_BIGENDIAN
+  SANE_Byte *start = v;
+#endif
+
+  while (len > 0)
+    {
+      if (w->direction == WIRE_DECODE && w->buffer.curr == w->buffer.end
+	  && len >= w->buffer.size)
+	{
+	  /* more than the buffer holds: read it to where it belongs */
+	  nread = (*w->io.read) (w->io.fd, v, len);
+	  if (nread <= 0)
+	    {
+	      w->status = (nread == 0) ? EINVAL : errno;
+	      return;
+	    }
+	  v += nread;
+	  len -= nread;
+	  continue;
+	}
+
+      sanei_w_space (w, step);
+      if (w->status)
+	return;
+      n = w->buffer.end - w->buffer.curr;
+      if (n > len)
+	n = len;
+
+      switch (w->direction)
+	{
+	case WIRE_ENCODE:
+	  n -= n % step;
+	  memcpy (w->buffer.curr, v, n);
+#ifndef WORDS_BIGENDIAN
+	  if (step == 4)
+	    sanei_swap_32 ((SANE_Byte *) w->buffer.curr, n);
+#endif
+	  break;
+
+	case WIRE_DECODE:
+	  memcpy (v, w->buffer.curr, n);
+	  break;
+
+	case WIRE_FREE:
+	  return;
+	}
+      w->buffer.curr += n;
+      v += n;
+      len -= n;
+    }
+
+#ifndef WORDS_BIGENDIAN
+  if (step == 4 && w->direction == WIRE_DECODE)
+    sanei_swap_32 (start, v - start);
+#endif
+}
+
+static void
+bin_w_bytes (Wire *w, void *v, size_t num)
+{
+  bin_w_bulk (w, v, num, 1);
+}
+
+static void
+bin_w_words (Wire *w, void *v, size_t num)
+{
+  bin_w_bulk (w, v, num * 4, 4);
+}
+
 void
 sanei_codec_bin_init (Wire *w)
 {
@@ -136,4 +213,6 @@ sanei_codec_bin_init (Wire *w)
   w->codec.w_char = bin_w_byte;
   w->codec.w_word = bin_w_word;
   w->codec.w_string = bin_w_string;
+  w->codec.w_bytes = bin_w_bytes;
+  w->codec.w_words = bin_w_words;
 }
@@ -0,0 +1,358 @@
+/* sane - Scanner Access Now Easy.
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it under
+   the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+   for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.  If not, write to the Free
+   Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/* Compression of image data on the saned data connection, see
+   sanei_compress.h.
+
+   SANEI_COMPRESS_RLE is PackBits as in TIFF: a control byte n in 0..127
+   is followed by n + 1 literal bytes, n in 129..255 by one byte to
+   repeat 257 - n times.  128 is a no-op.
+
+   SANEI_COMPRESS_LZ is the LZ4 block format: a sequence of a token
+   byte, whose high nibble is the number of literals and low nibble the
+   match length minus 4 (either extended by bytes of 255 and a final
+   byte < 255 if it's 15), the literals, a 2-byte little-endian offset
+   and the match.  The last sequence has only literals, and the last 5
+   bytes of a block are always literals. */
+
+#include "../include/sane/config.h"
+
+#include <string.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_compress.h"
+
+#define RLE_MAX_RUN	128
+
+#define LZ_MIN_MATCH	4
+#define LZ_HASH_LOG	12
+#define LZ_MAX_OFFSET	65535
+#define LZ_LAST_LITERALS 5	/* the last bytes are always literals */
+#define LZ_MF_LIMIT	12	/* no match starts this close to the end */
+
+SANEI_Compress_Codec
+sanei_compress_codec (SANE_Int depth)
+{
+  return (depth == 1) ? SANEI_COMPRESS_RLE : SANEI_COMPRESS_LZ;
+}
+
+size_t
+sanei_compress_bound (size_t len)
+{
+  /* LZ expands incompressible data by a length byte for every 255
+     literals, RLE by a control byte for every 128 */
+  return len + len / 128 + 16;
+}
+
+static size_t
+rle_compress (const SANE_Byte * in, size_t in_len, SANE_Byte * out,
+	      size_t out_size)
+{
+  size_t i = 0, o = 0, run, start;
+
+  while (i < in_len)
+    {
+      run = 1;
+      while (i + run < in_len && run < RLE_MAX_RUN && in[i + run] == in[i])
+	run++;
+
+      if (run >= 3)
+	{
+	  if (o + 2 > out_size)
+	    return 0;
+	  out[o++] = (SANE_Byte) (257 - run);
+	  out[o++] = in[i];
+	  i += run;
+	  continue;
+	}
+
+      /* literals, up to the next run of three */
+      start = i;
+      while (i < in_len && i - start < RLE_MAX_RUN)
+	{
+	  if (i + 2 < in_len && in[i] == in[i + 1] && in[i] == in[i + 2])
+	    break;
+	  i++;
+	}
+      if (o + 1 + (i - start) > out_size)
+	return 0;
+      out[o++] = (SANE_Byte) (i - start - 1);
+      memcpy (out + o, in + start, i - start);
+      o += i - start;
+    }
+  return o;
+}
+
+static SANE_Status
+rle_decompress (const SANE_Byte * in, size_t in_len, SANE_Byte * out,
+		size_t out_len)
+{
+  size_t i = 0, o = 0, n;
+  SANE_Byte c;
+
+  while (i < in_len)
+    {
+      c = in[i++];
+      if (c < 128)
+	{
+	  n = c + 1;
+	  if (i + n > in_len || o + n > out_len)
+	    return SANE_STATUS_IO_ERROR;
+	  memcpy (out + o, in + i, n);
+	  i += n;
+	}
+      else if (c > 128)
+	{
+	  n = 257 - c;
+	  if (i >= in_len || o + n > out_len)
+	    return SANE_STATUS_IO_ERROR;
+	  memset (out + o, in[i++], n);
+	}
+      else
+	n = 0;
+      o += n;
+    }
+  return (o == out_len) ? SANE_STATUS_GOOD : SANE_STATUS_IO_ERROR;
+}
+
+static unsigned int
+lz_hash (const SANE_Byte * p)
+{
+  unsigned long v;
+
+  v = (unsigned long) p[0] | ((unsigned long) p[1] << 8)
+    | ((unsigned long) p[2] << 16) | ((unsigned long) p[3] << 24);
+  return (unsigned int) (((v * 2654435761UL) & 0xffffffffUL)
+			 >> (32 - LZ_HASH_LOG));
+}
+
+/* Stores a length that didn't fit into its nibble of the token. */
+static size_t
+lz_put_length (SANE_Byte * out, size_t o, size_t len)
+{
+  while (len >= 255)
+    {
+      out[o++] = 255;
+      len -= 255;
+    }
+  out[o++] = (SANE_Byte) len;
+  return o;
+}
+
+/* Stores a sequence of LIT_LEN literals from LIT followed by a match of
+   MATCH_LEN bytes at OFFSET, or just the literals if MATCH_LEN is 0.
+   Returns the new output position, or 0 if OUT is too small. */
+static size_t
+lz_put_sequence (SANE_Byte * out, size_t o, size_t out_size,
+		 const SANE_Byte * lit, size_t lit_len,
+		 size_t offset, size_t match_len)
+{
+  size_t token;
+
+  if (o + 1 + lit_len + lit_len / 255 + 1 + 2 + match_len / 255 + 1
+      > out_size)
+    return 0;
+
+  token = o++;
+  out[token] = (SANE_Byte) ((lit_len < 15 ? lit_len : 15) << 4);
+  if (lit_len >= 15)
+    o = lz_put_length (out, o, lit_len - 15);
+  memcpy (out + o, lit, lit_len);
+  o += lit_len;
+
+  if (match_len == 0)
+    return o;
+
+  out[o++] = offset & 0xff;
+  out[o++] = (offset >> 8) & 0xff;
+  match_len -= LZ_MIN_MATCH;
+  out[token] |= (SANE_Byte) (match_len < 15 ? match_len : 15);
+  if (match_len >= 15)
+    o = lz_put_length (out, o, match_len - 15);
+  return o;
+}
+
+static size_t
+lz_compress (const SANE_Byte * in, size_t in_len, SANE_Byte * out,
+	     size_t out_size)
+{
+  size_t table[1 << LZ_HASH_LOG];
+  size_t ip = 0, anchor = 0, ref, len, o = 0;
+  unsigned int h;
+
+  memset (table, 0, sizeof (table));
+
+  if (in_len > LZ_MF_LIMIT)
+    while (ip < in_len - LZ_MF_LIMIT)
+      {
+	h = lz_hash (in + ip);
+	ref = table[h];
+	table[h] = ip;
+
+	if (ref >= ip || ip - ref > LZ_MAX_OFFSET
+	    || memcmp (in + ref, in + ip, LZ_MIN_MATCH) != 0)
+	  {
+	    /* skip faster through data that doesn't compress */
+	    ip += 1 + ((ip - anchor) >> 6);
+	    continue;
+	  }
+
+	len = LZ_MIN_MATCH;
+	while (ip + len < in_len - LZ_LAST_LITERALS
+	       && in[ref + len] == in[ip + len])
+	  len++;
+
+	o = lz_put_sequence (out, o, out_size, in + anchor, ip - anchor,
+			     ip - ref, len);
+	if (o == 0)
+	  return 0;
+	ip += len;
+	anchor = ip;
+	if (ip < in_len - LZ_MF_LIMIT)
+	  table[lz_hash (in + ip - 2)] = ip - 2;
+      }
+
+  return lz_put_sequence (out, o, out_size, in + anchor, in_len - anchor,
+			  0, 0);
+}
+
+/* Reads a length extension into *LEN.  Returns the new input position,
+   or 0 if the input ends first. */
+static size_t
+lz_get_length (const SANE_Byte * in, size_t i, size_t in_len, size_t * len)
+{
+  SANE_Byte c;
+
+  do
+    {
+      if (i >= in_len)
+	return 0;
+      c = in[i++];
+      *len += c;
+    }
+  while (c == 255);
+  return i;
+}
+
+static SANE_Status
+lz_decompress (const SANE_Byte * in, size_t in_len, SANE_Byte * out,
+	       size_t out_len)
+{
+  size_t i = 0, o = 0, len, offset;
+  SANE_Byte token;
+
+  while (i < in_len)
+    {
+      token = in[i++];
+
+      len = token >> 4;
+      if (len == 15 && (i = lz_get_length (in, i, in_len, &len)) == 0)
+	return SANE_STATUS_IO_ERROR;
+      if (i + len > in_len || o + len > out_len)
+	return SANE_STATUS_IO_ERROR;
+      memcpy (out + o, in + i, len);
+      i += len;
+      o += len;
+
+      if (i == in_len)
+	break;			/* the last sequence has no match */
+
+      if (i + 2 > in_len)
+	return SANE_STATUS_IO_ERROR;
+      offset = in[i] | (in[i + 1] << 8);
+      i += 2;
+      if (offset == 0 || offset > o)
+	return SANE_STATUS_IO_ERROR;
+
+      len = token & 0x0f;
+      if (len == 15 && (i = lz_get_length (in, i, in_len, &len)) == 0)
+	return SANE_STATUS_IO_ERROR;
+      len += LZ_MIN_MATCH;
+      if (o + len > out_len)
+	return SANE_STATUS_IO_ERROR;
+
+      if (offset >= len)
+	memcpy (out + o, out + o - offset, len);
+      else
+	{
+	  /* the match overlaps what it produces: a repeated pattern */
+	  size_t n;
+
+	  for (n = 0; n < len; n++)
+	    out[o + n] = out[o + n - offset];
+	}
+      o += len;
+    }
+  return (o == out_len) ? SANE_STATUS_GOOD : SANE_STATUS_IO_ERROR;
+}
+
+size_t
+sanei_compress (SANEI_Compress_Codec codec, const SANE_Byte * in,
+		size_t in_len, SANE_Byte * out, size_t out_size)
+{
+  switch (codec)
+    {
+    case SANEI_COMPRESS_RLE:
+      return rle_compress (in, in_len, out, out_size);
+    case SANEI_COMPRESS_LZ:
+      return lz_compress (in, in_len, out, out_size);
+    default:
+      return 0;
+    }
+}
+
+SANE_Status
+sanei_decompress (SANEI_Compress_Codec codec, const SANE_Byte * in,
+		  size_t in_len, SANE_Byte * out, size_t out_len)
+{
+  switch (codec)
+    {
+    case SANEI_COMPRESS_NONE:
+      if (in_len != out_len)
+	return SANE_STATUS_IO_ERROR;
+      memcpy (out, in, in_len);
+      return SANE_STATUS_GOOD;
+    case SANEI_COMPRESS_RLE:
+      return rle_decompress (in, in_len, out, out_len);
+    case SANEI_COMPRESS_LZ:
+      return lz_decompress (in, in_len, out, out_len);
+    default:
+      return SANE_STATUS_UNSUPPORTED;
+    }
+}
@@ -50,6 +50,16 @@
 #include <errno.h>
 #include <math.h>
 
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef USE_PTHREAD
+# include <pthread.h>
+#endif
+#if defined (__SSE2__)
+# include <emmintrin.h>
+#endif
+
 #define BACKEND_NAME sanei_magic      /* name of this module for debugging */
 
 #include "../include/sane/sane.h"
@@ -64,6 +74,14 @@
 #define M_PI_2 (M_PI/2)
 #endif
 
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+
 /* prototypes for utility functions defined at bottom of file */
 int * sanei_magic_getTransY (
   SANE_Parameters * params, int dpi, SANE_Byte * buffer, int top);
@@ -71,6 +89,27 @@ int * sanei_magic_getTransY (
 int * sanei_magic_getTransX (
   SANE_Parameters * params, int dpi, SANE_Byte * buffer, int left);
 
+static int * getTransY (SANE_Parameters * params, int dpi,
+  SANE_Byte * buffer, int top, int from, int to);
+
+static int * getTransX (SANE_Parameters * params, int dpi,
+  SANE_Byte * buffer, int left, int from, int to);
+
+static int getTransRow (SANE_Parameters * params, SANE_Byte * row,
+  int left);
+
+static void filterTrans (int * buff, int from, int to, int dpi, int none);
+
+static SANE_Status getEdges (int width, int height, int * topBuf,
+  int * botBuf, int * leftBuf, int * rightBuf,
+  int * top, int * bot, int * left, int * right);
+
+static SANE_Status getSkew (int width, int height, int dpiY, int * topBuf,
+  int * botBuf, int * centerX, int * centerY, double * finSlope);
+
+static double getDarkness (SANE_Parameters * params, SANE_Byte * row,
+  int x, int len);
+
 static SANE_Status getTopEdge (int width, int height, int resolution,
   int * buff, double * finSlope, int * finXInter, int * finYInter);
 
@@ -82,194 +121,336 @@ static SANE_Status getLine (int height, int width, int * buff,
   int offsets, int minOffset, int maxOffset,
   double * finSlope, int * finOffset, int * finDensity);
 
+static void getCenter (double TSlope, int TXInter, double LSlope,
+  int LYInter, int * centerX, int * centerY);
+
 void
 sanei_magic_init( void )
 {
   DBG_INIT();
 }
 
-/* find small spots and replace them with image background color */
-SANE_Status
-sanei_magic_despeck (SANE_Parameters * params, SANE_Byte * buffer,
-  SANE_Int diam)
+/* Despeckle works in place, and a window that gets painted changes the
+ * pixels the following windows look at, so the page is walked in the
+ * same order as always.  For each row of windows, this keeps per column
+ * the minimum, per channel sums and the color (if there is only one) of
+ * the diam rows inside the windows, and prefix sums and sliding minimums
+ * of the rows just above and below, which no window of this row writes.
+ * Each window then costs O(1) instead of O(diam^2), plus O(diam) to see
+ * if painting it would change anything. */
+
+/* luminance, per channel prefix sums and the minimum luminance of each
+ * run of w pixels of one gray or color row */
+static void
+despeck_row (SANE_Byte * row, int pw, int bpp, int w, int * lum,
+  int * fwd, int * back, int * sum, int * segmin)
 {
+  int b, c, n;
 
-  SANE_Status ret = SANE_STATUS_GOOD;
+  for(n=0; n<bpp; n++)
+    sum[n] = 0;
+
+  if(bpp == 1){
+    for(c=0; c<pw; c++){
+      lum[c] = row[c];
+      sum[c+1] = sum[c] + row[c];
+    }
+  }
+  else{
+    for(c=0; c<pw; c++){
+      int l = 0;
+
+      for(n=0; n<bpp; n++){
+        l += row[c*bpp + n];
+        sum[(c+1)*bpp + n] = sum[c*bpp + n] + row[c*bpp + n];
+      }
+      lum[c] = l;
+    }
+  }
+
+  /* van Herk/Gil-Werman: minimums from the start and to the end of each
+   * block of w pixels, a run covers at most two blocks */
+  for(b=0; b<pw; b+=w){
+    int e = MIN(b+w, pw);
+
+    fwd[b] = lum[b];
+    for(c=b+1; c<e; c++)
+      fwd[c] = MIN(fwd[c-1], lum[c]);
+
+    back[e-1] = lum[e-1];
+    for(c=e-2; c>=b; c--)
+      back[c] = MIN(back[c+1], lum[c]);
+  }
+
+  for(c=0; c+w<=pw; c++)
+    segmin[c] = MIN(back[c], fwd[c+w-1]);
+}
 
+/* gray or color, bpp is 1 or 3 */
+static SANE_Status
+despeck_bytes (SANE_Parameters * params, SANE_Byte * buffer, int diam,
+  int bpp)
+{
   int pw = params->pixels_per_line;
   int bw = params->bytes_per_line;
   int h  = params->lines;
-  int bt = bw*h;
+  int border = 4*diam + 4;
+
+  int * mem;
+  int * colmin, * colsum, * colu, * queue;
+  int * lum, * fwd, * back;
+  int * topsum, * botsum, * topmin, * botmin;
+
+  int r, j, c, k, n;
+
+  /* no window fits */
+  if(diam < 1 || pw-2-diam < 1 || h-2-diam < 1)
+    return SANE_STATUS_GOOD;
+
+  mem = malloc(sizeof(int) * ((8 + bpp)*pw + 2*(pw+1)*bpp));
+  if(!mem){
+    DBG (5, "despeck_bytes: no buffers\n");
+    return SANE_STATUS_NO_MEM;
+  }
+
+  colmin = mem;
+  colu = colmin + pw;
+  queue = colu + pw;
+  lum = queue + pw;
+  fwd = lum + pw;
+  back = fwd + pw;
+  topmin = back + pw;
+  botmin = topmin + pw;
+  colsum = botmin + pw;
+  topsum = colsum + pw*bpp;
+  botsum = topsum + (pw+1)*bpp;
+
+  for(r=1; r<h-1-diam; r++){
+    int head = 0, tail = 0;
+
+    despeck_row(buffer + (r-1)*bw, pw, bpp, diam+2, lum, fwd, back,
+      topsum, topmin);
+    despeck_row(buffer + (r+diam)*bw, pw, bpp, diam+2, lum, fwd, back,
+      botsum, botmin);
+
+    /* the columns of the windows, a row at a time */
+    if(bpp == 1){
+      SANE_Byte * p = buffer + r*bw;
+
+      for(c=0; c<pw; c++){
+        colmin[c] = colu[c] = colsum[c] = p[c];
+      }
 
-  int i,j,k,l,n;
+      for(k=1; k<diam; k++){
+        p += bw;
+        for(c=0; c<pw; c++){
+          if(p[c] < colmin[c])
+            colmin[c] = p[c];
+          if(p[c] != colu[c])
+            colu[c] = -1;
+          colsum[c] += p[c];
+        }
+      }
+    }
+    else{
+      for(k=0; k<diam; k++){
+        SANE_Byte * p = buffer + (r+k)*bw;
 
-  DBG (10, "sanei_magic_despeck: start\n");
+        for(c=0; c<pw; c++, p+=bpp){
+          int l = 0, color = 0;
 
-  if(params->format == SANE_FRAME_RGB){
+          for(n=0; n<bpp; n++){
+            l += p[n];
+            color = color << 8 | p[n];
+            colsum[c*bpp + n] = (k ? colsum[c*bpp + n] : 0) + p[n];
+          }
 
-    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
-      for(j=1; j<pw-1-diam; j++){
+          if(!k || l < colmin[c])
+            colmin[c] = l;
+          if(!k)
+            colu[c] = color;
+          else if(color != colu[c])
+            colu[c] = -1;
+        }
+      }
+    }
 
-        int thresh = 255*3;
-        int outer[] = {0,0,0};
-        int hits = 0;
+    /* queue of columns with increasing minimum, for the window minimum */
+    for(c=1; c<diam; c++){
+      while(tail > head && colmin[queue[tail-1]] >= colmin[c])
+        tail--;
+      queue[tail++] = c;
+    }
 
-        /* loop over rows and columns in window */
-        /* find darkest pixel */
-        for(k=0; k<diam; k++){
-          for(l=0; l<diam; l++){
-            int tmp = 0;
+    for(j=1; j<pw-1-diam; j++){
+      int thresh, color = 0;
+      int outer[3];
 
-            for(n=0; n<3; n++){
-              tmp += buffer[i + j*3 + k*bw + l*3 + n];
-            }
+      c = j+diam-1;
+      while(tail > head && colmin[queue[tail-1]] >= colmin[c])
+        tail--;
+      queue[tail++] = c;
+      while(queue[head] < j)
+        head++;
 
-            if(tmp < thresh)
-              thresh = tmp;
-          }
-        }
+      /* convert darkest pixel into a brighter threshold */
+      thresh = (colmin[queue[head]] + 2*255*bpp)/3;
 
-        /* convert darkest pixel into a brighter threshold */
-        thresh = (thresh + 255*3 + 255*3)/3;
-  
-        /*loop over rows and columns around window */
-        for(k=-1; k<diam+1; k++){
-          for(l=-1; l<diam+1; l++){
+      /* a darker pixel around the window */
+      if(topmin[j-1] < thresh || botmin[j-1] < thresh
+        || colmin[j-1] < thresh || colmin[j+diam] < thresh)
+        continue;
 
-            int tmp[3];
-  
-            /* dont count pixels in the window */
-            if(k != -1 && k != diam && l != -1 && l != diam)
-              continue;
-  
-            for(n=0; n<3; n++){
-              tmp[n] = buffer[i + j*3 + k*bw + l*3 + n];
-              outer[n] += tmp[n];
-            }
-            if(tmp[0]+tmp[1]+tmp[2] < thresh){
-              hits++;
-              break;
-            }
-          }
-        }
+      /* replacement color, average of the surrounding pixels */
+      for(n=0; n<bpp; n++){
+        outer[n] = topsum[(j+diam+1)*bpp + n] - topsum[(j-1)*bpp + n]
+          + botsum[(j+diam+1)*bpp + n] - botsum[(j-1)*bpp + n]
+          + colsum[(j-1)*bpp + n] + colsum[(j+diam)*bpp + n];
+        outer[n] /= border;
+        color = color << 8 | outer[n];
+      }
 
-        /*no hits, overwrite with avg surrounding color*/
-        if(!hits){
+      /* window already is that color */
+      for(c=j; c<j+diam && colu[c] == color; c++);
+      if(c == j+diam)
+        continue;
 
-          /* per channel replacement color */
-          for(n=0; n<3; n++){
-            outer[n] /= (4*diam + 4);
-          }
+      for(k=0; k<diam; k++){
+        SANE_Byte * p = buffer + (r+k)*bw + j*bpp;
 
-          for(k=0; k<diam; k++){
-            for(l=0; l<diam; l++){
-              for(n=0; n<3; n++){
-                buffer[i + j*3 + k*bw + l*3 + n] = outer[n];
-              }
-            }
+        for(c=0; c<diam; c++, p+=bpp){
+          for(n=0; n<bpp; n++){
+            p[n] = outer[n];
           }
         }
       }
+
+      for(c=j; c<j+diam; c++){
+        colmin[c] = 0;
+        for(n=0; n<bpp; n++){
+          colmin[c] += outer[n];
+          colsum[c*bpp + n] = outer[n]*diam;
+        }
+        colu[c] = color;
+      }
+
+      /* the window is all one value now */
+      head = 0;
+      tail = 1;
+      queue[0] = j+diam-1;
     }
   }
 
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 8){
-    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
-      for(j=1; j<pw-1-diam; j++){
+  free(mem);
+  return SANE_STATUS_GOOD;
+}
 
-        int thresh = 255;
-        int outer = 0;
-        int hits = 0;
+/* lineart, set bits are dark */
+static SANE_Status
+despeck_bits (SANE_Parameters * params, SANE_Byte * buffer, int diam)
+{
+  int pw = params->pixels_per_line;
+  int bw = params->bytes_per_line;
+  int h  = params->lines;
 
-        for(k=0; k<diam; k++){
-          for(l=0; l<diam; l++){
-            if(buffer[i + j + k*bw + l] < thresh)
-              thresh = buffer[i + j + k*bw + l];
-          }
-        }
+  int * mem;
+  int * colany, * topcnt, * botcnt;
+  SANE_Byte * any;
 
-        /* convert darkest pixel into a brighter threshold */
-        thresh = (thresh + 255 + 255)/3;
-  
-        /*loop over rows and columns around window */
-        for(k=-1; k<diam+1; k++){
-          for(l=-1; l<diam+1; l++){
+  int r, j, c, k;
 
-            int tmp = 0;
+  /* no window fits */
+  if(diam < 1 || pw-2-diam < 1 || h-2-diam < 1)
+    return SANE_STATUS_GOOD;
 
-            /* dont count pixels in the window */
-            if(k != -1 && k != diam && l != -1 && l != diam)
-              continue;
-  
-            tmp = buffer[i + j + k*bw + l];
+  mem = malloc(sizeof(int) * (3*pw + 2) + bw);
+  if(!mem){
+    DBG (5, "despeck_bits: no buffers\n");
+    return SANE_STATUS_NO_MEM;
+  }
 
-            if(tmp < thresh){
-              hits++;
-              break;
-            }
+  colany = mem;
+  topcnt = colany + pw;
+  botcnt = topcnt + pw + 1;
+  any = (SANE_Byte *)(botcnt + pw + 1);
 
-            outer += tmp;
-          }
-        }
+  for(r=1; r<h-1-diam; r++){
+    SANE_Byte * top = buffer + (r-1)*bw;
+    SANE_Byte * bot = buffer + (r+diam)*bw;
+    int cnt = 0;
 
-        /*no hits, overwrite with avg surrounding color*/
-        if(!hits){
-          /* replacement color */
-          outer /= (4*diam + 4);
+    /* dark pixels in the rows above and below, and in the columns */
+    memcpy(any, buffer + r*bw, bw);
+    for(k=1; k<diam; k++){
+      SANE_Byte * p = buffer + (r+k)*bw;
 
-          for(k=0; k<diam; k++){
-            for(l=0; l<diam; l++){
-              buffer[i + j + k*bw + l] = outer;
-            }
-          }
-        }
-      }
+      for(c=0; c<bw; c++)
+        any[c] |= p[c];
     }
-  }
 
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
-    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
-      for(j=1; j<pw-1-diam; j++){
-        
-        int curr = 0;
-        int hits = 0;
+    topcnt[0] = botcnt[0] = 0;
+    for(c=0; c<pw; c++){
+      int bit = 7 - c%8;
 
-        for(k=0; k<diam; k++){
-          for(l=0; l<diam; l++){
-            curr += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
-          }
-        }
+      topcnt[c+1] = topcnt[c] + (top[c/8] >> bit & 1);
+      botcnt[c+1] = botcnt[c] + (bot[c/8] >> bit & 1);
+      colany[c] = any[c/8] >> bit & 1;
+    }
 
-        if(!curr)
-          continue;
+    /* cnt is the number of dark columns in the window */
+    for(c=1; c<diam; c++)
+      cnt += colany[c];
 
-        /*loop over rows and columns around window */
-        for(k=-1; k<diam+1; k++){
-          for(l=-1; l<diam+1; l++){
+    for(j=1; j<pw-1-diam; j++){
 
-            /* dont count pixels in the window */
-            if(k != -1 && k != diam && l != -1 && l != diam)
-              continue;
-  
-            hits += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
+      cnt += colany[j+diam-1];
 
-            if(hits)
-              break;
-          }
-        }
+      /* something in the window, nothing around it: overwrite with white */
+      if(cnt && topcnt[j+diam+1] == topcnt[j-1]
+        && botcnt[j+diam+1] == botcnt[j-1]
+        && !colany[j-1] && !colany[j+diam]){
 
-        /*no hits, overwrite with white*/
-        if(!hits){
-          for(k=0; k<diam; k++){
-            for(l=0; l<diam; l++){
-              buffer[i + k*bw + (j+l)/8] &= ~(1 << (7-(j+l)%8));
-            }
+        for(k=0; k<diam; k++){
+          for(c=j; c<j+diam; c++){
+            buffer[(r+k)*bw + c/8] &= ~(1 << (7-c%8));
           }
         }
+
+        for(c=j; c<j+diam; c++)
+          colany[c] = 0;
+        cnt = 0;
       }
+
+      cnt -= colany[j];
     }
   }
 
+  free(mem);
+  return SANE_STATUS_GOOD;
+}
+
+/* find small spots and replace them with image background color */
+SANE_Status
+sanei_magic_despeck (SANE_Parameters * params, SANE_Byte * buffer,
+  SANE_Int diam)
+{
+
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  DBG (10, "sanei_magic_despeck: start\n");
+
+  if(params->format == SANE_FRAME_RGB){
+    ret = despeck_bytes(params, buffer, diam, 3);
+  }
+
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 8){
+    ret = despeck_bytes(params, buffer, diam, 1);
+  }
+
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+    ret = despeck_bits(params, buffer, diam);
+  }
+
   else{
     DBG (5, "sanei_magic_despeck: unsupported format/depth\n");
     ret = SANE_STATUS_INVAL;
@@ -293,11 +474,6 @@ sanei_magic_findEdges(SANE_Parameters * params, SANE_Byte * buffer,
   int * topBuf = NULL, * botBuf = NULL;
   int * leftBuf = NULL, * rightBuf = NULL;
 
-  int topCount = 0, botCount = 0;
-  int leftCount = 0, rightCount = 0;
-
-  int i;
-
   DBG (10, "sanei_magic_findEdges: start\n");
 
   /* get buffers to find sides and bottom */
@@ -329,97 +505,9 @@ sanei_magic_findEdges(SANE_Parameters * params, SANE_Byte * buffer,
     goto cleanup;
   }
 
-  /* loop thru left and right lists, look for top and bottom extremes */
-  *top = height;
-  for(i=0; i<height; i++){
-    if(rightBuf[i] > leftBuf[i]){
-      if(*top > i){
-        *top = i;
-      }
-
-      topCount++;
-      if(topCount > 3){
-        break;
-      }
-    }
-    else{
-      topCount = 0;
-      *top = height;
-    }
-  }
-
-  *bot = -1;
-  for(i=height-1; i>=0; i--){
-    if(rightBuf[i] > leftBuf[i]){
-      if(*bot < i){
-        *bot = i;
-      }
-
-      botCount++;
-      if(botCount > 3){
-        break;
-      }
-    }
-    else{
-      botCount = 0;
-      *bot = -1;
-    }
-  }
-
-  /* could not find top/bot edges */
-  if(*top > *bot){
-    DBG (5, "sanei_magic_findEdges: bad t/b edges\n");
-    ret = SANE_STATUS_UNSUPPORTED;
-    goto cleanup;
-  }
-
-  /* loop thru top and bottom lists, look for l and r extremes
-   * NOTE: We dont look above the top or below the bottom found previously.
-   * This prevents issues with adf scanners that pad the image after the
-   * paper runs out (usually with white) */
-  DBG (5, "sanei_magic_findEdges: bb0:%d tb0:%d b:%d t:%d\n",
-    botBuf[0], topBuf[0], *bot, *top);
-
-  *left = width;
-  for(i=0; i<width; i++){
-    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
-      if(*left > i){
-        *left = i;
-      }
-
-      leftCount++;
-      if(leftCount > 3){
-        break;
-      }
-    }
-    else{
-      leftCount = 0;
-      *left = width;
-    }
-  }
-
-  *right = -1;
-  for(i=width-1; i>=0; i--){
-    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
-      if(*right < i){
-        *right = i;
-      }
-
-      rightCount++;
-      if(rightCount > 3){
-        break;
-      }
-    }
-    else{
-      rightCount = 0;
-      *right = -1;
-    }
-  }
-
-  /* could not find left/right edges */
-  if(*left > *right){
-    DBG (5, "sanei_magic_findEdges: bad l/r edges\n");
-    ret = SANE_STATUS_UNSUPPORTED;
+  ret = getEdges (width, height, topBuf, botBuf, leftBuf, rightBuf,
+    top, bot, left, right);
+  if(ret){
     goto cleanup;
   }
 
@@ -518,21 +606,6 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
   int pwidth = params->pixels_per_line;
   int height = params->lines;
 
-  double TSlope = 0;
-  int TXInter = 0;
-  int TYInter = 0;
-  double TSlopeHalf = 0;
-  int TOffsetHalf = 0;
-
-  double LSlope = 0;
-  int LXInter = 0;
-  int LYInter = 0;
-  double LSlopeHalf = 0;
-  int LOffsetHalf = 0;
-
-  int rotateX = 0;
-  int rotateY = 0;
-
   int * topBuf = NULL, * botBuf = NULL;
 
   DBG (10, "sanei_magic_findSkew: start\n");
@@ -554,720 +627,2166 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
     goto cleanup;
   }
 
-  /* find best top line */
-  ret = getTopEdge (pwidth, height, dpiY, topBuf,
-    &TSlope, &TXInter, &TYInter);
-  if(ret){
-    DBG(5,"sanei_magic_findSkew: gTE error: %d",ret);
-    goto cleanup;
-  }
-  DBG(15,"top: %04.04f %d %d\n",TSlope,TXInter,TYInter);
-
-  /* slope is too shallow, don't want to divide by 0 */
-  if(fabs(TSlope) < 0.0001){
-    DBG(15,"sanei_magic_findSkew: slope too shallow: %0.08f\n",TSlope);
-    ret = SANE_STATUS_UNSUPPORTED;
-    goto cleanup;
-  }
+  ret = getSkew (pwidth, height, dpiY, topBuf, botBuf,
+    centerX, centerY, finSlope);
 
-  /* find best left line, perpendicular to top line */
-  LSlope = (double)-1/TSlope;
-  ret = getLeftEdge (pwidth, height, topBuf, botBuf, LSlope,
-    &LXInter, &LYInter);
-  if(ret){
-    DBG(5,"sanei_magic_findSkew: gLE error: %d",ret);
-    goto cleanup;
-  }
-  DBG(15,"sanei_magic_findSkew: left: %04.04f %d %d\n",LSlope,LXInter,LYInter);
-
-  /* find point about which to rotate */
-  TSlopeHalf = tan(atan(TSlope)/2);
-  TOffsetHalf = LYInter;
-  DBG(15,"sanei_magic_findSkew: top half: %04.04f %d\n",TSlopeHalf,TOffsetHalf);
-
-  LSlopeHalf = tan((atan(LSlope) + ((LSlope < 0)?-M_PI_2:M_PI_2))/2);
-  LOffsetHalf = - LSlopeHalf * TXInter;
-  DBG(15,"sanei_magic_findSkew: left half: %04.04f %d\n",LSlopeHalf,LOffsetHalf);
-
-  rotateX = (LOffsetHalf-TOffsetHalf) / (TSlopeHalf-LSlopeHalf);
-  rotateY = TSlopeHalf * rotateX + TOffsetHalf;
-  DBG(15,"sanei_magic_findSkew: rotate: %d %d\n",rotateX,rotateY);
-
-  *centerX = rotateX;
-  *centerY = rotateY;
-  *finSlope = TSlope;
-
-  cleanup:
-  if(topBuf)
-    free(topBuf);
-  if(botBuf)
-    free(botBuf);
+  cleanup:
+  if(topBuf)
+    free(topBuf);
+  if(botBuf)
+    free(botBuf);
 
   DBG (10, "sanei_magic_findSkew: finish\n");
   return ret;
 }
 
-/* function to do a simple rotation by a given slope, around
- * a given point. The point can be outside of image to get
- * proper edge alignment. Unused areas filled with bg color
- * FIXME: Do in-place rotation to save memory */
-SANE_Status
-sanei_magic_rotate (SANE_Parameters * params, SANE_Byte * buffer,
-  int centerX, int centerY, double slope, int bg_color)
-{
+/* The multi-resolution versions of findEdges and findSkew look at a
+ * smaller gray copy of the image first, which is much cheaper: the
+ * transitions are searched over scale^2 times fewer pixels, and the line
+ * fitting in getTopEdge costs the square of the width.  The results are
+ * then refined on the full image, looking only near the estimates. */
 
-  SANE_Status ret = SANE_STATUS_GOOD;
+/* edges are refined within this many pixels of the small copy */
+#define PYR_MARGIN 4
 
-  double slopeRad = -atan(slope);
-  double slopeSin = sin(slopeRad);
-  double slopeCos = cos(slopeRad);
+/* below this size, the small copy is not worth making */
+#define PYR_MIN_SIZE 64
 
-  int pwidth = params->pixels_per_line;
-  int bwidth = params->bytes_per_line;
-  int height = params->lines;
-  int depth = 1;
+/* the slope search in getTopEdge can not see a degree of skew on a
+ * narrower copy, so the scale is reduced until it is this wide */
+#define PYR_MIN_SKEW 512
 
-  unsigned char * outbuf;
-  int i, j, k;
+/* A gray copy of the image, scale times smaller in both directions.
+ * Each pixel is the average of the 2x2 pixels in the middle of its
+ * block, so making it costs a quarter of the image at scale 4, and the
+ * edges of the media are not thin enough to fall between. Lineart
+ * becomes gray too, so the coarse passes use the gray detector. */
+static SANE_Status
+shrinkImage (SANE_Parameters * params, SANE_Byte * buffer, int scale,
+  SANE_Parameters * small, SANE_Byte ** out)
+{
+  int bw = params->bytes_per_line;
+  int sw = params->pixels_per_line / scale;
+  int sh = params->lines / scale;
+  int mid = scale/2 - 1;
+  int bpp;
+  SANE_Byte * buf;
+  int i, j, n;
 
-  DBG(10,"sanei_magic_rotate: start: %d %d\n",centerX,centerY);
+  if(params->format == SANE_FRAME_RGB){
+    bpp = 3;
+  }
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 8){
+    bpp = 1;
+  }
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+    bpp = 0;
+  }
+  else{
+    DBG (5, "shrinkImage: unsupported format/depth\n");
+    return SANE_STATUS_INVAL;
+  }
 
-  outbuf = malloc(bwidth*height);
-  if(!outbuf){
-    DBG(15,"sanei_magic_rotate: no outbuf\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
+  buf = malloc(sw*sh);
+  if(!buf){
+    DBG (5, "shrinkImage: no buffer\n");
+    return SANE_STATUS_NO_MEM;
   }
 
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
-  ){
+  for(i=0; i<sh; i++){
+    SANE_Byte * p = buffer + (i*scale + mid)*bw;
+    SANE_Byte * q = p + bw;
 
-    if(params->format == SANE_FRAME_RGB)
-      depth = 3;
+    /* set bits are dark */
+    if(!bpp){
+      for(j=0; j<sw; j++){
+        int x = j*scale + mid;
+        int sum = (p[x/8] >> (7-x%8) & 1) + (q[x/8] >> (7-x%8) & 1);
 
-    memset(outbuf,bg_color,bwidth*height);
+        x++;
+        sum += (p[x/8] >> (7-x%8) & 1) + (q[x/8] >> (7-x%8) & 1);
+        buf[i*sw + j] = 255 - sum*255/4;
+      }
+    }
+    else{
+      for(j=0; j<sw; j++){
+        int x = (j*scale + mid)*bpp;
+        int sum = 0;
 
-    for (i=0; i<height; i++) {
-      int shiftY = centerY - i;
-    
-      for (j=0; j<pwidth; j++) {
-        int shiftX = centerX - j;
-        int sourceX, sourceY;
-    
-        sourceX = centerX - (int)(shiftX * slopeCos + shiftY * slopeSin);
-        if (sourceX < 0 || sourceX >= pwidth)
-          continue;
-    
-        sourceY = centerY + (int)(-shiftY * slopeCos + shiftX * slopeSin);
-        if (sourceY < 0 || sourceY >= height)
-          continue;
-    
-        for (k=0; k<depth; k++) {
-          outbuf[i*bwidth+j*depth+k]
-            = buffer[sourceY*bwidth+sourceX*depth+k];
+        for(n=0; n<bpp*2; n++){
+          sum += p[x+n] + q[x+n];
         }
+        buf[i*sw + j] = sum / (bpp*4);
       }
     }
   }
 
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+  small->format = SANE_FRAME_GRAY;
+  small->last_frame = SANE_TRUE;
+  small->depth = 8;
+  small->pixels_per_line = sw;
+  small->bytes_per_line = sw;
+  small->lines = sh;
 
-    if(bg_color)
-      bg_color = 0xff;
+  *out = buf;
 
-    memset(outbuf,bg_color,bwidth*height);
+  DBG (15, "shrinkImage: %dx%d to %dx%d\n", params->pixels_per_line,
+    params->lines, sw, sh);
+  return SANE_STATUS_GOOD;
+}
 
-    for (i=0; i<height; i++) {
-      int shiftY = centerY - i;
-    
-      for (j=0; j<pwidth; j++) {
-        int shiftX = centerX - j;
-        int sourceX, sourceY;
-    
-        sourceX = centerX - (int)(shiftX * slopeCos + shiftY * slopeSin);
-        if (sourceX < 0 || sourceX >= pwidth)
-          continue;
-    
-        sourceY = centerY + (int)(-shiftY * slopeCos + shiftX * slopeSin);
-        if (sourceY < 0 || sourceY >= height)
-          continue;
+/* find likely edges of media inside image background color,
+ * first on a smaller copy of the image */
+SANE_Status
+sanei_magic_findEdges2(SANE_Parameters * params, SANE_Byte * buffer,
+  int dpiX, int dpiY, int * top, int * bot, int * left, int * right,
+  int scale)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  int width = params->pixels_per_line;
+  int height = params->lines;
 
-        /* wipe out old bit */
-        outbuf[i*bwidth + j/8] &= ~(1 << (7-(j%8)));
+  SANE_Parameters small;
+  SANE_Byte * sbuf = NULL;
 
-        /* fill in new bit */
-        outbuf[i*bwidth + j/8] |= 
-          ((buffer[sourceY*bwidth + sourceX/8]
-          >> (7-(sourceX%8))) & 1) << (7-(j%8));
-      }
-    }
+  int * topBuf = NULL, * botBuf = NULL;
+  int * leftBuf = NULL, * rightBuf = NULL;
+
+  int t, b, l, r;
+  int from, to, count;
+  int i;
+
+  /* lineart is cheaper to search in full than to shrink */
+  if(scale < 2 || params->depth == 1
+    || width/scale < PYR_MIN_SIZE || height/scale < PYR_MIN_SIZE){
+    return sanei_magic_findEdges(params, buffer, dpiX, dpiY,
+      top, bot, left, right);
   }
-  else{
-    DBG (5, "sanei_magic_rotate: unsupported format/depth\n");
-    ret = SANE_STATUS_INVAL;
+
+  DBG (10, "sanei_magic_findEdges2: start %d\n", scale);
+
+  ret = shrinkImage(params, buffer, scale, &small, &sbuf);
+  if(ret){
     goto cleanup;
   }
 
-  memcpy(buffer,outbuf,bwidth*height);
-
-  cleanup:
+  /* the transitions have to have neighbors within dpi/2 pixels on the
+   * following rows, which is the same slope at any scale */
+  ret = sanei_magic_findEdges(&small, sbuf, dpiX, dpiY, &t, &b, &l, &r);
+  if(ret){
+    DBG (5, "sanei_magic_findEdges2: no coarse edges\n");
+    goto cleanup;
+  }
 
-  if(outbuf)
-    free(outbuf);
+  DBG (15, "sanei_magic_findEdges2: coarse t:%d b:%d l:%d r:%d\n",t,b,l,r);
 
-  DBG(10,"sanei_magic_rotate: finish\n");
+  /* top, from the full resolution rows near the estimate. The last 7
+   * rows are not filtered for neighbors, so get some more */
+  from = MAX(0, (t-PYR_MARGIN)*scale);
+  to = MIN(height, (t+PYR_MARGIN+1)*scale);
 
-  return 0;
-}
+  leftBuf = getTransX(params, dpiX, buffer, 1, from, MIN(height, to+7));
+  rightBuf = getTransX(params, dpiX, buffer, 0, from, MIN(height, to+7));
+  if(!leftBuf || !rightBuf){
+    DBG (5, "sanei_magic_findEdges2: no l/r bufs\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
 
-SANE_Status
-sanei_magic_isBlank (SANE_Parameters * params, SANE_Byte * buffer,
-  double thresh)
-{
-  SANE_Status ret = SANE_STATUS_GOOD;
-  double imagesum = 0;
-  int i, j;
+  *top = height;
+  count = 0;
+  for(i=from; i<to; i++){
+    if(rightBuf[i] > leftBuf[i]){
+      if(*top > i){
+        *top = i;
+      }
 
-  DBG(10,"sanei_magic_isBlank: start: %f\n",thresh);
+      count++;
+      if(count > 3){
+        break;
+      }
+    }
+    else{
+      count = 0;
+      *top = height;
+    }
+  }
+  if(count <= 3){
+    *top = t*scale;
+  }
 
-  /*convert thresh from percent (0-100) to 0-1 range*/
-  thresh /= 100;
+  free(leftBuf);
+  free(rightBuf);
 
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
-  ){
+  /* bottom, the same */
+  from = MAX(0, (b-PYR_MARGIN)*scale);
+  to = MIN(height, (b+PYR_MARGIN+1)*scale);
 
-    /* loop over all rows, find density of each */
-    for(i=0; i<params->lines; i++){
-      int rowsum = 0;
-      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
+  leftBuf = getTransX(params, dpiX, buffer, 1, from, MIN(height, to+7));
+  rightBuf = getTransX(params, dpiX, buffer, 0, from, MIN(height, to+7));
+  if(!leftBuf || !rightBuf){
+    DBG (5, "sanei_magic_findEdges2: no l/r bufs\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
 
-      /* loop over all columns, sum the 'darkness' of the pixels */
-      for(j=0; j<params->bytes_per_line; j++){
-        rowsum += 255 - ptr[j];
+  *bot = -1;
+  count = 0;
+  for(i=to-1; i>=from; i--){
+    if(rightBuf[i] > leftBuf[i]){
+      if(*bot < i){
+        *bot = i;
       }
 
-      imagesum += (double)rowsum/params->bytes_per_line/255;
+      count++;
+      if(count > 3){
+        break;
+      }
+    }
+    else{
+      count = 0;
+      *bot = -1;
     }
-
   }
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+  if(count <= 3){
+    *bot = b*scale + scale-1;
+  }
 
-    /* loop over all rows, find density of each */
-    for(i=0; i<params->lines; i++){
-      int rowsum = 0;
-      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
+  /* left, from the full resolution columns near the estimate,
+   * not above the top or below the bottom, like findEdges */
+  from = MAX(0, (l-PYR_MARGIN)*scale);
+  to = MIN(width, (l+PYR_MARGIN+1)*scale);
 
-      /* loop over all columns, sum the pixels */
-      for(j=0; j<params->pixels_per_line; j++){
-        rowsum += ptr[j/8] >> (7-(j%8)) & 1;
+  topBuf = getTransY(params, dpiY, buffer, 1, from, MIN(width, to+7));
+  botBuf = getTransY(params, dpiY, buffer, 0, from, MIN(width, to+7));
+  if(!topBuf || !botBuf){
+    DBG (5, "sanei_magic_findEdges2: no t/b bufs\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  *left = width;
+  count = 0;
+  for(i=from; i<to; i++){
+    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
+      if(*left > i){
+        *left = i;
       }
 
-      imagesum += (double)rowsum/params->pixels_per_line;
+      count++;
+      if(count > 3){
+        break;
+      }
+    }
+    else{
+      count = 0;
+      *left = width;
     }
-
   }
-  else{
-    DBG (5, "sanei_magic_isBlank: unsupported format/depth\n");
-    ret = SANE_STATUS_INVAL;
+  if(count <= 3){
+    *left = l*scale;
+  }
+
+  free(topBuf);
+  free(botBuf);
+
+  /* right, the same */
+  from = MAX(0, (r-PYR_MARGIN)*scale);
+  to = MIN(width, (r+PYR_MARGIN+1)*scale);
+
+  topBuf = getTransY(params, dpiY, buffer, 1, from, MIN(width, to+7));
+  botBuf = getTransY(params, dpiY, buffer, 0, from, MIN(width, to+7));
+  if(!topBuf || !botBuf){
+    DBG (5, "sanei_magic_findEdges2: no t/b bufs\n");
+    ret = SANE_STATUS_NO_MEM;
     goto cleanup;
   }
 
-  DBG (5, "sanei_magic_isBlank: sum:%f lines:%d thresh:%f density:%f\n",
-    imagesum,params->lines,thresh,imagesum/params->lines);
+  *right = -1;
+  count = 0;
+  for(i=to-1; i>=from; i--){
+    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
+      if(*right < i){
+        *right = i;
+      }
 
-  if(imagesum/params->lines <= thresh){
-    DBG (5, "sanei_magic_isBlank: blank!\n");
-    ret = SANE_STATUS_NO_DOCS;
+      count++;
+      if(count > 3){
+        break;
+      }
+    }
+    else{
+      count = 0;
+      *right = -1;
+    }
+  }
+  if(count <= 3){
+    *right = r*scale + scale-1;
   }
 
-  cleanup:
+  DBG (15, "sanei_magic_findEdges2: t:%d b:%d l:%d r:%d\n",
+    *top,*bot,*left,*right);
 
-  DBG(10,"sanei_magic_isBlank: finish\n");
+  cleanup:
+  if(sbuf)
+    free(sbuf);
+  if(topBuf)
+    free(topBuf);
+  if(botBuf)
+    free(botBuf);
+  if(leftBuf)
+    free(leftBuf);
+  if(rightBuf)
+    free(rightBuf);
 
+  DBG (10, "sanei_magic_findEdges2: finish\n");
   return ret;
 }
 
-/* Divide the image into 1/2 inch squares, skipping a 1/4 inch
- * margin on all sides. If all squares are under the user's density,
- * signal our caller to skip the image entirely, by returning 
- * SANE_STATUS_NO_DOCS */
-SANE_Status
-sanei_magic_isBlank2 (SANE_Parameters * params, SANE_Byte * buffer,
-  int dpiX, int dpiY, double thresh)
+/* Row of the first transition in column x, looking down from row 'from'
+ * to row 'to', with the same detectors as getTransY. -1 if none. */
+static int
+getTransNear (SANE_Parameters * params, SANE_Byte * buffer, int x,
+  int from, int to)
 {
-  int xb,yb,x,y;
-
-  /* .25 inch, rounded down to 8 pixel */
-  int xquarter = dpiX/4/8*8;
-  int yquarter = dpiY/4/8*8;
-  int xhalf    = xquarter*2;
-  int yhalf    = yquarter*2;
-  int blockpix = xhalf*yhalf;
-  int xblocks  = (params->pixels_per_line-xhalf)/xhalf;
-  int yblocks  = (params->lines-yhalf)/yhalf;
-
-  /*convert thresh from percent (0-100) to 0-1 range*/
-  thresh /= 100;
+  int bwidth = params->bytes_per_line;
+  int winLen = 9;
+  int j, k;
 
-  DBG (10, "sanei_magic_isBlank2: start %d %d %f %d\n",xhalf,yhalf,thresh,blockpix);
+  if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+    int near = buffer[from*bwidth + x/8] >> (7-(x%8)) & 1;
 
-  if(params->depth == 8 &&
-    (params->format == SANE_FRAME_RGB || params->format == SANE_FRAME_GRAY)
-  ){
+    for(j=from+1; j<to; j++){
+      if((buffer[j*bwidth + x/8] >> (7-(x%8)) & 1) != near){
+        return j;
+      }
+    }
+  }
+  else{
+    int depth = (params->format == SANE_FRAME_RGB) ? 3 : 1;
+    int near = 0;
+    int far = 0;
 
-    int Bpp = params->format == SANE_FRAME_RGB ? 3 : 1;
+    for(k=0; k<depth; k++){
+      near += buffer[from*bwidth + x*depth + k];
+    }
+    near *= winLen;
+    far = near;
 
-    for(yb=0; yb<yblocks; yb++){
-      for(xb=0; xb<xblocks; xb++){
-  
-        /*count dark pix in this block*/
-        double blocksum = 0;
-  
-        for(y=0; y<yhalf; y++){
-  
-          /* skip the top and left 1/4 inch */
-          int offset = (yquarter + yb*yhalf + y) * params->bytes_per_line
-            + (xquarter + xb*xhalf) * Bpp;
-          SANE_Byte * ptr = buffer + offset;
+    for(j=from+1; j<to; j++){
+      int farLine = MAX(j-winLen*2, from);
+      int nearLine = MAX(j-winLen, from);
 
-          /*count darkness of pix in this row*/
-          int rowsum = 0;
-  
-          for(x=0; x<xhalf*Bpp; x++){
-            rowsum += 255 - ptr[x];
-          }
+      for(k=0; k<depth; k++){
+        far -= buffer[farLine*bwidth + x*depth + k];
+        far += buffer[nearLine*bwidth + x*depth + k];
 
-          blocksum += (double)rowsum/(xhalf*Bpp)/255;
-        }
+        near -= buffer[nearLine*bwidth + x*depth + k];
+        near += buffer[j*bwidth + x*depth + k];
+      }
 
-        /* block was darker than thresh, keep image */
-        if(blocksum/yhalf > thresh){
-          DBG (15, "sanei_magic_isBlank2: not blank %f %d %d\n", blocksum/yhalf, yb, xb);
-          return SANE_STATUS_GOOD;
-        }
-        DBG (20, "sanei_magic_isBlank2: block blank %f %d %d\n", blocksum/yhalf, yb, xb);
+      if(abs(near - far) > 50*winLen*depth - near*40/255){
+        return j;
       }
     }
   }
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
-
-    for(yb=0; yb<yblocks; yb++){
-      for(xb=0; xb<xblocks; xb++){
-  
-        /*count dark pix in this block*/
-        double blocksum = 0;
-  
-        for(y=0; y<yhalf; y++){
-  
-          /* skip the top and left 1/4 inch */
-          int offset = (yquarter + yb*yhalf + y) * params->bytes_per_line
-            + (xquarter + xb*xhalf) / 8;
-          SANE_Byte * ptr = buffer + offset;
 
-          /*count darkness of pix in this row*/
-          int rowsum = 0;
-  
-          for(x=0; x<xhalf; x++){
-            rowsum += ptr[x/8] >> (7-(x%8)) & 1;
-          }
+  return -1;
+}
 
-          blocksum += (double)rowsum/xhalf;
+static int
+cmpInt (const void * a, const void * b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+/* Bring the top edge found on the smaller copy back to full resolution.
+ * The transition of each column is looked for only near the line found,
+ * which is then moved by the median distance to them (the coarse
+ * transitions come later), and fitted by least squares to the ones
+ * close to it, twice, with a tighter tolerance the second time. */
+static SANE_Status
+refineTopEdge (SANE_Parameters * params, SANE_Byte * buffer, int scale,
+  double * finSlope, int * finXInter, int * finYInter)
+{
+  int width = params->pixels_per_line;
+  int height = params->lines;
+  int margin = (9+PYR_MARGIN) * scale;
+
+  double slope = *finSlope;
+  double yInter = (double)*finYInter * scale;
+
+  int * trans;
+  int * dist;
+  int i, n, pass;
+
+  trans = malloc(width*sizeof(int));
+  dist = malloc(width*sizeof(int));
+  if(!trans || !dist){
+    DBG (5, "refineTopEdge: no buffers\n");
+    free(trans);
+    free(dist);
+    return SANE_STATUS_NO_MEM;
+  }
+
+  n = 0;
+  for(i=0; i<width; i++){
+    int pred = yInter + slope*i;
+
+    trans[i] = -1;
+    if(pred < 0 || pred >= height)
+      continue;
+
+    trans[i] = getTransNear(params, buffer, i, MAX(0, pred-margin),
+      MIN(height, pred+margin));
+    if(trans[i] >= 0)
+      dist[n++] = trans[i] - pred;
+  }
+
+  if(n < width/10){
+    DBG (5, "refineTopEdge: too few transitions %d, keeping estimate\n", n);
+    n = 0;
+  }
+  else{
+    qsort(dist, n, sizeof(int), cmpInt);
+    yInter += dist[n/2];
+  }
+
+  for(pass=0; n && pass<2; pass++){
+    double tol = pass ? 3 : scale*2 + 2;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int count = 0;
+
+    for(i=0; i<width; i++){
+      if(trans[i] < 0 || fabs(trans[i] - yInter - slope*i) > tol)
+        continue;
+
+      sx += i;
+      sy += trans[i];
+      sxx += (double)i*i;
+      sxy += (double)i*trans[i];
+      count++;
+    }
+
+    if(count < width/10 || count*sxx == sx*sx){
+      DBG (5, "refineTopEdge: pass %d fits only %d\n", pass, count);
+      break;
+    }
+
+    slope = (count*sxy - sx*sy) / (count*sxx - sx*sx);
+    yInter = (sy - slope*sx) / count;
+
+    DBG (15, "refineTopEdge: pass %d %d points, %+0.6f %0.1f\n",
+      pass, count, slope, yInter);
+  }
+
+  free(trans);
+  free(dist);
+
+  /* same as getTopEdge */
+  *finYInter = yInter;
+  *finXInter = *finYInter / -slope;
+  *finSlope = slope;
+
+  return SANE_STATUS_GOOD;
+}
+
+/* find angle of media rotation against image background,
+ * first on a smaller copy of the image */
+SANE_Status
+sanei_magic_findSkew2(SANE_Parameters * params, SANE_Byte * buffer,
+  int dpiX, int dpiY, int * centerX, int * centerY, double * finSlope,
+  int scale)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  int width = params->pixels_per_line;
+  int height = params->lines;
+
+  SANE_Parameters small;
+  SANE_Byte * sbuf = NULL;
+
+  double TSlope = 0;
+  int TXInter = 0;
+  int TYInter = 0;
+
+  double LSlope = 0;
+  int LXInter = 0;
+  int LYInter = 0;
+
+  int * topBuf = NULL, * botBuf = NULL;
+
+  while(scale > 1 && width/scale < PYR_MIN_SKEW){
+    scale /= 2;
+  }
+
+  if(scale < 2 || width/scale < PYR_MIN_SIZE || height/scale < PYR_MIN_SIZE){
+    return sanei_magic_findSkew(params, buffer, dpiX, dpiY,
+      centerX, centerY, finSlope);
+  }
+
+  DBG (10, "sanei_magic_findSkew2: start %d\n", scale);
+
+  ret = shrinkImage(params, buffer, scale, &small, &sbuf);
+  if(ret){
+    goto cleanup;
+  }
+
+  /* get buffers for edge detection, see findEdges2 for the dpi */
+  topBuf = sanei_magic_getTransY(&small,dpiY,sbuf,1);
+  if(!topBuf){
+    DBG (5, "sanei_magic_findSkew2: cant gTY\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  botBuf = sanei_magic_getTransY(&small,dpiY,sbuf,0);
+  if(!botBuf){
+    DBG (5, "sanei_magic_findSkew2: cant gTY\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  /* find best top line, on the small copy */
+  ret = getTopEdge (small.pixels_per_line, small.lines, MAX(1,dpiY/scale),
+    topBuf, &TSlope, &TXInter, &TYInter);
+  if(ret){
+    DBG(5,"sanei_magic_findSkew2: gTE error: %d",ret);
+    goto cleanup;
+  }
+  DBG(15,"sanei_magic_findSkew2: coarse top: %04.04f %d %d\n",
+    TSlope,TXInter,TYInter);
+
+  /* nothing found, or slope is too shallow */
+  if(fabs(TSlope) < 0.0001){
+    DBG(15,"sanei_magic_findSkew2: slope too shallow: %0.08f\n",TSlope);
+    ret = SANE_STATUS_UNSUPPORTED;
+    goto cleanup;
+  }
+
+  /* and on the full image */
+  ret = refineTopEdge (params, buffer, scale, &TSlope, &TXInter, &TYInter);
+  if(ret){
+    goto cleanup;
+  }
+  DBG(15,"sanei_magic_findSkew2: top: %04.04f %d %d\n",TSlope,TXInter,TYInter);
+
+  /* slope is too shallow, don't want to divide by 0 */
+  if(fabs(TSlope) < 0.0001){
+    DBG(15,"sanei_magic_findSkew2: slope too shallow: %0.08f\n",TSlope);
+    ret = SANE_STATUS_UNSUPPORTED;
+    goto cleanup;
+  }
+
+  /* find best left line, perpendicular to top line. The point only
+   * moves the center of rotation, the small copy is good enough. */
+  LSlope = (double)-1/TSlope;
+  ret = getLeftEdge (small.pixels_per_line, small.lines, topBuf, botBuf,
+    LSlope, &LXInter, &LYInter);
+  if(ret){
+    DBG(5,"sanei_magic_findSkew2: gLE error: %d",ret);
+    goto cleanup;
+  }
+  LXInter *= scale;
+  LYInter *= scale;
+  DBG(15,"sanei_magic_findSkew2: left: %04.04f %d %d\n",LSlope,LXInter,LYInter);
+
+  getCenter (TSlope, TXInter, LSlope, LYInter, centerX, centerY);
+  *finSlope = TSlope;
+
+  cleanup:
+  if(sbuf)
+    free(sbuf);
+  if(topBuf)
+    free(topBuf);
+  if(botBuf)
+    free(botBuf);
+
+  DBG (10, "sanei_magic_findSkew2: finish\n");
+  return ret;
+}
+
+/* The rotation is done in place, on bands of rows, each of which can
+ * be done by a thread of its own.  A band keeps the originals of the
+ * rows it has overwritten in a ring for as long as they can be the
+ * source of a later row, and a copy of the rows of its neighbors it
+ * reads from.  For every output row it works out the span of pixels
+ * whose source lies inside the image, then steps the source coordinates
+ * along the row in 16.16 fixed point, recomputing them exactly every
+ * ROT_SPAN pixels so that rounding errors cannot add up.  Source rows
+ * are kept relative to the output row, so only the page width and the
+ * vertical displacement have to fit in 16 bits. */
+#define ROT_SHIFT 16
+#define ROT_ONE (1 << ROT_SHIFT)
+#define ROT_FRAC (ROT_ONE - 1)
+#define ROT_SPAN 32
+#define ROT_MAX 32000
+
+/* rows per thread below which another thread is not worth starting */
+#define ROT_MIN_ROWS 256
+#define ROT_MAX_THREADS 8
+
+/* most bands sanei_magic_rotate2() splits an image in, 0 for one per
+ * online CPU */
+static int rotateThreads = 0;
+
+struct rotate_band
+{
+  SANE_Parameters * params;
+  SANE_Byte * buffer;
+  int centerX;
+  int centerY;
+  double slopeSin;
+  double slopeCos;
+  int bg_color;
+  int interp;
+  int fixed;          /* fixed point coordinates fit */
+  int first;          /* first row of the band */
+  int last;           /* one past the last row */
+  int ringRows;
+  SANE_Byte * ring;   /* originals of the rows overwritten */
+  SANE_Byte * halo;   /* originals of the neighbor rows read */
+  SANE_Byte ** rows;  /* where the original of each row is */
+};
+
+/* source coordinates, fixed point, of a span of pixels.  For nearest
+ * neighbor they are rounded like the original rotation did it with
+ * doubles: towards the center of rotation. */
+static void
+rotate_coords (struct rotate_band * b, int row, int x, int y,
+  int dx, int dy, int n, int * sx, int * sy, int * wt)
+{
+  int pw = b->params->pixels_per_line;
+  int h = b->params->lines;
+  int cx = b->centerX * ROT_ONE;
+  int cy = b->centerY - row;
+  int k = 0;
+
+  /* the threshold only matters near the row, clamp it so it fits */
+  if(cy > ROT_MAX)
+    cy = ROT_MAX;
+  if(cy < -ROT_MAX)
+    cy = -ROT_MAX;
+  cy *= ROT_ONE;
+
+#if defined (__SSE2__)
+  {
+    __m128i vx = _mm_set_epi32(x+3*dx, x+2*dx, x+dx, x);
+    __m128i vy = _mm_set_epi32(y+3*dy, y+2*dy, y+dy, y);
+    __m128i vdx = _mm_set1_epi32(4*dx);
+    __m128i vdy = _mm_set1_epi32(4*dy);
+    __m128i vcx = _mm_set1_epi32(cx);
+    __m128i vcy = _mm_set1_epi32(cy);
+    __m128i frac = _mm_set1_epi32(ROT_FRAC);
+    __m128i minus1 = _mm_set1_epi32(-1);
+    __m128i vpw = _mm_set1_epi32(pw);
+    __m128i vlo = _mm_set1_epi32(-row-1);
+    __m128i vhi = _mm_set1_epi32(h-row);
+    __m128i lowx = _mm_set1_epi32(0xff);
+    __m128i lowy = _mm_set1_epi32(0xff00);
+    int nearest = (b->interp == SANEI_MAGIC_NEAREST);
+
+    for(; k+4 <= n; k+=4){
+      __m128i ix, iy, ok;
+
+      if(nearest){
+        ix = _mm_add_epi32(vx,
+          _mm_andnot_si128(_mm_cmpgt_epi32(vx, vcx), frac));
+        iy = _mm_add_epi32(vy,
+          _mm_and_si128(_mm_cmplt_epi32(vy, vcy), frac));
+      }
+      else{
+        ix = vx;
+        iy = vy;
+        _mm_storeu_si128((__m128i *)(wt+k), _mm_or_si128(
+          _mm_and_si128(_mm_srai_epi32(vx, 8), lowx),
+          _mm_and_si128(vy, lowy)));
+      }
+      ix = _mm_srai_epi32(ix, ROT_SHIFT);
+      iy = _mm_srai_epi32(iy, ROT_SHIFT);
+
+      ok = _mm_and_si128(_mm_cmpgt_epi32(ix, minus1),
+        _mm_cmplt_epi32(ix, vpw));
+      ok = _mm_and_si128(ok, _mm_cmpgt_epi32(iy, vlo));
+      ok = _mm_and_si128(ok, _mm_cmplt_epi32(iy, vhi));
+      ix = _mm_or_si128(_mm_and_si128(ok, ix), _mm_andnot_si128(ok, minus1));
+
+      _mm_storeu_si128((__m128i *)(sx+k), ix);
+      _mm_storeu_si128((__m128i *)(sy+k), iy);
+
+      vx = _mm_add_epi32(vx, vdx);
+      vy = _mm_add_epi32(vy, vdy);
+    }
+    x += k*dx;
+    y += k*dy;
+  }
+#endif
+
+  for(; k<n; k++, x+=dx, y+=dy){
+    int ix, iy;
+
+    if(b->interp == SANEI_MAGIC_NEAREST){
+      ix = (x + (x > cx ? 0 : ROT_FRAC)) >> ROT_SHIFT;
+      iy = (y + (y < cy ? ROT_FRAC : 0)) >> ROT_SHIFT;
+    }
+
+    /* bilinear: the pixel up and left of the source point, and how
+     * far the point is from it, in 1/256 */
+    else{
+      ix = x >> ROT_SHIFT;
+      iy = y >> ROT_SHIFT;
+      wt[k] = ((x >> 8) & 0xff) | (y & 0xff00);
+    }
+
+    if(ix < 0 || ix >= pw || iy < -row || iy >= h-row)
+      ix = -1;
+    sx[k] = ix;
+    sy[k] = iy;
+  }
+}
+
+/* same as rotate_coords, for images too large for fixed point:
+ * one double precision evaluation per pixel */
+static void
+rotate_coords_slow (struct rotate_band * b, int row, int first, int n,
+  int * sx, int * sy, int * wt)
+{
+  int pw = b->params->pixels_per_line;
+  int h = b->params->lines;
+  int shiftY = b->centerY - row;
+  int k;
+
+  for(k=0; k<n; k++){
+    int shiftX = b->centerX - first - k;
+    double u = shiftX * b->slopeCos + shiftY * b->slopeSin;
+    double v = -shiftY * b->slopeCos + shiftX * b->slopeSin;
+    int ix, iy;
+
+    if(b->interp == SANEI_MAGIC_NEAREST){
+      ix = b->centerX - (int)u;
+      iy = b->centerY + (int)v - row;
+    }
+    else{
+      double fx = b->centerX - u;
+      double fy = b->centerY + v;
+
+      ix = (int)floor(fx);
+      iy = (int)floor(fy);
+      wt[k] = ((int)((fx - ix) * 256) & 0xff)
+        | ((int)((fy - iy) * 256) & 0xff) << 8;
+      iy -= row;
+    }
+
+    if(ix < 0 || ix >= pw || iy < -row || iy >= h-row)
+      ix = -1;
+    sx[k] = ix;
+    sy[k] = iy;
+  }
+}
+
+/* fill in the pixels first..first+n-1 of one output row */
+static void
+rotate_pixels (struct rotate_band * b, int row, int first, int n,
+  int * sx, int * sy, int * wt)
+{
+  int bw = b->params->bytes_per_line;
+  int pw = b->params->pixels_per_line;
+  int h = b->params->lines;
+  SANE_Byte ** rows = b->rows + row;
+  SANE_Byte * dst = b->buffer + (size_t)row * bw;
+  int k;
+
+  /* first is a multiple of 8, so whole bytes are built */
+  if(b->params->format == SANE_FRAME_GRAY && b->params->depth == 1){
+    dst += first/8;
+    for(k=0; k<n; k+=8, dst++){
+      int m = MIN(8, n-k);
+      int byte = *dst;
+      int l;
+
+      for(l=0; l<m; l++){
+        int x = sx[k+l];
+
+        if(x < 0)
+          continue;
+        if((rows[sy[k+l]][x/8] << (x%8)) & 0x80)
+          byte |= 0x80 >> l;
+        else
+          byte &= ~(0x80 >> l);
+      }
+      *dst = byte;
+    }
+  }
+
+  else if(b->interp == SANEI_MAGIC_NEAREST){
+
+    /* mostly, all of a span is inside the image.  The coordinates move
+     * monotonically along a row, so looking at the ends is enough. */
+    if(sx[0] >= 0 && sx[n-1] >= 0){
+      if(b->params->format == SANE_FRAME_RGB){
+        dst += first*3;
+        for(k=0; k<n; k++, dst+=3){
+          SANE_Byte * p = rows[sy[k]] + sx[k]*3;
+          dst[0] = p[0];
+          dst[1] = p[1];
+          dst[2] = p[2];
+        }
+      }
+      else{
+        dst += first;
+        for(k=0; k<n; k++)
+          dst[k] = rows[sy[k]][sx[k]];
+      }
+    }
+
+    else if(b->params->format == SANE_FRAME_RGB){
+      dst += first*3;
+      for(k=0; k<n; k++, dst+=3){
+        SANE_Byte * s;
+
+        if(sx[k] < 0)
+          continue;
+
+        s = rows[sy[k]] + sx[k]*3;
+        dst[0] = s[0];
+        dst[1] = s[1];
+        dst[2] = s[2];
+      }
+    }
+    else{
+      dst += first;
+      for(k=0; k<n; k++){
+        if(sx[k] >= 0)
+          dst[k] = rows[sy[k]][sx[k]];
+      }
+    }
+  }
+
+  /* bilinear, the same shortcut, if the neighbors are inside too */
+  else if(sx[0] >= 0 && sx[n-1] >= 0 && sx[n-1] < pw-1 && sx[0] < pw-1
+    && sy[0] < h-1-row && sy[n-1] < h-1-row){
+    int depth = (b->params->format == SANE_FRAME_RGB) ? 3 : 1;
+
+    dst += first*depth;
+    for(k=0; k<n; k++, dst+=depth){
+      SANE_Byte * p = rows[sy[k]] + sx[k]*depth;
+      SANE_Byte * q = rows[sy[k]+1] + sx[k]*depth;
+      int wx = wt[k] & 0xff;
+      int wy = wt[k] >> 8;
+      int c;
+
+      for(c=0; c<depth; c++){
+        int top = p[c] + (((p[c+depth] - p[c]) * wx + 128) >> 8);
+        int bot = q[c] + (((q[c+depth] - q[c]) * wx + 128) >> 8);
+        dst[c] = top + (((bot - top) * wy + 128) >> 8);
+      }
+    }
+  }
+
+  else{
+    int depth = (b->params->format == SANE_FRAME_RGB) ? 3 : 1;
+
+    dst += first*depth;
+    for(k=0; k<n; k++, dst+=depth){
+      SANE_Byte * s;
+      SANE_Byte * t;
+      int wx, wy, nx, c;
+
+      if(sx[k] < 0)
+        continue;
+
+      wx = wt[k] & 0xff;
+      wy = wt[k] >> 8;
+
+      /* at the last column or row, the neighbor is the pixel itself */
+      nx = (sx[k] < pw-1) ? depth : 0;
+      s = rows[sy[k]] + sx[k]*depth;
+      t = (sy[k] < h-1-row) ? rows[sy[k]+1] + sx[k]*depth : s;
+
+      for(c=0; c<depth; c++){
+        int top = s[c] + (((s[c+nx] - s[c]) * wx + 128) >> 8);
+        int bot = t[c] + (((t[c+nx] - t[c]) * wx + 128) >> 8);
+        dst[c] = top + (((bot - top) * wy + 128) >> 8);
+      }
+    }
+  }
+}
+
+/* rotate the rows b->first..b->last-1 of the image */
+static void
+rotate_rows (struct rotate_band * b)
+{
+  int pw = b->params->pixels_per_line;
+  int bw = b->params->bytes_per_line;
+  int h = b->params->lines;
+  double c = b->slopeCos;
+  double s = b->slopeSin;
+  int dx = (int)floor(c * ROT_ONE + 0.5);
+  int dy = (int)floor(-s * ROT_ONE + 0.5);
+  int bg = b->bg_color;
+  int sx[ROT_SPAN];  /* source column, -1 if outside the image */
+  int sy[ROT_SPAN];  /* source row, relative to the output row */
+  int wt[ROT_SPAN];  /* bilinear weights, x | y << 8 */
+  int i;
+
+  if(b->params->format == SANE_FRAME_GRAY && b->params->depth == 1 && bg)
+    bg = 0xff;
+
+  for(i=b->first; i<b->last; i++){
+    SANE_Byte * out = b->buffer + (size_t)i * bw;
+    SANE_Byte * save = b->ring + (size_t)((i - b->first) % b->ringRows) * bw;
+    int shiftY = b->centerY - i;
+
+    /* source x = x0 + j*c, source y - i = y0 - j*s */
+    double x0 = b->centerX - b->centerX * c - shiftY * s;
+    double y0 = shiftY - shiftY * c + b->centerX * s;
+    double lo = 0, hi = pw;
+    int first, last, j;
+
+    /* later rows may still read the original */
+    memcpy(save, out, bw);
+    b->rows[i] = save;
+    memset(out, bg, bw);
+
+    /* the pixels whose source can be inside the image, with a pixel
+     * to spare on both ends for rounding */
+    if(c > 0){
+      lo = (-1 - x0) / c;
+      hi = (pw - x0) / c;
+    }
+    if(s > 0){
+      lo = MAX(lo, (y0 + i - h) / s);
+      hi = MIN(hi, (y0 + i + 1) / s);
+    }
+    else if(s < 0){
+      lo = MAX(lo, (y0 + i + 1) / s);
+      hi = MIN(hi, (y0 + i - h) / s);
+    }
+    else if(y0 + i < -1 || y0 + i > h){
+      continue;
+    }
+
+    first = (int)MAX(0, floor(lo) - 1) & ~7;
+    last = (int)MIN(pw, ceil(hi) + 2);
+    if(first >= last)
+      continue;
+
+    for(j=first; j<last; j+=ROT_SPAN){
+      int n = MIN(ROT_SPAN, last-j);
+
+      if(b->fixed)
+        rotate_coords(b, i,
+          (int)floor((x0 + j * c) * ROT_ONE + 0.5),
+          (int)floor((y0 - j * s) * ROT_ONE + 0.5),
+          dx, dy, n, sx, sy, wt);
+      else
+        rotate_coords_slow(b, i, j, n, sx, sy, wt);
+
+      rotate_pixels(b, i, j, n, sx, sy, wt);
+    }
+  }
+}
+
+#ifdef USE_PTHREAD
+static void *
+rotate_thread (void * arg)
+{
+  rotate_rows(arg);
+  return NULL;
+}
+#endif
+
+/* how many bands to split an image of h rows in */
+static int
+rotate_threads (int h)
+{
+  int n = rotateThreads;
+
+#if defined (USE_PTHREAD) && defined (_SC_NPROCESSORS_ONLN)
+  if(n <= 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if(n > ROT_MAX_THREADS)
+    n = ROT_MAX_THREADS;
+  if(n > h / ROT_MIN_ROWS)
+    n = h / ROT_MIN_ROWS;
+  if(n < 1)
+    n = 1;
+
+  return n;
+}
+
+void
+sanei_magic_setThreads (int threads)
+{
+  rotateThreads = threads;
+}
+
+/* function to do a simple rotation by a given slope, around
+ * a given point. The point can be outside of image to get
+ * proper edge alignment. Unused areas filled with bg color */
+SANE_Status
+sanei_magic_rotate (SANE_Parameters * params, SANE_Byte * buffer,
+  int centerX, int centerY, double slope, int bg_color)
+{
+  return sanei_magic_rotate2(params, buffer, centerX, centerY, slope,
+    bg_color, SANEI_MAGIC_NEAREST);
+}
+
+SANE_Status
+sanei_magic_rotate2 (SANE_Parameters * params, SANE_Byte * buffer,
+  int centerX, int centerY, double slope, int bg_color, int interp)
+{
+
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  double slopeRad = -atan(slope);
+  double slopeSin = sin(slopeRad);
+  double slopeCos = cos(slopeRad);
+
+  int pwidth = params->pixels_per_line;
+  int bwidth = params->bytes_per_line;
+  int height = params->lines;
+
+  struct rotate_band bands[ROT_MAX_THREADS];
+#ifdef USE_PTHREAD
+  pthread_t threads[ROT_MAX_THREADS];
+  int started[ROT_MAX_THREADS];
+#endif
+  int fixed, back, fwd, nbands, i, j, r;
+
+  DBG(10,"sanei_magic_rotate2: start: %d %d\n",centerX,centerY);
+
+  memset(bands,0,sizeof(bands));
+
+  if(!(params->format == SANE_FRAME_RGB
+    || (params->format == SANE_FRAME_GRAY && params->depth == 8)
+    || (params->format == SANE_FRAME_GRAY && params->depth == 1))
+  ){
+    DBG (5, "sanei_magic_rotate2: unsupported format/depth\n");
+    ret = SANE_STATUS_INVAL;
+    goto cleanup;
+  }
+
+  /* lineart is only sampled */
+  if(params->format == SANE_FRAME_GRAY && params->depth == 1)
+    interp = SANEI_MAGIC_NEAREST;
+
+  /* can the source coordinates be done in 16.16 fixed point? */
+  fixed = pwidth < ROT_MAX && abs(centerX) < ROT_MAX
+    && (abs(centerY) + height) * (1 - slopeCos)
+    + (abs(centerX) + pwidth) * fabs(slopeSin) < ROT_MAX;
+
+  /* how many rows above and below an output row its sources can be,
+   * the vertical displacement is largest in a corner */
+  back = fwd = 0;
+  for(i=0; i<4; i++){
+    int row = (i & 1) ? height-1 : 0;
+    int col = (i & 2) ? pwidth-1 : 0;
+    double dy = (centerY - row) * (1 - slopeCos) + (centerX - col) * slopeSin;
+
+    back = MAX(back, (int)ceil(-dy));
+    fwd = MAX(fwd, (int)ceil(dy));
+  }
+  back = MIN(back + 2, height);
+  fwd = MIN(fwd + 2, height);
+
+  nbands = rotate_threads(height);
+  for(i=0; i<nbands; i++){
+    struct rotate_band * b = bands + i;
+    int top, bot;
+
+    b->params = params;
+    b->buffer = buffer;
+    b->centerX = centerX;
+    b->centerY = centerY;
+    b->slopeSin = slopeSin;
+    b->slopeCos = slopeCos;
+    b->bg_color = bg_color;
+    b->interp = interp;
+    b->fixed = fixed;
+    b->first = (int)((double)height * i / nbands);
+    b->last = (int)((double)height * (i+1) / nbands);
+    b->ringRows = MIN(back + 1, b->last - b->first);
+
+    /* rows of the bands above and below this one reads */
+    top = MAX(0, b->first - back);
+    bot = MIN(height, b->last + fwd);
+
+    b->ring = malloc((size_t)b->ringRows * bwidth);
+    b->rows = malloc(height * sizeof(SANE_Byte *));
+    b->halo = malloc((size_t)(b->first - top + bot - b->last) * bwidth + 1);
+    if(!b->ring || !b->rows || !b->halo){
+      DBG(15,"sanei_magic_rotate2: no band buffers\n");
+      ret = SANE_STATUS_NO_MEM;
+      goto cleanup;
+    }
+
+    for(r=0; r<height; r++)
+      b->rows[r] = buffer + (size_t)r * bwidth;
+
+    /* copied now, the other bands will overwrite them */
+    for(r=top, j=0; r<bot; r++){
+      if(r == b->first)
+        r = b->last;
+      if(r >= bot)
+        break;
+      b->rows[r] = b->halo + (size_t)j++ * bwidth;
+      memcpy(b->rows[r], buffer + (size_t)r * bwidth, bwidth);
+    }
+  }
+
+#ifdef USE_PTHREAD
+  for(i=1; i<nbands; i++)
+    started[i] = !pthread_create(threads+i, NULL, rotate_thread, bands+i);
+
+  rotate_rows(bands);
+
+  for(i=1; i<nbands; i++){
+    if(started[i])
+      pthread_join(threads[i], NULL);
+    else
+      rotate_rows(bands+i);
+  }
+#else
+  for(i=0; i<nbands; i++)
+    rotate_rows(bands+i);
+#endif
+
+  DBG(15,"sanei_magic_rotate2: %d rows in %d bands, %d+%d rows kept, %s\n",
+    height, nbands, back, fwd, fixed ? "fixed point" : "floating point");
+
+  cleanup:
+
+  for(i=0; i<ROT_MAX_THREADS; i++){
+    if(bands[i].ring)
+      free(bands[i].ring);
+    if(bands[i].rows)
+      free(bands[i].rows);
+    if(bands[i].halo)
+      free(bands[i].halo);
+  }
+
+  DBG(10,"sanei_magic_rotate2: finish\n");
+
+  return ret;
+}
+
+SANE_Status
+sanei_magic_isBlank (SANE_Parameters * params, SANE_Byte * buffer,
+  double thresh)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  double imagesum = 0;
+  int i, j;
+
+  DBG(10,"sanei_magic_isBlank: start: %f\n",thresh);
+
+  /*convert thresh from percent (0-100) to 0-1 range*/
+  thresh /= 100;
+
+  if(params->format == SANE_FRAME_RGB || 
+    (params->format == SANE_FRAME_GRAY && params->depth == 8)
+  ){
+
+    /* loop over all rows, find density of each */
+    for(i=0; i<params->lines; i++){
+      int rowsum = 0;
+      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
+
+      /* loop over all columns, sum the 'darkness' of the pixels */
+      for(j=0; j<params->bytes_per_line; j++){
+        rowsum += 255 - ptr[j];
+      }
+
+      imagesum += (double)rowsum/params->bytes_per_line/255;
+    }
+
+  }
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+
+    /* loop over all rows, find density of each */
+    for(i=0; i<params->lines; i++){
+      int rowsum = 0;
+      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
+
+      /* loop over all columns, sum the pixels */
+      for(j=0; j<params->pixels_per_line; j++){
+        rowsum += ptr[j/8] >> (7-(j%8)) & 1;
+      }
+
+      imagesum += (double)rowsum/params->pixels_per_line;
+    }
+
+  }
+  else{
+    DBG (5, "sanei_magic_isBlank: unsupported format/depth\n");
+    ret = SANE_STATUS_INVAL;
+    goto cleanup;
+  }
+
+  DBG (5, "sanei_magic_isBlank: sum:%f lines:%d thresh:%f density:%f\n",
+    imagesum,params->lines,thresh,imagesum/params->lines);
+
+  if(imagesum/params->lines <= thresh){
+    DBG (5, "sanei_magic_isBlank: blank!\n");
+    ret = SANE_STATUS_NO_DOCS;
+  }
+
+  cleanup:
+
+  DBG(10,"sanei_magic_isBlank: finish\n");
+
+  return ret;
+}
+
+/* Divide the image into 1/2 inch squares, skipping a 1/4 inch
+ * margin on all sides. If all squares are under the user's density,
+ * signal our caller to skip the image entirely, by returning 
+ * SANE_STATUS_NO_DOCS */
+SANE_Status
+sanei_magic_isBlank2 (SANE_Parameters * params, SANE_Byte * buffer,
+  int dpiX, int dpiY, double thresh)
+{
+  int xb,yb,y;
+
+  /* .25 inch, rounded down to 8 pixel */
+  int xquarter = dpiX/4/8*8;
+  int yquarter = dpiY/4/8*8;
+  int xhalf    = xquarter*2;
+  int yhalf    = yquarter*2;
+  int blockpix = xhalf*yhalf;
+  int xblocks  = (params->pixels_per_line-xhalf)/xhalf;
+  int yblocks  = (params->lines-yhalf)/yhalf;
+
+  /*convert thresh from percent (0-100) to 0-1 range*/
+  thresh /= 100;
+
+  DBG (10, "sanei_magic_isBlank2: start %d %d %f %d\n",xhalf,yhalf,thresh,blockpix);
+
+  if(!(params->format == SANE_FRAME_GRAY && params->depth == 1)
+    && !(params->depth == 8 &&
+      (params->format == SANE_FRAME_RGB || params->format == SANE_FRAME_GRAY))
+  ){
+    DBG (5, "sanei_magic_isBlank2: unsupported format/depth\n");
+    return SANE_STATUS_INVAL;
+  }
+
+  for(yb=0; yb<yblocks; yb++){
+    for(xb=0; xb<xblocks; xb++){
+
+      /*count dark pix in this block*/
+      double blocksum = 0;
+
+      for(y=0; y<yhalf; y++){
+
+        /* skip the top and left 1/4 inch */
+        SANE_Byte * ptr = buffer
+          + (yquarter + yb*yhalf + y) * params->bytes_per_line;
+
+        blocksum += getDarkness(params, ptr, xquarter + xb*xhalf, xhalf);
+      }
+
+      /* block was darker than thresh, keep image */
+      if(blocksum/yhalf > thresh){
+        DBG (15, "sanei_magic_isBlank2: not blank %f %d %d\n", blocksum/yhalf, yb, xb);
+        return SANE_STATUS_GOOD;
+      }
+      DBG (20, "sanei_magic_isBlank2: block blank %f %d %d\n", blocksum/yhalf, yb, xb);
+    }
+  }
+
+  DBG (10, "sanei_magic_isBlank2: returning blank\n");
+  return SANE_STATUS_NO_DOCS;
+}
+
+SANE_Status
+sanei_magic_findTurn(SANE_Parameters * params, SANE_Byte * buffer,
+  int dpiX, int dpiY, int * angle)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  int i, j, k;
+  int depth = 1;
+  int htrans=0, vtrans=0;
+  int htot=0, vtot=0;
+
+  DBG(10,"sanei_magic_findTurn: start\n");
+
+  if(params->format == SANE_FRAME_RGB || 
+    (params->format == SANE_FRAME_GRAY && params->depth == 8)
+  ){
+
+    if(params->format == SANE_FRAME_RGB)
+      depth = 3;
+
+    /* loop over some rows, count segment lengths */
+    for(i=0; i<params->lines; i+=dpiY/20){
+      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
+      int color = 0;
+      int len   = 0;
+      int sum   = 0;
+
+      /* loop over all columns */
+      for(j=0; j<params->pixels_per_line; j++){
+        int curr = 0;
+
+        /*convert color to gray*/
+        for (k=0; k<depth; k++) {
+          curr += ptr[j*depth+k];
+        }
+        curr /= depth;
+
+        /*convert gray to binary (with hysteresis) */
+        curr = (curr < 100)?1:
+               (curr > 156)?0:color;
+
+        /*count segment length*/
+        if(curr != color || j==params->pixels_per_line-1){
+          sum += len * len/5;
+          len = 0;
+          color = curr;
+        }
+        else{
+          len++;
+        }
+      }
+
+      htot++;
+      htrans += (double)sum/params->pixels_per_line;
+    }
+
+    /* loop over some cols, count dark vs light transitions */
+    for(i=0; i<params->pixels_per_line; i+=dpiX/20){
+      SANE_Byte * ptr = buffer + i*depth;
+      int color = 0;
+      int len   = 0;
+      int sum   = 0;
+
+      /* loop over all rows */
+      for(j=0; j<params->lines; j++){
+        int curr = 0;
+
+        /*convert color to gray*/
+        for (k=0; k<depth; k++) {
+          curr += ptr[j*params->bytes_per_line+k];
+        }
+        curr /= depth;
+
+        /*convert gray to binary (with hysteresis) */
+        curr = (curr < 100)?1:
+               (curr > 156)?0:color;
+
+        /*count segment length*/
+        if(curr != color || j==params->lines-1){
+          sum += len * len/5;
+          len = 0;
+          color = curr;
+        }
+        else{
+          len++;
+        }
+      }
+
+      vtot++;
+      vtrans += (double)sum/params->lines;
+    }
+
+  }
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+
+    /* loop over some rows, count segment lengths */
+    for(i=0; i<params->lines; i+=dpiY/30){
+      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
+      int color = 0;
+      int len   = 0;
+      int sum   = 0;
+
+      /* loop over all columns */
+      for(j=0; j<params->pixels_per_line; j++){
+        int curr = ptr[j/8] >> (7-(j%8)) & 1;
+
+        /*count segment length*/
+        if(curr != color || j==params->pixels_per_line-1){
+          sum += len * len/5;
+          len = 0;
+          color = curr;
+        }
+        else{
+          len++;
+        }
+      }
+
+      htot++;
+      htrans += (double)sum/params->pixels_per_line;
+    }
+
+    /* loop over some cols, count dark vs light transitions */
+    for(i=0; i<params->pixels_per_line; i+=dpiX/30){
+      SANE_Byte * ptr = buffer;
+      int color = 0;
+      int len   = 0;
+      int sum   = 0;
+
+      /* loop over all rows */
+      for(j=0; j<params->lines; j++){
+        int curr = ptr[j*params->bytes_per_line + i/8] >> (7-(i%8)) & 1;
+
+        /*count segment length*/
+        if(curr != color || j==params->lines-1){
+          sum += len * len/5;
+          len = 0;
+          color = curr;
+        }
+        else{
+          len++;
+        }
+      }
+
+      vtot++;
+      vtrans += (double)sum/params->lines;
+    }
+
+  }
+  else{
+    DBG (5, "sanei_magic_findTurn: unsupported format/depth\n");
+    ret = SANE_STATUS_INVAL;
+    goto cleanup;
+  }
+
+  DBG (10, "sanei_magic_findTurn: vtrans=%d vtot=%d vfrac=%f htrans=%d htot=%d hfrac=%f\n",
+    vtrans, vtot, (double)vtrans/vtot, htrans, htot, (double)htrans/htot
+  );
+
+  if((double)vtrans/vtot > (double)htrans/htot){
+    DBG (10, "sanei_magic_findTurn: suggest turning 90\n");
+    *angle = 90;
+  }
+
+  cleanup:
+
+  DBG(10,"sanei_magic_findTurn: finish\n");
+
+  return ret;
+}
+
+/* FIXME: Do in-place rotation to save memory */
+SANE_Status
+sanei_magic_turn(SANE_Parameters * params, SANE_Byte * buffer,
+  int angle)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  int opwidth, ipwidth = params->pixels_per_line;
+  int obwidth, ibwidth = params->bytes_per_line;
+  int oheight, iheight = params->lines;
+  int depth = 1;
+
+  unsigned char * outbuf = NULL;
+  int i, j, k;
+
+  DBG(10,"sanei_magic_turn: start %d\n",angle);
+
+  if(params->format == SANE_FRAME_RGB)
+    depth = 3;
+
+  /*clean angle and convert to 0-3*/
+  angle = (angle % 360) / 90;
+
+  /*figure size of output image*/
+  switch(angle){
+    case 1:
+    case 3:
+      opwidth = iheight;
+      oheight = ipwidth;
+
+      /*gray and color, 1 or 3 bytes per pixel*/
+      if ( params->format == SANE_FRAME_RGB
+        || (params->format == SANE_FRAME_GRAY && params->depth == 8)
+      ){
+        obwidth = opwidth*depth;
+      }
+
+      /*clamp binary to byte width. must be <= input image*/
+      else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+        obwidth = opwidth/8;
+        opwidth = obwidth*8;
+      }
+
+      else{
+        DBG(10,"sanei_magic_turn: bad params\n");
+        ret = SANE_STATUS_INVAL;
+        goto cleanup;
+      }
+
+      break;
+
+    case 2:
+      opwidth = ipwidth;
+      obwidth = ibwidth;
+      oheight = iheight;
+      break;
+
+    default:
+      DBG(10,"sanei_magic_turn: no turn\n");
+      goto cleanup;
+  }
+
+  /*get output image buffer*/
+  outbuf = malloc(obwidth*oheight);
+  if(!outbuf){
+    DBG(15,"sanei_magic_turn: no outbuf\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  /*turn color & gray image*/
+  if(params->format == SANE_FRAME_RGB || 
+    (params->format == SANE_FRAME_GRAY && params->depth == 8)
+  ){
+
+    switch (angle) {
+
+      /*rotate 90 clockwise*/
+      case 1:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            for (k=0; k<depth; k++) {
+              outbuf[i*obwidth + j*depth + k]
+                = buffer[(iheight-j-1)*ibwidth + i*depth + k];
+            }
+          }
+        }
+        break;
+
+      /*rotate 180 clockwise*/
+      case 2:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            for (k=0; k<depth; k++) {
+              outbuf[i*obwidth + j*depth + k]
+                = buffer[(iheight-i-1)*ibwidth + (ipwidth-j-1)*depth + k];
+            }
+          }
+        }
+        break;
+
+      /*rotate 270 clockwise*/
+      case 3:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            for (k=0; k<depth; k++) {
+              outbuf[i*obwidth + j*depth + k]
+                = buffer[j*ibwidth + (ipwidth-i-1)*depth + k];
+            }
+          }
+        }
+        break;
+    } /*end switch*/
+  }
+
+  /*turn binary image*/
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+
+    switch (angle) {
+
+      /*rotate 90 clockwise*/
+      case 1:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            unsigned char curr
+              = buffer[(iheight-j-1)*ibwidth + i/8] >> (7-(i%8)) & 1;
+
+            unsigned char mask = 1 << (7-(j%8));
+
+            if(curr){
+              outbuf[i*obwidth + j/8] |= mask;
+            }
+            else{
+              outbuf[i*obwidth + j/8] &= (~mask);
+            }
+
+          }
+        }
+        break;
+
+      /*rotate 180 clockwise*/
+      case 2:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            unsigned char curr
+              = buffer[(iheight-i-1)*ibwidth + (ipwidth-j-1)/8] >> (j%8) & 1;
+
+            unsigned char mask = 1 << (7-(j%8));
+
+            if(curr){
+              outbuf[i*obwidth + j/8] |= mask;
+            }
+            else{
+              outbuf[i*obwidth + j/8] &= (~mask);
+            }
+
+          }
+        }
+        break;
+
+      /*rotate 270 clockwise*/
+      case 3:
+        for (i=0; i<oheight; i++) {
+          for (j=0; j<opwidth; j++) {
+            unsigned char curr
+              = buffer[j*ibwidth + (ipwidth-i-1)/8] >> (i%8) & 1;
+
+            unsigned char mask = 1 << (7-(j%8));
+
+            if(curr){
+              outbuf[i*obwidth + j/8] |= mask;
+            }
+            else{
+              outbuf[i*obwidth + j/8] &= (~mask);
+            }
+
+          }
         }
+        break;
+    } /*end switch*/
+  }
+
+  else{
+    DBG (5, "sanei_magic_turn: unsupported format/depth\n");
+    ret = SANE_STATUS_INVAL;
+    goto cleanup;
+  }
+
+  /*copy output back into input buffer*/
+  memcpy(buffer,outbuf,obwidth*oheight);
+
+  /*update input params*/
+  params->pixels_per_line = opwidth;
+  params->bytes_per_line = obwidth;
+  params->lines = oheight;
+
+  cleanup:
+
+  if(outbuf)
+    free(outbuf);
+
+  DBG(10,"sanei_magic_turn: finish\n");
 
-        /* block was darker than thresh, keep image */
-        if(blocksum/yhalf > thresh){
-          DBG (15, "sanei_magic_isBlank2: not blank %f %d %d\n", blocksum/yhalf, yb, xb);
-          return SANE_STATUS_GOOD;
-        }
-        DBG (20, "sanei_magic_isBlank2: block blank %f %d %d\n", blocksum/yhalf, yb, xb);
-      }
+  return ret;
+}
+
+/* Streaming analysis of a page, as its lines arrive from the scanner.
+ * The transitions of the columns are found with the same windows as
+ * getTransY, moved down one line at a time, and those of the rows with
+ * getTransRow as each line comes in. Going up the page, the windows are
+ * the same two, 17 lines higher, with near and far swapped, so the lowest
+ * transition from the bottom is kept too, and only the last lines need
+ * the end of the page. The blocks of isBlank2 are summed as their lines
+ * pass. Only the lines for the windows are kept. */
+
+/* window length of getTransY, and the lines kept for two of them */
+#define STREAM_WIN 9
+#define STREAM_RING (STREAM_WIN*2+1)
+
+struct sanei_magic_stream
+{
+  SANE_Parameters params;  /* lines counts the lines seen */
+  int height;              /* lines expected, or -1 if unknown */
+  int dpiX;
+  int dpiY;
+  int depth;               /* bytes per pixel, 0 for lineart */
+  int finished;
+
+  SANE_Byte * ring;        /* the last STREAM_RING lines */
+  SANE_Byte * first;       /* first line, for lineart */
+  SANE_Byte * partial;     /* start of a line, from the last write */
+  int partialLen;
+
+  /* window sums of each column, for lineart near is the line where the
+   * last run of equal pixels started */
+  int * near;
+  int * far;
+
+  int * top;               /* transitions in each column */
+  int * bot;
+  int * left;              /* transitions in each row */
+  int * right;
+  int rows;                /* size of left and right */
+
+  /* the blocks of isBlank2 */
+  int xquarter;
+  int yquarter;
+  int xhalf;
+  int yhalf;
+  int xblocks;
+  double * blocks;         /* darkness of the row of blocks being summed */
+  double darkest;          /* darkest block that counts */
+  double pending;          /* darkest block of a row that may not count */
+  int pendingRow;
+};
+
+/* A row of blocks only counts if there is half an inch below it, which
+ * is known right away if the height of the page is */
+static void
+streamConfirm (SANEI_Magic_Stream * s)
+{
+  int lines = s->height > 0 ? s->height : s->params.lines;
+
+  if(s->pendingRow >= 0 && lines >= (s->pendingRow+2)*s->yhalf){
+    if(s->pending > s->darkest){
+      s->darkest = s->pending;
     }
+    s->pendingRow = -1;
   }
-  else{
-    DBG (5, "sanei_magic_isBlank2: unsupported format/depth\n");
-    return SANE_STATUS_INVAL;
-  }
-
-  DBG (10, "sanei_magic_isBlank2: returning blank\n");
-  return SANE_STATUS_NO_DOCS;
 }
 
-SANE_Status
-sanei_magic_findTurn(SANE_Parameters * params, SANE_Byte * buffer,
-  int dpiX, int dpiY, int * angle)
+static SANE_Status
+streamLine (SANEI_Magic_Stream * s, SANE_Byte * buffer)
 {
-  SANE_Status ret = SANE_STATUS_GOOD;
-  int i, j, k;
-  int depth = 1;
-  int htrans=0, vtrans=0;
-  int htot=0, vtot=0;
-
-  DBG(10,"sanei_magic_findTurn: start\n");
+  SANE_Parameters * params = &s->params;
+  int width = params->pixels_per_line;
+  int bwidth = params->bytes_per_line;
+  int depth = s->depth;
+  int j = params->lines;
+  SANE_Byte * line = s->ring + (j % STREAM_RING) * bwidth;
+  int i, k;
 
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
-  ){
+  if(s->height > 0 && j >= s->height){
+    DBG (5, "streamLine: more than %d lines\n", s->height);
+    return SANE_STATUS_INVAL;
+  }
 
-    if(params->format == SANE_FRAME_RGB)
-      depth = 3;
+  memcpy(line, buffer, bwidth);
 
-    /* loop over some rows, count segment lengths */
-    for(i=0; i<params->lines; i+=dpiY/20){
-      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
-      int color = 0;
-      int len   = 0;
-      int sum   = 0;
+  /* windows down each column, as getTransY */
+  if(depth){
+    int winLen = STREAM_WIN;
+    int thresh = 50*winLen*depth;
+    SANE_Byte * nearLine = s->ring + (MAX(j-winLen,0) % STREAM_RING) * bwidth;
+    SANE_Byte * farLine = s->ring + (MAX(j-winLen*2,0) % STREAM_RING) * bwidth;
 
-      /* loop over all columns */
-      for(j=0; j<params->pixels_per_line; j++){
-        int curr = 0;
+    for(i=0; i<width; i++){
+      int near = s->near[i];
+      int far = s->far[i];
 
-        /*convert color to gray*/
-        for (k=0; k<depth; k++) {
-          curr += ptr[j*depth+k];
+      if(!j){
+        near = 0;
+        for(k=0; k<depth; k++){
+          near += line[i*depth + k];
         }
-        curr /= depth;
+        near *= winLen;
+        s->near[i] = s->far[i] = near;
+        continue;
+      }
 
-        /*convert gray to binary (with hysteresis) */
-        curr = (curr < 100)?1:
-               (curr > 156)?0:color;
+      for(k=0; k<depth; k++){
+        far -= farLine[i*depth + k];
+        far += nearLine[i*depth + k];
 
-        /*count segment length*/
-        if(curr != color || j==params->pixels_per_line-1){
-          sum += len * len/5;
-          len = 0;
-          color = curr;
-        }
-        else{
-          len++;
-        }
+        near -= nearLine[i*depth + k];
+        near += line[i*depth + k];
       }
+      s->near[i] = near;
+      s->far[i] = far;
 
-      htot++;
-      htrans += (double)sum/params->pixels_per_line;
-    }
+      if(s->top[i] < 0 && abs(near - far) > thresh - near*40/255){
+        s->top[i] = j;
+      }
 
-    /* loop over some cols, count dark vs light transitions */
-    for(i=0; i<params->pixels_per_line; i+=dpiX/20){
-      SANE_Byte * ptr = buffer + i*depth;
-      int color = 0;
-      int len   = 0;
-      int sum   = 0;
+      /* from below, far is the near window, and starts 17 lines up */
+      if(j >= winLen*2-1 && abs(near - far) > thresh - far*40/255){
+        s->bot[i] = j - (winLen*2-1);
+      }
+    }
+  }
 
-      /* loop over all rows */
-      for(j=0; j<params->lines; j++){
-        int curr = 0;
+  /* lineart changes against the first line and the one before */
+  else if(!j){
+    memcpy(s->first, line, bwidth);
+    for(i=0; i<width; i++){
+      s->near[i] = 0;
+    }
+  }
+  else{
+    SANE_Byte * prev = s->ring + ((j-1) % STREAM_RING) * bwidth;
 
-        /*convert color to gray*/
-        for (k=0; k<depth; k++) {
-          curr += ptr[j*params->bytes_per_line+k];
-        }
-        curr /= depth;
+    for(k=0; k<bwidth; k++){
+      int diff = line[k] ^ s->first[k];
+      int change = line[k] ^ prev[k];
 
-        /*convert gray to binary (with hysteresis) */
-        curr = (curr < 100)?1:
-               (curr > 156)?0:color;
+      if(!(diff | change)){
+        continue;
+      }
+      for(i=k*8; i<k*8+8 && i<width; i++){
+        int mask = 0x80 >> (i%8);
 
-        /*count segment length*/
-        if(curr != color || j==params->lines-1){
-          sum += len * len/5;
-          len = 0;
-          color = curr;
+        if(change & mask){
+          s->near[i] = j;
         }
-        else{
-          len++;
+        if((diff & mask) && s->top[i] < 0){
+          s->top[i] = j;
         }
       }
+    }
+  }
 
-      vtot++;
-      vtrans += (double)sum/params->lines;
+  /* transitions of the row */
+  if(j >= s->rows){
+    int rows = s->rows * 2;
+    int * left = realloc(s->left, rows * sizeof(int));
+    int * right;
+
+    if(!left){
+      DBG (5, "streamLine: no left\n");
+      return SANE_STATUS_NO_MEM;
     }
+    s->left = left;
 
+    right = realloc(s->right, rows * sizeof(int));
+    if(!right){
+      DBG (5, "streamLine: no right\n");
+      return SANE_STATUS_NO_MEM;
+    }
+    s->right = right;
+    s->rows = rows;
   }
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+  s->left[j] = getTransRow(params, line, 1);
+  s->right[j] = getTransRow(params, line, 0);
 
-    /* loop over some rows, count segment lengths */
-    for(i=0; i<params->lines; i+=dpiY/30){
-      SANE_Byte * ptr = buffer + params->bytes_per_line*i;
-      int color = 0;
-      int len   = 0;
-      int sum   = 0;
+  /* blocks, below the top 1/4 inch */
+  if(s->xblocks && j >= s->yquarter){
+    for(i=0; i<s->xblocks; i++){
+      s->blocks[i] += getDarkness(params, line, s->xquarter + i*s->xhalf,
+        s->xhalf);
+    }
 
-      /* loop over all columns */
-      for(j=0; j<params->pixels_per_line; j++){
-        int curr = ptr[j/8] >> (7-(j%8)) & 1;
+    /* row of blocks is done */
+    if((j - s->yquarter) % s->yhalf == s->yhalf-1){
+      double darkest = 0;
 
-        /*count segment length*/
-        if(curr != color || j==params->pixels_per_line-1){
-          sum += len * len/5;
-          len = 0;
-          color = curr;
-        }
-        else{
-          len++;
+      for(i=0; i<s->xblocks; i++){
+        if(s->blocks[i]/s->yhalf > darkest){
+          darkest = s->blocks[i]/s->yhalf;
         }
+        s->blocks[i] = 0;
       }
-
-      htot++;
-      htrans += (double)sum/params->pixels_per_line;
+      DBG (15, "streamLine: blocks %d %f\n", (j - s->yquarter)/s->yhalf,
+        darkest);
+      s->pending = darkest;
+      s->pendingRow = (j - s->yquarter)/s->yhalf;
     }
+  }
 
-    /* loop over some cols, count dark vs light transitions */
-    for(i=0; i<params->pixels_per_line; i+=dpiX/30){
-      SANE_Byte * ptr = buffer;
-      int color = 0;
-      int len   = 0;
-      int sum   = 0;
+  params->lines++;
+  streamConfirm(s);
 
-      /* loop over all rows */
-      for(j=0; j<params->lines; j++){
-        int curr = ptr[j*params->bytes_per_line + i/8] >> (7-(i%8)) & 1;
+  return SANE_STATUS_GOOD;
+}
 
-        /*count segment length*/
-        if(curr != color || j==params->lines-1){
-          sum += len * len/5;
-          len = 0;
-          color = curr;
-        }
-        else{
-          len++;
-        }
-      }
+SANE_Status
+sanei_magic_streamOpen (SANE_Parameters * params, int dpiX, int dpiY,
+  SANEI_Magic_Stream ** stream)
+{
+  SANEI_Magic_Stream * s;
+  int width = params->pixels_per_line;
+  int bwidth = params->bytes_per_line;
+  int i;
 
-      vtot++;
-      vtrans += (double)sum/params->lines;
-    }
+  DBG (10, "sanei_magic_streamOpen: start %d %d\n", width, params->lines);
 
-  }
-  else{
-    DBG (5, "sanei_magic_findTurn: unsupported format/depth\n");
-    ret = SANE_STATUS_INVAL;
-    goto cleanup;
+  if(!(params->format == SANE_FRAME_GRAY && params->depth == 1)
+    && !(params->depth == 8 &&
+      (params->format == SANE_FRAME_RGB || params->format == SANE_FRAME_GRAY))
+  ){
+    DBG (5, "sanei_magic_streamOpen: unsupported format/depth\n");
+    return SANE_STATUS_INVAL;
   }
 
-  DBG (10, "sanei_magic_findTurn: vtrans=%d vtot=%d vfrac=%f htrans=%d htot=%d hfrac=%f\n",
-    vtrans, vtot, (double)vtrans/vtot, htrans, htot, (double)htrans/htot
-  );
+  if(width < 1 || bwidth < 1){
+    DBG (5, "sanei_magic_streamOpen: bad width %d %d\n", width, bwidth);
+    return SANE_STATUS_INVAL;
+  }
 
-  if((double)vtrans/vtot > (double)htrans/htot){
-    DBG (10, "sanei_magic_findTurn: suggest turning 90\n");
-    *angle = 90;
+  s = calloc(1, sizeof(*s));
+  if(!s){
+    DBG (5, "sanei_magic_streamOpen: no stream\n");
+    return SANE_STATUS_NO_MEM;
   }
 
-  cleanup:
+  s->params = *params;
+  s->params.lines = 0;
+  s->height = params->lines;
+  s->dpiX = dpiX;
+  s->dpiY = dpiY;
+  s->pendingRow = -1;
 
-  DBG(10,"sanei_magic_findTurn: finish\n");
+  if(params->depth == 8){
+    s->depth = params->format == SANE_FRAME_RGB ? 3 : 1;
+  }
 
-  return ret;
-}
+  /* .25 inch, rounded down to 8 pixel, as isBlank2 */
+  s->xquarter = dpiX/4/8*8;
+  s->yquarter = dpiY/4/8*8;
+  s->xhalf = s->xquarter*2;
+  s->yhalf = s->yquarter*2;
+  if(s->xhalf && s->yhalf){
+    s->xblocks = (width-s->xhalf)/s->xhalf;
+  }
 
-/* FIXME: Do in-place rotation to save memory */
-SANE_Status
-sanei_magic_turn(SANE_Parameters * params, SANE_Byte * buffer,
-  int angle)
-{
-  SANE_Status ret = SANE_STATUS_GOOD;
-  int opwidth, ipwidth = params->pixels_per_line;
-  int obwidth, ibwidth = params->bytes_per_line;
-  int oheight, iheight = params->lines;
-  int depth = 1;
+  s->rows = s->height > 0 ? s->height : 1024;
 
-  unsigned char * outbuf = NULL;
-  int i, j, k;
+  s->ring = malloc(STREAM_RING * bwidth);
+  s->first = malloc(bwidth);
+  s->partial = malloc(bwidth);
+  s->near = malloc(width * sizeof(int));
+  s->far = malloc(width * sizeof(int));
+  s->top = malloc(width * sizeof(int));
+  s->bot = malloc(width * sizeof(int));
+  s->left = malloc(s->rows * sizeof(int));
+  s->right = malloc(s->rows * sizeof(int));
+  s->blocks = calloc(MAX(s->xblocks,1), sizeof(double));
 
-  DBG(10,"sanei_magic_turn: start %d\n",angle);
+  if(!s->ring || !s->first || !s->partial || !s->near || !s->far
+    || !s->top || !s->bot || !s->left || !s->right || !s->blocks
+  ){
+    DBG (5, "sanei_magic_streamOpen: no buffers\n");
+    sanei_magic_streamClose(s);
+    return SANE_STATUS_NO_MEM;
+  }
 
-  if(params->format == SANE_FRAME_RGB)
-    depth = 3;
+  /* not found yet */
+  for(i=0; i<width; i++){
+    s->top[i] = s->bot[i] = -1;
+  }
 
-  /*clean angle and convert to 0-3*/
-  angle = (angle % 360) / 90;
+  *stream = s;
 
-  /*figure size of output image*/
-  switch(angle){
-    case 1:
-    case 3:
-      opwidth = iheight;
-      oheight = ipwidth;
+  DBG (10, "sanei_magic_streamOpen: finish\n");
+  return SANE_STATUS_GOOD;
+}
 
-      /*gray and color, 1 or 3 bytes per pixel*/
-      if ( params->format == SANE_FRAME_RGB
-        || (params->format == SANE_FRAME_GRAY && params->depth == 8)
-      ){
-        obwidth = opwidth*depth;
-      }
+SANE_Status
+sanei_magic_streamWrite (SANEI_Magic_Stream * s, SANE_Byte * buffer,
+  int len)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  int bwidth = s->params.bytes_per_line;
 
-      /*clamp binary to byte width. must be <= input image*/
-      else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
-        obwidth = opwidth/8;
-        opwidth = obwidth*8;
-      }
+  if(s->finished){
+    DBG (5, "sanei_magic_streamWrite: already finished\n");
+    return SANE_STATUS_INVAL;
+  }
 
-      else{
-        DBG(10,"sanei_magic_turn: bad params\n");
-        ret = SANE_STATUS_INVAL;
-        goto cleanup;
-      }
+  /* complete the line started by the last write */
+  if(s->partialLen){
+    int n = MIN(len, bwidth - s->partialLen);
 
-      break;
+    memcpy(s->partial + s->partialLen, buffer, n);
+    s->partialLen += n;
+    buffer += n;
+    len -= n;
 
-    case 2:
-      opwidth = ipwidth;
-      obwidth = ibwidth;
-      oheight = iheight;
-      break;
+    if(s->partialLen < bwidth){
+      return SANE_STATUS_GOOD;
+    }
+    s->partialLen = 0;
 
-    default:
-      DBG(10,"sanei_magic_turn: no turn\n");
-      goto cleanup;
+    ret = streamLine(s, s->partial);
+    if(ret){
+      return ret;
+    }
   }
 
-  /*get output image buffer*/
-  outbuf = malloc(obwidth*oheight);
-  if(!outbuf){
-    DBG(15,"sanei_magic_turn: no outbuf\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
+  for(; len >= bwidth; len -= bwidth, buffer += bwidth){
+    ret = streamLine(s, buffer);
+    if(ret){
+      return ret;
+    }
+  }
+
+  if(len){
+    memcpy(s->partial, buffer, len);
+    s->partialLen = len;
   }
 
-  /*turn color & gray image*/
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
-  ){
+  return ret;
+}
+
+SANE_Status
+sanei_magic_streamFinish (SANEI_Magic_Stream * s)
+{
+  int width = s->params.pixels_per_line;
+  int bwidth = s->params.bytes_per_line;
+  int height = s->params.lines;
+  int depth = s->depth;
+  int i, j, k;
+
+  DBG (10, "sanei_magic_streamFinish: start %d\n", height);
 
-    switch (angle) {
+  if(s->finished){
+    return SANE_STATUS_GOOD;
+  }
 
-      /*rotate 90 clockwise*/
-      case 1:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            for (k=0; k<depth; k++) {
-              outbuf[i*obwidth + j*depth + k]
-                = buffer[(iheight-j-1)*ibwidth + i*depth + k];
-            }
-          }
-        }
-        break;
+  if(s->partialLen){
+    DBG (5, "sanei_magic_streamFinish: dropping %d bytes\n", s->partialLen);
+    s->partialLen = 0;
+  }
 
-      /*rotate 180 clockwise*/
-      case 2:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            for (k=0; k<depth; k++) {
-              outbuf[i*obwidth + j*depth + k]
-                = buffer[(iheight-i-1)*ibwidth + (ipwidth-j-1)*depth + k];
-            }
-          }
-        }
-        break;
+  if(!height){
+    DBG (5, "sanei_magic_streamFinish: no lines\n");
+    return SANE_STATUS_INVAL;
+  }
 
-      /*rotate 270 clockwise*/
-      case 3:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            for (k=0; k<depth; k++) {
-              outbuf[i*obwidth + j*depth + k]
-                = buffer[j*ibwidth + (ipwidth-i-1)*depth + k];
-            }
-          }
-        }
-        break;
-    } /*end switch*/
+  if(s->height > 0 && height != s->height){
+    DBG (5, "sanei_magic_streamFinish: %d lines, not %d\n", height, s->height);
   }
 
-  /*turn binary image*/
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+  /* the lowest lines see the end of the page through their windows,
+   * look at those as getTransY does, from the bottom up */
+  if(depth){
+    int winLen = STREAM_WIN;
+    int stop = MAX(0, height - (winLen*2-1));
+    SANE_Byte * lastLine = s->ring + ((height-1) % STREAM_RING) * bwidth;
 
-    switch (angle) {
+    for(i=0; i<width; i++){
+      int near = 0;
+      int far = 0;
 
-      /*rotate 90 clockwise*/
-      case 1:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            unsigned char curr
-              = buffer[(iheight-j-1)*ibwidth + i/8] >> (7-(i%8)) & 1;
+      for(k=0; k<depth; k++){
+        near += lastLine[i*depth + k];
+      }
+      near *= winLen;
+      far = near;
 
-            unsigned char mask = 1 << (7-(j%8));
+      for(j=height-2; j>=stop; j--){
+        SANE_Byte * farLine = s->ring
+          + (MIN(j+winLen*2,height-1) % STREAM_RING) * bwidth;
+        SANE_Byte * nearLine = s->ring
+          + (MIN(j+winLen,height-1) % STREAM_RING) * bwidth;
+        SANE_Byte * line = s->ring + (j % STREAM_RING) * bwidth;
 
-            if(curr){
-              outbuf[i*obwidth + j/8] |= mask;
-            }
-            else{
-              outbuf[i*obwidth + j/8] &= (~mask);
-            }
+        for(k=0; k<depth; k++){
+          far -= farLine[i*depth + k];
+          far += nearLine[i*depth + k];
 
-          }
+          near -= nearLine[i*depth + k];
+          near += line[i*depth + k];
         }
-        break;
 
-      /*rotate 180 clockwise*/
-      case 2:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            unsigned char curr
-              = buffer[(iheight-i-1)*ibwidth + (ipwidth-j-1)/8] >> (j%8) & 1;
+        if(abs(near - far) > 50*winLen*depth - near*40/255){
+          s->bot[i] = j;
+          break;
+        }
+      }
+    }
+  }
 
-            unsigned char mask = 1 << (7-(j%8));
+  /* lineart changes just before its last run */
+  else{
+    for(i=0; i<width; i++){
+      s->bot[i] = s->near[i] - 1;
+    }
+  }
 
-            if(curr){
-              outbuf[i*obwidth + j/8] |= mask;
-            }
-            else{
-              outbuf[i*obwidth + j/8] &= (~mask);
-            }
+  for(i=0; i<width; i++){
+    if(s->top[i] < 0){
+      s->top[i] = height;
+    }
+  }
 
-          }
-        }
-        break;
+  filterTrans (s->top, 0, width, s->dpiY, height);
+  filterTrans (s->bot, 0, width, s->dpiY, -1);
+  filterTrans (s->left, 0, height, s->dpiX, width);
+  filterTrans (s->right, 0, height, s->dpiX, -1);
 
-      /*rotate 270 clockwise*/
-      case 3:
-        for (i=0; i<oheight; i++) {
-          for (j=0; j<opwidth; j++) {
-            unsigned char curr
-              = buffer[j*ibwidth + (ipwidth-i-1)/8] >> (i%8) & 1;
+  s->finished = 1;
 
-            unsigned char mask = 1 << (7-(j%8));
+  DBG (10, "sanei_magic_streamFinish: finish\n");
+  return SANE_STATUS_GOOD;
+}
 
-            if(curr){
-              outbuf[i*obwidth + j/8] |= mask;
-            }
-            else{
-              outbuf[i*obwidth + j/8] &= (~mask);
-            }
+SANE_Status
+sanei_magic_streamIsBlank (SANEI_Magic_Stream * s, double thresh)
+{
+  /*convert thresh from percent (0-100) to 0-1 range*/
+  thresh /= 100;
 
-          }
-        }
-        break;
-    } /*end switch*/
+  if(s->darkest > thresh){
+    DBG (15, "sanei_magic_streamIsBlank: not blank %f\n", s->darkest);
+    return SANE_STATUS_GOOD;
   }
 
-  else{
-    DBG (5, "sanei_magic_turn: unsupported format/depth\n");
-    ret = SANE_STATUS_INVAL;
-    goto cleanup;
+  if(s->finished){
+    DBG (15, "sanei_magic_streamIsBlank: blank\n");
+    return SANE_STATUS_NO_DOCS;
   }
 
-  /*copy output back into input buffer*/
-  memcpy(buffer,outbuf,obwidth*oheight);
+  /* all the rows of blocks that count have been seen */
+  if(s->height > 0 && s->yhalf){
+    int yblocks = (s->height-s->yhalf)/s->yhalf;
 
-  /*update input params*/
-  params->pixels_per_line = opwidth;
-  params->bytes_per_line = obwidth;
-  params->lines = oheight;
+    if(s->params.lines >= s->yquarter + yblocks*s->yhalf){
+      DBG (15, "sanei_magic_streamIsBlank: blank at %d of %d\n",
+        s->params.lines, s->height);
+      return SANE_STATUS_NO_DOCS;
+    }
+  }
 
-  cleanup:
+  return SANE_STATUS_DEVICE_BUSY;
+}
 
-  if(outbuf)
-    free(outbuf);
+SANE_Status
+sanei_magic_streamFindEdges (SANEI_Magic_Stream * s,
+  int * top, int * bot, int * left, int * right)
+{
+  SANE_Status ret;
 
-  DBG(10,"sanei_magic_turn: finish\n");
+  if(!s->finished){
+    DBG (5, "sanei_magic_streamFindEdges: not finished\n");
+    return SANE_STATUS_INVAL;
+  }
 
+  ret = getEdges (s->params.pixels_per_line, s->params.lines,
+    s->top, s->bot, s->left, s->right, top, bot, left, right);
+
+  DBG (15, "sanei_magic_streamFindEdges: %d t:%d b:%d l:%d r:%d\n",
+    ret,*top,*bot,*left,*right);
   return ret;
 }
 
+SANE_Status
+sanei_magic_streamFindSkew (SANEI_Magic_Stream * s,
+  int * centerX, int * centerY, double * finSlope)
+{
+  if(!s->finished){
+    DBG (5, "sanei_magic_streamFindSkew: not finished\n");
+    return SANE_STATUS_INVAL;
+  }
+
+  return getSkew (s->params.pixels_per_line, s->params.lines, s->dpiY,
+    s->top, s->bot, centerX, centerY, finSlope);
+}
+
+void
+sanei_magic_streamClose (SANEI_Magic_Stream * s)
+{
+  if(!s){
+    return;
+  }
+
+  free(s->ring);
+  free(s->first);
+  free(s->partial);
+  free(s->near);
+  free(s->far);
+  free(s->top);
+  free(s->bot);
+  free(s->left);
+  free(s->right);
+  free(s->blocks);
+  free(s);
+}
+
 /* Utility functions, not used outside this file */
 
 /* Repeatedly call getLine to find the best range of slope and offset.
@@ -1612,75 +3131,259 @@ getLeftEdge (int width, int height, int * top, int * bot,
   int botXInter, botYInter;
   int leftCount;
 
-  DBG(10,"getEdgeSlope: start\n");
+  DBG(10,"getEdgeSlope: start\n");
+
+  topXInter = width;
+  topYInter = 0;
+  leftCount = 0;
+
+  for(i=0;i<width;i++){
+    
+    if(top[i] < height){
+      int tyi = top[i] - (slope * i);
+      int txi = tyi/-slope;
+
+      if(topXInter > txi){
+        topXInter = txi;
+        topYInter = tyi;
+      }
+
+      leftCount++;
+      if(leftCount > 5){
+        break;
+      }
+    }
+    else{
+      topXInter = width;
+      topYInter = 0;
+      leftCount = 0;
+    }
+  }
+
+  botXInter = width;
+  botYInter = 0;
+  leftCount = 0;
+
+  for(i=0;i<width;i++){
+    
+    if(bot[i] > -1){
+
+      int byi = bot[i] - (slope * i);
+      int bxi = byi/-slope;
+
+      if(botXInter > bxi){
+        botXInter = bxi;
+        botYInter = byi;
+      }
+
+      leftCount++;
+      if(leftCount > 5){
+        break;
+      }
+    }
+    else{
+      botXInter = width;
+      botYInter = 0;
+      leftCount = 0;
+    }
+  }
+
+  if(botXInter < topXInter){
+    *finXInter = botXInter;
+    *finYInter = botYInter;
+  }
+  else{
+    *finXInter = topXInter;
+    *finYInter = topYInter;
+  }
+
+  DBG(10,"getEdgeSlope: finish\n");
+
+  return 0;
+}
+
+/* Look for the edges in the transitions of the columns and rows,
+ * the first run of 4 with a transition from both sides each way */
+static SANE_Status
+getEdges (int width, int height, int * topBuf, int * botBuf,
+  int * leftBuf, int * rightBuf, int * top, int * bot, int * left, int * right)
+{
+  int topCount = 0, botCount = 0;
+  int leftCount = 0, rightCount = 0;
+
+  int i;
+
+  /* loop thru left and right lists, look for top and bottom extremes */
+  *top = height;
+  for(i=0; i<height; i++){
+    if(rightBuf[i] > leftBuf[i]){
+      if(*top > i){
+        *top = i;
+      }
+
+      topCount++;
+      if(topCount > 3){
+        break;
+      }
+    }
+    else{
+      topCount = 0;
+      *top = height;
+    }
+  }
+
+  *bot = -1;
+  for(i=height-1; i>=0; i--){
+    if(rightBuf[i] > leftBuf[i]){
+      if(*bot < i){
+        *bot = i;
+      }
+
+      botCount++;
+      if(botCount > 3){
+        break;
+      }
+    }
+    else{
+      botCount = 0;
+      *bot = -1;
+    }
+  }
 
-  topXInter = width;
-  topYInter = 0;
-  leftCount = 0;
+  /* could not find top/bot edges */
+  if(*top > *bot){
+    DBG (5, "getEdges: bad t/b edges\n");
+    return SANE_STATUS_UNSUPPORTED;
+  }
 
-  for(i=0;i<width;i++){
-    
-    if(top[i] < height){
-      int tyi = top[i] - (slope * i);
-      int txi = tyi/-slope;
+  /* loop thru top and bottom lists, look for l and r extremes
+   * NOTE: We dont look above the top or below the bottom found previously.
+   * This prevents issues with adf scanners that pad the image after the
+   * paper runs out (usually with white) */
+  DBG (5, "getEdges: bb0:%d tb0:%d b:%d t:%d\n",
+    botBuf[0], topBuf[0], *bot, *top);
 
-      if(topXInter > txi){
-        topXInter = txi;
-        topYInter = tyi;
+  *left = width;
+  for(i=0; i<width; i++){
+    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
+      if(*left > i){
+        *left = i;
       }
 
       leftCount++;
-      if(leftCount > 5){
+      if(leftCount > 3){
         break;
       }
     }
     else{
-      topXInter = width;
-      topYInter = 0;
       leftCount = 0;
+      *left = width;
     }
   }
 
-  botXInter = width;
-  botYInter = 0;
-  leftCount = 0;
-
-  for(i=0;i<width;i++){
-    
-    if(bot[i] > -1){
-
-      int byi = bot[i] - (slope * i);
-      int bxi = byi/-slope;
-
-      if(botXInter > bxi){
-        botXInter = bxi;
-        botYInter = byi;
+  *right = -1;
+  for(i=width-1; i>=0; i--){
+    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
+      if(*right < i){
+        *right = i;
       }
 
-      leftCount++;
-      if(leftCount > 5){
+      rightCount++;
+      if(rightCount > 3){
         break;
       }
     }
     else{
-      botXInter = width;
-      botYInter = 0;
-      leftCount = 0;
+      rightCount = 0;
+      *right = -1;
     }
   }
 
-  if(botXInter < topXInter){
-    *finXInter = botXInter;
-    *finYInter = botYInter;
+  /* could not find left/right edges */
+  if(*left > *right){
+    DBG (5, "getEdges: bad l/r edges\n");
+    return SANE_STATUS_UNSUPPORTED;
   }
-  else{
-    *finXInter = topXInter;
-    *finYInter = topYInter;
+
+  return SANE_STATUS_GOOD;
+}
+
+/* Fit the top edge to the transitions of the columns, and the left edge
+ * perpendicular to it. Their intersection is the center of rotation. */
+static SANE_Status
+getSkew (int width, int height, int dpiY, int * topBuf, int * botBuf,
+  int * centerX, int * centerY, double * finSlope)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  double TSlope = 0;
+  int TXInter = 0;
+  int TYInter = 0;
+
+  double LSlope = 0;
+  int LXInter = 0;
+  int LYInter = 0;
+
+  /* find best top line */
+  ret = getTopEdge (width, height, dpiY, topBuf,
+    &TSlope, &TXInter, &TYInter);
+  if(ret){
+    DBG(5,"getSkew: gTE error: %d",ret);
+    return ret;
   }
+  DBG(15,"getSkew: top: %04.04f %d %d\n",TSlope,TXInter,TYInter);
 
-  DBG(10,"getEdgeSlope: finish\n");
+  /* slope is too shallow, don't want to divide by 0 */
+  if(fabs(TSlope) < 0.0001){
+    DBG(15,"getSkew: slope too shallow: %0.08f\n",TSlope);
+    return SANE_STATUS_UNSUPPORTED;
+  }
 
-  return 0;
+  /* find best left line, perpendicular to top line */
+  LSlope = (double)-1/TSlope;
+  ret = getLeftEdge (width, height, topBuf, botBuf, LSlope,
+    &LXInter, &LYInter);
+  if(ret){
+    DBG(5,"getSkew: gLE error: %d",ret);
+    return ret;
+  }
+  DBG(15,"getSkew: left: %04.04f %d %d\n",LSlope,LXInter,LYInter);
+
+  getCenter (TSlope, TXInter, LSlope, LYInter, centerX, centerY);
+  *finSlope = TSlope;
+
+  return ret;
+}
+
+/* find point about which to rotate, from the top line and
+ * the intercept of the left one */
+static void
+getCenter (double TSlope, int TXInter, double LSlope, int LYInter,
+  int * centerX, int * centerY)
+{
+  double TSlopeHalf = 0;
+  int TOffsetHalf = 0;
+
+  double LSlopeHalf = 0;
+  int LOffsetHalf = 0;
+
+  int rotateX = 0;
+  int rotateY = 0;
+
+  TSlopeHalf = tan(atan(TSlope)/2);
+  TOffsetHalf = LYInter;
+  DBG(15,"getCenter: top half: %04.04f %d\n",TSlopeHalf,TOffsetHalf);
+
+  LSlopeHalf = tan((atan(LSlope) + ((LSlope < 0)?-M_PI_2:M_PI_2))/2);
+  LOffsetHalf = - LSlopeHalf * TXInter;
+  DBG(15,"getCenter: left half: %04.04f %d\n",LSlopeHalf,LOffsetHalf);
+
+  rotateX = (LOffsetHalf-TOffsetHalf) / (TSlopeHalf-LSlopeHalf);
+  rotateY = TSlopeHalf * rotateX + TOffsetHalf;
+  DBG(15,"getCenter: rotate: %d %d\n",rotateX,rotateY);
+
+  *centerX = rotateX;
+  *centerY = rotateY;
 }
 
 /* Loop thru the image and look for first color change in each column.
@@ -1688,12 +3391,22 @@ getLeftEdge (int width, int height, int * top, int * bot,
 int * 
 sanei_magic_getTransY (
   SANE_Parameters * params, int dpi, SANE_Byte * buffer, int top)
+{
+  return getTransY(params, dpi, buffer, top, 0, params->pixels_per_line);
+}
+
+/* The same, for the columns from..to-1 only. The array still has an
+ * entry for every column, the others are left at the impossible value. */
+static int *
+getTransY (SANE_Parameters * params, int dpi, SANE_Byte * buffer, int top,
+  int from, int to)
 {
   int * buff;
 
   int i, j, k;
   int winLen = 9;
 
+  int bwidth = params->bytes_per_line;
   int width = params->pixels_per_line;
   int height = params->lines;
   int depth = 1;
@@ -1731,14 +3444,14 @@ sanei_magic_getTransY (
       depth = 3;
 
     /* loop over all columns, find first transition */
-    for(i=0; i<width; i++){
+    for(i=from; i<to; i++){
 
       int near = 0;
       int far = 0;
 
       /* load the near and far windows with repeated copy of first pixel */
       for(k=0; k<depth; k++){
-        near += buffer[(firstLine*width+i) * depth + k];
+        near += buffer[firstLine*bwidth + i*depth + k];
       }
       near *= winLen;
       far = near;
@@ -1757,11 +3470,11 @@ sanei_magic_getTransY (
         }
 
         for(k=0; k<depth; k++){
-          far -= buffer[(farLine*width+i)*depth+k];
-          far += buffer[(nearLine*width+i)*depth+k];
+          far -= buffer[farLine*bwidth + i*depth + k];
+          far += buffer[nearLine*bwidth + i*depth + k];
 
-          near -= buffer[(nearLine*width+i)*depth+k];
-          near += buffer[(j*width+i)*depth+k];
+          near -= buffer[nearLine*bwidth + i*depth + k];
+          near += buffer[j*bwidth + i*depth + k];
         }
 
         /* significant transition */
@@ -1777,14 +3490,14 @@ sanei_magic_getTransY (
 
     int near = 0;
 
-    for(i=0; i<width; i++){
+    for(i=from; i<to; i++){
   
       /* load the near window with first pixel */
-      near = buffer[(firstLine*width+i)/8] >> (7-(i%8)) & 1;
+      near = buffer[firstLine*bwidth + i/8] >> (7-(i%8)) & 1;
   
       /* move */
       for(j=firstLine+direction; j!=lastLine; j+=direction){
-        if((buffer[(j*width+i)/8] >> (7-(i%8)) & 1) != near){
+        if((buffer[j*bwidth + i/8] >> (7-(i%8)) & 1) != near){
           buff[i] = j;
           break;
         }
@@ -1799,16 +3512,7 @@ sanei_magic_getTransY (
     return NULL;
   }
 
-  /* ignore transitions with few neighbors within .5 inch */
-  for(i=0;i<width-7;i++){
-    int sum = 0;
-    for(j=1;j<=7;j++){
-      if(abs(buff[i+j] - buff[i]) < dpi/2)
-        sum++;
-    }
-    if(sum < 2)
-      buff[i] = lastLine;
-  }
+  filterTrans (buff, from, to, dpi, lastLine);
 
   DBG (10, "sanei_magic_getTransY: finish\n");
 
@@ -1820,29 +3524,31 @@ sanei_magic_getTransY (
 int * 
 sanei_magic_getTransX (
   SANE_Parameters * params, int dpi, SANE_Byte * buffer, int left)
+{
+  return getTransX(params, dpi, buffer, left, 0, params->lines);
+}
+
+/* The same, for the rows from..to-1 only */
+static int *
+getTransX (SANE_Parameters * params, int dpi, SANE_Byte * buffer, int left,
+  int from, int to)
 {
   int * buff;
 
-  int i, j, k;
-  int winLen = 9;
+  int i;
 
   int bwidth = params->bytes_per_line;
   int width = params->pixels_per_line;
   int height = params->lines;
-  int depth = 1;
 
-  /* defaults for right-first */
-  int firstCol = width-1;
+  /* impossible value, for right-first */
   int lastCol = -1;
-  int direction = -1;
 
   DBG (10, "sanei_magic_getTransX: start\n");
 
   /* override for left-first*/
   if(left){
-    firstCol = 0;
     lastCol = width;
-    direction = 1;
   }
 
   /* build output and preload with impossible value */
@@ -1854,96 +3560,159 @@ sanei_magic_getTransX (
   for(i=0; i<height; i++)
     buff[i] = lastCol;
 
-  /* load the buff array with x value for first color change from edge
-   * gray/color uses a different algo from binary/halftone */
+  /* load the buff array with x value for first color change from edge */
+  if(params->format == SANE_FRAME_RGB ||
+    (params->format == SANE_FRAME_GRAY &&
+      (params->depth == 8 || params->depth == 1))
+  ){
+    for(i=from; i<to; i++){
+      buff[i] = getTransRow(params, buffer + i*bwidth, left);
+    }
+  }
+
+  /* some other format? */
+  else{
+    DBG (5, "sanei_magic_getTransX: unsupported format/depth\n");
+    free(buff);
+    return NULL;
+  }
+
+  filterTrans (buff, from, to, dpi, lastCol);
+
+  DBG (10, "sanei_magic_getTransX: finish\n");
+
+  return buff;
+}
+
+/* Look for the first color change in one row, from the left or right.
+ * Return the column, or the impossible value if there is none. */
+static int
+getTransRow (SANE_Parameters * params, SANE_Byte * row, int left)
+{
+  int j, k;
+  int winLen = 9;
+
+  int width = params->pixels_per_line;
+  int depth = 1;
+
+  /* defaults for right-first */
+  int firstCol = width-1;
+  int lastCol = -1;
+  int direction = -1;
+
+  /* override for left-first*/
+  if(left){
+    firstCol = 0;
+    lastCol = width;
+    direction = 1;
+  }
+
+  /* gray/color uses a different algo from binary/halftone */
   if(params->format == SANE_FRAME_RGB || 
     (params->format == SANE_FRAME_GRAY && params->depth == 8)
   ){
 
+    int near = 0;
+    int far = 0;
+
     if(params->format == SANE_FRAME_RGB)
       depth = 3;
 
-    /* loop over all columns, find first transition */
-    for(i=0; i<height; i++){
+    /* load the near and far windows with repeated copy of first pixel */
+    for(k=0; k<depth; k++){
+      near += row[k];
+    }
+    near *= winLen;
+    far = near;
 
-      int near = 0;
-      int far = 0;
+    /* move windows, check delta */
+    for(j=firstCol+direction; j!=lastCol; j+=direction){
 
-      /* load the near and far windows with repeated copy of first pixel */
-      for(k=0; k<depth; k++){
-        near += buffer[i*bwidth + k];
+      int farCol = j-winLen*2*direction;
+      int nearCol = j-winLen*direction;
+
+      if(farCol < 0 || farCol >= width){
+        farCol = firstCol;
+      }
+      if(nearCol < 0 || nearCol >= width){
+        nearCol = firstCol;
       }
-      near *= winLen;
-      far = near;
-  
-      /* move windows, check delta */
-      for(j=firstCol+direction; j!=lastCol; j+=direction){
-  
-        int farCol = j-winLen*2*direction;
-        int nearCol = j-winLen*direction;
 
-        if(farCol < 0 || farCol >= width){
-          farCol = firstCol;
-        }
-        if(nearCol < 0 || nearCol >= width){
-          nearCol = firstCol;
-        }
+      for(k=0; k<depth; k++){
+        far -= row[farCol*depth + k];
+        far += row[nearCol*depth + k];
 
-        for(k=0; k<depth; k++){
-          far -= buffer[i*bwidth + farCol*depth + k];
-          far += buffer[i*bwidth + nearCol*depth + k];
+        near -= row[nearCol*depth + k];
+        near += row[j*depth + k];
+      }
 
-          near -= buffer[i*bwidth + nearCol*depth + k];
-          near += buffer[i*bwidth + j*depth + k];
-        }
-  
-        if(abs(near - far) > 50*winLen*depth - near*40/255){
-          buff[i] = j;
-          break;
-        }
+      if(abs(near - far) > 50*winLen*depth - near*40/255){
+        return j;
       }
     }
   }
 
-  else if (params->format == SANE_FRAME_GRAY && params->depth == 1){
+  else{
 
-    int near = 0;
+    /* load the near window with first pixel */
+    int near = row[firstCol/8] >> (7-(firstCol%8)) & 1;
 
-    for(i=0; i<height; i++){
-  
-      /* load the near window with first pixel */
-      near = buffer[i*bwidth + firstCol/8] >> (7-(firstCol%8)) & 1;
-  
-      /* move */
-      for(j=firstCol+direction; j!=lastCol; j+=direction){
-        if((buffer[i*bwidth + j/8] >> (7-(j%8)) & 1) != near){
-          buff[i] = j;
-          break;
-        }
+    /* move */
+    for(j=firstCol+direction; j!=lastCol; j+=direction){
+      if((row[j/8] >> (7-(j%8)) & 1) != near){
+        return j;
       }
     }
   }
 
-  /* some other format? */
-  else{
-    DBG (5, "sanei_magic_getTransX: unsupported format/depth\n");
-    free(buff);
-    return NULL;
-  }
+  return lastCol;
+}
+
+/* ignore transitions with few neighbors within .5 inch */
+static void
+filterTrans (int * buff, int from, int to, int dpi, int none)
+{
+  int i, j;
 
-  /* ignore transitions with few neighbors within .5 inch */
-  for(i=0;i<height-7;i++){
+  for(i=from;i<to-7;i++){
     int sum = 0;
     for(j=1;j<=7;j++){
       if(abs(buff[i+j] - buff[i]) < dpi/2)
         sum++;
     }
     if(sum < 2)
-      buff[i] = lastCol;
+      buff[i] = none;
   }
+}
 
-  DBG (10, "sanei_magic_getTransX: finish\n");
+/* darkness of len pixels of a row, starting at x, from 0 to 1.
+ * For lineart, x has to be on a byte boundary. */
+static double
+getDarkness (SANE_Parameters * params, SANE_Byte * row, int x, int len)
+{
+  int rowsum = 0;
+  int i;
 
-  return buff;
-}
+  if(params->depth == 1){
+    /* set bits in each nibble */
+    static const int bits[16] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4};
+    SANE_Byte * ptr = row + x/8;
+
+    for(i=0; i<len/8; i++){
+      rowsum += bits[ptr[i] >> 4] + bits[ptr[i] & 15];
+    }
+    for(i=len/8*8; i<len; i++){
+      rowsum += ptr[i/8] >> (7-(i%8)) & 1;
+    }
+    return (double)rowsum/len;
+  }
+  else{
+    int Bpp = params->format == SANE_FRAME_RGB ? 3 : 1;
+    SANE_Byte * ptr = row + x*Bpp;
 
+    for(i=0; i<len*Bpp; i++){
+      rowsum += 255 - ptr[i];
+    }
+    return (double)rowsum/(len*Bpp)/255;
+  }
+}
@@ -42,9 +42,11 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei_net.h"
+#include "../include/sane/sanei_codec_bin.h"
 
 void
 sanei_w_init_req (Wire *w, SANE_Init_Req *req)
@@ -161,6 +163,76 @@ sanei_w_control_option_reply (Wire *w, SANE_Control_Option_Reply *reply)
   sanei_w_string (w, &reply->resource_to_authorize);
 }
 
+static void
+w_option_req_item (Wire *w, SANE_Control_Option_Req *req)
+{
+  sanei_w_word (w, &req->option);
+  sanei_w_word (w, &req->action);
+  if (req->action != SANE_ACTION_SET_AUTO)
+    {
+      sanei_w_word (w, &req->value_type);
+      sanei_w_word (w, &req->value_size);
+      w_option_value (w, req->value_type, req->value_size, &req->value);
+    }
+}
+
+static void
+w_option_reply_item (Wire *w, SANE_Control_Option_Reply *reply)
+{
+  sanei_w_status (w, &reply->status);
+  sanei_w_word (w, &reply->info);
+  sanei_w_word (w, &reply->value_type);
+  sanei_w_word (w, &reply->value_size);
+  w_option_value (w, reply->value_type, reply->value_size, &reply->value);
+}
+
+static void
+w_option_change (Wire *w, SANE_Option_Change *change)
+{
+  sanei_w_word (w, &change->index);
+  sanei_w_option_descriptor_ptr (w, &change->desc);
+}
+
+void
+sanei_w_control_options_req (Wire *w, SANE_Control_Options_Req *req)
+{
+  sanei_w_word (w, &req->handle);
+  sanei_w_array (w, &req->num_requests, (void **) &req->requests,
+		 (WireCodecFunc) w_option_req_item, sizeof (req->requests[0]));
+}
+
+void
+sanei_w_control_options_reply (Wire *w, SANE_Control_Options_Reply *reply)
+{
+  sanei_w_array (w, &reply->num_replies, (void **) &reply->replies,
+		 (WireCodecFunc) w_option_reply_item,
+		 sizeof (reply->replies[0]));
+  sanei_w_word (w, &reply->num_options);
+  sanei_w_array (w, &reply->num_changes, (void **) &reply->changes,
+		 (WireCodecFunc) w_option_change, sizeof (reply->changes[0]));
+  sanei_w_string (w, &reply->resource_to_authorize);
+}
+
+void
+sanei_w_get_option_changes_req (Wire *w, SANE_Get_Option_Changes_Req *req)
+{
+  sanei_w_word (w, &req->handle);
+  sanei_w_word (w, &req->version);
+  sanei_w_string (w, &req->digest);
+}
+
+void
+sanei_w_get_option_changes_reply (Wire *w,
+				  SANE_Get_Option_Changes_Reply *reply)
+{
+  sanei_w_status (w, &reply->status);
+  sanei_w_word (w, &reply->version);
+  sanei_w_string (w, &reply->digest);
+  sanei_w_word (w, &reply->num_options);
+  sanei_w_array (w, &reply->num_changes, (void **) &reply->changes,
+		 (WireCodecFunc) w_option_change, sizeof (reply->changes[0]));
+}
+
 void
 sanei_w_get_parameters_reply (Wire *w, SANE_Get_Parameters_Reply *reply)
 {
@@ -184,3 +256,154 @@ sanei_w_authorization_req (Wire *w, SANE_Authorization_Req *req)
   sanei_w_string (w, &req->username);
   sanei_w_string (w, &req->password);
 }
+
+void
+sanei_net_free_option_descriptor (SANE_Option_Descriptor *d)
+{
+  Wire w;
+
+  if (!d)
+    return;
+  /* The copies are laid out like decoded descriptors, so the wire's
+     free path can release them; it needs neither a buffer nor an fd.
+     A copy that ran out of memory may lack its constraint. */
+  if (!d->constraint.range)
+    d->constraint_type = SANE_CONSTRAINT_NONE;
+  memset (&w, 0, sizeof (w));
+  w.io.fd = -1;
+  sanei_codec_bin_init (&w);
+  sanei_w_free (&w, (WireCodecFunc) sanei_w_option_descriptor, d);
+  free (d);
+}
+
+static char *
+copy_string (SANE_String_Const str, int *ok)
+{
+  char *copy;
+
+  if (!str)
+    return NULL;
+  copy = strdup (str);
+  if (!copy)
+    *ok = 0;
+  return copy;
+}
+
+SANE_Option_Descriptor *
+sanei_net_copy_option_descriptor (const SANE_Option_Descriptor *d)
+{
+  SANE_Option_Descriptor *c;
+  SANE_String_Const *list;
+  SANE_Word *words;
+  SANE_Range *range;
+  int i, n, ok = 1;
+
+  c = malloc (sizeof (*c));
+  if (!c)
+    return NULL;
+  *c = *d;
+  c->name = copy_string (d->name, &ok);
+  c->title = copy_string (d->title, &ok);
+  c->desc = copy_string (d->desc, &ok);
+  c->constraint.range = NULL;
+  switch (d->constraint_type)
+    {
+    case SANE_CONSTRAINT_RANGE:
+      if (!d->constraint.range)
+	break;
+      range = malloc (sizeof (*range));
+      if (range)
+	*range = *d->constraint.range;
+      c->constraint.range = range;
+      ok = ok && range;
+      break;
+
+    case SANE_CONSTRAINT_WORD_LIST:
+      if (!d->constraint.word_list)
+	break;
+      n = d->constraint.word_list[0] + 1;
+      words = malloc (n * sizeof (words[0]));
+      if (words)
+	memcpy (words, d->constraint.word_list, n * sizeof (words[0]));
+      c->constraint.word_list = words;
+      ok = ok && words;
+      break;
+
+    case SANE_CONSTRAINT_STRING_LIST:
+      if (!d->constraint.string_list)
+	break;
+      for (n = 0; d->constraint.string_list[n]; ++n);
+      list = calloc (n + 1, sizeof (list[0]));
+      c->constraint.string_list = list;
+      if (!list)
+	{
+	  ok = 0;
+	  break;
+	}
+      for (i = 0; i < n && ok; ++i)
+	list[i] = copy_string (d->constraint.string_list[i], &ok);
+      break;
+
+    default:
+      break;
+    }
+  if (!ok)
+    {
+      sanei_net_free_option_descriptor (c);
+      return NULL;
+    }
+  return c;
+}
+
+static int
+same_string (SANE_String_Const a, SANE_String_Const b)
+{
+  if (!a || !b)
+    return a == b;
+  return strcmp (a, b) == 0;
+}
+
+SANE_Bool
+sanei_net_same_option_descriptor (const SANE_Option_Descriptor *a,
+				  const SANE_Option_Descriptor *b)
+{
+  const SANE_String_Const *la, *lb;
+  int i;
+
+  if (!a || !b)
+    return a == b;
+  if (!same_string (a->name, b->name) || !same_string (a->title, b->title)
+      || !same_string (a->desc, b->desc) || a->type != b->type
+      || a->unit != b->unit || a->size != b->size || a->cap != b->cap
+      || a->constraint_type != b->constraint_type)
+    return 0;
+  if (a->constraint_type == SANE_CONSTRAINT_NONE)
+    return 1;
+  if (!a->constraint.range || !b->constraint.range)
+    return a->constraint.range == b->constraint.range;
+
+  switch (a->constraint_type)
+    {
+    case SANE_CONSTRAINT_RANGE:
+      return (a->constraint.range->min == b->constraint.range->min
+	      && a->constraint.range->max == b->constraint.range->max
+	      && a->constraint.range->quant == b->constraint.range->quant);
+
+    case SANE_CONSTRAINT_WORD_LIST:
+      return (a->constraint.word_list[0] == b->constraint.word_list[0]
+	      && memcmp (a->constraint.word_list, b->constraint.word_list,
+			 (a->constraint.word_list[0] + 1)
+			 * sizeof (SANE_Word)) == 0);
+
+    case SANE_CONSTRAINT_STRING_LIST:
+      la = a->constraint.string_list;
+      lb = b->constraint.string_list;
+      for (i = 0; la[i] && lb[i]; ++i)
+	if (strcmp (la[i], lb[i]) != 0)
+	  return 0;
+      return la[i] == lb[i];
+
+    default:
+      return 1;
+    }
+}
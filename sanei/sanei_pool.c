@@ -0,0 +1,250 @@
+/* sane - Scanner Access Now Easy.
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it under
+   the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your
+   option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+   for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.  If not, write to the Free
+   Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/* A pool of worker threads for image post-processing, see
+   sanei_pool.h.
+
+   The pool keeps a FIFO of queued jobs under one mutex.  Workers sleep
+   on 'work' until a job is queued or the pool is stopped; a joiner
+   sleeps on 'done' until its job is finished.  A job stays allocated
+   until it is joined, so its status can be collected at any time after
+   it ran. */
+
+#include "../include/sane/config.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef USE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_pool.h"
+
+#define POOL_MAX_THREADS 16
+
+struct sanei_pool_job
+{
+  SANEI_Pool_Func func;
+  void *arg;
+  SANE_Status status;
+  int done;
+  SANEI_Pool *pool;
+  SANEI_Pool_Job *next;
+};
+
+struct sanei_pool
+{
+  int nthreads;
+#ifdef USE_PTHREAD
+  pthread_t threads[POOL_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  SANEI_Pool_Job *head;
+  SANEI_Pool_Job *tail;
+  int stop;
+#endif
+};
+
+#ifdef USE_PTHREAD
+static void *
+pool_worker (void *arg)
+{
+  SANEI_Pool *pool = arg;
+  SANEI_Pool_Job *job;
+
+  pthread_mutex_lock (&pool->lock);
+  for (;;)
+    {
+      while (!pool->head && !pool->stop)
+	pthread_cond_wait (&pool->work, &pool->lock);
+
+      /* queued jobs are run even when stopping, so that no joiner
+         is left waiting */
+      job = pool->head;
+      if (!job)
+	break;
+      pool->head = job->next;
+      if (!pool->head)
+	pool->tail = NULL;
+      pthread_mutex_unlock (&pool->lock);
+
+      job->status = job->func (job->arg);
+
+      pthread_mutex_lock (&pool->lock);
+      job->done = 1;
+      pthread_cond_broadcast (&pool->done);
+    }
+  pthread_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+#endif
+
+SANE_Status
+sanei_pool_create (int threads, SANEI_Pool ** pool)
+{
+  SANEI_Pool *p;
+
+  p = calloc (1, sizeof (*p));
+  if (!p)
+    return SANE_STATUS_NO_MEM;
+
+#ifdef USE_PTHREAD
+  if (threads <= 0)
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+      threads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+      if (threads < 1)
+	threads = 1;
+    }
+  if (threads > POOL_MAX_THREADS)
+    threads = POOL_MAX_THREADS;
+
+  pthread_mutex_init (&p->lock, NULL);
+  pthread_cond_init (&p->work, NULL);
+  pthread_cond_init (&p->done, NULL);
+
+  while (p->nthreads < threads
+	 && !pthread_create (p->threads + p->nthreads, NULL, pool_worker, p))
+    p->nthreads++;
+#else
+  (void) threads;
+#endif
+
+  *pool = p;
+  return SANE_STATUS_GOOD;
+}
+
+int
+sanei_pool_threads (SANEI_Pool * pool)
+{
+  return pool->nthreads;
+}
+
+SANE_Status
+sanei_pool_submit (SANEI_Pool * pool, SANEI_Pool_Func func, void *arg,
+		   SANEI_Pool_Job ** job)
+{
+  SANEI_Pool_Job *j;
+
+  j = calloc (1, sizeof (*j));
+  if (!j)
+    return SANE_STATUS_NO_MEM;
+
+  j->func = func;
+  j->arg = arg;
+  j->pool = pool;
+
+#ifdef USE_PTHREAD
+  if (pool->nthreads)
+    {
+      pthread_mutex_lock (&pool->lock);
+      if (pool->tail)
+	pool->tail->next = j;
+      else
+	pool->head = j;
+      pool->tail = j;
+      pthread_cond_signal (&pool->work);
+      pthread_mutex_unlock (&pool->lock);
+
+      *job = j;
+      return SANE_STATUS_GOOD;
+    }
+#endif
+
+  j->status = func (arg);
+  j->done = 1;
+
+  *job = j;
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sanei_pool_join (SANEI_Pool_Job * job)
+{
+  SANE_Status status;
+
+#ifdef USE_PTHREAD
+  SANEI_Pool *pool = job->pool;
+
+  if (pool->nthreads)
+    {
+      pthread_mutex_lock (&pool->lock);
+      while (!job->done)
+	pthread_cond_wait (&pool->done, &pool->lock);
+      pthread_mutex_unlock (&pool->lock);
+    }
+#endif
+
+  status = job->status;
+  free (job);
+
+  return status;
+}
+
+void
+sanei_pool_destroy (SANEI_Pool * pool)
+{
+#ifdef USE_PTHREAD
+  int i;
+#endif
+
+  if (!pool)
+    return;
+
+#ifdef USE_PTHREAD
+  pthread_mutex_lock (&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast (&pool->work);
+  pthread_mutex_unlock (&pool->lock);
+
+  for (i = 0; i < pool->nthreads; i++)
+    pthread_join (pool->threads[i], NULL);
+
+  pthread_cond_destroy (&pool->done);
+  pthread_cond_destroy (&pool->work);
+  pthread_mutex_destroy (&pool->lock);
+#endif
+
+  free (pool);
+}
@@ -87,9 +87,6 @@
 #include <libusb.h>
 #endif /* HAVE_LIBUSB_1_0 */
 
-#ifdef NACL
-#include "nacl_usb.h"
-#endif /* NACL */
 
 #ifdef HAVE_USBCALLS
 #include <usb.h>
@@ -166,9 +163,6 @@ typedef struct
   libusb_device *lu_device;
   libusb_device_handle *lu_handle;
 #endif /* HAVE_LIBUSB_1_0 */
-#ifdef NACL
-  nacl_usb_dev *nacl_usb_dev_handle;
-#endif
 }
 device_list_type;
 
@@ -381,9 +375,6 @@ store_device (device_list_type device)
 #ifdef HAVE_LIBUSB_1_0
           devices[i].lu_device = device.lu_device;
 #endif
-#ifdef NACL
-          devices[i].nacl_usb_dev_handle = device.nacl_usb_dev_handle;
-#endif
 
           devices[i].missing=0;
 	  DBG (3, "store_device: not storing device %s\n", device.devname);
@@ -1044,19 +1035,6 @@ static void libusb_scan_devices(void)
 }
 #endif /* HAVE_LIBUSB_1_0 */
 
-#ifdef NACL
-static void nacl_usb_scan_devices (void)
-{
-  nacl_usb_dev* devices = NULL;
-  nacl_usb_get_devices(&devices);
-  for (devices; devices++) {
-    device_list_type device = {0};
-    devices.
-  }
-  nacl_usb_get_devices_free(devices);
-}
-#endif /* NACL */
-
 void
 sanei_usb_scan_devices (void)
 {
@@ -1089,10 +1067,6 @@ sanei_usb_scan_devices (void)
   libusb_scan_devices();
 #endif
 
-#ifdef NACL
-  nacl_usb_scan_devices();
-#endif
-
 #ifdef HAVE_USBCALLS
   /* Check for devices using OS/2 USBCALLS Interface */
   usbcall_scan_devices();
@@ -55,7 +55,7 @@
 void
 sanei_w_space (Wire * w, size_t howmuch)
 {
-  size_t nbytes, left_over;
+  size_t nbytes, left_over, room;
   int fd = w->io.fd;
   ssize_t nread, nwritten;
 
@@ -110,20 +110,28 @@ sanei_w_space (Wire * w, size_t howmuch)
 	      return;
 	    }
 
-	  if (left_over)
+	  /* New data goes behind what is left over.  The left over bytes
+	     are only moved to the start when the rest of the buffer is
+	     too short for the request, or too short to read a useful
+	     amount into. */
+	  room = w->buffer.start + w->buffer.size - w->buffer.curr;
+	  if (left_over == 0)
+	    w->buffer.curr = w->buffer.end = w->buffer.start;
+	  else if (room < howmuch || room < w->buffer.size / 4)
 	    {
 	      DBG (4, "sanei_w_space: DECODE: %lu bytes left in buffer\n",
 		   (u_long) left_over);
 	      memmove (w->buffer.start, w->buffer.curr, left_over);
+	      w->buffer.curr = w->buffer.start;
+	      w->buffer.end = w->buffer.start + left_over;
 	    }
-	  w->buffer.curr = w->buffer.start;
-	  w->buffer.end = w->buffer.start + left_over;
 
 	  DBG (4, "sanei_w_space: DECODE: receiving data\n");
 	  do
 	    {
 	      nread = (*w->io.read) (fd, w->buffer.end,
-				     w->buffer.size - left_over);
+				     w->buffer.start + w->buffer.size
+				     - w->buffer.end);
 	      if (nread <= 0)
 		{
 		  DBG (2, "sanei_w_space: DECODE: no data received (%d)\n",
@@ -138,7 +146,7 @@ sanei_w_space (Wire * w, size_t howmuch)
 	    }
 	  while (left_over < howmuch);
 	  DBG (4, "sanei_w_space: DECODE: %lu bytes read\n",
-	       (u_long) (w->buffer.end - w->buffer.start));
+	       (u_long) (w->buffer.end - w->buffer.curr));
 	  break;
 
 	case WIRE_FREE:
@@ -155,25 +163,159 @@ sanei_w_void (Wire * w)
   DBG (3, "sanei_w_void: wire %d (void debug output)\n", w->io.fd);
 }
 
+/* Arena blocks start with this header; the data behind it is aligned
+   for any decoded type. */
+struct WireArenaBlock
+{
+  struct WireArenaBlock *next;
+  size_t size;
+};
+
+typedef union
+{
+  double d;
+  long l;
+  void *p;
+}
+WireArenaAlign;
+
+#define ARENA_ALIGN(n) \
+  (((n) + sizeof (WireArenaAlign) - 1) / sizeof (WireArenaAlign) \
+   * sizeof (WireArenaAlign))
+#define ARENA_HEADER	ARENA_ALIGN (sizeof (struct WireArenaBlock))
+#define ARENA_MIN_BLOCK	(16 * 1024)
+
+static void
+arena_free_blocks (Wire * w)
+{
+  struct WireArenaBlock *b, *next;
+
+  for (b = w->arena.blocks; b; b = next)
+    {
+      next = b->next;
+      free (b);
+    }
+  w->arena.blocks = 0;
+  w->arena.used = 0;
+}
+
+void
+sanei_w_arena_begin (Wire * w)
+{
+  if (w->arena.depth++ > 0)
+    return;
+  DBG (5, "sanei_w_arena_begin: wire %d\n", w->io.fd);
+  w->arena.base_memory = w->allocated_memory;
+  w->arena.used = 0;
+}
+
+void
+sanei_w_arena_end (Wire * w)
+{
+  struct WireArenaBlock *b;
+  size_t total;
+
+  if (w->arena.depth <= 0)
+    {
+      DBG (1, "sanei_w_arena_end: wire %d has no arena\n", w->io.fd);
+      return;
+    }
+  if (--w->arena.depth > 0)
+    return;
+
+  DBG (5, "sanei_w_arena_end: wire %d, %d bytes decoded\n", w->io.fd,
+       w->allocated_memory - w->arena.base_memory);
+  w->allocated_memory = w->arena.base_memory;
+
+  /* Keep a single block for the next request.  If this one needed
+     more, replace them by one block big enough for all of it. */
+  if (w->arena.blocks && w->arena.blocks->next)
+    {
+      total = 0;
+      for (b = w->arena.blocks; b; b = b->next)
+	total += b->size;
+      arena_free_blocks (w);
+      w->arena.hint = total;
+    }
+  w->arena.used = 0;
+}
+
+void *
+sanei_w_alloc (Wire * w, size_t size)
+{
+  struct WireArenaBlock *b = w->arena.blocks;
+  size_t block_size;
+  void *v;
+
+  if (w->arena.depth <= 0)
+    return malloc (size);
+
+  size = ARENA_ALIGN (size);
+  if (!b || b->size - w->arena.used < size)
+    {
+      block_size = ARENA_MIN_BLOCK;
+      if (!b && block_size < w->arena.hint)
+	block_size = w->arena.hint;
+      if (block_size < size)
+	block_size = size;
+      b = malloc (ARENA_HEADER + block_size);
+      if (!b)
+	return 0;
+      DBG (5, "sanei_w_alloc: new arena block of %lu bytes\n",
+	   (u_long) block_size);
+      b->size = block_size;
+      b->next = w->arena.blocks;
+      w->arena.blocks = b;
+      w->arena.hint = 0;
+      w->arena.used = 0;
+    }
+  v = (char *) b + ARENA_HEADER + w->arena.used;
+  w->arena.used += size;
+  return v;
+}
+
+/* Returns the codec's function to transfer arrays of W_ELEMENT at once,
+   if it has one. */
+static WireBulkFunc
+bulk_func (Wire * w, WireCodecFunc w_element, size_t element_size)
+{
+  if (element_size == sizeof (SANE_Word)
+      && (w_element == w->codec.w_word
+	  || w_element == (WireCodecFunc) sanei_w_word))
+    return w->codec.w_words;
+  if (element_size == 1
+      && (w_element == w->codec.w_byte || w_element == w->codec.w_char
+	  || w_element == (WireCodecFunc) sanei_w_byte
+	  || w_element == (WireCodecFunc) sanei_w_char))
+    return w->codec.w_bytes;
+  return 0;
+}
+
 void
 sanei_w_array (Wire * w, SANE_Word * len_ptr, void **v,
 	       WireCodecFunc w_element, size_t element_size)
 {
   SANE_Word len;
+  WireBulkFunc w_bulk;
   char *val;
   int i;
 
   DBG (3, "sanei_w_array: wire %d, elements of size %lu\n", w->io.fd,
        (u_long) element_size);
 
+  w_bulk = bulk_func (w, w_element, element_size);
+
   if (w->direction == WIRE_FREE)
     {
+      if (w->arena.depth > 0)
+	return;
       if (*len_ptr && *v)
 	{
 	  DBG (4, "sanei_w_array: FREE: freeing array (%d elements)\n",
 	       *len_ptr);
 	  val = *v;
-	  for (i = 0; i < *len_ptr; ++i)
+	  /* bytes and words own no memory */
+	  for (i = 0; !w_bulk && i < *len_ptr; ++i)
 	    {
 	      (*w_element) (w, val);
 	      val += element_size;
@@ -217,7 +359,7 @@ sanei_w_array (Wire * w, SANE_Word * len_ptr, void **v,
 	      w->status = ENOMEM;
 	      return;
 	    }
-	  *v = malloc (len * element_size);
+	  *v = sanei_w_alloc (w, len * element_size);
 	  if (*v == 0)
 	    {
 	      /* Malloc failed, so return an error. */
@@ -233,6 +375,14 @@ sanei_w_array (Wire * w, SANE_Word * len_ptr, void **v,
     }
 
   val = *v;
+  if (w_bulk && len > 0)
+    {
+      DBG (4, "sanei_w_array: transferring array elements in bulk\n");
+      (*w_bulk) (w, val, len);
+      if (w->status)
+	DBG (1, "sanei_w_array: bad status: %d\n", w->status);
+      return;
+    }
   DBG (4, "sanei_w_array: transferring array elements\n");
   for (i = 0; i < len; ++i)
     {
@@ -257,6 +407,8 @@ sanei_w_ptr (Wire * w, void **v, WireCodecFunc w_value, size_t value_size)
 
   if (w->direction == WIRE_FREE)
     {
+      if (w->arena.depth > 0)
+	return;
       if (*v && value_size)
 	{
 	  DBG (4, "sanei_w_ptr: FREE: freeing value\n");
@@ -297,7 +449,7 @@ sanei_w_ptr (Wire * w, void **v, WireCodecFunc w_value, size_t value_size)
 	      return;
 	    }
 
-	  *v = malloc (value_size);
+	  *v = sanei_w_alloc (w, value_size);
 	  if (*v == 0)
 	    {
 	      /* Malloc failed, so return an error. */
@@ -597,29 +749,45 @@ sanei_w_set_dir (Wire * w, WireDirection dir)
 }
 
 void
-sanei_w_call (Wire * w,
-	      SANE_Word procnum,
-	      WireCodecFunc w_arg, void *arg,
-	      WireCodecFunc w_reply, void *reply)
+sanei_w_send (Wire * w,
+	      SANE_Word procnum, WireCodecFunc w_arg, void *arg)
 {
-
-  DBG (3, "sanei_w_call: wire %d (old status %d)\n", w->io.fd, w->status);
+  DBG (3, "sanei_w_send: wire %d (old status %d)\n", w->io.fd, w->status);
   w->status = 0;
   sanei_w_set_dir (w, WIRE_ENCODE);
 
-  DBG (4, "sanei_w_call: sending request (procedure number: %d)\n", procnum);
+  DBG (4, "sanei_w_send: sending request (procedure number: %d)\n", procnum);
   sanei_w_word (w, &procnum);
   (*w_arg) (w, arg);
 
+  /* switching the direction flushes the request */
   if (w->status == 0)
-    {
-      DBG (4, "sanei_w_call: receiving reply\n");
-      sanei_w_set_dir (w, WIRE_DECODE);
-      (*w_reply) (w, reply);
-    }
+    sanei_w_set_dir (w, WIRE_DECODE);
+
+  if (w->status != 0)
+    DBG (2, "sanei_w_send: error status %d\n", w->status);
+}
+
+void
+sanei_w_receive (Wire * w, WireCodecFunc w_reply, void *reply)
+{
+  DBG (4, "sanei_w_receive: receiving reply\n");
+  if (w->status == 0)
+    (*w_reply) (w, reply);
 
   if (w->status != 0)
-    DBG (2, "sanei_w_call: error status %d\n", w->status);
+    DBG (2, "sanei_w_receive: error status %d\n", w->status);
+}
+
+void
+sanei_w_call (Wire * w,
+	      SANE_Word procnum,
+	      WireCodecFunc w_arg, void *arg,
+	      WireCodecFunc w_reply, void *reply)
+{
+  DBG (3, "sanei_w_call: wire %d (old status %d)\n", w->io.fd, w->status);
+  sanei_w_send (w, procnum, w_arg, arg);
+  sanei_w_receive (w, w_reply, reply);
   DBG (4, "sanei_w_call: done\n");
 }
 
@@ -643,6 +811,12 @@ sanei_w_free (Wire * w, WireCodecFunc w_reply, void *reply)
 
   DBG (3, "sanei_w_free: wire %d\n", w->io.fd);
 
+  if (w->arena.depth > 0)
+    {
+      DBG (4, "sanei_w_free: left to the arena\n");
+      return;
+    }
+
   w->direction = WIRE_FREE;
   (*w_reply) (w, reply);
   w->direction = saved_dir;
@@ -672,6 +846,9 @@ sanei_w_init (Wire * w, void (*codec_init_func) (Wire *))
 
   w->buffer.curr = w->buffer.start;
   w->buffer.end = w->buffer.start + w->buffer.size;
+  w->codec.w_bytes = 0;
+  w->codec.w_words = 0;
+  memset (&w->arena, 0, sizeof (w->arena));
   if (codec_init_func != 0)
     {
       DBG (4, "sanei_w_init: initializing codec\n");
@@ -692,5 +869,8 @@ sanei_w_exit (Wire * w)
     }
   w->buffer.start = 0;
   w->buffer.size = 0;
+  arena_free_blocks (w);
+  w->arena.depth = 0;
+  w->arena.hint = 0;
   DBG (4, "sanei_w_exit: done\n");
 }
@@ -0,0 +1,137 @@
+// copyright...
+
+#include "fake_ppapi.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <map>
+
+#include <pthread.h>
+
+#include "ppapi/cpp/instance.h"
+#include "ppapi/cpp/module.h"
+
+namespace {
+
+pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+bool g_started = false;
+pthread_t g_main_thread;
+
+// Pending callbacks by due time; equal times run in the order queued.
+typedef std::multimap<long long, std::pair<pp::CompletionCallback, int32_t> >
+    CallbackQueue;
+CallbackQueue g_queue;
+
+fake_ppapi::PostMessageHandler g_handler = NULL;
+void* g_handler_data = NULL;
+
+long long NowUs() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+void* MainThread(void* unused) {
+  pthread_mutex_lock(&g_mutex);
+  for (;;) {
+    if (g_queue.empty()) {
+      pthread_cond_wait(&g_cond, &g_mutex);
+      continue;
+    }
+    long long due = g_queue.begin()->first;
+    if (due > NowUs()) {
+      struct timespec deadline;
+      deadline.tv_sec = due / 1000000;
+      deadline.tv_nsec = (due % 1000000) * 1000;
+      pthread_cond_timedwait(&g_cond, &g_mutex, &deadline);
+      continue;
+    }
+    std::pair<pp::CompletionCallback, int32_t> next = g_queue.begin()->second;
+    g_queue.erase(g_queue.begin());
+    pthread_mutex_unlock(&g_mutex);
+    next.first.Run(next.second);
+    pthread_mutex_lock(&g_mutex);
+  }
+  return NULL;
+}
+
+struct RunAndSignal {
+  void (*func)(void*);
+  void* arg;
+  bool done;
+};
+
+void RunAndSignalCallback(void* user_data, int32_t unused) {
+  RunAndSignal* run = static_cast<RunAndSignal*>(user_data);
+  run->func(run->arg);
+  pthread_mutex_lock(&g_mutex);
+  run->done = true;
+  pthread_cond_broadcast(&g_cond);
+  pthread_mutex_unlock(&g_mutex);
+}
+
+}  // namespace {}
+
+namespace pp {
+
+void Core::CallOnMainThread(int32_t delay_in_milliseconds,
+                            const CompletionCallback& callback,
+                            int32_t result) {
+  pthread_mutex_lock(&g_mutex);
+  if (!g_started) {
+    g_started = true;
+    pthread_create(&g_main_thread, NULL, &MainThread, NULL);
+  }
+  g_queue.insert(std::make_pair(NowUs() + delay_in_milliseconds * 1000LL,
+                                std::make_pair(callback, result)));
+  pthread_cond_broadcast(&g_cond);
+  pthread_mutex_unlock(&g_mutex);
+}
+
+bool Core::IsMainThread() {
+  pthread_mutex_lock(&g_mutex);
+  bool is_main = g_started && pthread_equal(g_main_thread, pthread_self());
+  pthread_mutex_unlock(&g_mutex);
+  return is_main;
+}
+
+Module* Module::Get() {
+  static Module* module = CreateModule();
+  return module;
+}
+
+void Instance::PostMessage(const Var& message) {
+  pthread_mutex_lock(&g_mutex);
+  fake_ppapi::PostMessageHandler handler = g_handler;
+  void* user_data = g_handler_data;
+  pthread_mutex_unlock(&g_mutex);
+  if (handler)
+    handler(user_data, message);
+  else
+    fprintf(stderr, "fake_ppapi: message dropped, no handler\n");
+}
+
+}  // namespace pp
+
+namespace fake_ppapi {
+
+void SetPostMessageHandler(PostMessageHandler handler, void* user_data) {
+  pthread_mutex_lock(&g_mutex);
+  g_handler = handler;
+  g_handler_data = user_data;
+  pthread_mutex_unlock(&g_mutex);
+}
+
+void RunOnMainThread(void (*func)(void*), void* arg) {
+  RunAndSignal run = { func, arg, false };
+  pp::Module::Get()->core()->CallOnMainThread(
+      0, pp::CompletionCallback(&RunAndSignalCallback, &run), PP_OK);
+  pthread_mutex_lock(&g_mutex);
+  while (!run.done)
+    pthread_cond_wait(&g_cond, &g_mutex);
+  pthread_mutex_unlock(&g_mutex);
+}
+
+}  // namespace fake_ppapi
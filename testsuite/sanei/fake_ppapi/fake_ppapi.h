@@ -0,0 +1,25 @@
+// copyright...
+//
+// Test-only controls for the fake Pepper API in this directory. The fake runs
+// a "main thread" of its own that executes pp::Core::CallOnMainThread()
+// callbacks in deadline order, and routes pp::Instance::PostMessage() to a
+// handler standing in for the page's JavaScript.
+
+#ifndef FAKE_PPAPI_H__
+#define FAKE_PPAPI_H__
+
+#include "ppapi/cpp/var.h"
+
+namespace fake_ppapi {
+
+// Called, on whichever thread posted it (the main thread, for the NaCl
+// glue), with every message the module sends to the page.
+typedef void (*PostMessageHandler)(void* user_data, const pp::Var& message);
+void SetPostMessageHandler(PostMessageHandler handler, void* user_data);
+
+// Runs func(arg) on the main thread and waits for it to return.
+void RunOnMainThread(void (*func)(void*), void* arg);
+
+}  // namespace fake_ppapi
+
+#endif  // FAKE_PPAPI_H__
@@ -0,0 +1,32 @@
+// copyright...
+
+#ifndef FAKE_PPAPI_CPP_COMPLETION_CALLBACK_H__
+#define FAKE_PPAPI_CPP_COMPLETION_CALLBACK_H__
+
+#include <stdint.h>
+
+#define PP_OK 0
+
+typedef void (*PP_CompletionCallback_Func)(void* user_data, int32_t result);
+
+namespace pp {
+
+class CompletionCallback {
+ public:
+  CompletionCallback() : func_(NULL), user_data_(NULL) {}
+  CompletionCallback(PP_CompletionCallback_Func func, void* user_data)
+      : func_(func), user_data_(user_data) {}
+
+  void Run(int32_t result) const {
+    if (func_)
+      func_(user_data_, result);
+  }
+
+ private:
+  PP_CompletionCallback_Func func_;
+  void* user_data_;
+};
+
+}  // namespace pp
+
+#endif  // FAKE_PPAPI_CPP_COMPLETION_CALLBACK_H__
@@ -0,0 +1,23 @@
+// copyright...
+
+#ifndef FAKE_PPAPI_CPP_CORE_H__
+#define FAKE_PPAPI_CPP_CORE_H__
+
+#include <stdint.h>
+
+#include "ppapi/cpp/completion_callback.h"
+
+namespace pp {
+
+class Core {
+ public:
+  // Queues callback to run on the fake main thread after delay_in_milliseconds.
+  void CallOnMainThread(int32_t delay_in_milliseconds,
+                        const CompletionCallback& callback,
+                        int32_t result = 0);
+  bool IsMainThread();
+};
+
+}  // namespace pp
+
+#endif  // FAKE_PPAPI_CPP_CORE_H__
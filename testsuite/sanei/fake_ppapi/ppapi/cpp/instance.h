@@ -0,0 +1,36 @@
+// copyright...
+
+#ifndef FAKE_PPAPI_CPP_INSTANCE_H__
+#define FAKE_PPAPI_CPP_INSTANCE_H__
+
+#include <stdint.h>
+
+#include "ppapi/cpp/var.h"
+
+typedef int32_t PP_Instance;
+
+namespace pp {
+
+class Instance {
+ public:
+  explicit Instance(PP_Instance instance) : pp_instance_(instance) {}
+  virtual ~Instance() {}
+
+  virtual bool Init(uint32_t argc, const char* argn[], const char* argv[]) {
+    return true;
+  }
+  virtual void HandleMessage(const Var& message) {}
+
+  // Hands message to the handler installed with
+  // fake_ppapi::SetPostMessageHandler(), i.e. to the emulated page.
+  void PostMessage(const Var& message);
+
+  PP_Instance pp_instance() const { return pp_instance_; }
+
+ private:
+  PP_Instance pp_instance_;
+};
+
+}  // namespace pp
+
+#endif  // FAKE_PPAPI_CPP_INSTANCE_H__
@@ -0,0 +1,31 @@
+// copyright...
+
+#ifndef FAKE_PPAPI_CPP_MODULE_H__
+#define FAKE_PPAPI_CPP_MODULE_H__
+
+#include "ppapi/cpp/core.h"
+#include "ppapi/cpp/instance.h"
+
+namespace pp {
+
+class Module {
+ public:
+  Module() {}
+  virtual ~Module() {}
+
+  // The module made by CreateModule(), created on first use.
+  static Module* Get();
+  Core* core() { return &core_; }
+
+  virtual Instance* CreateInstance(PP_Instance instance) = 0;
+
+ private:
+  Core core_;
+};
+
+// Defined by the module under test, as in a real .nexe.
+Module* CreateModule();
+
+}  // namespace pp
+
+#endif  // FAKE_PPAPI_CPP_MODULE_H__
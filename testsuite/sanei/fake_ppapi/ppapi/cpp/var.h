@@ -0,0 +1,41 @@
+// copyright...
+//
+// Host-side stand-in for the Pepper C++ API, just enough of it to build the
+// NaCl glue (nacl_main.cc, sanei/nacl_jscall.cc, sanei/nacl_usb.cc) on Linux
+// for tests. See fake_ppapi.h for the test-only controls.
+
+#ifndef FAKE_PPAPI_CPP_VAR_H__
+#define FAKE_PPAPI_CPP_VAR_H__
+
+#include <string>
+#include <tr1/memory>
+#include <vector>
+
+namespace pp {
+
+class Var {
+ public:
+  Var() : type_(kUndefined) {}
+  Var(const char* value) : type_(kString), string_(value) {}
+  Var(const std::string& value) : type_(kString), string_(value) {}
+  virtual ~Var() {}
+
+  bool is_undefined() const { return type_ == kUndefined; }
+  bool is_string() const { return type_ == kString; }
+  bool is_array_buffer() const { return type_ == kArrayBuffer; }
+  bool is_array() const { return false; }
+  std::string AsString() const { return string_; }
+
+ protected:
+  enum Type { kUndefined, kString, kArrayBuffer };
+
+  Type type_;
+  std::string string_;
+  // Array buffers are reference counted, like the browser's: copies of a
+  // Var share the same bytes.
+  std::tr1::shared_ptr<std::vector<unsigned char> > buffer_;
+};
+
+}  // namespace pp
+
+#endif  // FAKE_PPAPI_CPP_VAR_H__
@@ -0,0 +1,35 @@
+// copyright...
+
+#ifndef FAKE_PPAPI_CPP_VAR_ARRAY_BUFFER_H__
+#define FAKE_PPAPI_CPP_VAR_ARRAY_BUFFER_H__
+
+#include <stdint.h>
+
+#include "ppapi/cpp/var.h"
+
+namespace pp {
+
+class VarArrayBuffer : public Var {
+ public:
+  VarArrayBuffer() { Allocate(0); }
+  explicit VarArrayBuffer(uint32_t size_in_bytes) { Allocate(size_in_bytes); }
+  // Shares the bytes of var, which must be an array buffer.
+  explicit VarArrayBuffer(const Var& var) : Var(var) {
+    if (!is_array_buffer())
+      Allocate(0);
+  }
+
+  uint32_t ByteLength() const { return buffer_->size(); }
+  void* Map() { return buffer_->empty() ? NULL : &(*buffer_)[0]; }
+  void Unmap() {}
+
+ private:
+  void Allocate(uint32_t size) {
+    type_ = kArrayBuffer;
+    buffer_.reset(new std::vector<unsigned char>(size));
+  }
+};
+
+}  // namespace pp
+
+#endif  // FAKE_PPAPI_CPP_VAR_ARRAY_BUFFER_H__
@@ -0,0 +1,303 @@
+// copyright...
+//
+// Headless benchmark for the NaCl module. nacl_main.cc, the JS bridge and
+// the libusb implementation are built for the host against the fake Pepper
+// API in fake_ppapi/, with a UsbPlaybackResponder standing in for the page.
+// The driver then
+//
+//   - times JS round trips, one at a time and pipelined,
+//   - replays a USB recording (see nacl_usb_responder.h) through libusb and
+//     times each transfer,
+//   - runs LaunchSane(), opens the test backend and scans a page through the
+//     fake pipes, reporting their throughput,
+//   - scans the page again, streaming it to the responder in ArrayBuffer
+//     chunks with ImageStreamer (see sane/nacl_stream.h).
+//
+// Usage: nacl_harness [-n round trips] [-r recording] [-d dpi]
+//
+// The test backend must have been built with --enable-pthread: a forked
+// reader can't write to in-process pipes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <libusb.h>
+
+#include "fake_ppapi.h"
+#include "nacl_usb_responder.h"
+#include "ppapi/cpp/module.h"
+#include "sane/config.h"
+#include "sane/nacl_jscall.h"
+#include "sane/nacl_stream.h"
+#include "sane/nacl_usb.h"
+#include "sane/sane.h"
+#include "sane/saneopts.h"
+
+using scanley::JavaScriptCallHandle;
+using scanley::UsbPlaybackResponder;
+using scanley::UsbRecord;
+using std::string;
+using std::vector;
+
+extern scanley::SynchronousJavaScriptCaller* g_js_caller;
+
+namespace scanley {
+void* LaunchSane(void* args);
+}
+
+namespace {
+
+double NowMs() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+}
+
+// Prints min/mean/99th percentile of a set of latencies in ms.
+void Report(const char* what, vector<double>* ms) {
+  if (ms->empty())
+    return;
+  std::sort(ms->begin(), ms->end());
+  double total = 0;
+  for (size_t i = 0; i < ms->size(); i++)
+    total += (*ms)[i];
+  printf("%-24s %6zu calls  min %8.3f  mean %8.3f  p99 %8.3f ms\n", what,
+         ms->size(), ms->front(), total / ms->size(),
+         (*ms)[ms->size() * 99 / 100]);
+}
+
+void JsRoundTrips(int count) {
+  vector<double> ms;
+  for (int i = 0; i < count; i++) {
+    double start = NowMs();
+    g_js_caller->Call("PING");
+    ms.push_back(NowMs() - start);
+  }
+  Report("JS round trip", &ms);
+
+  double start = NowMs();
+  vector<JavaScriptCallHandle> calls;
+  for (int i = 0; i < count; i++)
+    calls.push_back(g_js_caller->CallAsync("PING"));
+  for (int i = 0; i < count; i++)
+    calls[i]->Wait();
+  double elapsed = NowMs() - start;
+  printf("%-24s %6d calls  %.0f calls/s\n", "JS pipelined", count,
+         count * 1000.0 / elapsed);
+}
+
+// A scanner-like session: a vendor command, a bulk command, then the image
+// in 64 KiB reads.
+string DefaultRecording() {
+  std::ostringstream out;
+  out << "device 1 2 120100020000004098041a01000101020001\n"
+      << "control 40 0c 0084 0000 2 0100 -> 0\n"
+      << "bulk 02 4 1b490000 -> 0\n";
+  for (int i = 0; i < 64; i++)
+    out << "bulk 81 65536 -> 0 65536*80\n";
+  out << "control c0 0c 0084 0000 2 -> 0 0000\n";
+  return out.str();
+}
+
+void ReplayUsb(UsbPlaybackResponder* playback, int iterations) {
+  libusb_device** list;
+  if (libusb_get_device_list(NULL, &list) < 1) {
+    printf("replay: no devices in the recording\n");
+    return;
+  }
+  libusb_device_handle* handle;
+  int rc = libusb_open(list[0], &handle);
+  libusb_free_device_list(list, 1);
+  if (rc < 0) {
+    printf("replay: libusb_open failed: %d\n", rc);
+    return;
+  }
+
+  vector<double> control_ms, bulk_out_ms, bulk_in_ms;
+  double bulk_in_bytes = 0, bulk_in_total_ms = 0;
+  vector<unsigned char> buf;
+  const vector<UsbRecord>& records = playback->records();
+  for (int n = 0; n < iterations; n++) {
+    playback->Rewind();
+    for (size_t i = 0; i < records.size(); i++) {
+      const UsbRecord& record = records[i];
+      buf.resize(record.length + 1);
+      if (record.is_out() && record.length)
+        memcpy(&buf[0], record.out_data.data(), record.out_data.size());
+      int transferred = 0;
+      double start = NowMs();
+      if (record.opcode == scanley::kUsbOpControlTransfer) {
+        libusb_control_transfer(handle, record.setup[0], record.setup[1],
+                                record.setup[2] | record.setup[3] << 8,
+                                record.setup[4] | record.setup[5] << 8,
+                                &buf[0], record.length, 1000);
+        control_ms.push_back(NowMs() - start);
+      } else if (record.opcode == scanley::kUsbOpBulkTransfer) {
+        libusb_bulk_transfer(handle, record.endpoint, &buf[0], record.length,
+                             &transferred, 1000);
+        double elapsed = NowMs() - start;
+        if (record.is_out()) {
+          bulk_out_ms.push_back(elapsed);
+        } else {
+          bulk_in_ms.push_back(elapsed);
+          bulk_in_bytes += transferred;
+          bulk_in_total_ms += elapsed;
+        }
+      } else {
+        libusb_interrupt_transfer(handle, record.endpoint, &buf[0],
+                                  record.length, &transferred, 1000);
+      }
+    }
+  }
+  libusb_close(handle);
+
+  Report("USB control", &control_ms);
+  Report("USB bulk out", &bulk_out_ms);
+  Report("USB bulk in", &bulk_in_ms);
+  if (bulk_in_total_ms > 0)
+    printf("%-24s %.1f MB/s\n", "USB bulk in throughput",
+           bulk_in_bytes / 1000.0 / bulk_in_total_ms);
+  if (playback->mismatches())
+    printf("replay: %d requests didn't match the recording\n",
+           playback->mismatches());
+}
+
+// Sets option name of handle to value (a string for string options, a
+// number otherwise).
+void SetOption(SANE_Handle handle, const char* name, const char* value) {
+  for (SANE_Int i = 1;; i++) {
+    const SANE_Option_Descriptor* opt = sane_get_option_descriptor(handle, i);
+    if (!opt)
+      break;
+    if (!opt->name || strcmp(opt->name, name) != 0)
+      continue;
+    SANE_Word word;
+    void* arg = &word;
+    if (opt->type == SANE_TYPE_STRING)
+      arg = const_cast<char*>(value);
+    else if (opt->type == SANE_TYPE_FIXED)
+      word = SANE_FIX(atof(value));
+    else
+      word = atoi(value);
+    if (sane_control_option(handle, i, SANE_ACTION_SET_VALUE, arg, NULL) !=
+        SANE_STATUS_GOOD)
+      printf("can't set %s to %s\n", name, value);
+    return;
+  }
+  printf("no option %s\n", name);
+}
+
+void Scan(UsbPlaybackResponder* page, const char* dpi) {
+  double start = NowMs();
+  scanley::LaunchSane(NULL);
+  printf("%-24s %.1f ms\n", "LaunchSane", NowMs() - start);
+
+  SANE_Handle handle;
+  start = NowMs();
+  SANE_Status status = sane_open("", &handle);
+  if (status != SANE_STATUS_GOOD) {
+    printf("sane_open: %s\n", sane_strstatus(status));
+    return;
+  }
+  printf("%-24s %.1f ms\n", "sane_open", NowMs() - start);
+  SetOption(handle, SANE_NAME_SCAN_MODE, "Color");
+  SetOption(handle, SANE_NAME_SCAN_RESOLUTION, dpi);
+
+  start = NowMs();
+  status = sane_start(handle);
+  double bytes = 0;
+  vector<SANE_Byte> buf(256 * 1024);
+  while (status == SANE_STATUS_GOOD) {
+    SANE_Int length;
+    status = sane_read(handle, &buf[0], buf.size(), &length);
+    if (status == SANE_STATUS_GOOD)
+      bytes += length;
+  }
+  double elapsed = NowMs() - start;
+  if (status != SANE_STATUS_EOF)
+    printf("scan: %s\n", sane_strstatus(status));
+  printf("%-24s %.1f MB in %.1f ms, %.1f MB/s through the pipe\n", "scan",
+         bytes / 1e6, elapsed, bytes / 1000.0 / elapsed);
+  sane_cancel(handle);
+
+  page->ClearImage();
+  start = NowMs();
+  status = sane_start(handle);
+  if (status == SANE_STATUS_GOOD) {
+    scanley::ImageStreamer streamer(g_js_caller);
+    status = streamer.StreamImage(handle);
+  }
+  elapsed = NowMs() - start;
+  if (status != SANE_STATUS_EOF)
+    printf("streamed scan: %s\n", sane_strstatus(status));
+  bytes = page->image().size();
+  printf("%-24s %.1f MB in %.1f ms, %.1f MB/s to the page\n", "streamed scan",
+         bytes / 1e6, elapsed, bytes / 1000.0 / elapsed);
+  sane_cancel(handle);
+  sane_close(handle);
+  sane_exit();
+}
+
+struct InstanceHolder {
+  pp::Instance* instance;
+};
+
+void CreateInstance(void* arg) {
+  static_cast<InstanceHolder*>(arg)->instance =
+      pp::Module::Get()->CreateInstance(1);
+}
+
+}  // namespace {}
+
+int main(int argc, char** argv) {
+#ifndef USE_PTHREAD
+  printf("nacl_harness needs a build configured with --enable-pthread\n");
+  return 77;
+#endif
+  int round_trips = 1000;
+  const char* recording = NULL;
+  const char* dpi = "300";
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:d:")) != -1) {
+    switch (opt) {
+      case 'n': round_trips = atoi(optarg); break;
+      case 'r': recording = optarg; break;
+      case 'd': dpi = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-n round trips] [-r recording] [-d dpi]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  // Like the browser, create the instance on the main thread.
+  InstanceHolder holder = { NULL };
+  fake_ppapi::RunOnMainThread(&CreateInstance, &holder);
+
+  UsbPlaybackResponder playback;
+  bool loaded;
+  if (recording) {
+    loaded = playback.LoadFile(recording);
+  } else {
+    std::istringstream script(DefaultRecording());
+    loaded = playback.Load(script);
+  }
+  if (!loaded)
+    return 1;
+  playback.Attach(holder.instance);
+
+  libusb_init(NULL);
+  JsRoundTrips(round_trips);
+  ReplayUsb(&playback, recording ? 1 : 8);
+  Scan(&playback, dpi);
+  libusb_exit(NULL);
+  return 0;
+}
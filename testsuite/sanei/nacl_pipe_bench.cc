@@ -0,0 +1,172 @@
+// copyright...
+//
+// Throughput benchmark for scanley::FakePipe, the pipe() replacement used by
+// the NaCl build. One thread writes a known byte pattern, the other reads and
+// verifies it; the result is reported in MB/s. For comparison the original
+// byte-at-a-time implementation is kept here as LegacyFakePipe.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include "sane/nacl_pipe.h"
+#include "sane/nacl_util.h"
+
+using scanley::FakePipe;
+using scanley::ScopedPthreadLock;
+
+namespace {
+
+// The pre-ring-buffer FakePipe: moves one byte per iteration and broadcasts
+// a single condition variable after every byte.
+class LegacyFakePipe {
+ public:
+  static const size_t kBufBytes = 64 * 1024;
+
+  LegacyFakePipe() : size_(0), next_read_(0) {
+    pthread_cond_init(&cond_, NULL);
+    pthread_mutex_init(&mutex_, NULL);
+  }
+
+  ssize_t Write(const unsigned char* buf, size_t len) {
+    ScopedPthreadLock lock(&mutex_);
+    for (size_t in_pos = 0; in_pos < len; in_pos++) {
+      while (size_ == kBufBytes)
+        pthread_cond_wait(&cond_, &mutex_);
+      buf_[(next_read_ + size_) % kBufBytes] = buf[in_pos];
+      size_++;
+      pthread_cond_broadcast(&cond_);
+    }
+    return len;
+  }
+
+  ssize_t Read(unsigned char* buf, size_t len) {
+    ScopedPthreadLock lock(&mutex_);
+    for (size_t out_pos = 0; out_pos < len; out_pos++) {
+      while (size_ == 0)
+        pthread_cond_wait(&cond_, &mutex_);
+      buf[out_pos] = buf_[next_read_];
+      next_read_ = (next_read_ + 1) % kBufBytes;
+      size_--;
+      pthread_cond_broadcast(&cond_);
+    }
+    return len;
+  }
+
+ private:
+  pthread_cond_t cond_;
+  pthread_mutex_t mutex_;
+  unsigned char buf_[kBufBytes];
+  size_t size_;
+  size_t next_read_;
+};
+
+template<typename Pipe>
+struct BenchArgs {
+  Pipe* pipe;
+  size_t total;
+  size_t chunk;
+  bool ok;
+};
+
+template<typename Pipe>
+void* Writer(void* arg) {
+  BenchArgs<Pipe>* args = static_cast<BenchArgs<Pipe>*>(arg);
+  unsigned char* buf = new unsigned char[args->chunk];
+  size_t done = 0;
+  while (done < args->total) {
+    size_t len = args->total - done;
+    if (len > args->chunk)
+      len = args->chunk;
+    for (size_t i = 0; i < len; i++)
+      buf[i] = static_cast<unsigned char>((done + i) * 7);
+    ssize_t rc = args->pipe->Write(buf, len);
+    if (rc <= 0) {
+      fprintf(stderr, "write failed: %zd\n", rc);
+      args->ok = false;
+      break;
+    }
+    done += rc;
+  }
+  delete[] buf;
+  return NULL;
+}
+
+template<typename Pipe>
+void* Reader(void* arg) {
+  BenchArgs<Pipe>* args = static_cast<BenchArgs<Pipe>*>(arg);
+  unsigned char* buf = new unsigned char[args->chunk];
+  size_t done = 0;
+  while (done < args->total) {
+    size_t len = args->total - done;
+    if (len > args->chunk)
+      len = args->chunk;
+    ssize_t rc = args->pipe->Read(buf, len);
+    if (rc <= 0) {
+      fprintf(stderr, "read failed: %zd\n", rc);
+      args->ok = false;
+      break;
+    }
+    for (ssize_t i = 0; i < rc; i++) {
+      if (buf[i] != static_cast<unsigned char>((done + i) * 7)) {
+        fprintf(stderr, "data mismatch at offset %zu\n", done + i);
+        args->ok = false;
+        delete[] buf;
+        return NULL;
+      }
+    }
+    done += rc;
+  }
+  delete[] buf;
+  return NULL;
+}
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+template<typename Pipe>
+bool Run(const char* name, Pipe* pipe, size_t total, size_t chunk) {
+  BenchArgs<Pipe> args = { pipe, total, chunk, true };
+  pthread_t writer, reader;
+  double start = Now();
+  pthread_create(&reader, NULL, &Reader<Pipe>, &args);
+  pthread_create(&writer, NULL, &Writer<Pipe>, &args);
+  pthread_join(writer, NULL);
+  pthread_join(reader, NULL);
+  double secs = Now() - start;
+  printf("%-24s chunk %7zu: %9.1f MB/s%s\n", name, chunk,
+         total / secs / (1024 * 1024), args.ok ? "" : "  (FAILED)");
+  return args.ok;
+}
+
+}  // namespace {}
+
+int main(int argc, char** argv) {
+  size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 0) : 64;
+  size_t total = megabytes * 1024 * 1024;
+  // The legacy path is slow enough that it gets a smaller share of data.
+  size_t legacy_total = total / 16;
+  static const size_t kChunks[] = { 512, 8 * 1024, 32 * 1024, 256 * 1024 };
+  static const size_t kCapacities[] = { 64 * 1024, 256 * 1024, 1024 * 1024 };
+  bool ok = true;
+
+  printf("FakePipe throughput, %zu MB per run\n", megabytes);
+  for (size_t c = 0; c < sizeof(kChunks) / sizeof(kChunks[0]); c++) {
+    LegacyFakePipe legacy;
+    ok &= Run("legacy (64 KiB)", &legacy, legacy_total, kChunks[c]);
+    for (size_t i = 0; i < sizeof(kCapacities) / sizeof(kCapacities[0]); i++) {
+      char name[32];
+      snprintf(name, sizeof(name), "ring (%zu KiB)", kCapacities[i] / 1024);
+      FakePipe pipe(kCapacities[i]);
+      ok &= Run(name, &pipe, total, kChunks[c]);
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+// copyright...
+//
+// Tests for scanley::FakePipe and scanley::FakePipeManager, the pipe()
+// replacement used by the NaCl build.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "sane/nacl_pipe.h"
+
+using scanley::FakePipe;
+using scanley::FakePipeManager;
+
+namespace {
+
+void wraparound() {
+  FakePipe pipe(8);
+  unsigned char in[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  unsigned char out[8];
+
+  assert(pipe.Write(in, 6) == 6);
+  assert(pipe.Read(out, 4) == 4);
+  assert(memcmp(out, in, 4) == 0);
+  // This write wraps around the end of the ring.
+  assert(pipe.Write(in, 5) == 5);
+  // Read returns what is buffered, not the full request.
+  assert(pipe.Read(out, 8) == 7);
+  assert(out[0] == 5 && out[1] == 6);
+  assert(memcmp(out + 2, in, 5) == 0);
+}
+
+void nonblocking() {
+  FakePipe pipe(4);
+  unsigned char buf[8] = { 0 };
+
+  pipe.SetReadNonblock(true);
+  pipe.SetWriteNonblock(true);
+  assert(pipe.Read(buf, 1) == -1 && errno == EAGAIN);
+  assert(pipe.Write(buf, 8) == 4);
+  assert(pipe.Write(buf, 1) == -1 && errno == EAGAIN);
+}
+
+void eof_and_epipe() {
+  FakePipe pipe;
+  unsigned char buf[4] = { 9, 9, 9, 9 };
+
+  assert(pipe.Write(buf, 2) == 2);
+  pipe.CloseWriter();
+  assert(pipe.Read(buf, 4) == 2);
+  assert(pipe.Read(buf, 4) == 0);
+
+  FakePipe pipe2;
+  pipe2.CloseReader();
+  assert(pipe2.Write(buf, 4) == -1 && errno == EPIPE);
+}
+
+void fd_reuse() {
+  FakePipeManager manager;
+  int fds[2];
+  int fds2[2];
+
+  assert(manager.Pipe(fds) == 0);
+  assert(FakePipeManager::IsFakeFd(fds[0]));
+  assert(FakePipeManager::IsFakeFd(fds[1]));
+  assert(fds[0] != fds[1]);
+  assert(manager.Close(fds[0]) == 0);
+  assert(manager.Close(fds[0]) == -1 && errno == EBADF);
+  assert(manager.Close(fds[1]) == 0);
+  // Closed slots are handed out again.
+  assert(manager.Pipe(fds2) == 0);
+  assert(fds2[0] == fds[1] || fds2[0] == fds[0]);
+
+  // Exhaust the table, then make sure closing frees a slot.
+  int count = 1;
+  while (manager.Pipe(fds) == 0)
+    count++;
+  assert(errno == EMFILE);
+  assert(count == FakePipeManager::kMaxFds / 2);
+  assert(manager.Close(fds2[0]) == 0);
+  assert(manager.Close(fds2[1]) == 0);
+  assert(manager.Pipe(fds) == 0);
+}
+
+struct DelayedWrite {
+  FakePipeManager* manager;
+  int fd;
+};
+
+void* delayed_write(void* arg) {
+  DelayedWrite* args = static_cast<DelayedWrite*>(arg);
+  unsigned char byte = 42;
+  usleep(20000);
+  args->manager->Write(args->fd, &byte, 1);
+  return NULL;
+}
+
+void poll_and_select() {
+  FakePipeManager manager(16);
+  int fds[2];
+  unsigned char buf[16] = { 0 };
+  assert(manager.Pipe(fds) == 0);
+
+  struct pollfd pfd[2];
+  pfd[0].fd = fds[0];
+  pfd[0].events = POLLIN;
+  pfd[1].fd = fds[1];
+  pfd[1].events = POLLOUT;
+  assert(manager.Poll(pfd, 2, 0) == 1);
+  assert(pfd[0].revents == 0);
+  assert(pfd[1].revents == POLLOUT);
+
+  // Fill the pipe: now readable but not writable.
+  assert(manager.Write(fds[1], buf, 16) == 16);
+  assert(manager.Poll(pfd, 2, 10) == 1);
+  assert(pfd[0].revents == POLLIN);
+  assert(pfd[1].revents == 0);
+  assert(manager.Read(fds[0], buf, 16) == 16);
+
+  // A blocking poll wakes up when another thread writes.
+  DelayedWrite args = { &manager, fds[1] };
+  pthread_t thread;
+  pthread_create(&thread, NULL, &delayed_write, &args);
+  assert(manager.Poll(pfd, 1, -1) == 1);
+  assert(pfd[0].revents == POLLIN);
+  pthread_join(thread, NULL);
+
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(fds[0], &readfds);
+  struct timeval timeout = { 0, 0 };
+  assert(manager.Select(fds[0] + 1, &readfds, NULL, NULL, &timeout) == 1);
+  assert(FD_ISSET(fds[0], &readfds));
+  assert(manager.Read(fds[0], buf, 16) == 1 && buf[0] == 42);
+
+  FD_SET(fds[0], &readfds);
+  assert(manager.Select(fds[0] + 1, &readfds, NULL, NULL, &timeout) == 0);
+  assert(!FD_ISSET(fds[0], &readfds));
+
+  // Closing the write end hangs up the read end.
+  assert(manager.Close(fds[1]) == 0);
+  assert(manager.Poll(pfd, 1, -1) == 1);
+  assert(pfd[0].revents & POLLHUP);
+  assert(manager.Read(fds[0], buf, 16) == 0);
+}
+
+void fcntl_nonblock() {
+  FakePipeManager manager;
+  int fds[2];
+  unsigned char byte = 0;
+  assert(manager.Pipe(fds) == 0);
+  assert(manager.FcntlF_SETFL(fds[0], O_NONBLOCK) == 0);
+  assert(manager.Read(fds[0], &byte, 1) == -1 && errno == EAGAIN);
+  assert(manager.Read(fds[1], &byte, 1) == -1 && errno == EBADF);
+}
+
+// The plain libc calls a backend makes reach the pipes, and real fds still
+// reach the kernel.
+void libc_calls() {
+  int fds[2];
+  unsigned char byte = 7;
+  assert(pipe(fds) == 0);
+  assert(FakePipeManager::IsFakeFd(fds[0]));
+  assert(FakePipeManager::IsFakeFd(fds[1]));
+
+  struct pollfd pfd;
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  assert(poll(&pfd, 1, 0) == 0);
+  assert(write(fds[1], &byte, 1) == 1);
+  assert(poll(&pfd, 1, -1) == 1 && pfd.revents == POLLIN);
+
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(fds[0], &readfds);
+  struct timeval timeout = { 0, 0 };
+  assert(select(fds[0] + 1, &readfds, NULL, NULL, &timeout) == 1);
+  assert(FD_ISSET(fds[0], &readfds));
+
+  byte = 0;
+  assert(read(fds[0], &byte, 1) == 1 && byte == 7);
+  assert(fcntl(fds[0], F_GETFL) == O_RDONLY);
+  assert(fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK) == 0);
+  assert(fcntl(fds[0], F_GETFL) == (O_RDONLY | O_NONBLOCK));
+  assert(fcntl(fds[1], F_GETFL) == O_WRONLY);
+  assert(read(fds[0], &byte, 1) == -1 && errno == EAGAIN);
+
+  assert(close(fds[1]) == 0);
+  assert(poll(&pfd, 1, -1) == 1 && (pfd.revents & POLLHUP));
+  assert(read(fds[0], &byte, 1) == 0);
+  assert(close(fds[0]) == 0);
+  assert(close(fds[0]) == -1 && errno == EBADF);
+
+  int null_fd = open("/dev/null", O_WRONLY);
+  assert(null_fd >= 0 && !FakePipeManager::IsFakeFd(null_fd));
+  pfd.fd = null_fd;
+  pfd.events = POLLOUT;
+  assert(poll(&pfd, 1, 0) == 1 && pfd.revents == POLLOUT);
+  assert(write(null_fd, &byte, 1) == 1);
+  assert(close(null_fd) == 0);
+  assert(close(null_fd) == -1 && errno == EBADF);
+
+  // Real fds numbered like pipes go to the real calls, unless they are
+  // mixed with pipes in one poll() or select().
+  assert(pipe(fds) == 0);
+  int high_fd = fds[1] + 1;
+  int dev_null = open("/dev/null", O_RDWR);
+  assert(dup2(dev_null, high_fd) == high_fd && close(dev_null) == 0);
+  assert(FakePipeManager::IsFakeFd(high_fd));
+  assert(write(high_fd, &byte, 1) == 1);
+  assert(read(high_fd, &byte, 1) == 0);
+  assert((fcntl(high_fd, F_GETFL) & O_ACCMODE) == O_RDWR);
+  assert(fcntl(high_fd, F_GETFD) >= 0);
+
+  FD_ZERO(&readfds);
+  FD_SET(high_fd, &readfds);
+  timeout.tv_usec = 0;
+  assert(select(high_fd + 1, &readfds, NULL, NULL, &timeout) == 1);
+  FD_SET(fds[0], &readfds);
+  assert(select(high_fd + 1, &readfds, NULL, NULL, &timeout) == -1 &&
+         errno == EINVAL);
+  struct pollfd pfds[2];
+  pfds[0].fd = fds[0];
+  pfds[1].fd = high_fd;
+  pfds[0].events = pfds[1].events = POLLIN;
+  assert(poll(pfds, 2, 0) == -1 && errno == EINVAL);
+
+  assert(close(high_fd) == 0);
+  assert(fcntl(high_fd, F_GETFD) == -1 && errno == EBADF);
+  assert(close(fds[0]) == 0 && close(fds[1]) == 0);
+
+  // A select() with no fds just sleeps.
+  timeout.tv_usec = 1000;
+  assert(select(0, NULL, NULL, NULL, &timeout) == 0);
+}
+
+}  // namespace {}
+
+int main() {
+  wraparound();
+  nonblocking();
+  eof_and_epipe();
+  fd_reuse();
+  poll_and_select();
+  fcntl_nonblock();
+  libc_calls();
+  return 0;
+}
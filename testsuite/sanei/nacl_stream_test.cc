@@ -0,0 +1,162 @@
+// copyright...
+//
+// Tests for scanley::ImageStreamer (sanei/nacl_stream.cc), against a fake
+// SANE backend defined here and UsbResponder standing in for the page.
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+
+#include "nacl_usb_responder.h"
+#include "ppapi/cpp/instance.h"
+#include "ppapi/cpp/module.h"
+#include "sane/nacl_jscall.h"
+#include "sane/nacl_stream.h"
+#include "sane/sane.h"
+
+using scanley::ImageStreamer;
+using scanley::UsbResponder;
+using std::string;
+
+namespace {
+
+class TestModule : public pp::Module {
+ public:
+  virtual pp::Instance* CreateInstance(PP_Instance instance) {
+    return new pp::Instance(instance);
+  }
+};
+
+// The fake backend: frames of data, handed out bite bytes per sane_read().
+struct FakeScan {
+  string frames[3];
+  int frame_count;
+  int frame;
+  size_t pos;
+  size_t bite;
+  bool cancelled;
+};
+
+FakeScan g_scan;
+
+void reset_scan(int frame_count, size_t frame_bytes, size_t bite) {
+  g_scan.frame_count = frame_count;
+  for (int f = 0; f < frame_count; f++) {
+    g_scan.frames[f].clear();
+    for (size_t i = 0; i < frame_bytes; i++)
+      g_scan.frames[f].push_back(static_cast<char>(i * 7 + f));
+  }
+  g_scan.frame = 0;
+  g_scan.pos = 0;
+  g_scan.bite = bite;
+  g_scan.cancelled = false;
+}
+
+UsbResponder* g_page;
+scanley::SynchronousJavaScriptCaller* g_caller;
+
+void one_frame() {
+  reset_scan(1, 10000, 333);
+  g_page->ClearImage();
+  g_page->set_reply_delay_ms(5);
+  ImageStreamer streamer(g_caller, 1000, 3);
+  assert(streamer.StreamImage(NULL) == SANE_STATUS_EOF);
+  assert(g_page->image() == g_scan.frames[0]);
+  assert(streamer.bytes_streamed() == 10000);
+  // Chunks overlap in flight, but never more than the pool (plus the params
+  // request).
+  assert(g_page->max_pending() >= 2);
+  assert(g_page->max_pending() <= 4);
+  g_page->set_reply_delay_ms(0);
+}
+
+void three_frames() {
+  reset_scan(3, 2500, 4096);
+  g_page->ClearImage();
+  ImageStreamer streamer(g_caller, 1024, 2);
+  assert(streamer.StreamImage(NULL) == SANE_STATUS_EOF);
+  assert(g_scan.frame == 2);
+  assert(g_page->image() ==
+         g_scan.frames[0] + g_scan.frames[1] + g_scan.frames[2]);
+}
+
+void page_stops_scan() {
+  reset_scan(1, 50000, 1000);
+  g_page->ClearImage();
+  g_page->set_image_status(1);
+  ImageStreamer streamer(g_caller, 1000, 2);
+  assert(streamer.StreamImage(NULL) == SANE_STATUS_CANCELLED);
+  assert(g_scan.cancelled);
+  assert(g_scan.pos < 50000);
+  g_page->set_image_status(0);
+}
+
+}  // namespace {}
+
+extern "C" {
+
+SANE_Status sane_get_parameters(SANE_Handle handle, SANE_Parameters* params) {
+  memset(params, 0, sizeof(*params));
+  params->format = g_scan.frame_count == 1 ? SANE_FRAME_GRAY :
+      static_cast<SANE_Frame>(SANE_FRAME_RED + g_scan.frame);
+  params->last_frame = g_scan.frame == g_scan.frame_count - 1;
+  params->bytes_per_line = 100;
+  params->pixels_per_line = 100;
+  params->lines = g_scan.frames[g_scan.frame].size() / 100;
+  params->depth = 8;
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status sane_start(SANE_Handle handle) {
+  if (g_scan.frame + 1 >= g_scan.frame_count)
+    return SANE_STATUS_INVAL;
+  g_scan.frame++;
+  g_scan.pos = 0;
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status sane_read(SANE_Handle handle, SANE_Byte* data,
+                      SANE_Int max_length, SANE_Int* length) {
+  const string& frame = g_scan.frames[g_scan.frame];
+  *length = 0;
+  if (g_scan.cancelled)
+    return SANE_STATUS_CANCELLED;
+  if (g_scan.pos == frame.size())
+    return SANE_STATUS_EOF;
+  size_t count = frame.size() - g_scan.pos;
+  if (count > g_scan.bite)
+    count = g_scan.bite;
+  if (count > static_cast<size_t>(max_length))
+    count = max_length;
+  memcpy(data, frame.data() + g_scan.pos, count);
+  g_scan.pos += count;
+  *length = count;
+  return SANE_STATUS_GOOD;
+}
+
+void sane_cancel(SANE_Handle handle) {
+  g_scan.cancelled = true;
+}
+
+}  // extern "C"
+
+namespace pp {
+Module* CreateModule() {
+  return new TestModule;
+}
+}  // namespace pp
+
+int main() {
+  pp::Instance* instance = pp::Module::Get()->CreateInstance(1);
+  scanley::SynchronousJavaScriptCaller caller(instance);
+  g_caller = &caller;
+  UsbResponder page;
+  page.Attach(&caller);
+  g_page = &page;
+
+  one_frame();
+  three_frames();
+  page_stops_scan();
+  return 0;
+}
@@ -0,0 +1,470 @@
+// copyright...
+
+#include "nacl_usb_responder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fstream>
+#include <sstream>
+
+#include <libusb.h>
+
+#include "fake_ppapi.h"
+#include "ppapi/cpp/module.h"
+#include "ppapi/cpp/var_array_buffer.h"
+#include "sane/nacl_stream.h"
+#include "sane/nacl_usb.h"
+#include "sane/nacl_util.h"
+
+using std::istream;
+using std::istringstream;
+using std::string;
+
+namespace scanley {
+
+namespace {
+
+// A batch of reply frames on its way back to the module.
+struct PendingReply {
+  UsbResponder* responder;
+  SynchronousJavaScriptCaller* caller;
+  pp::Instance* instance;
+  int frames;
+  pp::VarArrayBuffer buffer;
+};
+
+void AppendFrame(string* out, uint32_t id, uint16_t opcode, uint16_t status,
+                 const string& payload) {
+  unsigned char header[kJSFrameHeaderBytes];
+  PutLE32(header, id);
+  PutLE16(header + 4, opcode);
+  PutLE16(header + 6, status);
+  PutLE32(header + 8, payload.size());
+  out->append(reinterpret_cast<const char*>(header), sizeof(header));
+  out->append(payload);
+}
+
+string LE32(uint32_t value) {
+  unsigned char bytes[4];
+  PutLE32(bytes, value);
+  return string(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+}
+
+// Parses hex bytes, or <count>*<hex byte>.
+bool ParseData(const string& word, string* data) {
+  size_t star = word.find('*');
+  if (star != string::npos) {
+    char* end;
+    unsigned long count = strtoul(word.c_str(), &end, 10);
+    if (end != word.c_str() + star)
+      return false;
+    unsigned long byte = strtoul(word.c_str() + star + 1, &end, 16);
+    if (*end || byte > 0xff)
+      return false;
+    data->append(count, static_cast<char>(byte));
+    return true;
+  }
+  if (word.size() % 2)
+    return false;
+  for (size_t i = 0; i < word.size(); i += 2) {
+    char hex[3] = { word[i], word[i + 1], '\0' };
+    char* end;
+    unsigned long byte = strtoul(hex, &end, 16);
+    if (*end)
+      return false;
+    data->push_back(static_cast<char>(byte));
+  }
+  return true;
+}
+
+bool ParseHex(istream& in, unsigned long* value) {
+  string word;
+  if (!(in >> word))
+    return false;
+  char* end;
+  *value = strtoul(word.c_str(), &end, 16);
+  return *end == '\0';
+}
+
+// Parses "[<data>] -> <error> [<data>]", the end of a transfer record.
+bool ParseTransfer(istream& in, UsbRecord* record) {
+  string word;
+  if (!(in >> word))
+    return false;
+  if (word != "->") {
+    if (!ParseData(word, &record->out_data) || !(in >> word) || word != "->")
+      return false;
+  }
+  if (!(in >> record->error))
+    return false;
+  if (in >> word)
+    return ParseData(word, &record->in_data) && !(in >> word);
+  return true;
+}
+
+}  // namespace {}
+
+FakeUsbDevice::FakeUsbDevice()
+    : bus(1), address(1), configuration(1), bulk_in_pos(0) {
+}
+
+UsbResponder::UsbResponder()
+    : caller_(NULL), instance_(NULL), reply_delay_ms_(0), drop_replies_(false),
+      image_status_(0), messages_(0), frames_(0), pending_(0),
+      max_pending_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+UsbResponder::~UsbResponder() {
+  if (caller_ || instance_)
+    fake_ppapi::SetPostMessageHandler(NULL, NULL);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void UsbResponder::Attach(SynchronousJavaScriptCaller* caller) {
+  caller_ = caller;
+  instance_ = NULL;
+  fake_ppapi::SetPostMessageHandler(&StaticHandleMessage, this);
+}
+
+void UsbResponder::Attach(pp::Instance* instance) {
+  caller_ = NULL;
+  instance_ = instance;
+  fake_ppapi::SetPostMessageHandler(&StaticHandleMessage, this);
+}
+
+uint32_t UsbResponder::AddDevice(const FakeUsbDevice& device) {
+  devices_.push_back(device);
+  return devices_.size() - 1;
+}
+
+int UsbResponder::messages() const {
+  ScopedPthreadLock lock(&mutex_);
+  return messages_;
+}
+
+int UsbResponder::frames() const {
+  ScopedPthreadLock lock(&mutex_);
+  return frames_;
+}
+
+int UsbResponder::max_pending() const {
+  ScopedPthreadLock lock(&mutex_);
+  return max_pending_;
+}
+
+void UsbResponder::StaticHandleMessage(void* self, const pp::Var& message) {
+  static_cast<UsbResponder*>(self)->HandleMessage(message);
+}
+
+void UsbResponder::HandleMessage(const pp::Var& message) {
+  if (!message.is_array_buffer()) {
+    fprintf(stderr, "UsbResponder: unexpected message %s\n",
+            message.AsString().c_str());
+    return;
+  }
+  pp::VarArrayBuffer requests(message);
+  const unsigned char* in = static_cast<const unsigned char*>(requests.Map());
+  const unsigned char* end = in + requests.ByteLength();
+  string replies;
+  int frames = 0;
+  while (end - in >= static_cast<ptrdiff_t>(kJSFrameHeaderBytes)) {
+    uint32_t id = GetLE32(in);
+    uint16_t opcode = GetLE16(in + 4);
+    size_t length = GetLE32(in + 8);
+    in += kJSFrameHeaderBytes;
+    if (static_cast<size_t>(end - in) < length)
+      break;
+    string payload;
+    uint16_t status = HandleRequest(opcode, in, length, &payload);
+    AppendFrame(&replies, id, opcode, status, payload);
+    in += length;
+    frames++;
+  }
+  requests.Unmap();
+
+  {
+    ScopedPthreadLock lock(&mutex_);
+    messages_++;
+    frames_ += frames;
+    if (drop_replies_ || replies.empty())
+      return;
+    pending_ += frames;
+    if (pending_ > max_pending_)
+      max_pending_ = pending_;
+  }
+
+  PendingReply* reply = new PendingReply;
+  reply->responder = this;
+  reply->frames = frames;
+  reply->caller = caller_;
+  reply->instance = instance_;
+  reply->buffer = pp::VarArrayBuffer(replies.size());
+  memcpy(reply->buffer.Map(), replies.data(), replies.size());
+  reply->buffer.Unmap();
+  pp::Module::Get()->core()->CallOnMainThread(
+      reply_delay_ms_, pp::CompletionCallback(&StaticDeliver, reply), PP_OK);
+}
+
+void UsbResponder::StaticDeliver(void* user_data, int32_t unused) {
+  PendingReply* reply = static_cast<PendingReply*>(user_data);
+  {
+    ScopedPthreadLock lock(&reply->responder->mutex_);
+    reply->responder->pending_ -= reply->frames;
+  }
+  if (reply->instance)
+    reply->instance->HandleMessage(reply->buffer);
+  else if (!reply->caller->HandleReply(reply->buffer))
+    fprintf(stderr, "UsbResponder: reply rejected\n");
+  delete reply;
+}
+
+uint16_t UsbResponder::HandleRequest(uint16_t opcode,
+                                     const unsigned char* data, size_t length,
+                                     string* reply) {
+  if (opcode == kJSOpText || opcode == kJSOpImageParams)
+    return 0;
+  if (opcode == kJSOpImageData)
+    return ImageData(data, length);
+
+  if (opcode == kUsbOpGetDevices) {
+    for (size_t i = 0; i < devices_.size(); i++) {
+      reply->append(LE32(i));
+      reply->push_back(devices_[i].bus);
+      reply->push_back(devices_[i].address);
+      reply->append(2, '\0');
+      reply->append(devices_[i].device_descriptor);
+    }
+    return 0;
+  }
+
+  // Everything else starts with a device id or handle. Handles are device
+  // ids plus one, so that 0 is never valid.
+  if (length < 4)
+    return -LIBUSB_ERROR_INVALID_PARAM;
+  uint32_t id = GetLE32(data);
+  if (opcode != kUsbOpGetConfigDescriptor && opcode != kUsbOpOpen)
+    id--;
+  if (id >= devices_.size())
+    return -LIBUSB_ERROR_NO_DEVICE;
+  FakeUsbDevice* dev = &devices_[id];
+
+  switch (opcode) {
+    case kUsbOpGetConfigDescriptor:
+      if (length < 5 || data[4] != 0)
+        return -LIBUSB_ERROR_NOT_FOUND;
+      *reply = dev->config_descriptor;
+      return 0;
+    case kUsbOpOpen:
+      *reply = LE32(id + 1);
+      return 0;
+    case kUsbOpSetConfiguration:
+      if (length < 8)
+        return -LIBUSB_ERROR_INVALID_PARAM;
+      dev->configuration = GetLE32(data + 4);
+      return 0;
+    case kUsbOpControlTransfer:
+      return ControlTransfer(dev, data, length, reply);
+    case kUsbOpBulkTransfer:
+    case kUsbOpInterruptTransfer:
+      return DataTransfer(dev, data, length, reply);
+    case kUsbOpClose:
+    case kUsbOpClaimInterface:
+    case kUsbOpReleaseInterface:
+    case kUsbOpSetInterfaceAltSetting:
+    case kUsbOpClearHalt:
+    case kUsbOpResetDevice:
+      return 0;
+  }
+  return -LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+uint16_t UsbResponder::ImageData(const unsigned char* data, size_t length) {
+  if (length < ImageStreamer::kChunkHeaderBytes)
+    return 1;
+  data += ImageStreamer::kChunkHeaderBytes;
+  length -= ImageStreamer::kChunkHeaderBytes;
+  image_.append(reinterpret_cast<const char*>(data), length);
+  return image_status_;
+}
+
+uint16_t UsbResponder::ControlTransfer(FakeUsbDevice* dev,
+                                       const unsigned char* data,
+                                       size_t length, string* reply) {
+  if (length < kUsbTransferParamBytes)
+    return -LIBUSB_ERROR_INVALID_PARAM;
+  uint8_t request_type = data[4];
+  uint8_t request = data[5];
+  uint16_t value = GetLE16(data + 6);
+  uint16_t w_length = GetLE16(data + 10);
+
+  if ((request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+    if (length - kUsbTransferParamBytes != w_length)
+      return -LIBUSB_ERROR_INVALID_PARAM;
+    *reply = LE32(w_length);
+    return 0;
+  }
+  if (request == LIBUSB_REQUEST_GET_CONFIGURATION) {
+    reply->push_back(dev->configuration);
+  } else if (request == LIBUSB_REQUEST_GET_DESCRIPTOR &&
+             (value >> 8) == LIBUSB_DT_DEVICE) {
+    *reply = dev->device_descriptor;
+  } else if (request == LIBUSB_REQUEST_GET_DESCRIPTOR &&
+             (value >> 8) == LIBUSB_DT_CONFIG) {
+    *reply = dev->config_descriptor;
+  } else {
+    return -LIBUSB_ERROR_PIPE;
+  }
+  if (reply->size() > w_length)
+    reply->resize(w_length);
+  return 0;
+}
+
+uint16_t UsbResponder::DataTransfer(FakeUsbDevice* dev,
+                                    const unsigned char* data, size_t length,
+                                    string* reply) {
+  if (length < kUsbTransferParamBytes)
+    return -LIBUSB_ERROR_INVALID_PARAM;
+  uint8_t endpoint = data[4];
+  size_t transfer_length = GetLE32(data + 8);
+  const char* payload =
+      reinterpret_cast<const char*>(data + kUsbTransferParamBytes);
+
+  if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+    size_t written = length - kUsbTransferParamBytes;
+    dev->bulk_out.append(payload, written);
+    *reply = LE32(written);
+    return 0;
+  }
+  size_t left = dev->bulk_in.size() - dev->bulk_in_pos;
+  if (left == 0)
+    return -LIBUSB_ERROR_TIMEOUT;
+  size_t count = transfer_length < left ? transfer_length : left;
+  reply->assign(dev->bulk_in, dev->bulk_in_pos, count);
+  dev->bulk_in_pos += count;
+  return 0;
+}
+
+bool UsbRecord::is_out() const {
+  uint8_t direction = opcode == kUsbOpControlTransfer ? setup[0] : endpoint;
+  return (direction & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT;
+}
+
+UsbPlaybackResponder::UsbPlaybackResponder() : next_(0), mismatches_(0) {
+}
+
+bool UsbPlaybackResponder::LoadFile(const char* path) {
+  std::ifstream script(path);
+  if (!script) {
+    fprintf(stderr, "UsbPlaybackResponder: can't open %s\n", path);
+    return false;
+  }
+  return Load(script);
+}
+
+bool UsbPlaybackResponder::Load(istream& script) {
+  string line;
+  for (int line_number = 1; std::getline(script, line); line_number++) {
+    istringstream in(line);
+    string kind;
+    if (!(in >> kind) || kind[0] == '#')
+      continue;
+
+    bool ok = false;
+    if (kind == "device") {
+      FakeUsbDevice dev;
+      unsigned bus, address;
+      string desc, config;
+      ok = (in >> bus >> address >> desc) &&
+          ParseData(desc, &dev.device_descriptor) &&
+          dev.device_descriptor.size() == 18;
+      if (ok && (in >> config))
+        ok = ParseData(config, &dev.config_descriptor);
+      dev.bus = bus;
+      dev.address = address;
+      if (ok)
+        AddDevice(dev);
+    } else if (kind == "control") {
+      UsbRecord record;
+      unsigned long request_type, request, value, index;
+      unsigned length;
+      ok = ParseHex(in, &request_type) && ParseHex(in, &request) &&
+          ParseHex(in, &value) && ParseHex(in, &index) && (in >> length) &&
+          ParseTransfer(in, &record);
+      record.opcode = kUsbOpControlTransfer;
+      record.setup[0] = request_type;
+      record.setup[1] = request;
+      PutLE16(record.setup + 2, value);
+      PutLE16(record.setup + 4, index);
+      PutLE16(record.setup + 6, length);
+      record.endpoint = 0;
+      record.length = length;
+      if (ok)
+        records_.push_back(record);
+    } else if (kind == "bulk" || kind == "interrupt") {
+      UsbRecord record;
+      unsigned long endpoint;
+      ok = ParseHex(in, &endpoint) && (in >> record.length) &&
+          ParseTransfer(in, &record);
+      record.opcode = kind == "bulk" ? kUsbOpBulkTransfer :
+          kUsbOpInterruptTransfer;
+      memset(record.setup, 0, sizeof(record.setup));
+      record.endpoint = endpoint;
+      if (ok)
+        records_.push_back(record);
+    }
+    if (!ok) {
+      fprintf(stderr, "UsbPlaybackResponder: bad line %d: %s\n", line_number,
+              line.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+void UsbPlaybackResponder::Rewind() {
+  next_ = 0;
+}
+
+bool UsbPlaybackResponder::Matches(const UsbRecord& record, uint16_t opcode,
+                                   const unsigned char* data,
+                                   size_t length) const {
+  if (record.opcode != opcode || length < kUsbTransferParamBytes)
+    return false;
+  const unsigned char* payload = data + kUsbTransferParamBytes;
+  size_t payload_length = length - kUsbTransferParamBytes;
+  if (opcode == kUsbOpControlTransfer) {
+    if (memcmp(record.setup, data + 4, sizeof(record.setup)) != 0)
+      return false;
+  } else if (record.endpoint != data[4] || record.length != GetLE32(data + 8)) {
+    return false;
+  }
+  if (record.is_out())
+    return record.out_data.size() == payload_length &&
+        memcmp(record.out_data.data(), payload, payload_length) == 0;
+  return payload_length == 0;
+}
+
+uint16_t UsbPlaybackResponder::HandleRequest(uint16_t opcode,
+                                             const unsigned char* data,
+                                             size_t length, string* reply) {
+  if (opcode != kUsbOpControlTransfer && opcode != kUsbOpBulkTransfer &&
+      opcode != kUsbOpInterruptTransfer)
+    return UsbResponder::HandleRequest(opcode, data, length, reply);
+
+  if (next_ >= records_.size() ||
+      !Matches(records_[next_], opcode, data, length)) {
+    fprintf(stderr, "UsbPlaybackResponder: request %u doesn't match record "
+            "%zu\n", opcode, next_);
+    mismatches_++;
+    return -LIBUSB_ERROR_IO;
+  }
+  const UsbRecord& record = records_[next_++];
+  if (record.error == 0)
+    *reply = record.is_out() ? LE32(record.out_data.size()) : record.in_data;
+  return -record.error;
+}
+
+}  // namespace scanley
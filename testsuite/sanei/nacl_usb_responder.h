@@ -0,0 +1,162 @@
+// copyright...
+//
+// A stand-in for the page's JavaScript when the NaCl glue is built against
+// the fake Pepper API (fake_ppapi/): it answers the binary requests of
+// SynchronousJavaScriptCaller, emulating USB devices for sanei/nacl_usb.cc
+// and collecting images streamed by ImageStreamer (sane/nacl_stream.h).
+
+#ifndef NACL_USB_RESPONDER_H__
+#define NACL_USB_RESPONDER_H__
+
+#include <stdint.h>
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "ppapi/cpp/instance.h"
+#include "ppapi/cpp/var.h"
+#include "sane/nacl_jscall.h"
+
+namespace scanley {
+
+struct FakeUsbDevice {
+  FakeUsbDevice();
+
+  uint8_t bus;
+  uint8_t address;
+  std::string device_descriptor;  // 18 bytes
+  std::string config_descriptor;  // all wTotalLength bytes
+  uint8_t configuration;
+  // Bulk IN transfers are served from here; once it runs dry they time out.
+  std::string bulk_in;
+  size_t bulk_in_pos;
+  // Everything written to bulk OUT endpoints.
+  std::string bulk_out;
+};
+
+class UsbResponder {
+ public:
+  UsbResponder();
+  virtual ~UsbResponder();
+
+  // Starts answering the messages caller posts to the page.
+  void Attach(SynchronousJavaScriptCaller* caller);
+  // Same, but replies go to instance->HandleMessage(), as they would from a
+  // real page, and it hands them to its caller.
+  void Attach(pp::Instance* instance);
+
+  // Returns the device's id. Devices must be added before they are used.
+  uint32_t AddDevice(const FakeUsbDevice& device);
+  FakeUsbDevice* device(uint32_t id) { return &devices_[id]; }
+
+  // Replies are delivered this long after the request arrives.
+  void set_reply_delay_ms(int delay_ms) { reply_delay_ms_ = delay_ms; }
+  // If set, requests are swallowed without a reply.
+  void set_drop_replies(bool drop) { drop_replies_ = drop; }
+
+  int messages() const;
+  int frames() const;
+  // Most requests answered but not yet replied to at any one time.
+  int max_pending() const;
+
+  // Image data received so far, all frames back to back.
+  const std::string& image() const { return image_; }
+  void ClearImage() { image_.clear(); }
+  // If set, image chunks are answered with this status, stopping the scan.
+  void set_image_status(uint16_t status) { image_status_ = status; }
+
+ protected:
+  // Answers one request; returns the reply status (a negated libusb_error).
+  // Subclasses override this to script other behaviour.
+  virtual uint16_t HandleRequest(uint16_t opcode, const unsigned char* data,
+                                 size_t length, std::string* reply);
+
+ private:
+  static void StaticHandleMessage(void* self, const pp::Var& message);
+  void HandleMessage(const pp::Var& message);
+  static void StaticDeliver(void* reply, int32_t unused);
+
+  uint16_t ControlTransfer(FakeUsbDevice* dev, const unsigned char* data,
+                           size_t length, std::string* reply);
+  uint16_t DataTransfer(FakeUsbDevice* dev, const unsigned char* data,
+                        size_t length, std::string* reply);
+  uint16_t ImageData(const unsigned char* data, size_t length);
+
+  SynchronousJavaScriptCaller* caller_;
+  pp::Instance* instance_;
+  std::vector<FakeUsbDevice> devices_;
+  int reply_delay_ms_;
+  bool drop_replies_;
+
+  std::string image_;
+  uint16_t image_status_;
+
+  mutable pthread_mutex_t mutex_;
+  int messages_;
+  int frames_;
+  int pending_;
+  int max_pending_;
+};
+
+// One recorded control, bulk or interrupt transfer.
+struct UsbRecord {
+  uint16_t opcode;  // kUsbOpControlTransfer, kUsbOpBulkTransfer, ...
+  unsigned char setup[8];  // control transfers: the setup packet
+  uint8_t endpoint;  // bulk and interrupt transfers
+  uint32_t length;  // wLength, or the transfer length
+  std::string out_data;
+  int error;  // a libusb_error
+  std::string in_data;
+
+  bool is_out() const;
+};
+
+// Plays back recorded USB traffic. Control, bulk and interrupt requests must
+// arrive in the order of the recording, and get its replies; anything else
+// (device list, open, claim, ...) is answered as UsbResponder does. The
+// recording is a text file of these lines:
+//
+//   # comment
+//   device <bus> <address> <device descriptor> [<config descriptor>]
+//   control <bmRequestType> <bRequest> <wValue> <wIndex> <wLength> [<data>]
+//       -> <error> [<data>]
+//   bulk <endpoint> <length> [<data>] -> <error> [<data>]
+//   interrupt <endpoint> <length> [<data>] -> <error> [<data>]
+//
+// (one line per record). bmRequestType, bRequest, wValue, wIndex and
+// endpoints are hex, lengths decimal, errors libusb_error values. Data is hex
+// bytes, or <count>*<hex byte> for a run of one byte. Data before "->" is
+// sent by the host (OUT), data after it is the reply (IN).
+class UsbPlaybackResponder : public UsbResponder {
+ public:
+  UsbPlaybackResponder();
+
+  // Returns false, after saying why on stderr, if the script is malformed.
+  bool Load(std::istream& script);
+  bool LoadFile(const char* path);
+
+  const std::vector<UsbRecord>& records() const { return records_; }
+  // Starts over from the first record.
+  void Rewind();
+  // Requests that didn't match the recording, or came after its end.
+  int mismatches() const { return mismatches_; }
+
+ protected:
+  virtual uint16_t HandleRequest(uint16_t opcode, const unsigned char* data,
+                                 size_t length, std::string* reply);
+
+ private:
+  bool Matches(const UsbRecord& record, uint16_t opcode,
+               const unsigned char* data, size_t length) const;
+
+  std::vector<UsbRecord> records_;
+  size_t next_;
+  int mismatches_;
+};
+
+}  // namespace scanley
+
+#endif  // NACL_USB_RESPONDER_H__
@@ -0,0 +1,303 @@
+// copyright...
+//
+// Tests for the libusb-1.0 implementation of the NaCl build
+// (sanei/nacl_usb.cc), run against UsbResponder standing in for the page.
+
+#include <assert.h>
+#include <string.h>
+
+#include <sstream>
+#include <string>
+
+#include <libusb.h>
+
+#include "nacl_usb_responder.h"
+#include "ppapi/cpp/instance.h"
+#include "ppapi/cpp/module.h"
+#include "sane/nacl_jscall.h"
+
+using scanley::FakeUsbDevice;
+using scanley::UsbPlaybackResponder;
+using scanley::UsbResponder;
+using std::string;
+
+extern scanley::SynchronousJavaScriptCaller* g_js_caller;
+
+namespace {
+
+class TestModule : public pp::Module {
+ public:
+  virtual pp::Instance* CreateInstance(PP_Instance instance) {
+    return new pp::Instance(instance);
+  }
+};
+
+const unsigned char kDeviceDescriptor[18] = {
+  18, LIBUSB_DT_DEVICE, 0x00, 0x02, 0, 0, 0, 64,
+  0xb8, 0x04, 0x2a, 0x01,  // idVendor 0x04b8, idProduct 0x012a
+  0x00, 0x01, 1, 2, 0, 1
+};
+
+// One interface with a class-specific descriptor that the parser must skip,
+// then a bulk IN, a bulk OUT and an interrupt IN endpoint.
+const unsigned char kConfigDescriptor[] = {
+  9, LIBUSB_DT_CONFIG, 44, 0, 1, 1, 0, 0xc0, 1,
+  9, LIBUSB_DT_INTERFACE, 0, 0, 3, 0xff, 0xff, 0xff, 0,
+  5, 0x24, 1, 2, 3,
+  7, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+  7, LIBUSB_DT_ENDPOINT, 0x02, LIBUSB_TRANSFER_TYPE_BULK, 0x00, 0x02, 0,
+  7, LIBUSB_DT_ENDPOINT, 0x83, LIBUSB_TRANSFER_TYPE_INTERRUPT, 0x08, 0x00, 4,
+};
+
+UsbResponder* g_responder;
+
+libusb_device_handle* open_first_device() {
+  libusb_device** list;
+  assert(libusb_get_device_list(NULL, &list) == 1);
+  libusb_device_handle* handle;
+  assert(libusb_open(list[0], &handle) == 0);
+  libusb_free_device_list(list, 1);
+  return handle;
+}
+
+void device_list() {
+  libusb_device** list;
+  assert(libusb_get_device_list(NULL, &list) == 1);
+  assert(list[1] == NULL);
+  assert(libusb_get_bus_number(list[0]) == 3);
+  assert(libusb_get_device_address(list[0]) == 7);
+
+  struct libusb_device_descriptor desc;
+  assert(libusb_get_device_descriptor(list[0], &desc) == 0);
+  assert(desc.idVendor == 0x04b8);
+  assert(desc.idProduct == 0x012a);
+  assert(desc.bNumConfigurations == 1);
+
+  struct libusb_config_descriptor* config;
+  assert(libusb_get_config_descriptor(list[0], 0, &config) == 0);
+  assert(config->bNumInterfaces == 1);
+  assert(config->interface[0].num_altsetting == 1);
+  const struct libusb_interface_descriptor* alt =
+      &config->interface[0].altsetting[0];
+  assert(alt->bInterfaceClass == 0xff);
+  assert(alt->bNumEndpoints == 3);
+  assert(alt->endpoint[0].bEndpointAddress == 0x81);
+  assert(alt->endpoint[0].wMaxPacketSize == 512);
+  assert(alt->endpoint[2].bmAttributes == LIBUSB_TRANSFER_TYPE_INTERRUPT);
+  assert(alt->endpoint[2].bInterval == 4);
+  libusb_free_config_descriptor(config);
+  assert(libusb_get_config_descriptor(list[0], 1, &config) ==
+         LIBUSB_ERROR_NOT_FOUND);
+
+  libusb_free_device_list(list, 1);
+}
+
+void control() {
+  libusb_device_handle* handle = open_first_device();
+  assert(libusb_claim_interface(handle, 0) == 0);
+
+  int config = 0;
+  assert(libusb_get_configuration(handle, &config) == 0 && config == 1);
+  assert(libusb_set_configuration(handle, 2) == 0);
+  assert(libusb_get_configuration(handle, &config) == 0 && config == 2);
+
+  unsigned char buf[64];
+  assert(libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN,
+                                 LIBUSB_REQUEST_GET_DESCRIPTOR,
+                                 LIBUSB_DT_DEVICE << 8, 0, buf, sizeof(buf),
+                                 1000) == 18);
+  assert(memcmp(buf, kDeviceDescriptor, 18) == 0);
+  assert(libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN, 0x42, 0, 0, buf,
+                                 sizeof(buf), 1000) == LIBUSB_ERROR_PIPE);
+  assert(libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT |
+                                 LIBUSB_REQUEST_TYPE_VENDOR, 0x01, 0, 0, buf,
+                                 16, 1000) == 16);
+
+  assert(libusb_release_interface(handle, 0) == 0);
+  libusb_close(handle);
+}
+
+void bulk() {
+  FakeUsbDevice* dev = g_responder->device(0);
+  dev->bulk_in = "hello, world";
+  dev->bulk_in_pos = 0;
+  libusb_device_handle* handle = open_first_device();
+
+  unsigned char buf[64];
+  int transferred = 0;
+  assert(libusb_bulk_transfer(handle, 0x81, buf, 5, &transferred, 1000) == 0);
+  assert(transferred == 5 && memcmp(buf, "hello", 5) == 0);
+  // Short read: only what's left.
+  assert(libusb_bulk_transfer(handle, 0x81, buf, sizeof(buf), &transferred,
+                              1000) == 0);
+  assert(transferred == 7 && memcmp(buf, ", world", 7) == 0);
+  assert(libusb_bulk_transfer(handle, 0x81, buf, sizeof(buf), &transferred,
+                              1000) == LIBUSB_ERROR_TIMEOUT);
+
+  unsigned char command[6] = { 0x1b, 'I', 0, 0, 0, 0 };
+  assert(libusb_bulk_transfer(handle, 0x02, command, sizeof(command),
+                              &transferred, 1000) == 0);
+  assert(transferred == 6);
+  assert(dev->bulk_out == string(reinterpret_cast<char*>(command), 6));
+  libusb_close(handle);
+}
+
+const int kAsyncTransfers = 4;
+const int kAsyncLength = 4096;
+
+struct AsyncState {
+  int completed;
+  int order[kAsyncTransfers];
+};
+
+void LIBUSB_CALL async_callback(struct libusb_transfer* transfer) {
+  AsyncState* state = static_cast<AsyncState*>(transfer->user_data);
+  assert(transfer->status == LIBUSB_TRANSFER_COMPLETED);
+  assert(transfer->actual_length == kAsyncLength);
+  state->order[state->completed++] = transfer->buffer[0];
+}
+
+void async_bulk() {
+  FakeUsbDevice* dev = g_responder->device(0);
+  dev->bulk_in.clear();
+  for (int i = 0; i < kAsyncTransfers; i++)
+    dev->bulk_in.append(kAsyncLength, static_cast<char>(i));
+  dev->bulk_in_pos = 0;
+  libusb_device_handle* handle = open_first_device();
+  g_responder->set_reply_delay_ms(20);
+
+  // All transfers are queued with the page before the first one completes.
+  AsyncState state = { 0, { 0 } };
+  struct libusb_transfer* transfers[kAsyncTransfers];
+  for (int i = 0; i < kAsyncTransfers; i++) {
+    transfers[i] = libusb_alloc_transfer(0);
+    unsigned char* buffer = static_cast<unsigned char*>(malloc(kAsyncLength));
+    libusb_fill_bulk_transfer(transfers[i], handle, 0x81, buffer,
+                              kAsyncLength, async_callback, &state, 1000);
+    transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    assert(libusb_submit_transfer(transfers[i]) == 0);
+  }
+  assert(state.completed == 0);
+
+  while (state.completed < kAsyncTransfers)
+    assert(libusb_handle_events(NULL) == 0);
+  for (int i = 0; i < kAsyncTransfers; i++) {
+    assert(state.order[i] == i);
+    libusb_free_transfer(transfers[i]);
+  }
+
+  g_responder->set_reply_delay_ms(0);
+  libusb_close(handle);
+}
+
+void LIBUSB_CALL cancel_callback(struct libusb_transfer* transfer) {
+  *static_cast<int*>(transfer->user_data) = transfer->status;
+}
+
+void timeout_and_cancel() {
+  libusb_device_handle* handle = open_first_device();
+  g_responder->set_drop_replies(true);
+
+  // The page never answers: the call gives up on its own.
+  unsigned char buf[16];
+  int transferred = -1;
+  assert(libusb_bulk_transfer(handle, 0x81, buf, sizeof(buf), &transferred,
+                              10) == LIBUSB_ERROR_TIMEOUT);
+  assert(transferred == 0);
+  // So do requests without a timeout.
+  assert(libusb_clear_halt(handle, 0x81) == LIBUSB_ERROR_TIMEOUT);
+
+  int status = -1;
+  struct libusb_transfer* transfer = libusb_alloc_transfer(0);
+  libusb_fill_bulk_transfer(transfer, handle, 0x81, buf, sizeof(buf),
+                            cancel_callback, &status, 0);
+  transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
+  assert(libusb_submit_transfer(transfer) == 0);
+  assert(libusb_cancel_transfer(transfer) == 0);
+  struct timeval tv = { 1, 0 };
+  assert(libusb_handle_events_timeout(NULL, &tv) == 0);
+  assert(status == LIBUSB_TRANSFER_CANCELLED);
+
+  g_responder->set_drop_replies(false);
+  libusb_close(handle);
+}
+
+const char kRecording[] =
+    "# a vendor command, then a short read of image data\n"
+    "device 1 2 120100020000004098041a01000101020001\n"
+    "control 40 0c 0084 0000 2 0100 -> 0\n"
+    "bulk 02 4 1b490000 -> 0\n"
+    "bulk 81 512 -> 0 300*7f\n"
+    "bulk 81 512 -> -7\n";
+
+void playback() {
+  UsbPlaybackResponder playback;
+  std::istringstream script(kRecording);
+  assert(playback.Load(script));
+  assert(playback.records().size() == 4);
+  playback.Attach(g_js_caller);
+
+  libusb_device_handle* handle = open_first_device();
+  unsigned char buf[512] = { 0x01, 0x00 };
+  assert(libusb_control_transfer(handle, 0x40, 0x0c, 0x84, 0, buf, 2, 1000) ==
+         2);
+  unsigned char command[4] = { 0x1b, 0x49, 0, 0 };
+  int transferred;
+  assert(libusb_bulk_transfer(handle, 0x02, command, 4, &transferred, 1000) ==
+         0);
+  assert(libusb_bulk_transfer(handle, 0x81, buf, 512, &transferred, 1000) ==
+         0);
+  assert(transferred == 300 && buf[0] == 0x7f && buf[299] == 0x7f);
+  assert(libusb_bulk_transfer(handle, 0x81, buf, 512, &transferred, 1000) ==
+         LIBUSB_ERROR_TIMEOUT);
+  assert(playback.mismatches() == 0);
+
+  // Past the end of the recording, or out of order.
+  assert(libusb_bulk_transfer(handle, 0x81, buf, 512, &transferred, 1000) ==
+         LIBUSB_ERROR_IO);
+  playback.Rewind();
+  assert(libusb_bulk_transfer(handle, 0x81, buf, 512, &transferred, 1000) ==
+         LIBUSB_ERROR_IO);
+  assert(playback.mismatches() == 2);
+  libusb_close(handle);
+
+  std::istringstream bad("bulk 81 -> 0\n");
+  assert(!UsbPlaybackResponder().Load(bad));
+}
+
+}  // namespace {}
+
+namespace pp {
+Module* CreateModule() {
+  return new TestModule;
+}
+}  // namespace pp
+
+int main() {
+  pp::Instance* instance = pp::Module::Get()->CreateInstance(1);
+  scanley::SynchronousJavaScriptCaller caller(instance);
+  g_js_caller = &caller;
+
+  UsbResponder responder;
+  FakeUsbDevice dev;
+  dev.bus = 3;
+  dev.address = 7;
+  dev.device_descriptor.assign(reinterpret_cast<const char*>(kDeviceDescriptor),
+                               sizeof(kDeviceDescriptor));
+  dev.config_descriptor.assign(reinterpret_cast<const char*>(kConfigDescriptor),
+                               sizeof(kConfigDescriptor));
+  responder.AddDevice(dev);
+  responder.Attach(&caller);
+  g_responder = &responder;
+
+  assert(libusb_init(NULL) == 0);
+  device_list();
+  control();
+  bulk();
+  async_bulk();
+  timeout_and_cancel();
+  playback();
+  responder.Attach(&caller);
+  libusb_exit(NULL);
+  return 0;
+}
@@ -0,0 +1,297 @@
+/* Benchmark for sanei_swap_16(), the conversion of 16 bit samples from a
+   saned of the other byte order in sane_read() of the net backend.
+
+   A 48 bit RGB page (letter size, 1200 dpi by default) is passed through
+   the sane_read() swap path in reads of a frontend-sized buffer, where the
+   data connection delivers an odd number of bytes now and then so samples
+   are split between reads.  For comparison the previous implementation is
+   kept here: a scalar loop, with a memmove() of the whole buffer whenever a
+   sample was split.  (It also returned a byte unswapped when a read after
+   a split sample got an odd number of bytes.)
+
+   Usage: sanei_byteorder_bench [-d dpi] [-b buffer size] [-c chunk size] */
+
+#include "../../include/sane/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_byteorder.h"
+
+#define SOURCE_SIZE (16 * 1024 * 1024)
+
+/* the data connection: a source of SOURCE_SIZE bytes, repeated */
+static SANE_Byte *source;
+static size_t source_pos, remaining, chunk;
+
+/* the carry state of sane_read() */
+static int hang_over, left_over;
+
+static size_t
+connection_read (SANE_Byte * data, size_t max_length)
+{
+  size_t n = max_length;
+
+  if (n > chunk)
+    n = chunk;
+  if (n > remaining)
+    n = remaining;
+  if (n > SOURCE_SIZE - source_pos)
+    n = SOURCE_SIZE - source_pos;
+  memcpy (data, source + source_pos, n);
+  source_pos = (source_pos + n) % SOURCE_SIZE;
+  remaining -= n;
+  return n;
+}
+
+/* sane_read() before sanei_swap_16() */
+static size_t
+legacy_read (SANE_Byte * data, size_t max_length)
+{
+  size_t nread, length, cnt, start_cnt, end_cnt;
+  SANE_Byte swap_buf, temp_hang_over;
+
+  if (left_over > -1)
+    {
+      *data = (SANE_Byte) left_over;
+      left_over = -1;
+      return 1;
+    }
+  nread = length = connection_read (data, max_length);
+  if (nread == 0)
+    return 0;
+  if (nread == 1 && hang_over > -1)
+    {
+      left_over = hang_over;
+      hang_over = -1;
+      return 1;
+    }
+  if (nread > 1 && hang_over > -1)
+    {
+      temp_hang_over = data[nread - 1];
+      memmove (data + 1, data, nread - 1);
+      *data = (SANE_Byte) hang_over;
+      if (nread % 2 == 0)
+	{
+	  left_over = data[nread - 1];
+	  data[nread - 1] = temp_hang_over;
+	  hang_over = -1;
+	  start_cnt = 0;
+	  end_cnt = nread - 2;
+	}
+      else
+	{
+	  hang_over = temp_hang_over;
+	  left_over = -1;
+	  start_cnt = 0;
+	  end_cnt = nread - 1;
+	}
+    }
+  else if (nread == 1)
+    {
+      hang_over = *data;
+      return 0;
+    }
+  else
+    {
+      start_cnt = 0;
+      if (nread % 2 != 0)
+	{
+	  hang_over = data[length - 1];
+	  length -= 1;
+	}
+      end_cnt = length;
+    }
+  for (cnt = start_cnt; cnt + 1 < end_cnt; cnt += 2)
+    {
+      swap_buf = data[cnt];
+      data[cnt] = data[cnt + 1];
+      data[cnt + 1] = swap_buf;
+    }
+  return length;
+}
+
+/* sane_read() with sanei_swap_16() */
+static size_t
+swap_read (SANE_Byte * data, size_t max_length)
+{
+  SANE_Byte *dest = data;
+  size_t length, start = 0;
+
+  if (left_over > -1)
+    {
+      *data = (SANE_Byte) left_over;
+      left_over = -1;
+      return 1;
+    }
+  if (hang_over > -1)
+    {
+      if (max_length == 1)
+	{
+	  if (connection_read (data, 1) == 0)
+	    return 0;
+	  left_over = hang_over;
+	  hang_over = -1;
+	  return 1;
+	}
+      dest = data + 1;
+      max_length--;
+    }
+  length = connection_read (dest, max_length);
+  if (length == 0)
+    return 0;
+  if (dest != data)
+    {
+      data[0] = data[1];
+      data[1] = (SANE_Byte) hang_over;
+      hang_over = -1;
+      length++;
+      start = 2;
+    }
+  if ((length - start) % 2)
+    {
+      length--;
+      hang_over = data[length];
+    }
+  sanei_swap_16 (data + start, length - start);
+  return length;
+}
+
+static double
+now_ms (void)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+}
+
+/* Reads a page of PAGE_BYTES through READ_FUNC into a buffer of BUF_SIZE
+   bytes, returns the time taken in ms; if OUT is not NULL, stores the
+   page there. */
+static double
+run (size_t (*read_func) (SANE_Byte *, size_t), size_t page_bytes,
+     SANE_Byte * buf, size_t buf_size, SANE_Byte * out)
+{
+  double start;
+  size_t n, total = 0;
+
+  source_pos = 0;
+  remaining = page_bytes;
+  hang_over = left_over = -1;
+  start = now_ms ();
+  while (remaining > 0 || left_over > -1)
+    {
+      n = read_func (buf, buf_size);
+      if (out)
+	memcpy (out + total, buf, n);
+      total += n;
+    }
+  if (total + (hang_over > -1) != page_bytes)
+    {
+      fprintf (stderr, "lost data: %lu of %lu bytes\n", (u_long) total,
+	       (u_long) page_bytes);
+      exit (1);
+    }
+  return now_ms () - start;
+}
+
+/* Checks the result against the source swapped as a whole, for reads
+   of odd sizes from a connection delivering odd sizes. */
+static void
+check (SANE_Byte * buf)
+{
+  static const size_t sizes[] = { 1, 2, 3, 7, 64, 4099 };
+  static const size_t chunks[] = { 1, 3, 17, 1000, 4097 };
+  size_t page_bytes = 65536;
+  SANE_Byte *out = malloc (page_bytes), *ref = malloc (page_bytes);
+  size_t i, j, saved_chunk = chunk;
+
+  if (!out || !ref)
+    exit (1);
+  memcpy (ref, source, page_bytes);
+  sanei_swap_16 (ref, page_bytes);
+  for (i = 0; i < page_bytes; i += 2)
+    if (ref[i] != source[i + 1] || ref[i + 1] != source[i])
+      {
+	fprintf (stderr, "sanei_swap_16 is broken at byte %lu\n", (u_long) i);
+	exit (1);
+      }
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    for (j = 0; j < sizeof (chunks) / sizeof (chunks[0]); j++)
+      {
+	chunk = chunks[j];
+	memset (out, 0, page_bytes);
+	run (swap_read, page_bytes, buf, sizes[i], out);
+	if (memcmp (out, ref, page_bytes) != 0)
+	  {
+	    fprintf (stderr, "mismatch with %lu byte reads of %lu byte "
+		     "chunks\n", (u_long) sizes[i], (u_long) chunks[j]);
+	    exit (1);
+	  }
+      }
+  free (out);
+  free (ref);
+  chunk = saved_chunk;
+}
+
+int
+main (int argc, char **argv)
+{
+  int dpi = 1200, opt;
+  size_t buf_size = 32768, page_bytes, i;
+  SANE_Byte *buf;
+  double legacy_ms, swap_ms;
+
+  chunk = 65535;
+  while ((opt = getopt (argc, argv, "d:b:c:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'd':
+	  dpi = atoi (optarg);
+	  break;
+	case 'b':
+	  buf_size = atoi (optarg);
+	  break;
+	case 'c':
+	  chunk = atoi (optarg);
+	  break;
+	default:
+	  fprintf (stderr, "usage: %s [-d dpi] [-b buffer size] "
+		   "[-c chunk size]\n", argv[0]);
+	  return 1;
+	}
+    }
+  if (dpi < 1 || buf_size < 1 || chunk < 1)
+    return 1;
+
+  source = malloc (SOURCE_SIZE);
+  buf = malloc (buf_size > 4099 ? buf_size : 4099);
+  if (!source || !buf)
+    return 1;
+  srand (1);
+  for (i = 0; i < SOURCE_SIZE; i++)
+    source[i] = rand ();
+
+  check (buf);
+
+  /* letter size, 3 samples of 2 bytes per pixel */
+  page_bytes = (size_t) (8.5 * dpi) * 6 * (size_t) (11 * dpi);
+  legacy_ms = run (legacy_read, page_bytes, buf, buf_size, NULL);
+  swap_ms = run (swap_read, page_bytes, buf, buf_size, NULL);
+  printf ("48 bit RGB at %d dpi: %.1f MB in %lu byte reads of %lu byte "
+	  "records\n", dpi, page_bytes / 1e6, (u_long) buf_size,
+	  (u_long) chunk);
+  printf ("%-16s %8.1f ms %8.1f MB/s\n", "legacy", legacy_ms,
+	  page_bytes / 1000.0 / legacy_ms);
+  printf ("%-16s %8.1f ms %8.1f MB/s\n", "sanei_swap_16", swap_ms,
+	  page_bytes / 1000.0 / swap_ms);
+  free (buf);
+  free (source);
+  return 0;
+}
@@ -0,0 +1,233 @@
+#include "../../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* sane includes for the sanei functions called */
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_compress.h"
+
+#define PAGE_SIZE (256 * 1024)
+
+static SANE_Byte page[PAGE_SIZE];
+static SANE_Byte packed[PAGE_SIZE + PAGE_SIZE / 128 + 16];
+static SANE_Byte unpacked[PAGE_SIZE];
+
+/* Compresses LEN bytes of page with CODEC, checks the result unpacks to
+   the same data and returns the compressed length. */
+static size_t
+round_trip (SANEI_Compress_Codec codec, size_t len)
+{
+  size_t n;
+  SANE_Status status;
+
+  n = sanei_compress (codec, page, len, packed, sanei_compress_bound (len));
+  assert (n > 0 || len == 0);
+  assert (n <= sanei_compress_bound (len));
+
+  memset (unpacked, 0xaa, sizeof (unpacked));
+  status = sanei_decompress (codec, packed, n, unpacked, len);
+  assert (status == SANE_STATUS_GOOD);
+  assert (memcmp (page, unpacked, len) == 0);
+  return n;
+}
+
+/* lineart: mostly white, a few black runs per line */
+static void
+fill_lineart (void)
+{
+  int i;
+
+  memset (page, 0, sizeof (page));
+  for (i = 0; i < PAGE_SIZE; i += 300)
+    {
+      memset (page + i + 20, 0xff, 7);
+      page[i + 100] = 0x3c;
+      page[i + 101] = 0x81;
+    }
+}
+
+/* gray: smooth gradients with a little noise */
+static void
+fill_gray (void)
+{
+  int i;
+
+  srand (1);
+  for (i = 0; i < PAGE_SIZE; i++)
+    page[i] = (SANE_Byte) ((i % 2400) / 10 + (rand () % 4 == 0));
+}
+
+static void
+fill_random (void)
+{
+  int i;
+
+  srand (2);
+  for (i = 0; i < PAGE_SIZE; i++)
+    page[i] = (SANE_Byte) rand ();
+}
+
+/******************************/
+/* start of tests definitions */
+/******************************/
+
+static void
+codec_for_depth (void)
+{
+  assert (sanei_compress_codec (1) == SANEI_COMPRESS_RLE);
+  assert (sanei_compress_codec (8) == SANEI_COMPRESS_LZ);
+  assert (sanei_compress_codec (16) == SANEI_COMPRESS_LZ);
+}
+
+static void
+rle_lineart (void)
+{
+  fill_lineart ();
+  assert (round_trip (SANEI_COMPRESS_RLE, PAGE_SIZE) < PAGE_SIZE / 10);
+}
+
+static void
+lz_lineart (void)
+{
+  fill_lineart ();
+  assert (round_trip (SANEI_COMPRESS_LZ, PAGE_SIZE) < PAGE_SIZE / 10);
+}
+
+static void
+lz_gray (void)
+{
+  fill_gray ();
+  assert (round_trip (SANEI_COMPRESS_LZ, PAGE_SIZE) < PAGE_SIZE);
+}
+
+static void
+random_data (void)
+{
+  fill_random ();
+  round_trip (SANEI_COMPRESS_RLE, PAGE_SIZE);
+  round_trip (SANEI_COMPRESS_LZ, PAGE_SIZE);
+}
+
+/* every length up to a few sequences, to hit the block end rules */
+static void
+short_blocks (void)
+{
+  size_t len;
+
+  fill_gray ();
+  memset (page + 8, 0, 40);
+  for (len = 0; len < 100; len++)
+    {
+      round_trip (SANEI_COMPRESS_RLE, len);
+      round_trip (SANEI_COMPRESS_LZ, len);
+    }
+}
+
+/* long runs need extended lengths in LZ and several runs in RLE */
+static void
+long_runs (void)
+{
+  memset (page, 0x55, PAGE_SIZE);
+  assert (round_trip (SANEI_COMPRESS_RLE, PAGE_SIZE) < PAGE_SIZE / 60);
+  assert (round_trip (SANEI_COMPRESS_LZ, PAGE_SIZE) < PAGE_SIZE / 200);
+}
+
+static void
+output_too_small (void)
+{
+  fill_random ();
+  assert (sanei_compress (SANEI_COMPRESS_RLE, page, 1000, packed, 500) == 0);
+  assert (sanei_compress (SANEI_COMPRESS_LZ, page, 1000, packed, 500) == 0);
+}
+
+static void
+unknown_codec (void)
+{
+  assert (sanei_compress ((SANEI_Compress_Codec) 99, page, 10, packed,
+			  sizeof (packed)) == 0);
+  assert (sanei_decompress ((SANEI_Compress_Codec) 99, packed, 10, unpacked,
+			    10) == SANE_STATUS_UNSUPPORTED);
+}
+
+static void
+stored (void)
+{
+  fill_gray ();
+  assert (sanei_decompress (SANEI_COMPRESS_NONE, page, 1000, unpacked, 1000)
+	  == SANE_STATUS_GOOD);
+  assert (memcmp (page, unpacked, 1000) == 0);
+  assert (sanei_decompress (SANEI_COMPRESS_NONE, page, 1000, unpacked, 999)
+	  == SANE_STATUS_IO_ERROR);
+}
+
+/* truncated or damaged input must be reported, not overrun a buffer */
+static void
+corrupt_data (void)
+{
+  size_t n, i;
+  SANE_Status status;
+
+  fill_gray ();
+  n = sanei_compress (SANEI_COMPRESS_LZ, page, 4096, packed, sizeof (packed));
+  status = sanei_decompress (SANEI_COMPRESS_LZ, packed, n - 1, unpacked,
+			     4096);
+  assert (status == SANE_STATUS_IO_ERROR);
+  status = sanei_decompress (SANEI_COMPRESS_LZ, packed, n, unpacked, 4095);
+  assert (status == SANE_STATUS_IO_ERROR);
+  status = sanei_decompress (SANEI_COMPRESS_LZ, packed, n, unpacked, 4097);
+  assert (status == SANE_STATUS_IO_ERROR);
+
+  /* an offset before the start of the output */
+  packed[0] = 0x10;
+  packed[1] = 'a';
+  packed[2] = 2;
+  packed[3] = 0;
+  status = sanei_decompress (SANEI_COMPRESS_LZ, packed, 4, unpacked, 5);
+  assert (status == SANE_STATUS_IO_ERROR);
+
+  /* a run longer than the output */
+  packed[0] = 129;
+  packed[1] = 0;
+  status = sanei_decompress (SANEI_COMPRESS_RLE, packed, 2, unpacked, 100);
+  assert (status == SANE_STATUS_IO_ERROR);
+
+  /* random garbage never decodes out of bounds */
+  srand (3);
+  for (i = 0; i < 1000; i++)
+    {
+      for (n = 0; n < 64; n++)
+	packed[n] = (SANE_Byte) rand ();
+      sanei_decompress (SANEI_COMPRESS_LZ, packed, 64, unpacked, 256);
+      sanei_decompress (SANEI_COMPRESS_RLE, packed, 64, unpacked, 256);
+    }
+}
+
+static void
+sanei_compress_suite (void)
+{
+  codec_for_depth ();
+  rle_lineart ();
+  lz_lineart ();
+  lz_gray ();
+  random_data ();
+  short_blocks ();
+  long_runs ();
+  output_too_small ();
+  unknown_codec ();
+  stored ();
+  corrupt_data ();
+}
+
+/**
+ * main function to run the test suites
+ */
+int
+main (void)
+{
+  /* run suites */
+  sanei_compress_suite ();
+
+  return 0;
+}
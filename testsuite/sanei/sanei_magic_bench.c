@@ -0,0 +1,521 @@
+/* Benchmark for the deskew rotation of sanei_magic.
+
+   A page skewed by a few degrees on a dark background, like an ADF
+   scanner with a black backing delivers it, is rotated back with
+   sanei_magic_rotate() and with bilinear interpolation, in lineart,
+   grayscale and color.  For comparison the previous implementation is
+   kept here: doubles and bounds checks for every pixel, into a second
+   page that is copied back.  The nearest neighbor results of both are
+   compared; they may only differ where a source coordinate is within
+   rounding error of a pixel boundary.
+
+   Before the rotation, sanei_magic_findSkew2() and
+   sanei_magic_findEdges2() are timed at each scale of the smaller copy,
+   scale 1 being the full image, with the error of the slope found.
+   The same analysis of a page written line by line to a stream is timed
+   against sanei_magic_isBlank2(), findEdges() and findSkew() on the
+   whole page.
+
+   Last, duplex pages are deskewed, cropped and despeckled the way the
+   kvs1025 backend does it, once one side after the other and once with
+   the back side handed to a sanei_pool worker while the front is
+   finished and read, and the pages per minute of both are printed.
+
+   Usage: sanei_magic_bench [-d dpi] [-a degrees] */
+
+#include "../../include/sane/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_magic.h"
+#include "../include/sane/sanei_pool.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* each rotation is timed this many times, the best counts */
+#define RUNS 3
+#define DUPLEX_PAGES 4
+
+/* sanei_magic_rotate() before the fixed point version */
+static void
+legacy_rotate (SANE_Parameters * params, SANE_Byte * buffer,
+	       int centerX, int centerY, double slope, int bg_color)
+{
+  double slopeRad = -atan (slope);
+  double slopeSin = sin (slopeRad);
+  double slopeCos = cos (slopeRad);
+  int pwidth = params->pixels_per_line;
+  int bwidth = params->bytes_per_line;
+  int height = params->lines;
+  int depth = 1;
+  unsigned char *outbuf;
+  int i, j, k;
+
+  outbuf = malloc (bwidth * height);
+  if (!outbuf)
+    exit (1);
+
+  if (params->format == SANE_FRAME_RGB || params->depth == 8)
+    {
+      if (params->format == SANE_FRAME_RGB)
+	depth = 3;
+      memset (outbuf, bg_color, bwidth * height);
+      for (i = 0; i < height; i++)
+	{
+	  int shiftY = centerY - i;
+
+	  for (j = 0; j < pwidth; j++)
+	    {
+	      int shiftX = centerX - j;
+	      int sourceX, sourceY;
+
+	      sourceX = centerX - (int) (shiftX * slopeCos + shiftY * slopeSin);
+	      if (sourceX < 0 || sourceX >= pwidth)
+		continue;
+	      sourceY = centerY + (int) (-shiftY * slopeCos + shiftX * slopeSin);
+	      if (sourceY < 0 || sourceY >= height)
+		continue;
+	      for (k = 0; k < depth; k++)
+		outbuf[i * bwidth + j * depth + k]
+		  = buffer[sourceY * bwidth + sourceX * depth + k];
+	    }
+	}
+    }
+  else
+    {
+      if (bg_color)
+	bg_color = 0xff;
+      memset (outbuf, bg_color, bwidth * height);
+      for (i = 0; i < height; i++)
+	{
+	  int shiftY = centerY - i;
+
+	  for (j = 0; j < pwidth; j++)
+	    {
+	      int shiftX = centerX - j;
+	      int sourceX, sourceY;
+
+	      sourceX = centerX - (int) (shiftX * slopeCos + shiftY * slopeSin);
+	      if (sourceX < 0 || sourceX >= pwidth)
+		continue;
+	      sourceY = centerY + (int) (-shiftY * slopeCos + shiftX * slopeSin);
+	      if (sourceY < 0 || sourceY >= height)
+		continue;
+	      outbuf[i * bwidth + j / 8] &= ~(1 << (7 - (j % 8)));
+	      outbuf[i * bwidth + j / 8] |=
+		((buffer[sourceY * bwidth + sourceX / 8]
+		  >> (7 - (sourceX % 8))) & 1) << (7 - (j % 8));
+	    }
+	}
+    }
+  memcpy (buffer, outbuf, bwidth * height);
+  free (outbuf);
+}
+
+static double
+now_ms (void)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+}
+
+/* An A4 page at DPI, rotated by DEGREES around its center, on a dark
+   background: light paper with lines of dark "words" on it. */
+static SANE_Byte *
+make_page (SANE_Parameters * params, SANE_Frame format, int depth, int dpi,
+	   double degrees)
+{
+  double a = degrees * M_PI / 180, ca = cos (a), sa = sin (a);
+  int pw = (int) (8.27 * dpi), h = (int) (11.69 * dpi);
+  int margin = dpi / 4, line = dpi / 6, word = dpi / 3;
+  int pagew = pw - 2 * margin, pageh = h - 2 * margin;
+  SANE_Byte *buf;
+  int i, j;
+
+  params->format = format;
+  params->depth = depth;
+  params->pixels_per_line = pw;
+  params->lines = h;
+  params->last_frame = SANE_TRUE;
+  if (depth == 1)
+    params->bytes_per_line = (pw + 7) / 8;
+  else
+    params->bytes_per_line = pw * (format == SANE_FRAME_RGB ? 3 : 1);
+
+  buf = calloc (params->bytes_per_line, h);
+  if (!buf)
+    exit (1);
+
+  for (i = 0; i < h; i++)
+    for (j = 0; j < pw; j++)
+      {
+	/* position on the page */
+	double dx = j - pw / 2.0, dy = i - h / 2.0;
+	double x = dx * ca + dy * sa + pagew / 2.0;
+	double y = -dx * sa + dy * ca + pageh / 2.0;
+	int v = 24, px = (int) x, py = (int) y;
+
+	if (x >= 0 && x < pagew && y >= 0 && y < pageh)
+	  {
+	    v = 235;
+	    if (px > margin && px < pagew - margin && py > margin
+		&& py < pageh - margin && py % line < line / 3
+		&& (px / word * 7 + py / line * 3) % 5 != 0
+		&& px % word < word * 4 / 5)
+	      v = 40;
+	  }
+
+	if (depth == 1)
+	  {
+	    if (v < 128)
+	      buf[i * params->bytes_per_line + j / 8] |= 0x80 >> (j % 8);
+	  }
+	else if (format == SANE_FRAME_RGB)
+	  {
+	    SANE_Byte *p = buf + i * params->bytes_per_line + j * 3;
+	    p[0] = v;
+	    p[1] = v * 7 / 8;
+	    p[2] = v * 3 / 4;
+	  }
+	else
+	  buf[i * params->bytes_per_line + j] = v;
+      }
+  return buf;
+}
+
+/* pixels (not bytes) that differ between A and B */
+static long
+count_diffs (SANE_Parameters * params, SANE_Byte * a, SANE_Byte * b)
+{
+  int bpp = params->format == SANE_FRAME_RGB ? 3 : 1;
+  long n = 0;
+  int i, j;
+
+  for (i = 0; i < params->lines; i++)
+    for (j = 0; j < params->pixels_per_line; j++)
+      {
+	size_t o = (size_t) i * params->bytes_per_line;
+
+	if (params->depth == 1)
+	  n += ((a[o + j / 8] ^ b[o + j / 8]) >> (7 - j % 8)) & 1;
+	else
+	  n += memcmp (a + o + j * bpp, b + o + j * bpp, bpp) != 0;
+      }
+  return n;
+}
+
+#define LEGACY 0
+#define NEAREST 1
+#define BILINEAR 2
+
+/* best time of RUNS rotations of PAGE by one of the above, the result
+   is left in OUT */
+static double
+time_rotate (int how, SANE_Parameters * params, SANE_Byte * page,
+	     SANE_Byte * out, int cx, int cy, double slope)
+{
+  size_t size = (size_t) params->bytes_per_line * params->lines;
+  double t, best = 0;
+  SANE_Status status = SANE_STATUS_GOOD;
+  int i;
+
+  for (i = 0; i < RUNS; i++)
+    {
+      memcpy (out, page, size);
+      t = now_ms ();
+      if (how == LEGACY)
+	legacy_rotate (params, out, cx, cy, slope, 0xff);
+      else
+	status = sanei_magic_rotate2 (params, out, cx, cy, slope, 0xff,
+				      how == NEAREST ? SANEI_MAGIC_NEAREST
+				      : SANEI_MAGIC_BILINEAR);
+      t = now_ms () - t;
+      if (status != SANE_STATUS_GOOD)
+	{
+	  fprintf (stderr, "sanei_magic_rotate2 failed: %d\n", status);
+	  exit (1);
+	}
+      if (i == 0 || t < best)
+	best = t;
+    }
+  return best;
+}
+
+/* skew and edge detection at scale 1, 2, 4 and 8; fails if a scale
+   finds a clearly different slope than the full image */
+static int
+bench_detect (SANE_Parameters * params, SANE_Byte * page, int dpi,
+	      double degrees)
+{
+  double skew_ms[4], edges_ms[4], error[4], slope = 0, t;
+  SANE_Status status[4];
+  int cx, cy, top, bot, left, right, i, failed = 0;
+
+  for (i = 0; i < 4; i++)
+    {
+      t = now_ms ();
+      status[i] = sanei_magic_findSkew2 (params, page, dpi, dpi, &cx, &cy,
+					 &slope, 1 << i);
+      skew_ms[i] = now_ms () - t;
+      error[i] = status[i] ? 0 : atan (slope) * 180 / M_PI - degrees;
+
+      t = now_ms ();
+      sanei_magic_findEdges2 (params, page, dpi, dpi, &top, &bot, &left,
+			      &right, 1 << i);
+      edges_ms[i] = now_ms () - t;
+
+      if (i && status[i] != status[0])
+	failed = 1;
+      if (i && !status[i] && fabs (error[i]) > fabs (error[0]) + 0.05)
+	failed = 1;
+    }
+
+  printf ("         skew  ");
+  for (i = 0; i < 4; i++)
+    printf (" %d: %6.1f ms %+.3f", 1 << i, skew_ms[i], error[i]);
+  printf ("\n         edges ");
+  for (i = 0; i < 4; i++)
+    printf (" %d: %6.1f ms       ", 1 << i, edges_ms[i]);
+  printf ("\n");
+  return failed;
+}
+
+/* analysis of the whole page against writing it to a stream a line at a
+   time; fails if they disagree */
+static int
+bench_stream (SANE_Parameters * params, SANE_Byte * page, int dpi)
+{
+  SANEI_Magic_Stream *s;
+  SANE_Status blank, edges, skew;
+  int t[4], st[4], cx, cy, scx, scy, i;
+  double slope = 0, sslope = 0, page_ms, stream_ms, write_ms;
+
+  page_ms = now_ms ();
+  blank = sanei_magic_isBlank2 (params, page, dpi, dpi, 10);
+  edges = sanei_magic_findEdges (params, page, dpi, dpi,
+				 t, t + 1, t + 2, t + 3);
+  skew = sanei_magic_findSkew (params, page, dpi, dpi, &cx, &cy, &slope);
+  page_ms = now_ms () - page_ms;
+
+  stream_ms = now_ms ();
+  if (sanei_magic_streamOpen (params, dpi, dpi, &s))
+    exit (1);
+  for (i = 0; i < params->lines; i++)
+    sanei_magic_streamWrite (s, page + (size_t) i * params->bytes_per_line,
+			     params->bytes_per_line);
+  sanei_magic_streamFinish (s);
+  write_ms = now_ms () - stream_ms;
+  if (sanei_magic_streamIsBlank (s, 10) != blank
+      || sanei_magic_streamFindEdges (s, st, st + 1, st + 2, st + 3) != edges
+      || sanei_magic_streamFindSkew (s, &scx, &scy, &sslope) != skew)
+    return 1;
+  stream_ms = now_ms () - stream_ms;
+  sanei_magic_streamClose (s);
+
+  printf ("         page   %7.1f ms  stream %7.1f ms, %.1f ms writing\n",
+	  page_ms, stream_ms, write_ms);
+
+  return (!edges && memcmp (t, st, sizeof (t)))
+    || (!skew && (cx != scx || cy != scy || slope != sslope));
+}
+
+/* one duplex page, and the values the back side borrows from the front */
+typedef struct
+{
+  SANE_Parameters params[2];
+  SANE_Byte *buf[2];
+  SANE_Status skew, edges;
+  int cx, cy, top, bot, left, right;
+  double slope;
+} Duplex;
+
+static SANE_Status
+duplex_back (void *arg)
+{
+  Duplex *d = arg;
+  SANE_Parameters *p = d->params + 1;
+  int w = p->pixels_per_line;
+
+  if (!d->skew)
+    sanei_magic_rotate (p, d->buf[1], w - d->cx, d->cy, -d->slope, 0xd6);
+  if (!d->edges)
+    sanei_magic_crop (p, d->buf[1], d->top, d->bot, w - d->right,
+		      w - d->left);
+  sanei_magic_despeck (p, d->buf[1], 2);
+  return SANE_STATUS_GOOD;
+}
+
+/* the front side, the back side inline or in POOL, and the frontend
+   reading both into SINK; returns the time taken */
+static double
+duplex_page (Duplex * d, int dpi, SANEI_Pool * pool, SANE_Byte * sink)
+{
+  SANE_Parameters *p = d->params;
+  SANEI_Pool_Job *job = NULL;
+  double t = now_ms ();
+
+  d->skew = sanei_magic_findSkew (p, d->buf[0], dpi, dpi, &d->cx, &d->cy,
+				  &d->slope);
+  if (!d->skew)
+    sanei_magic_rotate (p, d->buf[0], d->cx, d->cy, d->slope, 0xd6);
+  d->edges = sanei_magic_findEdges (p, d->buf[0], dpi, dpi, &d->top,
+				    &d->bot, &d->left, &d->right);
+  if (!d->edges)
+    sanei_magic_crop (p, d->buf[0], d->top, d->bot, d->left, d->right);
+
+  if (!pool || sanei_pool_submit (pool, duplex_back, d, &job))
+    duplex_back (d);
+
+  sanei_magic_despeck (p, d->buf[0], 2);
+  memcpy (sink, d->buf[0], (size_t) p->bytes_per_line * p->lines);
+
+  if (job)
+    sanei_pool_join (job);
+  memcpy (sink, d->buf[1], (size_t) p[1].bytes_per_line * p[1].lines);
+
+  return now_ms () - t;
+}
+
+/* pages per minute with and without a worker for the back side; fails
+   if the two don't give the same images */
+static int
+bench_duplex (SANE_Frame format, int depth, int dpi, double degrees)
+{
+  SANE_Parameters params[2];
+  SANE_Byte *page[2], *sink;
+  Duplex seq, par;
+  SANEI_Pool *pool;
+  double seq_ms = 0, par_ms = 0;
+  size_t size;
+  int i, s, failed = 0;
+
+  page[0] = make_page (params, format, depth, dpi, degrees);
+  page[1] = make_page (params + 1, format, depth, dpi, -degrees);
+  size = (size_t) params[0].bytes_per_line * params[0].lines;
+  seq.buf[0] = malloc (size);
+  seq.buf[1] = malloc (size);
+  par.buf[0] = malloc (size);
+  par.buf[1] = malloc (size);
+  sink = malloc (size);
+  if (!seq.buf[0] || !seq.buf[1] || !par.buf[0] || !par.buf[1] || !sink
+      || sanei_pool_create (1, &pool))
+    exit (1);
+
+  for (i = 0; i < DUPLEX_PAGES; i++)
+    {
+      for (s = 0; s < 2; s++)
+	{
+	  seq.params[s] = par.params[s] = params[s];
+	  memcpy (seq.buf[s], page[s], size);
+	  memcpy (par.buf[s], page[s], size);
+	}
+      seq_ms += duplex_page (&seq, dpi, NULL, sink);
+      par_ms += duplex_page (&par, dpi, pool, sink);
+
+      for (s = 0; s < 2; s++)
+	if (memcmp (&seq.params[s], &par.params[s], sizeof (params[s]))
+	    || memcmp (seq.buf[s], par.buf[s],
+		       (size_t) seq.params[s].bytes_per_line
+		       * seq.params[s].lines))
+	  failed = 1;
+    }
+
+  printf ("         duplex one side after the other %5.1f ppm, "
+	  "back side in %d worker %5.1f ppm\n",
+	  DUPLEX_PAGES * 60000.0 / seq_ms, sanei_pool_threads (pool),
+	  DUPLEX_PAGES * 60000.0 / par_ms);
+
+  sanei_pool_destroy (pool);
+  free (page[0]);
+  free (page[1]);
+  free (seq.buf[0]);
+  free (seq.buf[1]);
+  free (par.buf[0]);
+  free (par.buf[1]);
+  free (sink);
+  return failed;
+}
+
+static int
+bench (const char *name, SANE_Frame format, int depth, int dpi,
+       double degrees)
+{
+  SANE_Parameters params;
+  SANE_Byte *page, *ref, *work;
+  double slope = tan (degrees * M_PI / 180), legacy_ms, rotate_ms;
+  double bilinear_ms;
+  int cx, cy, failed;
+  long diffs, pixels;
+
+  page = make_page (&params, format, depth, dpi, degrees);
+  pixels = (long) params.pixels_per_line * params.lines;
+  cx = params.pixels_per_line / 2;
+  cy = params.lines / 2;
+  ref = malloc ((size_t) params.bytes_per_line * params.lines);
+  work = malloc ((size_t) params.bytes_per_line * params.lines);
+  if (!ref || !work)
+    exit (1);
+
+  legacy_ms = time_rotate (LEGACY, &params, page, ref, cx, cy, slope);
+  bilinear_ms = time_rotate (BILINEAR, &params, page, work, cx, cy, slope);
+  rotate_ms = time_rotate (NEAREST, &params, page, work, cx, cy, slope);
+  diffs = count_diffs (&params, ref, work);
+
+  printf ("%-8s %5dx%-5d legacy %7.1f ms  rotate %7.1f ms (%3.1fx)  "
+	  "bilinear %7.1f ms  %ld pixels differ\n", name,
+	  params.pixels_per_line, params.lines, legacy_ms, rotate_ms,
+	  legacy_ms / rotate_ms, bilinear_ms, diffs);
+
+  failed = bench_detect (&params, page, dpi, degrees);
+  failed |= bench_stream (&params, page, dpi);
+  failed |= bench_duplex (format, depth, dpi, degrees);
+
+  free (page);
+  free (ref);
+  free (work);
+
+  /* more than rounding noise means the sampling is broken */
+  return failed || diffs > pixels / 10000;
+}
+
+int
+main (int argc, char **argv)
+{
+  int dpi = 600, opt, failed = 0;
+  double degrees = 3.5;
+
+  while ((opt = getopt (argc, argv, "d:a:")) != -1)
+    {
+      switch (opt)
+	{
+	case 'd':
+	  dpi = atoi (optarg);
+	  break;
+	case 'a':
+	  degrees = atof (optarg);
+	  break;
+	default:
+	  fprintf (stderr, "usage: %s [-d dpi] [-a degrees]\n", argv[0]);
+	  return 1;
+	}
+    }
+  if (dpi < 10)
+    return 1;
+
+  sanei_magic_init ();
+  printf ("A4 at %d dpi, skewed by %.2f degrees\n", dpi, degrees);
+  failed |= bench ("lineart", SANE_FRAME_GRAY, 1, dpi, degrees);
+  failed |= bench ("gray", SANE_FRAME_GRAY, 8, dpi, degrees);
+  failed |= bench ("color", SANE_FRAME_RGB, 8, dpi, degrees);
+  return failed;
+}
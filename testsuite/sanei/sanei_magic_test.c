@@ -0,0 +1,872 @@
+#include "../../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+/* sane includes for the sanei functions called */
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_magic.h"
+
+/* sanei_magic_despeck() before it kept per-column summaries; the new one
+   has to give the same image, pixel for pixel */
+static void
+legacy_despeck (SANE_Parameters * params, SANE_Byte * buffer, int diam)
+{
+  int pw = params->pixels_per_line;
+  int bw = params->bytes_per_line;
+  int h = params->lines;
+  int bt = bw * h;
+  int i, j, k, l, n;
+
+  if (params->format == SANE_FRAME_RGB)
+    {
+      for (i = bw; i < bt - bw - (bw * diam); i += bw)
+	for (j = 1; j < pw - 1 - diam; j++)
+	  {
+	    int thresh = 255 * 3;
+	    int outer[] = { 0, 0, 0 };
+	    int hits = 0;
+
+	    for (k = 0; k < diam; k++)
+	      for (l = 0; l < diam; l++)
+		{
+		  int tmp = 0;
+
+		  for (n = 0; n < 3; n++)
+		    tmp += buffer[i + j * 3 + k * bw + l * 3 + n];
+		  if (tmp < thresh)
+		    thresh = tmp;
+		}
+
+	    thresh = (thresh + 255 * 3 + 255 * 3) / 3;
+
+	    for (k = -1; k < diam + 1; k++)
+	      for (l = -1; l < diam + 1; l++)
+		{
+		  int tmp[3];
+
+		  if (k != -1 && k != diam && l != -1 && l != diam)
+		    continue;
+		  for (n = 0; n < 3; n++)
+		    {
+		      tmp[n] = buffer[i + j * 3 + k * bw + l * 3 + n];
+		      outer[n] += tmp[n];
+		    }
+		  if (tmp[0] + tmp[1] + tmp[2] < thresh)
+		    {
+		      hits++;
+		      break;
+		    }
+		}
+
+	    if (!hits)
+	      {
+		for (n = 0; n < 3; n++)
+		  outer[n] /= (4 * diam + 4);
+		for (k = 0; k < diam; k++)
+		  for (l = 0; l < diam; l++)
+		    for (n = 0; n < 3; n++)
+		      buffer[i + j * 3 + k * bw + l * 3 + n] = outer[n];
+	      }
+	  }
+    }
+  else if (params->depth == 8)
+    {
+      for (i = bw; i < bt - bw - (bw * diam); i += bw)
+	for (j = 1; j < pw - 1 - diam; j++)
+	  {
+	    int thresh = 255;
+	    int outer = 0;
+	    int hits = 0;
+
+	    for (k = 0; k < diam; k++)
+	      for (l = 0; l < diam; l++)
+		if (buffer[i + j + k * bw + l] < thresh)
+		  thresh = buffer[i + j + k * bw + l];
+
+	    thresh = (thresh + 255 + 255) / 3;
+
+	    for (k = -1; k < diam + 1; k++)
+	      for (l = -1; l < diam + 1; l++)
+		{
+		  int tmp;
+
+		  if (k != -1 && k != diam && l != -1 && l != diam)
+		    continue;
+		  tmp = buffer[i + j + k * bw + l];
+		  if (tmp < thresh)
+		    {
+		      hits++;
+		      break;
+		    }
+		  outer += tmp;
+		}
+
+	    if (!hits)
+	      {
+		outer /= (4 * diam + 4);
+		for (k = 0; k < diam; k++)
+		  for (l = 0; l < diam; l++)
+		    buffer[i + j + k * bw + l] = outer;
+	      }
+	  }
+    }
+  else
+    {
+      for (i = bw; i < bt - bw - (bw * diam); i += bw)
+	for (j = 1; j < pw - 1 - diam; j++)
+	  {
+	    int curr = 0;
+	    int hits = 0;
+
+	    for (k = 0; k < diam; k++)
+	      for (l = 0; l < diam; l++)
+		curr += buffer[i + k * bw + (j + l) / 8] >> (7 - (j + l) % 8) & 1;
+
+	    if (!curr)
+	      continue;
+
+	    for (k = -1; k < diam + 1; k++)
+	      for (l = -1; l < diam + 1; l++)
+		{
+		  if (k != -1 && k != diam && l != -1 && l != diam)
+		    continue;
+		  hits += buffer[i + k * bw + (j + l) / 8] >> (7 - (j + l) % 8) & 1;
+		  if (hits)
+		    break;
+		}
+
+	    if (!hits)
+	      for (k = 0; k < diam; k++)
+		for (l = 0; l < diam; l++)
+		  buffer[i + k * bw + (j + l) / 8] &= ~(1 << (7 - (j + l) % 8));
+	  }
+    }
+}
+
+static unsigned int seed = 1;
+
+/* deterministic, so a failure can be reproduced */
+static int
+next_random (int n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) % n;
+}
+
+/* light paper with some noise, lines of dark text, specks of various
+   sizes and some perfectly white areas; PAD extra bytes per line */
+static SANE_Byte *
+make_page (SANE_Parameters * params, SANE_Frame format, int depth,
+	   int pw, int h, int pad)
+{
+  int bpp = format == SANE_FRAME_RGB ? 3 : 1;
+  SANE_Byte *buf;
+  int i, j, n, s;
+
+  params->format = format;
+  params->depth = depth;
+  params->pixels_per_line = pw;
+  params->lines = h;
+  params->last_frame = SANE_TRUE;
+  params->bytes_per_line = (depth == 1 ? (pw + 7) / 8 : pw * bpp) + pad;
+
+  buf = malloc (params->bytes_per_line * h);
+  assert (buf);
+
+  if (depth == 1)
+    {
+      memset (buf, 0, params->bytes_per_line * h);
+      for (i = 0; i < h; i++)
+	for (j = 0; j < pw; j++)
+	  if ((i % 17 < 4 && j % 23 < 15) || next_random (40) == 0)
+	    buf[i * params->bytes_per_line + j / 8] |= 0x80 >> (j % 8);
+    }
+  else
+    for (i = 0; i < h; i++)
+      for (j = 0; j < pw; j++)
+	{
+	  SANE_Byte *p = buf + i * params->bytes_per_line + j * bpp;
+	  int v = 255;
+
+	  if (i % 29 < 6 && j % 31 < 20)
+	    v = 20 + next_random (40);
+	  else if (i < h / 2 || j % 64 > 40)
+	    v = 225 + next_random (31);
+	  for (n = 0; n < bpp; n++)
+	    p[n] = v - (v == 255 ? 0 : next_random (8));
+	}
+
+  /* specks from 1 to 12 pixels, if they fit */
+  for (s = 0; pw > 12 && h > 12 && s < pw * h / 200; s++)
+    {
+      int size = 1 + next_random (12);
+      int x = next_random (pw - size), y = next_random (h - size);
+      int v = next_random (200);
+
+      for (i = y; i < y + size; i++)
+	for (j = x; j < x + size; j++)
+	  {
+	    if (depth == 1)
+	      buf[i * params->bytes_per_line + j / 8] |= 0x80 >> (j % 8);
+	    else
+	      for (n = 0; n < bpp; n++)
+		buf[i * params->bytes_per_line + j * bpp + n] = v + n * 10;
+	  }
+    }
+  return buf;
+}
+
+static void
+check_despeck (SANE_Frame format, int depth, int pw, int h, int pad,
+	       int diam)
+{
+  SANE_Parameters params;
+  SANE_Byte *page, *ref;
+  size_t size;
+  SANE_Status status;
+
+  page = make_page (&params, format, depth, pw, h, pad);
+  size = params.bytes_per_line * h;
+  ref = malloc (size);
+  assert (ref);
+  memcpy (ref, page, size);
+
+  legacy_despeck (&params, ref, diam);
+  status = sanei_magic_despeck (&params, page, diam);
+  assert (status == SANE_STATUS_GOOD);
+  assert (memcmp (page, ref, size) == 0);
+
+  free (page);
+  free (ref);
+}
+
+static void
+test_despeck_gray (void)
+{
+  int diam;
+
+  for (diam = 1; diam <= 10; diam++)
+    check_despeck (SANE_FRAME_GRAY, 8, 203, 150, 0, diam);
+  check_despeck (SANE_FRAME_GRAY, 8, 97, 61, 5, 3);
+}
+
+static void
+test_despeck_color (void)
+{
+  int diam;
+
+  for (diam = 1; diam <= 10; diam++)
+    check_despeck (SANE_FRAME_RGB, 8, 157, 120, 0, diam);
+  check_despeck (SANE_FRAME_RGB, 8, 81, 57, 3, 4);
+}
+
+static void
+test_despeck_lineart (void)
+{
+  int diam;
+
+  for (diam = 1; diam <= 10; diam++)
+    check_despeck (SANE_FRAME_GRAY, 1, 237, 150, 0, diam);
+  check_despeck (SANE_FRAME_GRAY, 1, 90, 77, 2, 2);
+}
+
+/* pages too small for any window are left alone */
+static void
+test_despeck_small (void)
+{
+  check_despeck (SANE_FRAME_GRAY, 8, 5, 40, 0, 3);
+  check_despeck (SANE_FRAME_RGB, 8, 40, 5, 0, 3);
+  check_despeck (SANE_FRAME_GRAY, 1, 6, 6, 0, 3);
+  check_despeck (SANE_FRAME_GRAY, 8, 30, 30, 0, 0);
+}
+
+static void
+test_despeck_inval (void)
+{
+  SANE_Parameters params;
+  SANE_Byte buf[64];
+
+  params.format = SANE_FRAME_GRAY;
+  params.depth = 16;
+  params.pixels_per_line = 4;
+  params.bytes_per_line = 8;
+  params.lines = 8;
+  assert (sanei_magic_despeck (&params, buf, 1) == SANE_STATUS_INVAL);
+}
+
+/* a dark rectangle on white paper, rows [Y0,Y1) and columns [X0,X1) */
+static SANE_Byte *
+make_box (SANE_Parameters * params, SANE_Frame format, int depth,
+	  int pw, int h, int pad, int x0, int x1, int y0, int y1)
+{
+  int bpp = format == SANE_FRAME_RGB ? 3 : 1;
+  SANE_Byte *buf;
+  int i, j;
+
+  params->format = format;
+  params->depth = depth;
+  params->pixels_per_line = pw;
+  params->lines = h;
+  params->last_frame = SANE_TRUE;
+  params->bytes_per_line = (depth == 1 ? (pw + 7) / 8 : pw * bpp) + pad;
+
+  buf = malloc (params->bytes_per_line * h);
+  assert (buf);
+  memset (buf, depth == 1 ? 0 : 255, params->bytes_per_line * h);
+
+  for (i = y0; i < y1; i++)
+    for (j = x0; j < x1; j++)
+      {
+	if (depth == 1)
+	  buf[i * params->bytes_per_line + j / 8] |= 0x80 >> (j % 8);
+	else
+	  memset (buf + i * params->bytes_per_line + j * bpp, 0, bpp);
+      }
+  return buf;
+}
+
+/* the edges must not depend on how the lines are padded; with
+   bytes_per_line != pixels_per_line * bytes per pixel, getTransY used
+   to read the rows at the wrong offsets */
+static void
+check_edges (SANE_Frame format, int depth, int pw, int h, int pad)
+{
+  SANE_Parameters params;
+  SANE_Byte *page;
+  int x0 = pw / 8, x1 = pw - pw / 8, y0 = h / 4, y1 = h - h / 4;
+  int top, bot, left, right;
+  SANE_Status status;
+
+  page = make_box (&params, format, depth, pw, h, pad, x0, x1, y0, y1);
+  status = sanei_magic_findEdges (&params, page, 100, 100,
+				  &top, &bot, &left, &right);
+  assert (status == SANE_STATUS_GOOD);
+  assert (abs (top - y0) <= 3 && abs (bot - y1) <= 3);
+  assert (abs (left - x0) <= 3 && abs (right - x1) <= 3);
+
+  free (page);
+}
+
+static void
+test_edges_padded (void)
+{
+  check_edges (SANE_FRAME_GRAY, 8, 200, 150, 0);
+  check_edges (SANE_FRAME_GRAY, 8, 197, 150, 7);
+  check_edges (SANE_FRAME_RGB, 8, 161, 120, 5);
+  check_edges (SANE_FRAME_GRAY, 1, 240, 150, 0);
+  check_edges (SANE_FRAME_GRAY, 1, 237, 150, 0);
+  check_edges (SANE_FRAME_GRAY, 1, 233, 150, 3);
+}
+
+/* sanei_magic_rotate() before it worked in place on bands: source
+   coordinates in doubles, truncated towards the center of rotation */
+static SANE_Byte *
+legacy_rotate (SANE_Parameters * params, SANE_Byte * buffer,
+	       int cx, int cy, double slope, int bg_color)
+{
+  double a = -atan (slope), sa = sin (a), ca = cos (a);
+  int pw = params->pixels_per_line;
+  int bw = params->bytes_per_line;
+  int h = params->lines;
+  int bpp = params->format == SANE_FRAME_RGB ? 3 : 1;
+  SANE_Byte *out;
+  int i, j, n;
+
+  out = malloc (bw * h);
+  assert (out);
+  if (params->depth == 1 && bg_color)
+    bg_color = 0xff;
+  memset (out, bg_color, bw * h);
+
+  for (i = 0; i < h; i++)
+    for (j = 0; j < pw; j++)
+      {
+	int sx = cx - (int) ((cx - j) * ca + (cy - i) * sa);
+	int sy = cy + (int) (-(cy - i) * ca + (cx - j) * sa);
+
+	if (sx < 0 || sx >= pw || sy < 0 || sy >= h)
+	  continue;
+	if (params->depth == 1)
+	  {
+	    out[i * bw + j / 8] &= ~(0x80 >> (j % 8));
+	    if (buffer[sy * bw + sx / 8] & (0x80 >> (sx % 8)))
+	      out[i * bw + j / 8] |= 0x80 >> (j % 8);
+	  }
+	else
+	  for (n = 0; n < bpp; n++)
+	    out[i * bw + j * bpp + n] = buffer[sy * bw + sx * bpp + n];
+      }
+  return out;
+}
+
+/* a source coordinate this close to a whole number may be truncated to
+   either side: the fixed point steps of sanei_magic_rotate() are off by
+   up to ROT_SPAN (32) / 65536 pixels from the exact value */
+#define ROTATE_TIE 0.001
+
+static int
+rotate_tie (double v)
+{
+  return fabs (v - floor (v + 0.5)) < ROTATE_TIE;
+}
+
+/* sanei_magic_rotate() must give the pixels the old rotation gave,
+   except where a source coordinate is a tie, split in THREADS bands */
+static void
+check_rotate (SANE_Frame format, int depth, int pw, int h, int pad,
+	      int cx, int cy, double slope, int threads)
+{
+  double a = -atan (slope), sa = sin (a), ca = cos (a);
+  SANE_Parameters params;
+  SANE_Byte *page, *ref;
+  int bpp = format == SANE_FRAME_RGB ? 3 : 1;
+  int i, j, n, diff, ties = 0;
+
+  page = make_page (&params, format, depth, pw, h, pad);
+  ref = legacy_rotate (&params, page, cx, cy, slope, 0xff);
+
+  sanei_magic_setThreads (threads);
+  assert (sanei_magic_rotate (&params, page, cx, cy, slope, 0xff)
+	  == SANE_STATUS_GOOD);
+  sanei_magic_setThreads (0);
+
+  for (i = 0; i < h; i++)
+    for (j = 0; j < pw; j++)
+      {
+	int o = i * params.bytes_per_line;
+
+	if (depth == 1)
+	  diff = (page[o + j / 8] ^ ref[o + j / 8]) & (0x80 >> (j % 8));
+	else
+	  for (n = 0, diff = 0; n < bpp; n++)
+	    diff |= page[o + j * bpp + n] != ref[o + j * bpp + n];
+	if (!diff)
+	  continue;
+	assert (rotate_tie ((cx - j) * ca + (cy - i) * sa)
+		|| rotate_tie (-(cy - i) * ca + (cx - j) * sa));
+	ties++;
+      }
+  /* ties are rare, anything else is a wrong coordinate */
+  assert (ties <= pw * h / 1000);
+
+  free (page);
+  free (ref);
+}
+
+static void
+test_rotate_gray (void)
+{
+  check_rotate (SANE_FRAME_GRAY, 8, 300, 600, 0, 150, 300, 0.05, 1);
+  check_rotate (SANE_FRAME_GRAY, 8, 301, 600, 5, 150, 300, -0.1, 1);
+  check_rotate (SANE_FRAME_GRAY, 8, 301, 600, 5, -40, 650, 0.02, 1);
+}
+
+static void
+test_rotate_color (void)
+{
+  check_rotate (SANE_FRAME_RGB, 8, 200, 400, 0, 100, 200, -0.05, 1);
+  check_rotate (SANE_FRAME_RGB, 8, 203, 400, 3, 230, -20, 0.08, 1);
+}
+
+static void
+test_rotate_lineart (void)
+{
+  check_rotate (SANE_FRAME_GRAY, 1, 320, 600, 0, 160, 300, 0.05, 1);
+  check_rotate (SANE_FRAME_GRAY, 1, 317, 600, 2, 160, 300, -0.07, 1);
+  check_rotate (SANE_FRAME_GRAY, 1, 317, 600, 2, 350, 10, 0.03, 1);
+}
+
+/* bands of at least 256 rows: 3 of them, each reading rows the others
+   overwrite, with a slope large enough to reach past its neighbor */
+static void
+test_rotate_bands (void)
+{
+  check_rotate (SANE_FRAME_GRAY, 8, 301, 800, 5, 150, 400, 0.1, 3);
+  check_rotate (SANE_FRAME_GRAY, 8, 301, 800, 5, -60, 900, -0.3, 3);
+  check_rotate (SANE_FRAME_RGB, 8, 201, 800, 3, 100, 400, -0.05, 3);
+  check_rotate (SANE_FRAME_GRAY, 1, 317, 800, 2, 160, 400, 0.1, 3);
+  check_rotate (SANE_FRAME_GRAY, 1, 317, 1100, 0, 160, 550, 0.9, 4);
+}
+
+/* a page of text turned by DEGREES on a dark background, like an ADF
+   scanner with a black backing delivers it; without text if BLANK */
+static SANE_Byte *
+make_skewed_page (SANE_Parameters * params, SANE_Frame format, int depth,
+		  int dpi, double degrees, int blank)
+{
+  int bpp = format == SANE_FRAME_RGB ? 3 : 1;
+  double a = degrees * 3.14159265358979323846 / 180;
+  double ca = cos (a), sa = sin (a);
+  int pw = dpi * 4 + 3, h = dpi * 6;
+  int pagew = pw - dpi / 2, pageh = h - dpi / 2;
+  int line = dpi / 6, word = dpi / 3;
+  SANE_Byte *buf;
+  int i, j, n;
+
+  params->format = format;
+  params->depth = depth;
+  params->pixels_per_line = pw;
+  params->lines = h;
+  params->last_frame = SANE_TRUE;
+  params->bytes_per_line = depth == 1 ? (pw + 7) / 8 : pw * bpp;
+
+  buf = calloc (params->bytes_per_line, h);
+  assert (buf);
+
+  for (i = 0; i < h; i++)
+    for (j = 0; j < pw; j++)
+      {
+	double dx = j - pw / 2.0, dy = i - h / 2.0;
+	double x = dx * ca + dy * sa + pagew / 2.0;
+	double y = -dx * sa + dy * ca + pageh / 2.0;
+	int px = (int) x, py = (int) y;
+	int v = 24 + next_random (8);
+
+	if (x >= 0 && x < pagew && y >= 0 && y < pageh)
+	  {
+	    v = 240 + next_random (10);
+	    if (!blank && px > dpi / 2 && px < pagew - dpi / 2
+		&& py > dpi / 2 && py < pageh - dpi / 2
+		&& py % line < line / 3 && px % word < word * 4 / 5)
+	      v = 40;
+	  }
+
+	if (depth == 1)
+	  {
+	    if (v < 128)
+	      buf[i * params->bytes_per_line + j / 8] |= 0x80 >> (j % 8);
+	  }
+	else
+	  for (n = 0; n < bpp; n++)
+	    buf[i * params->bytes_per_line + j * bpp + n] = v - n * 5;
+      }
+  return buf;
+}
+
+/* write PAGE to a stream CHUNK bytes at a time, the height given to the
+   stream only if KNOWN */
+static SANEI_Magic_Stream *
+stream_page (SANE_Parameters * params, SANE_Byte * page, int dpi,
+	     int chunk, int known)
+{
+  SANE_Parameters sp = *params;
+  SANEI_Magic_Stream *s;
+  int size = params->bytes_per_line * params->lines;
+  int done;
+
+  if (!known)
+    sp.lines = -1;
+  assert (sanei_magic_streamOpen (&sp, dpi, dpi, &s) == SANE_STATUS_GOOD);
+  for (done = 0; done < size; done += chunk)
+    assert (sanei_magic_streamWrite (s, page + done,
+				     chunk < size - done ? chunk : size - done)
+	    == SANE_STATUS_GOOD);
+  assert (sanei_magic_streamFinish (s) == SANE_STATUS_GOOD);
+  return s;
+}
+
+/* the stream has to find what the functions find on the whole page */
+static void
+check_stream (SANE_Frame format, int depth, int dpi, double degrees,
+	      int chunk, int known)
+{
+  SANE_Parameters params;
+  SANE_Byte *page;
+  SANEI_Magic_Stream *s;
+  SANE_Status status;
+  int t, b, l, r, st, sb, sl, sr;
+  int cx = 0, cy = 0, scx = 0, scy = 0;
+  double slope = 0, sslope = 0;
+
+  page = make_skewed_page (&params, format, depth, dpi, degrees, 0);
+  s = stream_page (&params, page, dpi, chunk, known);
+
+  status = sanei_magic_findEdges (&params, page, dpi, dpi, &t, &b, &l, &r);
+  assert (sanei_magic_streamFindEdges (s, &st, &sb, &sl, &sr) == status);
+  assert (status != SANE_STATUS_GOOD
+	  || (t == st && b == sb && l == sl && r == sr));
+
+  status = sanei_magic_findSkew (&params, page, dpi, dpi, &cx, &cy, &slope);
+  assert (sanei_magic_streamFindSkew (s, &scx, &scy, &sslope) == status);
+  assert (status != SANE_STATUS_GOOD
+	  || (cx == scx && cy == scy && slope == sslope));
+
+  assert (sanei_magic_streamIsBlank (s, 10)
+	  == sanei_magic_isBlank2 (&params, page, dpi, dpi, 10));
+
+  sanei_magic_streamClose (s);
+  free (page);
+}
+
+static void
+test_stream_gray (void)
+{
+  check_stream (SANE_FRAME_GRAY, 8, 100, -3, 4096, 1);
+  check_stream (SANE_FRAME_GRAY, 8, 200, 4.5, 1000, 0);
+  check_stream (SANE_FRAME_GRAY, 8, 100, 0, 400, 1);
+}
+
+static void
+test_stream_color (void)
+{
+  check_stream (SANE_FRAME_RGB, 8, 100, 2, 7777, 0);
+  check_stream (SANE_FRAME_RGB, 8, 100, -6, 1200, 1);
+}
+
+static void
+test_stream_lineart (void)
+{
+  check_stream (SANE_FRAME_GRAY, 1, 100, 3, 50, 1);
+  check_stream (SANE_FRAME_GRAY, 1, 100, -1.5, 13, 0);
+}
+
+/* pages shorter than the windows, cut across the edge of the paper */
+static void
+test_stream_short (void)
+{
+  SANE_Parameters params;
+  SANE_Byte *page, *part;
+  SANEI_Magic_Stream *s;
+  int h;
+
+  page = make_skewed_page (&params, SANE_FRAME_GRAY, 8, 40, 10, 0);
+  part = page + 2 * params.bytes_per_line;
+  for (h = 1; h < 24; h++)
+    {
+      int t, b, l, r, st, sb, sl, sr;
+      SANE_Status status;
+
+      params.lines = h;
+      s = stream_page (&params, part, 40, params.bytes_per_line, 1);
+      status = sanei_magic_findEdges (&params, part, 40, 40, &t, &b, &l, &r);
+      assert (sanei_magic_streamFindEdges (s, &st, &sb, &sl, &sr) == status);
+      assert (status != SANE_STATUS_GOOD
+	      || (t == st && b == sb && l == sl && r == sr));
+      sanei_magic_streamClose (s);
+    }
+  free (page);
+}
+
+/* blank pages of known height are known before their end, others as
+   soon as there is text */
+static void
+test_stream_blank_early (void)
+{
+  SANE_Parameters params, sp;
+  SANE_Byte *page;
+  SANEI_Magic_Stream *s;
+  int dpi = 100, i, status;
+
+  page = make_skewed_page (&params, SANE_FRAME_GRAY, 8, dpi, 0, 1);
+  assert (sanei_magic_isBlank2 (&params, page, dpi, dpi, 10)
+	  == SANE_STATUS_NO_DOCS);
+  assert (sanei_magic_streamOpen (&params, dpi, dpi, &s)
+	  == SANE_STATUS_GOOD);
+  for (i = 0; i < params.lines; i++)
+    {
+      assert (sanei_magic_streamWrite (s, page + i * params.bytes_per_line,
+				       params.bytes_per_line)
+	      == SANE_STATUS_GOOD);
+      status = sanei_magic_streamIsBlank (s, 10);
+      if (status != SANE_STATUS_DEVICE_BUSY)
+	break;
+    }
+  assert (status == SANE_STATUS_NO_DOCS);
+  assert (i < params.lines - dpi / 4);
+  sanei_magic_streamClose (s);
+  free (page);
+
+  page = make_skewed_page (&params, SANE_FRAME_GRAY, 8, dpi, 1, 0);
+  sp = params;
+  sp.lines = -1;
+  assert (sanei_magic_streamOpen (&sp, dpi, dpi, &s) == SANE_STATUS_GOOD);
+  for (i = 0; i < params.lines; i++)
+    {
+      assert (sanei_magic_streamWrite (s, page + i * params.bytes_per_line,
+				       params.bytes_per_line)
+	      == SANE_STATUS_GOOD);
+      status = sanei_magic_streamIsBlank (s, 10);
+      if (status != SANE_STATUS_DEVICE_BUSY)
+	break;
+    }
+  assert (status == SANE_STATUS_GOOD);
+  assert (i < params.lines / 2);
+  sanei_magic_streamClose (s);
+  free (page);
+}
+
+static void
+test_stream_inval (void)
+{
+  SANE_Parameters params;
+  SANE_Byte buf[64];
+  SANEI_Magic_Stream *s;
+  int t, b, l, r, cx, cy;
+  double slope;
+
+  memset (buf, 0, sizeof (buf));
+  params.format = SANE_FRAME_GRAY;
+  params.depth = 16;
+  params.pixels_per_line = 4;
+  params.bytes_per_line = 8;
+  params.lines = 4;
+  assert (sanei_magic_streamOpen (&params, 100, 100, &s)
+	  == SANE_STATUS_INVAL);
+
+  params.depth = 8;
+  params.bytes_per_line = 4;
+  assert (sanei_magic_streamOpen (&params, 100, 100, &s)
+	  == SANE_STATUS_GOOD);
+  assert (sanei_magic_streamFindEdges (s, &t, &b, &l, &r)
+	  == SANE_STATUS_INVAL);
+  assert (sanei_magic_streamFindSkew (s, &cx, &cy, &slope)
+	  == SANE_STATUS_INVAL);
+  assert (sanei_magic_streamFinish (s) == SANE_STATUS_INVAL);
+  assert (sanei_magic_streamWrite (s, buf, 20) == SANE_STATUS_INVAL);
+  sanei_magic_streamClose (s);
+
+  assert (sanei_magic_streamOpen (&params, 100, 100, &s)
+	  == SANE_STATUS_GOOD);
+  assert (sanei_magic_streamWrite (s, buf, 16) == SANE_STATUS_GOOD);
+  assert (sanei_magic_streamFinish (s) == SANE_STATUS_GOOD);
+  assert (sanei_magic_streamWrite (s, buf, 4) == SANE_STATUS_INVAL);
+  sanei_magic_streamClose (s);
+  sanei_magic_streamClose (NULL);
+}
+
+/* how far apart deskewing around (CX, CY) by SLOPE and around (SCX, SCY)
+   by SSLOPE puts the corners of a PW x H page, in pixels */
+static double
+deskew_distance (int pw, int h, int cx, int cy, double slope,
+		 int scx, int scy, double sslope)
+{
+  double a = atan (slope), sa = atan (sslope), d = 0;
+  int k;
+
+  for (k = 0; k < 4; k++)
+    {
+      double x = (k & 1) ? pw : 0, y = (k & 2) ? h : 0;
+      double dx = cx + (x - cx) * cos (a) - (y - cy) * sin (a)
+	- scx - (x - scx) * cos (sa) + (y - scy) * sin (sa);
+      double dy = cy + (x - cx) * sin (a) + (y - cy) * cos (a)
+	- scy - (x - scx) * sin (sa) - (y - scy) * cos (sa);
+
+      if (sqrt (dx * dx + dy * dy) > d)
+	d = sqrt (dx * dx + dy * dy);
+    }
+  return d;
+}
+
+/* findSkew2() and findEdges2() on a copy of the page up to 8 times
+   smaller have to agree with findSkew() and findEdges() on the full
+   page: the slope within SKEW_TOLERANCE degrees, and never more than
+   0.05 degrees further from the real one; the deskewed corners within
+   DESKEW_TOLERANCE pixels; the edges within EDGE_TOLERANCE pixels.
+   Scale 1 gives the same results. */
+#define SKEW_TOLERANCE 0.2
+#define DESKEW_TOLERANCE 6
+#define EDGE_TOLERANCE 2
+
+static void
+check_scaled (SANE_Frame format, int depth, int dpi, double degrees)
+{
+  SANE_Parameters params;
+  SANE_Byte *page;
+  SANE_Status skew, edges;
+  int t, b, l, r, st, sb, sl, sr;
+  int cx = 0, cy = 0, scx = 0, scy = 0, scale;
+  double slope = 0, sslope = 0, full, scaled;
+
+  page = make_skewed_page (&params, format, depth, dpi, degrees, 0);
+  skew = sanei_magic_findSkew (&params, page, dpi, dpi, &cx, &cy, &slope);
+  edges = sanei_magic_findEdges (&params, page, dpi, dpi, &t, &b, &l, &r);
+  assert (skew == SANE_STATUS_GOOD && edges == SANE_STATUS_GOOD);
+  full = atan (slope) * 180 / 3.14159265358979323846;
+
+  for (scale = 1; scale <= 8; scale *= 2)
+    {
+      assert (sanei_magic_findSkew2 (&params, page, dpi, dpi, &scx, &scy,
+				     &sslope, scale) == SANE_STATUS_GOOD);
+      scaled = atan (sslope) * 180 / 3.14159265358979323846;
+      assert (scale > 1 || (scx == cx && scy == cy && sslope == slope));
+      assert (fabs (scaled - full) <= SKEW_TOLERANCE);
+      assert (fabs (scaled - degrees) <= fabs (full - degrees) + 0.05);
+      assert (deskew_distance (params.pixels_per_line, params.lines,
+			       cx, cy, slope, scx, scy, sslope)
+	      <= DESKEW_TOLERANCE);
+
+      assert (sanei_magic_findEdges2 (&params, page, dpi, dpi,
+				      &st, &sb, &sl, &sr, scale)
+	      == SANE_STATUS_GOOD);
+      assert (scale > 1 || (st == t && sb == b && sl == l && sr == r));
+      assert (abs (st - t) <= EDGE_TOLERANCE && abs (sb - b) <= EDGE_TOLERANCE
+	      && abs (sl - l) <= EDGE_TOLERANCE
+	      && abs (sr - r) <= EDGE_TOLERANCE);
+    }
+  free (page);
+}
+
+/* the copy for the skew is kept at least 512 pixels wide, so 600 dpi
+   pages are searched at scale 4, 300 dpi ones at 2 and narrower ones
+   in full */
+static void
+test_scaled_gray (void)
+{
+  check_scaled (SANE_FRAME_GRAY, 8, 100, -2.5);
+  check_scaled (SANE_FRAME_GRAY, 8, 100, 4);
+  check_scaled (SANE_FRAME_GRAY, 8, 300, -6);
+  check_scaled (SANE_FRAME_GRAY, 8, 300, -2.5);
+  check_scaled (SANE_FRAME_GRAY, 8, 300, 1);
+  check_scaled (SANE_FRAME_GRAY, 8, 300, 4);
+  check_scaled (SANE_FRAME_GRAY, 8, 600, 1);
+  check_scaled (SANE_FRAME_GRAY, 8, 600, -3);
+}
+
+static void
+test_scaled_color (void)
+{
+  check_scaled (SANE_FRAME_RGB, 8, 150, -3);
+  check_scaled (SANE_FRAME_RGB, 8, 300, 2);
+}
+
+static void
+test_scaled_lineart (void)
+{
+  check_scaled (SANE_FRAME_GRAY, 1, 200, -4);
+  check_scaled (SANE_FRAME_GRAY, 1, 300, 1.5);
+}
+
+int
+main (void)
+{
+  sanei_magic_init ();
+
+  test_despeck_gray ();
+  test_despeck_color ();
+  test_despeck_lineart ();
+  test_despeck_small ();
+  test_despeck_inval ();
+  test_edges_padded ();
+  test_rotate_gray ();
+  test_rotate_color ();
+  test_rotate_lineart ();
+  test_rotate_bands ();
+
+  test_stream_gray ();
+  test_stream_color ();
+  test_stream_lineart ();
+  test_stream_short ();
+  test_stream_blank_early ();
+  test_stream_inval ();
+
+  test_scaled_gray ();
+  test_scaled_color ();
+  test_scaled_lineart ();
+
+  return 0;
+}
+
+/* vim: set sw=2 cino=>2se-1sn-1s{s^-1st0(0u0 smarttab expandtab: */
@@ -0,0 +1,197 @@
+#include "../../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* sane includes for the sanei functions called */
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_pool.h"
+
+#define NJOBS 200
+
+/* a job that does some work and reports its argument back */
+typedef struct
+{
+  int id;
+  int sum;
+  int *order;
+  int *next;
+} Work;
+
+static SANE_Status
+work (void *arg)
+{
+  Work *w = arg;
+  int i;
+
+  w->sum = 0;
+  for (i = 0; i < 10000 + w->id * 100; i++)
+    w->sum += i % 7;
+
+  return (w->id % 3) ? SANE_STATUS_GOOD : SANE_STATUS_IO_ERROR;
+}
+
+static int
+expected_sum (int id)
+{
+  int i, sum = 0;
+
+  for (i = 0; i < 10000 + id * 100; i++)
+    sum += i % 7;
+  return sum;
+}
+
+/* records the order in which jobs are started */
+static SANE_Status
+record (void *arg)
+{
+  Work *w = arg;
+
+  w->order[(*w->next)++] = w->id;
+  return SANE_STATUS_GOOD;
+}
+
+/* a job that queues another one on the same pool */
+typedef struct
+{
+  SANEI_Pool *pool;
+  SANEI_Pool_Job *child;
+  Work work;
+} Parent;
+
+static SANE_Status
+parent (void *arg)
+{
+  Parent *p = arg;
+
+  return sanei_pool_submit (p->pool, work, &p->work, &p->child);
+}
+
+/******************************/
+/* start of tests definitions */
+/******************************/
+
+static void
+run_jobs (int threads)
+{
+  SANEI_Pool *pool;
+  SANEI_Pool_Job *jobs[NJOBS];
+  Work w[NJOBS];
+  int i;
+
+  assert (sanei_pool_create (threads, &pool) == SANE_STATUS_GOOD);
+
+  for (i = 0; i < NJOBS; i++)
+    {
+      w[i].id = i;
+      w[i].sum = -1;
+      assert (sanei_pool_submit (pool, work, w + i, jobs + i)
+	      == SANE_STATUS_GOOD);
+    }
+
+  /* join in reverse, so some joiners wait and some don't */
+  for (i = NJOBS - 1; i >= 0; i--)
+    {
+      SANE_Status status = sanei_pool_join (jobs[i]);
+
+      assert (status == ((i % 3) ? SANE_STATUS_GOOD : SANE_STATUS_IO_ERROR));
+      assert (w[i].sum == expected_sum (i));
+    }
+
+  sanei_pool_destroy (pool);
+}
+
+static void
+thread_counts (void)
+{
+  run_jobs (0);
+  run_jobs (1);
+  run_jobs (4);
+  run_jobs (1000);
+}
+
+/* with a single worker, jobs run one after the other in FIFO order */
+static void
+fifo (void)
+{
+  SANEI_Pool *pool;
+  SANEI_Pool_Job *jobs[NJOBS];
+  Work w[NJOBS];
+  int order[NJOBS];
+  int next = 0;
+  int i;
+
+  assert (sanei_pool_create (1, &pool) == SANE_STATUS_GOOD);
+  assert (sanei_pool_threads (pool) <= 1);
+
+  for (i = 0; i < NJOBS; i++)
+    {
+      w[i].id = i;
+      w[i].order = order;
+      w[i].next = &next;
+      assert (sanei_pool_submit (pool, record, w + i, jobs + i)
+	      == SANE_STATUS_GOOD);
+    }
+  for (i = 0; i < NJOBS; i++)
+    assert (sanei_pool_join (jobs[i]) == SANE_STATUS_GOOD);
+
+  assert (next == NJOBS);
+  for (i = 0; i < NJOBS; i++)
+    assert (order[i] == i);
+
+  sanei_pool_destroy (pool);
+}
+
+static void
+nested (void)
+{
+  SANEI_Pool *pool;
+  SANEI_Pool_Job *job;
+  Parent p;
+
+  assert (sanei_pool_create (2, &pool) == SANE_STATUS_GOOD);
+
+  memset (&p, 0, sizeof (p));
+  p.pool = pool;
+  p.work.id = 5;
+  assert (sanei_pool_submit (pool, parent, &p, &job) == SANE_STATUS_GOOD);
+  assert (sanei_pool_join (job) == SANE_STATUS_GOOD);
+  assert (p.child != NULL);
+  assert (sanei_pool_join (p.child) == SANE_STATUS_GOOD);
+  assert (p.work.sum == expected_sum (5));
+
+  sanei_pool_destroy (pool);
+}
+
+/* an idle pool, and no pool at all, can be destroyed */
+static void
+destroy_idle (void)
+{
+  SANEI_Pool *pool;
+
+  assert (sanei_pool_create (3, &pool) == SANE_STATUS_GOOD);
+  sanei_pool_destroy (pool);
+  sanei_pool_destroy (NULL);
+}
+
+static void
+sanei_pool_suite (void)
+{
+  thread_counts ();
+  fifo ();
+  nested ();
+  destroy_idle ();
+}
+
+/**
+ * main function to run the test suites
+ */
+int
+main (void)
+{
+  /* run suites */
+  sanei_pool_suite ();
+
+  return 0;
+}
@@ -1,10 +1,12 @@
 #include "../include/sane/config.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <sys/fcntl.h>
+#include <sys/time.h>
 
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei.h"
@@ -24,6 +26,355 @@ static SANE_String_Const mode_list[] = {
 };
 
 static char *program_name;
+
+/* An in-memory connection: written data is appended, reads return at
+   most CHUNK bytes, like a socket delivering packets. */
+static char *mem;
+static size_t mem_size, mem_len, mem_pos, mem_chunk;
+
+static ssize_t
+mem_write (int fd, const void *buf, size_t len)
+{
+  (void) fd;
+  if (mem_len + len > mem_size)
+    {
+      mem_size = 2 * (mem_len + len);
+      mem = realloc (mem, mem_size);
+      if (!mem)
+	{
+	  errno = ENOMEM;
+	  return -1;
+	}
+    }
+  memcpy (mem + mem_len, buf, len);
+  mem_len += len;
+  return len;
+}
+
+static ssize_t
+mem_read (int fd, void *buf, size_t len)
+{
+  (void) fd;
+  if (len > mem_chunk)
+    len = mem_chunk;
+  if (len > mem_len - mem_pos)
+    len = mem_len - mem_pos;
+  memcpy (buf, mem + mem_pos, len);
+  mem_pos += len;
+  return len;
+}
+
+static void
+mem_rewind (Wire * mw, size_t chunk)
+{
+  sanei_w_set_dir (mw, WIRE_DECODE);
+  mw->status = 0;
+  mem_pos = 0;
+  mem_chunk = chunk;
+}
+
+static void
+mem_open (Wire * mw, void (*codec_init) (Wire *))
+{
+  sanei_w_init (mw, codec_init);
+  mw->io.fd = -1;
+  mw->io.read = mem_read;
+  mw->io.write = mem_write;
+  mem_len = mem_pos = 0;
+  sanei_w_set_dir (mw, WIRE_ENCODE);
+}
+
+/* Transfers a word the way arrays of other types are, to compare with
+   the codec's bulk transfer of words */
+static void
+word_element (Wire * mw, void *v)
+{
+  sanei_w_word (mw, v);
+}
+
+#define NUM_WORDS (MAX_MEM / sizeof (SANE_Word) / 2)
+#define STRING_LEN (3 * 8192 + 5)
+
+/* Sends a long word list and a long string through CODEC and back,
+   reading in chunks of odd size.  Returns the number of errors. */
+static int
+check_arrays (const char *codec, void (*codec_init) (Wire *))
+{
+  static SANE_Word words[NUM_WORDS];
+  SANE_Word len, *word_ptr, *got_words;
+  SANE_String str, got_str;
+  Wire mw;
+  size_t i;
+  int errors = 0;
+
+  for (i = 0; i < NUM_WORDS; ++i)
+    words[i] = (SANE_Word) ((i * 2654435761UL) & 0xffffffffUL);
+  str = malloc (STRING_LEN);
+  for (i = 0; i < STRING_LEN - 1; ++i)
+    str[i] = 'a' + i % 26;
+  str[i] = '\0';
+
+  mem_open (&mw, codec_init);
+  len = NUM_WORDS;
+  word_ptr = words;
+  sanei_w_array (&mw, &len, (void **) &word_ptr, mw.codec.w_word,
+		 sizeof (SANE_Word));
+  sanei_w_string (&mw, &str);
+  len = NUM_WORDS;
+  sanei_w_array (&mw, &len, (void **) &word_ptr, word_element,
+		 sizeof (SANE_Word));
+
+  mem_rewind (&mw, 4093);
+  got_words = 0;
+  sanei_w_array (&mw, &len, (void **) &got_words, mw.codec.w_word,
+		 sizeof (SANE_Word));
+  if (mw.status || len != NUM_WORDS
+      || memcmp (got_words, words, sizeof (words)) != 0)
+    {
+      fprintf (stderr, "%s: %s word array mismatch (status %d)\n",
+	       program_name, codec, mw.status);
+      ++errors;
+    }
+  /* not sanei_w_set_dir(), which drops what is buffered */
+  mw.direction = WIRE_FREE;
+  sanei_w_array (&mw, &len, (void **) &got_words, mw.codec.w_word,
+		 sizeof (SANE_Word));
+  mw.direction = WIRE_DECODE;
+
+  got_str = 0;
+  sanei_w_string (&mw, &got_str);
+  if (mw.status || !got_str || strcmp (got_str, str) != 0)
+    {
+      fprintf (stderr, "%s: %s string mismatch (status %d)\n",
+	       program_name, codec, mw.status);
+      ++errors;
+    }
+  mw.direction = WIRE_FREE;
+  sanei_w_string (&mw, &got_str);
+  mw.direction = WIRE_DECODE;
+
+  got_words = 0;
+  sanei_w_array (&mw, &len, (void **) &got_words, word_element,
+		 sizeof (SANE_Word));
+  if (mw.status || len != NUM_WORDS
+      || memcmp (got_words, words, sizeof (words)) != 0)
+    {
+      fprintf (stderr, "%s: %s word element mismatch (status %d)\n",
+	       program_name, codec, mw.status);
+      ++errors;
+    }
+  mw.direction = WIRE_FREE;
+  sanei_w_array (&mw, &len, (void **) &got_words, word_element,
+		 sizeof (SANE_Word));
+
+  sanei_w_exit (&mw);
+  free (str);
+  if (errors == 0)
+    printf ("%s array round trip successful\n", codec);
+  return errors;
+}
+
+/* Decodes the descriptors DESC inside an arena, over and over, and
+   checks that they come back right and that ending the arena leaves
+   no memory accounted to the wire.  Returns the number of errors. */
+static int
+check_arena (const char *codec, void (*codec_init) (Wire *),
+	     SANE_Option_Descriptor * desc, SANE_Word num)
+{
+  SANE_Option_Descriptor *got;
+  SANE_Word len;
+  Wire mw;
+  int r, errors = 0;
+
+  mem_open (&mw, codec_init);
+  for (r = 0; r < 100; ++r)
+    {
+      len = num;
+      sanei_w_array (&mw, &len, (void **) &desc,
+		     (WireCodecFunc) sanei_w_option_descriptor,
+		     sizeof (desc[0]));
+    }
+
+  mem_rewind (&mw, 1499);
+  for (r = 0; r < 100 && errors == 0; ++r)
+    {
+      sanei_w_arena_begin (&mw);
+      got = 0;
+      sanei_w_array (&mw, &len, (void **) &got,
+		     (WireCodecFunc) sanei_w_option_descriptor,
+		     sizeof (desc[0]));
+      if (mw.status || len != num || strcmp (got[0].name, desc[0].name)
+	  || strcmp (got[1].desc, desc[1].desc)
+	  || strcmp (got[1].constraint.string_list[2],
+		     desc[1].constraint.string_list[2])
+	  || got[0].constraint.word_list[3] != desc[0].constraint.word_list[3])
+	{
+	  fprintf (stderr, "%s: %s arena decode mismatch (status %d)\n",
+		   program_name, codec, mw.status);
+	  ++errors;
+	}
+      /* a no-op inside the arena */
+      mw.direction = WIRE_FREE;
+      sanei_w_array (&mw, &len, (void **) &got,
+		     (WireCodecFunc) sanei_w_option_descriptor,
+		     sizeof (desc[0]));
+      mw.direction = WIRE_DECODE;
+      sanei_w_arena_end (&mw);
+      if (mw.allocated_memory != 0)
+	{
+	  fprintf (stderr, "%s: %s arena left %d bytes allocated\n",
+		   program_name, codec, mw.allocated_memory);
+	  ++errors;
+	}
+    }
+  sanei_w_exit (&mw);
+  if (errors == 0)
+    printf ("%s arena decode successful\n", codec);
+  return errors;
+}
+
+static double
+now_ms (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, 0);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/* Decodes a gamma-table sized word array ROUNDS times, with the codec's
+   bulk transfer (W_ELEMENT of the codec) or word by word. */
+static void
+bench_array (void (*codec_init) (Wire *), WireCodecFunc w_element,
+	     const char *what, int rounds, size_t chunk)
+{
+  static SANE_Word words[65536];
+  SANE_Word len, *word_ptr, *got;
+  Wire mw;
+  double t_enc, t_dec;
+  int r;
+
+  mem_open (&mw, codec_init);
+  if (!w_element)
+    w_element = mw.codec.w_word;
+  word_ptr = words;
+  t_enc = now_ms ();
+  for (r = 0; r < rounds; ++r)
+    {
+      len = NELEMS (words);
+      sanei_w_array (&mw, &len, (void **) &word_ptr, w_element,
+		     sizeof (SANE_Word));
+    }
+  sanei_w_set_dir (&mw, WIRE_DECODE);
+  t_enc = now_ms () - t_enc;
+
+  mem_rewind (&mw, chunk);
+  t_dec = now_ms ();
+  for (r = 0; r < rounds; ++r)
+    {
+      got = 0;
+      sanei_w_array (&mw, &len, (void **) &got, w_element,
+		     sizeof (SANE_Word));
+      mw.direction = WIRE_FREE;
+      sanei_w_array (&mw, &len, (void **) &got, w_element,
+		     sizeof (SANE_Word));
+      mw.direction = WIRE_DECODE;
+    }
+  t_dec = now_ms () - t_dec;
+
+  printf ("  %-22s encode %8.1f MB/s  decode %8.1f MB/s\n", what,
+	  rounds * sizeof (words) / 1000.0 / t_enc,
+	  rounds * sizeof (words) / 1000.0 / t_dec);
+  sanei_w_exit (&mw);
+}
+
+/* Decodes single words from reads of CHUNK bytes, which refill the
+   decode buffer with a part of a word left over every time. */
+static void
+bench_refill (void (*codec_init) (Wire *), size_t chunk, int num)
+{
+  SANE_Word val;
+  Wire mw;
+  double t;
+  int i;
+
+  mem_open (&mw, codec_init);
+  for (i = 0; i < num; ++i)
+    {
+      val = i;
+      sanei_w_word (&mw, &val);
+    }
+  mem_rewind (&mw, chunk);
+  t = now_ms ();
+  for (i = 0; i < num && mw.status == 0; ++i)
+    sanei_w_word (&mw, &val);
+  t = now_ms () - t;
+  printf ("  words from %5lu byte reads      decode %8.1f MB/s\n",
+	  (unsigned long) chunk, num * 4.0 / 1000.0 / t);
+  sanei_w_exit (&mw);
+}
+
+/* Decodes and frees the descriptors DESC ROUNDS times, each time
+   with malloc() and free() or inside an arena. */
+static void
+bench_descriptors (void (*codec_init) (Wire *), SANE_Option_Descriptor * desc,
+		   SANE_Word num, int rounds, int arena)
+{
+  SANE_Option_Descriptor *got;
+  SANE_Word len;
+  Wire mw;
+  double t;
+  int r;
+
+  mem_open (&mw, codec_init);
+  for (r = 0; r < rounds; ++r)
+    {
+      len = num;
+      sanei_w_array (&mw, &len, (void **) &desc,
+		     (WireCodecFunc) sanei_w_option_descriptor,
+		     sizeof (desc[0]));
+    }
+  mem_rewind (&mw, 65536);
+  t = now_ms ();
+  for (r = 0; r < rounds && mw.status == 0; ++r)
+    {
+      if (arena)
+	sanei_w_arena_begin (&mw);
+      got = 0;
+      sanei_w_array (&mw, &len, (void **) &got,
+		     (WireCodecFunc) sanei_w_option_descriptor,
+		     sizeof (desc[0]));
+      mw.direction = WIRE_FREE;
+      sanei_w_array (&mw, &len, (void **) &got,
+		     (WireCodecFunc) sanei_w_option_descriptor,
+		     sizeof (desc[0]));
+      mw.direction = WIRE_DECODE;
+      if (arena)
+	sanei_w_arena_end (&mw);
+    }
+  t = now_ms () - t;
+  printf ("  %-22s %8.1f us per array of %d\n",
+	  arena ? "arena" : "malloc/free", t * 1000.0 / rounds, num);
+  sanei_w_exit (&mw);
+}
+
+static void
+bench (void (*codec_init) (Wire *), SANE_Option_Descriptor * desc,
+       SANE_Word num)
+{
+  printf ("option descriptor arrays:\n");
+  bench_descriptors (codec_init, desc, num, 20000, 0);
+  bench_descriptors (codec_init, desc, num, 20000, 1);
+  printf ("word arrays of 64k words:\n");
+  bench_array (codec_init, 0, "codec array", 50, 65536);
+  bench_array (codec_init, word_element, "word by word", 5, 65536);
+  bench_array (codec_init, 0, "codec array, 1500 B", 50, 1500);
+  printf ("decode buffer refills:\n");
+  bench_refill (codec_init, 1499, 200000);
+  bench_refill (codec_init, 8191, 200000);
+}
+
+
 static char *default_codec = "bin";
 static char *default_outfile = "test_wire.out";
 
@@ -36,6 +387,7 @@ usage (int code)
 \n\
 Test the SANE wire manipulation library.\n\
 \n\
+    --bench              also measure array and decode buffer throughput\n\
     --codec=CODEC        set the codec [default=%s]\n\
     --help               display this message and exit\n\
 -o, --output=FILE        set the output file [default=%s]\n\
@@ -60,7 +412,8 @@ main (int argc, char **argv)
   SANE_Word len;
   char *codec = default_codec;
   char *outfile = default_outfile;
-  int readonly = 0;
+  int readonly = 0, run_bench = 0, errors;
+  void (*codec_init) (Wire *);
 
   program_name = argv[0];
   argv++;
@@ -82,6 +435,10 @@ main (int argc, char **argv)
 	{
 	  codec = *argv + 8;
 	}
+      else if (!strcmp (*argv, "--bench"))
+	{
+	  run_bench = 1;
+	}
       else if (!strcmp (*argv, "--help"))
 	{
 	  usage (0);
@@ -127,14 +484,15 @@ main (int argc, char **argv)
 
 
   if (!strcmp (codec, "bin"))
-    sanei_w_init (&w, sanei_codec_bin_init);
+    codec_init = sanei_codec_bin_init;
   else if (!strcmp (codec, "ascii"))
-    sanei_w_init (&w, sanei_codec_ascii_init);
+    codec_init = sanei_codec_ascii_init;
   else
     {
       fprintf (stderr, "%s: unknown codec type `%s'\n", program_name, codec);
       usage (1);
     }
+  sanei_w_init (&w, codec_init);
 
   desc[0].name = "resolution";
   desc[0].title = 0;
@@ -232,5 +590,10 @@ main (int argc, char **argv)
 
   close (w.io.fd);
 
-  return 0;
+  errors = check_arrays (codec, codec_init);
+  errors += check_arena (codec, codec_init, desc, NELEMS (desc));
+  if (run_bench)
+    bench (codec_init, desc, NELEMS (desc));
+
+  return errors ? 1 : 0;
 }